@@ -21,11 +21,19 @@
 #ifndef _ABSTRACT_GATEWAY_HPP_
 #define _ABSTRACT_GATEWAY_HPP_
 
+#include <atomic>
+#include <chrono>
+#include <ctime>
 #include <functional>
 #include <set>
 #include <boost/regex.hpp>
 
 #include "utils.hpp"
+#include "senderAcl.hpp"
+#include "pollScheduler.hpp"
+#include "adaptiveInterval.hpp"
+#include "protocolTracer.hpp"
+#include "circuitBreaker.hpp"
 
 namespace telemeteryServices
 {
@@ -137,6 +145,25 @@ namespace telemeteryServices
         return "";
     }
 
+    /**
+     * Provides values for how well a gateway is able to reach its mail server.
+     */
+    enum class connectionHealth
+    {
+        /**
+         * The last attempt to talk to the server succeeded.
+         */
+        healthy,
+        /**
+         * The last attempt failed and the gateway is retrying with a growing delay.
+         */
+        reconnecting,
+        /**
+         * Several attempts in a row have failed; the gateway only probes the server now and then until it answers again.
+         */
+        unreachable,
+    };
+
     class abstractGateway;
 
     typedef std::function<void(const abstractGateway& sender, const std::string& message, void* userData)> notificationCallback;
@@ -144,6 +171,7 @@ namespace telemeteryServices
     typedef std::function<void(const abstractGateway& sender, const std::string& message, void* userData)> errorCallback;
     typedef std::function<void(const abstractGateway& sender, const std::string& originator, const std::string& subject, void* userData)> unauthorisedAccessCallback;
     typedef std::function<bool(const abstractGateway& sender, command command, const std::string& originator, std::string& message, std::vector<std::unique_ptr<utilities::temporaryFile>>& payload, void* userData)> commandReceivedCallback;
+    typedef std::function<void(const abstractGateway& sender, connectionHealth health, void* userData)> connectionHealthCallback;
 
     class abstractGateway
     {        
@@ -157,8 +185,13 @@ namespace telemeteryServices
         {
             _polling = false;
             _running = false;
+            _push_mode = false;
+            _poll_task = 0;
+            _max_payload_size = 25 * 1024 * 1024;
             _mime_access = utilities::accessControlAction::block;
             _sender_access = utilities::accessControlAction::block;
+            _protocol_trace = std::make_shared<protocolTrace>();
+            _health = connectionHealth::healthy;
         }
         abstractGateway(const abstractGateway& other) = default;
         abstractGateway(abstractGateway&& other) = default;
@@ -189,10 +222,13 @@ namespace telemeteryServices
             _mimes_acl.emplace(mime);
         }
 
+        /**
+         * Adds an address to the sender access control list; <code>*@domain</code> and <code>*@*.domain</code> cover a whole domain and its subdomains.
+         */
         void addControlledSender(const std::string& sender)
         {
             if (sender.empty()) return;
-            _senders_acl.emplace(sender);
+            _senders_acl.add(sender);
         }
 
         void setKillswitchPassword(const std::string& password)
@@ -215,6 +251,12 @@ namespace telemeteryServices
             _errorReceived = callback;
         }
 
+        /**
+         * <p>Sets the function that is handed each command the gateway receives. It may be called on a thread of the gateway's own rather than on
+         * the poll scheduler's, and the poll that found the message waits for it to return.</p>
+         * <p>The callback must therefore not pause or stop the gateway that called it, which would wait for that same poll to finish; doing so throws
+         * illegal_object_state. A command that needs the gateway stopped should have it stopped from another thread once the callback has returned.</p>
+         */
         void setCommandReceivedCallback(const commandReceivedCallback& callback)
         {
             _commandReceived = callback;
@@ -225,6 +267,14 @@ namespace telemeteryServices
             _unauthorisedAccess = callback;
         }
 
+        /**
+         * Sets the function called, from the poll scheduler's worker threads, whenever the gateway loses or regains its mail server.
+         */
+        void setConnectionHealthCallback(const connectionHealthCallback& callback)
+        {
+            _connectionHealthChanged = callback;
+        }
+
         void setAdminContact(const std::string& contact)
         {
             _admin_contact = contact;
@@ -245,6 +295,55 @@ namespace telemeteryServices
             return _input_contact;
         }
 
+        /**
+         * Sets whether the gateway should wait for the server to push new mail notifications rather than rescanning on a timer.
+         * Gateways that cannot be notified by their server fall back to the cheapest form of polling they support.
+         */
+        void setPushMode(bool push)
+        {
+            _push_mode = push;
+        }
+
+        [[nodiscard]] bool pushMode() const
+        {
+            return _push_mode;
+        }
+
+        /**
+         * Sets the directory in which the gateway keeps state that must survive a restart, such as mailbox checkpoints.
+         */
+        void setStateDirectory(const boost::filesystem::path& directory)
+        {
+            _state_directory = directory;
+        }
+
+        [[nodiscard]] boost::filesystem::path stateDirectory() const
+        {
+            return _state_directory;
+        }
+
+        /**
+         * Sets the shortest and longest time the gateway may wait between scans of its mailbox. The gateway polls at the minimum while there is
+         * activity and backs off towards the maximum while the mailbox is quiet or failing.
+         */
+        void setPollInterval(std::chrono::milliseconds min, std::chrono::milliseconds max)
+        {
+            _poll_interval.setBounds(min, max);
+        }
+
+        /**
+         * Sets the largest total size, in bytes as transferred, of the attachments the gateway will download from a single message.
+         */
+        void setMaxPayloadSize(std::size_t size)
+        {
+            _max_payload_size = size;
+        }
+
+        [[nodiscard]] std::size_t maxPayloadSize() const
+        {
+            return _max_payload_size;
+        }
+
         void *userData()
         {
             return _user_data;
@@ -255,7 +354,7 @@ namespace telemeteryServices
             _user_data = data;
         }
 
-        bool polling()
+        bool polling() const
         {
             return _polling;
         }
@@ -265,9 +364,70 @@ namespace telemeteryServices
             return _id;
         }
 
-        virtual void poll() = 0;
-        virtual void pollAsync() = 0;
-        virtual void pause() = 0;
+        [[nodiscard]] connectionHealth health() const
+        {
+            return _health;
+        }
+
+        [[nodiscard]] bool protocolTracing() const
+        {
+            return _protocol_trace->enabled();
+        }
+
+        /**
+         * Switches the tracing of the protocol lines exchanged with the mail servers on or off; it takes effect at once on open connections.
+         */
+        void setProtocolTracing(bool enabled)
+        {
+            _protocol_trace->setEnabled(enabled);
+        }
+
+        /**
+         * Gets the last protocol lines exchanged with the mail servers, oldest first.
+         */
+        [[nodiscard]] std::vector<std::string> protocolTraceLines(std::size_t count) const
+        {
+            return _protocol_trace->lastLines(count);
+        }
+
+        /**
+         * Performs one unit of polling work, such as checking for a push notification or scanning for new messages. It must not block for longer than
+         * the work itself takes, as it is run on one of the poll scheduler's shared worker threads.
+         * @return How long the gateway wants to wait before it is polled again.
+         */
+        virtual std::chrono::milliseconds poll() = 0;
+
+        /**
+         * Starts polling by registering the gateway with the poll scheduler.
+         */
+        virtual void pollAsync()
+        {
+            if (!_running) return;
+            if (_polling) return;
+            _polling = true;
+            if (_notificationReceived) _notificationReceived(*this, _id + " is preparing to start polling for incoming requests", _user_data);
+            _poll_interval.reset();
+            _breaker.reset();
+            setHealth(connectionHealth::healthy);
+            pollingStarted();
+            _poll_task = pollScheduler::instance().add([this]{ return poll(); }, _poll_interval.initialDelay());
+        }
+
+        /**
+         * Stops polling by unregistering the gateway from the poll scheduler, waiting for a poll that is in progress to finish. It must not be called
+         * from the gateway's own command callback.
+         */
+        virtual void pause()
+        {
+            if (!_running) return;
+            if (!_polling) return;
+            if (_dispatching == this) throw illegal_object_state("A gateway cannot be paused or stopped from its own command callback.");
+            _polling = false;
+            pollScheduler::instance().remove(_poll_task);
+            pollingStopped();
+            if (_notificationReceived) _notificationReceived(*this, _id + " is no longer polling for incoming requests", _user_data);
+        }
+
         virtual void stop() = 0;
         virtual bool start() = 0;
         virtual void messageUser(const std::string& user_id, const std::string& subject, const std::string& message) const = 0;
@@ -275,14 +435,252 @@ namespace telemeteryServices
         virtual void messageLastPoster(const std::string& subject, const std::string& message) const = 0;
 
     protected:
+        static constexpr std::size_t ERROR_TRACE_LINES = 20;
+
+        /**
+         * Reports an error talking to a mail server, followed by the last protocol lines that led up to it.
+         */
+        void reportConnectionError(const std::string& message)
+        {
+            if (_errorReceived) _errorReceived(*this, message, _user_data);
+            if (!_notificationReceived || !_protocol_trace->enabled()) return;
+            for (const auto& line : _protocol_trace->lastLines(ERROR_TRACE_LINES)) _notificationReceived(*this, _id + " trace " + line, _user_data);
+        }
+
+        void setHealth(connectionHealth health)
+        {
+            if (_health.exchange(health) == health) return;
+            if (_connectionHealthChanged) _connectionHealthChanged(*this, health, _user_data);
+        }
+
+        /**
+         * Checks with the circuit breaker whether the mail server may be contacted now.
+         * @param wait Receives how long to wait before asking again if it may not.
+         */
+        bool connectionAllowed(std::chrono::milliseconds& wait)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (_breaker.allow(now)) return true;
+            wait = _breaker.retryIn(now);
+
+            return false;
+        }
+
+        /**
+         * Records that the gateway talked to its mail server successfully.
+         */
+        void connectionSucceeded()
+        {
+            if ((_breaker.failures() > 0) && _notificationReceived) _notificationReceived(*this, _id + " has reconnected to its server", _user_data);
+            _breaker.success();
+            setHealth(connectionHealth::healthy);
+        }
+
+        /**
+         * Records that the gateway could not talk to its mail server. The first failure is reported as an error with the protocol trace that led up
+         * to it, later ones as warnings.
+         * @return How long to wait before trying again.
+         */
+        std::chrono::milliseconds connectionFailed(const std::string& message)
+        {
+            auto wait = _breaker.failure(std::chrono::steady_clock::now());
+            std::string retry = ", retrying in " + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(wait).count()) + " seconds";
+            if (_breaker.failures() == 1) reportConnectionError(message + retry);
+            else if (_warningReceived) _warningReceived(*this, message + " (" + std::to_string(_breaker.failures()) + " failures in a row)" + retry, _user_data);
+            setHealth((_breaker.current() == circuitBreaker::state::closed) ? connectionHealth::reconnecting : connectionHealth::unreachable);
+
+            return wait;
+        }
+
+        /**
+         * Called when polling starts, before the first call to poll().
+         */
+        virtual void pollingStarted()
+        {
+
+        }
+
+        /**
+         * Called when polling stops, after the last call to poll() has returned.
+         */
+        virtual void pollingStopped()
+        {
+
+        }
+
+        /**
+         * Checks, from its header alone, that a message is addressed to the gateway's input contact and comes from a sender the access control list
+         * allows, reporting any sender that it does not. The sender is remembered as the last sender.
+         * @param header The header of the message.
+         * @param subject Receives the subject of the message.
+         * @return true if the message should be processed, false if it should be ignored.
+         */
+        bool screenMessage(const vmime::header& header, std::string& subject)
+        {
+            std::string sender;
+            std::string senderName;
+            bool retval = screenMessage(header, subject, sender, senderName);
+            if (!sender.empty())
+            {
+                _last_sender = sender;
+                _last_sender_name = senderName;
+            }
+
+            return retval;
+        }
+
+        /**
+         * Screens a message as above but hands the sender back instead of remembering it, for gateways that screen one message while another is
+         * being dispatched.
+         * @param sender Receives the address of the sender.
+         * @param senderName Receives the display name of the sender.
+         */
+        bool screenMessage(const vmime::header& header, std::string& subject, std::string& sender, std::string& senderName)
+        {
+            // Get recipients.
+            auto to = header.To();
+            vmime::shared_ptr<const vmime::addressList> recipients1;
+            vmime::shared_ptr<const vmime::addressList> recipients2;
+            if (to) recipients1 = vmime::dynamicCast<const vmime::addressList>(to->getValue());
+            auto cc = header.Cc();
+            if (cc) recipients2 = vmime::dynamicCast<const vmime::addressList>(cc->getValue());
+            if (!utilities::search_for_email_address(_input_contact, recipients1, recipients2)) return false;
+            // Get sender.
+            auto sh = header.From();
+            if (sh)
+            {
+                auto from = vmime::dynamicCast<const vmime::mailbox>(sh->getValue());
+                sender = from->getEmail().toString();
+                if (sender.empty()) return false;
+                senderName = from->getName().getWholeBuffer();
+                if (senderName.empty()) senderName = "Unknown sender";
+            }
+            else
+            {
+                return false;
+            }
+            // Get the subject.
+            auto sjh = header.Subject();
+            if (sjh)
+            {
+                auto subj = vmime::dynamicCast<const vmime::text>(sjh->getValue());
+                subject = subj->getWholeBuffer();
+                if (subject.empty()) subject = "No subject";
+            }
+            else
+            {
+                subject = "No subject";
+            }
+
+            if (_senders_acl.contains(sender))
+            {
+                if (_sender_access == utilities::accessControlAction::block)
+                {
+                    if (_unauthorisedAccess) _unauthorisedAccess(*this, sender, subject, _user_data);
+                    return false;
+                }
+            }
+            else
+            {
+                if (_sender_access == utilities::accessControlAction::allow)
+                {
+                    if (_unauthorisedAccess) _unauthorisedAccess(*this, sender, subject, _user_data);
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        /**
+         * Gets the time a message was sent from its Date header.
+         */
+        static std::time_t messageTime(const vmime::header& header)
+        {
+            auto date = vmime::dynamicCast<const vmime::datetime>(header.Date()->getValue());
+            std::tm tm1{};
+            tm1.tm_year = date->getYear() - 1900;
+            tm1.tm_mon = date->getMonth() - 1;
+            tm1.tm_mday = date->getDay();
+            tm1.tm_hour = date->getHour();
+            tm1.tm_min = date->getMinute();
+            tm1.tm_sec = date->getSecond();
+
+            return std::mktime(&tm1);
+        }
+
+        /**
+         * Gets the earliest time a message can have been sent and still be acted upon.
+         */
+        static std::time_t windowStart()
+        {
+            return std::chrono::system_clock::to_time_t(std::chrono::system_clock::now() - std::chrono::hours(36));
+        }
+
+        /**
+         * Checks whether a message is older than the window (36 hours) in which messages are acted upon.
+         */
+        static bool olderThanWindow(std::time_t sent)
+        {
+            return (sent < windowStart());
+        }
+
+        static bool olderThanWindow(const vmime::header& header)
+        {
+            return olderThanWindow(messageTime(header));
+        }
+
+        static command commandForSubject(const std::string& subject)
+        {
+            if (boost::iequals(subject, "post")) return command::explicit_post;
+            if (boost::iequals(subject, "repost") || boost::iequals(subject, "re-post")) return command::repost;
+            if (boost::iequals(subject, "delete") || boost::iequals(subject, "remove")) return command::remove;
+            if (boost::iequals(subject, "killswitch")) return command::killswitch;
+
+            return command::implicit_post;
+        }
+
+        /**
+         * Hands the command a screened message carries to the command callback.
+         * @return true if the command was claimed by the callee, in which case the message should be removed from the mailbox.
+         */
+        bool dispatchCommand(const std::string& subject, std::string& text, std::vector<std::unique_ptr<utilities::temporaryFile>>& files)
+        {
+            if (!_commandReceived) return false;
+
+            _dispatching = this;
+            bool claimed;
+            try
+            {
+                claimed = _commandReceived(*this, commandForSubject(subject), _last_sender, text, files, _user_data);
+            }
+            catch (...)
+            {
+                _dispatching = nullptr;
+                throw;
+            }
+            _dispatching = nullptr;
+
+            return claimed;
+        }
+
         std::set<std::string> _mimes_acl;
-        std::set<std::string> _senders_acl;
+        utilities::senderAcl _senders_acl;
+        // Shared with the tracers of pooled connections, which can outlive the gateway.
+        std::shared_ptr<protocolTrace> _protocol_trace;
         utilities::accessControlAction _mime_access;
         utilities::accessControlAction _sender_access;
         std::string _id;
         void *_user_data;
-        bool _polling;
+        std::atomic<bool> _polling;
         bool _running;
+        pollScheduler::taskId _poll_task;
+        bool _push_mode;
+        adaptiveInterval _poll_interval;
+        circuitBreaker _breaker;
+        std::atomic<connectionHealth> _health;
+        std::size_t _max_payload_size;
+        boost::filesystem::path _state_directory;
         std::string _admin_contact;
         std::string _input_contact;
         std::string _killswitch_password;
@@ -291,8 +689,11 @@ namespace telemeteryServices
         warningCallback _warningReceived;
         errorCallback _errorReceived;
         unauthorisedAccessCallback _unauthorisedAccess;
+        connectionHealthCallback _connectionHealthChanged;
         std::string _last_sender_name;
         std::string _last_sender;
+        // The gateway whose command callback the current thread is running, if any.
+        static inline thread_local const abstractGateway *_dispatching = nullptr;
     };
 }
 
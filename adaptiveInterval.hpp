@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: adaptiveInterval.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ADAPTIVE_INTERVAL_HPP_
+#define _ADAPTIVE_INTERVAL_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace telemeteryServices
+{
+    /**
+     * <p>Works out how long a gateway should wait between scans of its mailbox.</p>
+     * <p>The interval drops to the minimum as soon as there is activity, so that a burst of posts is picked up quickly, and doubles after every quiet
+     * or failed scan until it reaches the maximum. Every interval handed out is spread by a random jitter so that gateways that were started
+     * together do not all hit the same provider in the same second.</p>
+     */
+    class adaptiveInterval
+    {
+    private:
+        std::chrono::milliseconds _min;
+        std::chrono::milliseconds _max;
+        std::chrono::milliseconds _current;
+        double _jitter;
+        std::mt19937 _random;
+
+        std::chrono::milliseconds spread(std::chrono::milliseconds interval)
+        {
+            std::uniform_real_distribution<double> dist(1.0 - _jitter, 1.0 + _jitter);
+            return std::chrono::milliseconds(static_cast<std::chrono::milliseconds::rep>(static_cast<double>(interval.count()) * dist(_random)));
+        }
+
+    public:
+        adaptiveInterval()
+        {
+            // Unless told otherwise a quiet mailbox is never left for longer than the fixed minute it used to be scanned at.
+            _min = std::chrono::seconds(30);
+            _max = std::chrono::minutes(1);
+            _current = _min;
+            _jitter = 0.2;
+            _random.seed(std::random_device()());
+        }
+
+        /**
+         * Sets the bounds of the interval; a maximum below the minimum is raised to it.
+         */
+        void setBounds(std::chrono::milliseconds min, std::chrono::milliseconds max)
+        {
+            _min = std::max(min, std::chrono::milliseconds(1000));
+            _max = std::max(max, _min);
+            _current = std::clamp(_current, _min, _max);
+        }
+
+        [[nodiscard]] std::chrono::milliseconds minimum() const
+        {
+            return _min;
+        }
+
+        [[nodiscard]] std::chrono::milliseconds maximum() const
+        {
+            return _max;
+        }
+
+        /**
+         * Sets the proportion, between 0 and 0.5, by which each interval is randomly lengthened or shortened.
+         */
+        void setJitter(double jitter)
+        {
+            _jitter = std::clamp(jitter, 0.0, 0.5);
+        }
+
+        void reset()
+        {
+            _current = _min;
+        }
+
+        /**
+         * Records that the last scan found something to do.
+         */
+        void activity()
+        {
+            _current = _min;
+        }
+
+        /**
+         * Records that the last scan found nothing, or failed.
+         */
+        void backoff()
+        {
+            _current = std::min(_current * 2, _max);
+        }
+
+        /**
+         * Gets the interval to wait before the next scan, with jitter applied.
+         */
+        std::chrono::milliseconds next()
+        {
+            return spread(_current);
+        }
+
+        /**
+         * Gets a random delay before the first scan, anywhere up to the minimum interval, so that gateways started together are spread out.
+         */
+        std::chrono::milliseconds initialDelay()
+        {
+            std::uniform_int_distribution<std::chrono::milliseconds::rep> dist(0, _min.count());
+            return std::chrono::milliseconds(dist(_random));
+        }
+    };
+}
+
+#endif // _ADAPTIVE_INTERVAL_HPP_
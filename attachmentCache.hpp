@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: attachmentCache.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ATTACHMENT_CACHE_HPP_
+#define _ATTACHMENT_CACHE_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "utils.hpp"
+
+namespace utilities
+{
+    /**
+     * <p>A process wide, content addressed cache of the attachments that have been received, so that a payload that is sent again (a "post" followed by a
+     * "repost", or one email copied to several input addresses) is recognised before it is processed a second time.</p>
+     * <p>Attachments are keyed by the XXH64 digest and length computed while they were extracted. A copy of each new attachment is kept in the cache
+     * directory, along with any results the application records against it, and the least recently used entries are evicted once the cache grows past
+     * its size limit. Without a directory the cache only remembers digests for the life of the process.</p>
+     * <p>A result belongs to a scope, such as the depot the attachment was processed for, so that the same file sent to two depots is processed for
+     * each of them.</p>
+     */
+    class attachmentCache
+    {
+    private:
+        struct entry
+        {
+            std::string key;
+            std::uint64_t size;
+            std::map<std::string, std::string> results;
+        };
+
+        typedef std::list<entry> lruList;
+
+        std::mutex _mutex;
+        boost::filesystem::path _directory;
+        std::uint64_t _maxSize;
+        std::uint64_t _totalSize;
+        lruList _lru;
+        std::unordered_map<std::string, lruList::iterator> _index;
+
+        attachmentCache()
+        {
+            _maxSize = 256 * 1024 * 1024;
+            _totalSize = 0;
+        }
+
+        static std::string keyFor(std::uint64_t digest, std::uint64_t size)
+        {
+            return xxHash64::toHex(digest) + "-" + std::to_string(size);
+        }
+
+        [[nodiscard]] boost::filesystem::path dataPath(const std::string& key) const
+        {
+            return _directory / (key + ".bin");
+        }
+
+        [[nodiscard]] boost::filesystem::path resultPath(const std::string& key) const
+        {
+            return _directory / (key + ".result");
+        }
+
+        /**
+         * Writes the results of an entry to its result file, one "scope<TAB>result" line each; the caller must hold the mutex.
+         */
+        void saveResults(const entry& e) const
+        {
+            if (_directory.empty()) return;
+            if (e.results.empty())
+            {
+                boost::system::error_code ec;
+                boost::filesystem::remove(resultPath(e.key), ec);
+                return;
+            }
+
+            std::ofstream out(resultPath(e.key).string(), std::ios::binary | std::ios::trunc);
+            for (const auto& [scope, result] : e.results) out << scope << '\t' << result << '\n';
+        }
+
+        void loadResults(entry& e) const
+        {
+            std::ifstream in(resultPath(e.key).string(), std::ios::binary);
+            std::string line;
+            while (std::getline(in, line))
+            {
+                auto tab = line.find('\t');
+                if (tab != std::string::npos) e.results[line.substr(0, tab)] = line.substr(tab + 1);
+            }
+        }
+
+        // Keeps a scope or result on one line of the result file.
+        static std::string oneLine(std::string text)
+        {
+            std::replace_if(text.begin(), text.end(), [](char c){ return (c == '\t') || (c == '\r') || (c == '\n'); }, ' ');
+            return text;
+        }
+
+        void touch(const std::string& key) const
+        {
+            if (_directory.empty()) return;
+            boost::system::error_code ec;
+            boost::filesystem::last_write_time(dataPath(key), std::time(nullptr), ec);
+        }
+
+        /**
+         * Drops least recently used entries until the cache fits in its limit; the caller must hold the mutex.
+         */
+        void evict()
+        {
+            while ((_totalSize > _maxSize) && !_lru.empty())
+            {
+                const entry& victim = _lru.back();
+                if (!_directory.empty())
+                {
+                    boost::system::error_code ec;
+                    boost::filesystem::remove(dataPath(victim.key), ec);
+                    boost::filesystem::remove(resultPath(victim.key), ec);
+                }
+                _totalSize -= victim.size;
+                _index.erase(victim.key);
+                _lru.pop_back();
+            }
+        }
+
+    public:
+        attachmentCache(const attachmentCache& other) = delete;
+        attachmentCache& operator=(const attachmentCache& other) = delete;
+
+        static attachmentCache& instance()
+        {
+            static attachmentCache cache;
+            return cache;
+        }
+
+        /**
+         * Sets the directory the cache is kept in and loads what a previous run left there, most recently used first.
+         */
+        void setDirectory(const boost::filesystem::path& directory)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _directory = directory;
+            _lru.clear();
+            _index.clear();
+            _totalSize = 0;
+
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(directory, ec);
+            std::vector<std::pair<std::time_t, entry>> found;
+            for (boost::filesystem::directory_iterator it(directory, ec), end; !ec && (it != end); it.increment(ec))
+            {
+                const auto& path = it->path();
+                if (path.extension() != ".bin") continue;
+
+                boost::system::error_code fec;
+                entry e{ path.stem().string(), boost::filesystem::file_size(path, fec), {} };
+                if (fec) continue;
+                std::time_t used = boost::filesystem::last_write_time(path, fec);
+                loadResults(e);
+                found.emplace_back(used, std::move(e));
+            }
+
+            std::sort(found.begin(), found.end(), [](const auto& a, const auto& b){ return a.first > b.first; });
+            for (auto& [used, e] : found)
+            {
+                _totalSize += e.size;
+                _lru.push_back(std::move(e));
+                _index.emplace(_lru.back().key, std::prev(_lru.end()));
+            }
+            evict();
+        }
+
+        /**
+         * Sets the largest total size of the attachments kept on disk.
+         */
+        void setMaxSize(std::uint64_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _maxSize = bytes;
+            evict();
+        }
+
+        /**
+         * Checks a freshly extracted attachment against the cache. If the same content has been received before, the file is marked as a duplicate;
+         * otherwise a copy of it is added to the cache.
+         * @return true if the attachment is a duplicate.
+         */
+        bool admit(temporaryFile& file)
+        {
+            if (!file.hasDigest()) return false;
+            std::string key = keyFor(file.digest(), file.size());
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _index.find(key);
+            if (it != _index.end())
+            {
+                _lru.splice(_lru.begin(), _lru, it->second);
+                touch(key);
+                file.setDuplicate();
+                return true;
+            }
+
+            if (!_directory.empty())
+            {
+                // A hard link costs nothing when the temporary directory is on the same file system as the cache.
+                boost::system::error_code ec;
+                boost::filesystem::create_hard_link(file.path(), dataPath(key), ec);
+                if (ec)
+                {
+                    ec.clear();
+                    boost::filesystem::copy_file(file.path(), dataPath(key), boost::filesystem::copy_option::overwrite_if_exists, ec);
+                }
+                if (ec) return false;
+                touch(key);
+            }
+
+            _lru.push_front(entry{ key, file.size(), {} });
+            _index.emplace(key, _lru.begin());
+            _totalSize += file.size();
+            evict();
+
+            return false;
+        }
+
+        /**
+         * Records the outcome of processing an attachment within a scope, to be handed to any later copy of it that is processed in the same scope.
+         */
+        void recordResult(const temporaryFile& file, const std::string& scope, const std::string& result)
+        {
+            if (!file.hasDigest()) return;
+            std::string key = keyFor(file.digest(), file.size());
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _index.find(key);
+            if (it == _index.end()) return;
+            it->second->results[oneLine(scope)] = oneLine(result);
+            saveResults(*it->second);
+        }
+
+        /**
+         * Gets the result recorded for an earlier copy of an attachment within a scope.
+         * @return The result, or an empty string if none has been recorded.
+         */
+        [[nodiscard]] std::string resultFor(const temporaryFile& file, const std::string& scope)
+        {
+            if (!file.hasDigest()) return "";
+            std::string key = keyFor(file.digest(), file.size());
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _index.find(key);
+            if (it == _index.end()) return "";
+            auto result = it->second->results.find(oneLine(scope));
+
+            return (result == it->second->results.end()) ? "" : result->second;
+        }
+
+        /**
+         * Forgets every result recorded within a scope, so that attachments sent to it again are processed afresh.
+         */
+        void forgetResults(const std::string& scope)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto& e : _lru)
+            {
+                if (e.results.erase(oneLine(scope)) > 0) saveResults(e);
+            }
+        }
+
+        [[nodiscard]] std::size_t count()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _lru.size();
+        }
+
+        [[nodiscard]] std::uint64_t totalSize()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _totalSize;
+        }
+    };
+}
+
+#endif // _ATTACHMENT_CACHE_HPP_
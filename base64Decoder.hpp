@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: base64Decoder.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BASE64_DECODER_HPP_
+#define _BASE64_DECODER_HPP_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define EUNOMIA_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace utilities
+{
+    namespace detail
+    {
+        constexpr std::uint8_t B64_SKIP = 0x80;
+        constexpr std::uint8_t B64_PAD = 0x81;
+
+        /**
+         * Maps each input byte to its 6-bit value, B64_PAD for '=' and B64_SKIP for anything else, which is ignored in the way vmime ignores it.
+         */
+        constexpr std::array<std::uint8_t, 256> makeBase64Table()
+        {
+            std::array<std::uint8_t, 256> table{};
+            for (auto& t : table) t = B64_SKIP;
+            for (int c = 'A'; c <= 'Z'; c++) table[c] = static_cast<std::uint8_t>(c - 'A');
+            for (int c = 'a'; c <= 'z'; c++) table[c] = static_cast<std::uint8_t>(c - 'a' + 26);
+            for (int c = '0'; c <= '9'; c++) table[c] = static_cast<std::uint8_t>(c - '0' + 52);
+            table['+'] = 62;
+            table['/'] = 63;
+            table['='] = B64_PAD;
+
+            return table;
+        }
+
+        constexpr std::array<std::uint8_t, 256> BASE64_TABLE = makeBase64Table();
+
+        /**
+         * Decodes whole blocks of base64 until one contains something other than the 64 alphabet characters.
+         * @return The number of input characters consumed, always a multiple of the block size; the output advances by three quarters of that.
+         */
+        typedef std::size_t (*base64Kernel)(const char *in, std::size_t length, unsigned char *out);
+
+        inline std::size_t base64KernelScalar(const char *in, std::size_t length, unsigned char *out)
+        {
+            std::size_t consumed = 0;
+            while (length - consumed >= 4)
+            {
+                std::uint8_t a = BASE64_TABLE[static_cast<unsigned char>(in[consumed])];
+                std::uint8_t b = BASE64_TABLE[static_cast<unsigned char>(in[consumed + 1])];
+                std::uint8_t c = BASE64_TABLE[static_cast<unsigned char>(in[consumed + 2])];
+                std::uint8_t d = BASE64_TABLE[static_cast<unsigned char>(in[consumed + 3])];
+                if ((a | b | c | d) & 0x80) break;
+                std::uint32_t v = (std::uint32_t(a) << 18) | (std::uint32_t(b) << 12) | (std::uint32_t(c) << 6) | d;
+                *out++ = static_cast<unsigned char>(v >> 16);
+                *out++ = static_cast<unsigned char>(v >> 8);
+                *out++ = static_cast<unsigned char>(v);
+                consumed += 4;
+            }
+
+            return consumed;
+        }
+
+#ifdef EUNOMIA_SIMD_X86
+        // The vector kernels validate and translate 16 or 32 characters at a time with nibble lookup tables and then pack the 6-bit values with
+        // multiply-add instructions (W. Muła and D. Lemire, "Faster Base64 Encoding and Decoding Using AVX2 Instructions", 2018). Each store writes
+        // a few bytes past the decoded data, which the callers allow for.
+
+        __attribute__((target("sse4.1")))
+        inline std::size_t base64KernelSse(const char *in, std::size_t length, unsigned char *out)
+        {
+            const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+            const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+            const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+            const __m128i mask2F = _mm_set1_epi8(0x2F);
+            const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+            std::size_t consumed = 0;
+            while (length - consumed >= 16)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + consumed));
+                __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask2F);
+                __m128i loNibbles = _mm_and_si128(v, mask2F);
+                __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+                __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+                if (!_mm_testz_si128(lo, hi)) break;
+
+                __m128i eq2F = _mm_cmpeq_epi8(v, mask2F);
+                __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, hiNibbles));
+                v = _mm_add_epi8(v, roll);
+                __m128i merged = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+                __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+                packed = _mm_shuffle_epi8(packed, pack);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out), packed);
+                out += 12;
+                consumed += 16;
+            }
+
+            return consumed;
+        }
+
+        __attribute__((target("avx2")))
+        inline std::size_t base64KernelAvx2(const char *in, std::size_t length, unsigned char *out)
+        {
+            const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                                   0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+            const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                                   0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+            const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                     0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+            const __m256i mask2F = _mm256_set1_epi8(0x2F);
+            const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+            const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+            std::size_t consumed = 0;
+            while (length - consumed >= 32)
+            {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + consumed));
+                __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask2F);
+                __m256i loNibbles = _mm256_and_si256(v, mask2F);
+                __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+                __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+                if (!_mm256_testz_si256(lo, hi)) break;
+
+                __m256i eq2F = _mm256_cmpeq_epi8(v, mask2F);
+                __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+                v = _mm256_add_epi8(v, roll);
+                __m256i merged = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+                __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+                packed = _mm256_shuffle_epi8(packed, pack);
+                packed = _mm256_permutevar8x32_epi32(packed, lanes);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), packed);
+                out += 24;
+                consumed += 32;
+            }
+
+            return consumed;
+        }
+#endif
+
+        struct base64KernelInfo
+        {
+            base64Kernel kernel;
+            std::size_t block;
+            const char *name;
+        };
+
+        /**
+         * Picks the widest kernel the processor supports, once.
+         */
+        inline const base64KernelInfo& selectBase64Kernel()
+        {
+            static const base64KernelInfo info = []
+            {
+#ifdef EUNOMIA_SIMD_X86
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("avx2")) return base64KernelInfo{ base64KernelAvx2, 32, "avx2" };
+                if (__builtin_cpu_supports("sse4.1")) return base64KernelInfo{ base64KernelSse, 16, "sse4.1" };
+#endif
+                return base64KernelInfo{ base64KernelScalar, 4, "scalar" };
+            }();
+
+            return info;
+        }
+    }
+
+    /**
+     * <p>A streaming base64 decoder.</p>
+     * <p>Input can be fed in chunks of any size, split anywhere. Runs of clean base64 are decoded by the widest vector kernel the processor supports;
+     * line breaks, padding and anything outside the alphabet are dealt with one character at a time, and characters outside the alphabet are ignored.</p>
+     */
+    class base64Decoder
+    {
+    private:
+        const detail::base64KernelInfo *_kernel;
+        std::uint32_t _bits;
+        unsigned int _pending;
+
+    public:
+        /**
+         * The number of bytes past the decoded data that decode() may write to.
+         */
+        static constexpr std::size_t OUTPUT_SLACK = 8;
+
+        base64Decoder()
+        {
+            _kernel = &detail::selectBase64Kernel();
+            _bits = 0;
+            _pending = 0;
+        }
+
+        /**
+         * Gets the size of output buffer needed to decode a chunk of the given length.
+         */
+        static constexpr std::size_t outputCapacity(std::size_t length)
+        {
+            return ((length / 4) + 1) * 3 + OUTPUT_SLACK;
+        }
+
+        /**
+         * Gets the name of the kernel in use, for diagnostics.
+         */
+        [[nodiscard]] const char *kernelName() const
+        {
+            return _kernel->name;
+        }
+
+        /**
+         * Uses the portable kernel whatever the processor supports.
+         */
+        void forceScalar()
+        {
+            static const detail::base64KernelInfo scalar{ detail::base64KernelScalar, 4, "scalar" };
+            _kernel = &scalar;
+        }
+
+        void reset()
+        {
+            _bits = 0;
+            _pending = 0;
+        }
+
+        /**
+         * Decodes a chunk of input.
+         * @param out Receives the decoded bytes; it must hold at least outputCapacity(length) bytes.
+         * @return The number of bytes decoded.
+         */
+        std::size_t decode(const char *in, std::size_t length, unsigned char *out)
+        {
+            unsigned char *o = out;
+            std::size_t i = 0;
+            while (i < length)
+            {
+                if ((_pending == 0) && (length - i >= _kernel->block))
+                {
+                    std::size_t consumed = _kernel->kernel(in + i, length - i, o);
+                    i += consumed;
+                    o += (consumed / 4) * 3;
+                    // Finish the tail of the line a group at a time, rather than a character at a time, up to the line break.
+                    consumed = detail::base64KernelScalar(in + i, length - i, o);
+                    i += consumed;
+                    o += (consumed / 4) * 3;
+                    if (i >= length) break;
+                }
+
+                std::uint8_t v = detail::BASE64_TABLE[static_cast<unsigned char>(in[i++])];
+                if (v == detail::B64_SKIP) continue;
+                if (v == detail::B64_PAD)
+                {
+                    o += flush(o);
+                    continue;
+                }
+
+                _bits = (_bits << 6) | v;
+                if (++_pending == 4)
+                {
+                    *o++ = static_cast<unsigned char>(_bits >> 16);
+                    *o++ = static_cast<unsigned char>(_bits >> 8);
+                    *o++ = static_cast<unsigned char>(_bits);
+                    _bits = 0;
+                    _pending = 0;
+                }
+            }
+
+            return static_cast<std::size_t>(o - out);
+        }
+
+        /**
+         * Emits whatever a final, unpadded group of characters holds; at most two bytes.
+         */
+        std::size_t flush(unsigned char *out)
+        {
+            std::size_t retval = 0;
+            if (_pending == 2)
+            {
+                out[0] = static_cast<unsigned char>(_bits >> 4);
+                retval = 1;
+            }
+            else if (_pending == 3)
+            {
+                out[0] = static_cast<unsigned char>(_bits >> 10);
+                out[1] = static_cast<unsigned char>(_bits >> 2);
+                retval = 2;
+            }
+            _bits = 0;
+            _pending = 0;
+
+            return retval;
+        }
+    };
+
+    /**
+     * <p>A streaming quoted-printable decoder (RFC 2045 section 6.7).</p>
+     * <p>Literal runs are copied with memchr/memcpy rather than byte by byte. Soft line breaks are removed, and an '=' that does not start a valid
+     * escape is passed through as it stands.</p>
+     */
+    class quotedPrintableDecoder
+    {
+    private:
+        char _held[3];
+        unsigned int _heldCount;
+
+        static int hexValue(char c)
+        {
+            if ((c >= '0') && (c <= '9')) return c - '0';
+            if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+            if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+            return -1;
+        }
+
+        void put(char c, unsigned char *&out)
+        {
+            if (_heldCount == 0)
+            {
+                if (c == '=')
+                {
+                    _held[0] = c;
+                    _heldCount = 1;
+                }
+                else
+                {
+                    *out++ = static_cast<unsigned char>(c);
+                }
+                return;
+            }
+
+            _held[_heldCount++] = c;
+            if (_held[1] == '\n')
+            {
+                // Soft line break.
+                _heldCount = 0;
+                return;
+            }
+            if (_held[1] == '\r')
+            {
+                if (_heldCount < 3) return;
+                if (_held[2] == '\n')
+                {
+                    _heldCount = 0;
+                    return;
+                }
+            }
+            else if (_heldCount < 3)
+            {
+                if (hexValue(_held[1]) >= 0) return;
+            }
+            else
+            {
+                int hi = hexValue(_held[1]);
+                int lo = hexValue(_held[2]);
+                if (lo >= 0)
+                {
+                    *out++ = static_cast<unsigned char>((hi << 4) | lo);
+                    _heldCount = 0;
+                    return;
+                }
+            }
+
+            // Not a valid escape: the '=' stands as it is and what followed it is read again.
+            char rest[2];
+            unsigned int restCount = _heldCount - 1;
+            for (unsigned int i = 0; i < restCount; i++) rest[i] = _held[i + 1];
+            _heldCount = 0;
+            *out++ = '=';
+            for (unsigned int i = 0; i < restCount; i++) put(rest[i], out);
+        }
+
+    public:
+        quotedPrintableDecoder()
+        {
+            _heldCount = 0;
+        }
+
+        static constexpr std::size_t outputCapacity(std::size_t length)
+        {
+            return length + 3;
+        }
+
+        void reset()
+        {
+            _heldCount = 0;
+        }
+
+        /**
+         * Decodes a chunk of input.
+         * @param out Receives the decoded bytes; it must hold at least outputCapacity(length) bytes.
+         * @return The number of bytes decoded.
+         */
+        std::size_t decode(const char *in, std::size_t length, unsigned char *out)
+        {
+            unsigned char *o = out;
+            std::size_t i = 0;
+            while (i < length)
+            {
+                if (_heldCount > 0)
+                {
+                    put(in[i++], o);
+                    continue;
+                }
+
+                const void *eq = std::memchr(in + i, '=', length - i);
+                std::size_t run = eq ? static_cast<std::size_t>(static_cast<const char *>(eq) - (in + i)) : (length - i);
+                std::memcpy(o, in + i, run);
+                o += run;
+                i += run;
+                if (i < length) put(in[i++], o);
+            }
+
+            return static_cast<std::size_t>(o - out);
+        }
+
+        /**
+         * Emits any escape sequence left incomplete at the end of the input as it stands.
+         */
+        std::size_t flush(unsigned char *out)
+        {
+            std::size_t retval = _heldCount;
+            for (unsigned int i = 0; i < _heldCount; i++) out[i] = static_cast<unsigned char>(_held[i]);
+            _heldCount = 0;
+
+            return retval;
+        }
+    };
+
+    /**
+     * Decodes a buffer in fixed size chunks, handing each decoded chunk to a sink so that large attachments never need a second full size buffer.
+     * @param sink Called as sink(const unsigned char *data, std::size_t length).
+     */
+    template<typename DecoderT, typename SinkT>
+    void decodeStreaming(DecoderT& decoder, const char *in, std::size_t length, SinkT&& sink)
+    {
+        constexpr std::size_t CHUNK = 64 * 1024;
+        std::vector<unsigned char> buffer(DecoderT::outputCapacity(CHUNK));
+        for (std::size_t offset = 0; offset < length; offset += CHUNK)
+        {
+            std::size_t n = decoder.decode(in + offset, std::min(CHUNK, length - offset), buffer.data());
+            if (n > 0) sink(buffer.data(), n);
+        }
+        std::size_t n = decoder.flush(buffer.data());
+        if (n > 0) sink(buffer.data(), n);
+    }
+}
+
+#endif // _BASE64_DECODER_HPP_
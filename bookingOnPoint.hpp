@@ -7,7 +7,11 @@
 #include <QDateTime>
 #include <QDomNode>
 #include <QStringListModel>
+#include <algorithm>
+#include <type_traits>
 #include "imapEmailGateway.hpp"
+#include "pop3EmailGateway.hpp"
+#include "maildirGateway.hpp"
 
 inline QString buildQString(const char * string)
 {
@@ -68,6 +72,10 @@ private:
     QStringListModel *_model;
     std::mutex logMutex;
     std::mutex stateMutex;
+    static constexpr std::size_t PROTOCOL_TRACE_LINES = 100;
+    template<typename ScannerT>
+    static bool parseIncomingServer(const QDomNode& sNode, ScannerT& scanner);
+    static bool parseIncomingServer(const QDomNode& sNode, std::unique_ptr<telemeteryServices::maildirGateway>& scanner);
 public:
     bookingOnPoint(const QString& company, const QString& name, const QString& orgUnit, const QString& line);
     ~bookingOnPoint() override;
@@ -82,10 +90,13 @@ public:
     void stopScannersAsync();
     void startPollingAsync();
     void stopPolling();
+    void setProtocolTracing(bool enabled);
+    void dumpProtocolTrace();
     [[nodiscard]] bool blocked() const;
     [[nodiscard]] const std::vector<std::unique_ptr<telemeteryServices::abstractGateway>>& scanners() const;
     DepotServerState state();
     void setState(DepotServerState newState);
+    void updateNetworkState();
     void claimListModel(QStringListModel *model);
     void disclaimModel();
     void clearMessageLog();
@@ -117,16 +128,32 @@ inline void unauthorised(const telemeteryServices::abstractGateway& sender, cons
     depot->appendLogMessage(QString::fromStdString(s));
 }
 
+inline void connectionHealthChanged(const telemeteryServices::abstractGateway& sender, telemeteryServices::connectionHealth health, void* userData)
+{
+    bookingOnPoint *depot = static_cast<bookingOnPoint *>(userData);
+    depot->updateNetworkState();
+}
+
 inline bool command(const telemeteryServices::abstractGateway& sender, telemeteryServices::command command, const std::string& originator, std::string& message, std::vector<std::unique_ptr<utilities::temporaryFile>>& payload, void* userData)
 {
     bookingOnPoint *depot = static_cast<bookingOnPoint *>(userData);
     std::string s = "Command '" + commandToString(command) + "' received from '" + originator + "' via " + sender.getID();
     depot->appendLogMessage(QString::fromStdString(s));
 
+    // Results of processing a payload are kept per depot, as the same sheet may be sent to several of them.
+    std::string scope = (depot->name() + " (" + depot->line() + ")").toStdString();
+
     std::cout << "Text: \n" << message << "\n";
     for (const auto& a : payload)
     {
         std::cout << "Attachment: " << a->string() << "\n";
+        if (a->isDuplicate())
+        {
+            std::string d = "An attachment received from '" + originator + "' via " + sender.getID() + " is identical to one received earlier";
+            std::string result = utilities::attachmentCache::instance().resultFor(*a, scope);
+            if (!result.empty()) d += " (" + result + ")";
+            depot->appendLogMessage(QString::fromStdString(d));
+        }
     }
 
     switch (command)
@@ -155,6 +182,8 @@ inline bool command(const telemeteryServices::abstractGateway& sender, telemeter
         }
         break;
     case telemeteryServices::command::remove:
+        // A sheet that is posted again after being removed must be processed again.
+        utilities::attachmentCache::instance().forgetResults(scope);
         break;
     case telemeteryServices::command::killswitch_pending:
         break;
@@ -167,7 +196,29 @@ inline bool command(const telemeteryServices::abstractGateway& sender, telemeter
 
     }
 
-    // Process and action command.
+    // A payload that has already been processed for this depot, a "post" followed by a "repost" or one email sent to several of its input
+    // addresses, is not processed again; the poster is told what became of the earlier copy instead.
+    bool isPost = (command == telemeteryServices::command::implicit_post) || (command == telemeteryServices::command::explicit_post) || (command == telemeteryServices::command::repost);
+    std::vector<std::string> results;
+    for (const auto& a : payload)
+    {
+        if (!isPost || !a->isDuplicate()) break;
+        std::string result = utilities::attachmentCache::instance().resultFor(*a, scope);
+        if (result.empty()) break;
+        results.push_back(result);
+    }
+    if (!payload.empty() && (results.size() == payload.size()))
+    {
+        std::string result = results.front();
+        sender.messageLastPoster("The last '" + commandToString(command) + "' command to the " + depot->name().toStdString() + " schedule sheet dispatcher was not processed again", "The payload attached to this email is identical to one that has already been processed: " + result + ".");
+        std::string s = "The last '" + commandToString(command) + "' command received from '" + originator + "' via " + sender.getID() + " was not processed because its payload has already been processed: " + result;
+        depot->appendLogMessage(QString::fromStdString(s));
+        return true;
+    }
+
+    // Process and action command. Once a sheet has been dispatched, its outcome is recorded against each attachment with
+    // attachmentCache::recordResult() under the depot's scope, so that later copies sent to this depot are short-circuited above.
+
     return false;
 }
 
@@ -183,6 +234,43 @@ bookingOnPoint::bookingOnPoint(const QString& company, const QString& name, cons
     setText(_name + " (" + _line + ")");
 }
 
+template<typename ScannerT>
+bool bookingOnPoint::parseIncomingServer(const QDomNode& sNode, ScannerT& scanner)
+{
+    auto isNode = sNode.namedItem("incoming-server");
+    if (isNode.isNull() || isNode.childNodes().isEmpty()) return false;
+    auto unNode = isNode.namedItem("username");
+    if (unNode.isNull() || unNode.toElement().text().isEmpty()) return false;
+    scanner->setFetchUsername(unNode.toElement().text().toStdString());
+    auto pwNode = isNode.namedItem("password");
+    if (pwNode.isNull() || pwNode.toElement().text().isEmpty()) return false;
+    scanner->setFetchPassword(pwNode.toElement().text().toStdString());
+    auto hNode = isNode.namedItem("host");
+    if (hNode.isNull() || hNode.toElement().text().isEmpty()) return false;
+    scanner->setFetchServer(hNode.toElement().text().toStdString());
+    auto pNode = isNode.namedItem("port");
+    if (pNode.isNull() || pNode.toElement().text().isEmpty()) return false;
+    scanner->setFetchPort(pNode.toElement().text().toUInt());
+    if constexpr (std::is_same_v<ScannerT, std::unique_ptr<telemeteryServices::imapEmailGateway>>)
+    {
+        // Claimed messages are moved to this folder instead of being deleted.
+        auto afNode = isNode.namedItem("archive-folder");
+        if (!afNode.isNull()) scanner->setArchiveFolder(afNode.toElement().text().trimmed().toStdString());
+    }
+
+    return true;
+}
+
+inline bool bookingOnPoint::parseIncomingServer(const QDomNode& sNode, std::unique_ptr<telemeteryServices::maildirGateway>& scanner)
+{
+    // A local gateway reads from a directory rather than a server.
+    auto mdNode = sNode.namedItem("maildir");
+    if (mdNode.isNull() || mdNode.toElement().text().isEmpty()) return false;
+    scanner->setDirectory(mdNode.toElement().text().toStdString());
+
+    return true;
+}
+
 template<typename ScannerT>
 void bookingOnPoint::parseAndAddMailGateway(const QDomNode& sNode, ScannerT& scanner)
 {
@@ -195,34 +283,41 @@ void bookingOnPoint::parseAndAddMailGateway(const QDomNode& sNode, ScannerT& sca
     auto kkNode = sNode.namedItem("killswitch-key");
     if (kkNode.isNull() || kkNode.toElement().text().isEmpty()) return;
     scanner->setKillswitchPassword(kkNode.toElement().text().toStdString());
-    auto isNode = sNode.namedItem("incoming-server");
-    if (isNode.isNull() || isNode.childNodes().isEmpty()) return;
-    auto unNode = isNode.namedItem("username");
-    if (unNode.isNull() || unNode.toElement().text().isEmpty()) return;
-    scanner->setFetchUsername(unNode.toElement().text().toStdString());
-    auto pwNode = isNode.namedItem("password");
-    if (pwNode.isNull() || pwNode.toElement().text().isEmpty()) return;
-    scanner->setFetchPassword(pwNode.toElement().text().toStdString());
-    auto hNode = isNode.namedItem("host");
-    if (hNode.isNull() || hNode.toElement().text().isEmpty()) return;
-    scanner->setFetchServer(hNode.toElement().text().toStdString());
-    auto pNode = isNode.namedItem("port");
-    if (pNode.isNull() || pNode.toElement().text().isEmpty()) return;
-    scanner->setFetchPort(pNode.toElement().text().toUInt());
+    if (!parseIncomingServer(sNode, scanner)) return;
     auto ogNode = sNode.namedItem("outgoing-server");
     if (ogNode.isNull() || ogNode.childNodes().isEmpty()) return;
-    unNode = ogNode.namedItem("username");
+    auto unNode = ogNode.namedItem("username");
     if (unNode.isNull() || unNode.toElement().text().isEmpty()) return;
     scanner->setSendUsername(unNode.toElement().text().toStdString());
-    pwNode = ogNode.namedItem("password");
+    auto pwNode = ogNode.namedItem("password");
     if (pwNode.isNull() || pwNode.toElement().text().isEmpty()) return;
     scanner->setSendPassword(pwNode.toElement().text().toStdString());
-    hNode = ogNode.namedItem("host");
+    auto hNode = ogNode.namedItem("host");
     if (hNode.isNull() || hNode.toElement().text().isEmpty()) return;
     scanner->setSendServer(hNode.toElement().text().toStdString());
-    pNode = ogNode.namedItem("port");
+    auto pNode = ogNode.namedItem("port");
     if (pNode.isNull() || pNode.toElement().text().isEmpty()) return;
     scanner->setSendPort(pNode.toElement().text().toUInt());
+    auto pmNode = sNode.namedItem("push-mode");
+    if (!pmNode.isNull()) scanner->setPushMode(pmNode.toElement().text().compare("true", Qt::CaseInsensitive) == 0);
+    auto mpNode = sNode.namedItem("max-payload-size");
+    if (!mpNode.isNull())
+    {
+        // The limit is given in bytes.
+        bool ok = false;
+        auto maxPayload = mpNode.toElement().text().trimmed().toULongLong(&ok);
+        if (ok && (maxPayload > 0)) scanner->setMaxPayloadSize(static_cast<std::size_t>(maxPayload));
+    }
+    auto piNode = sNode.namedItem("poll-interval");
+    if (!piNode.isNull() && piNode.isElement())
+    {
+        // Bounds are given in seconds, e.g. <poll-interval min="15" max="600"/>. They default to 30 and 60, so a quiet mailbox is still scanned
+        // at least once a minute; a longer maximum must be asked for explicitly.
+        auto piElement = piNode.toElement();
+        int minSeconds = piElement.attribute("min", "30").toInt();
+        int maxSeconds = piElement.attribute("max", "60").toInt();
+        if (minSeconds > 0) scanner->setPollInterval(std::chrono::seconds(minSeconds), std::chrono::seconds(std::max(minSeconds, maxSeconds)));
+    }
     scanner->setSendersAccessControlAction(utilities::accessControlAction::allow);
     auto aclNode = sNode.namedItem("access-control-list");
     if (aclNode.isNull() || !aclNode.isElement()) return;
@@ -241,6 +336,7 @@ void bookingOnPoint::parseAndAddMailGateway(const QDomNode& sNode, ScannerT& sca
     scanner->setWarningCallback(warning);
     scanner->setUnauthorisedAccessCallback(unauthorised);
     scanner->setCommandReceivedCallback(command);
+    scanner->setConnectionHealthCallback(connectionHealthChanged);
     _scanners.push_back(std::move(scanner));
     _state = DepotServerState::Stopped;
 }
@@ -326,6 +422,30 @@ void bookingOnPoint::setState(DepotServerState newState)
     stateMutex.unlock();
 }
 
+/**
+ * Moves a polling depot into the network issue state while any of its scanners cannot reach its server, and back once they all can. Called from
+ * the poll scheduler's worker threads; a depot that is not polling is left alone.
+ */
+void bookingOnPoint::updateNetworkState()
+{
+    bool issue = false;
+    for (const auto& scn : _scanners)
+    {
+        if (scn->health() != telemeteryServices::connectionHealth::healthy) issue = true;
+    }
+
+    stateMutex.lock();
+    DepotServerState previous = _state;
+    if ((_state == DepotServerState::Polling) && issue) _state = DepotServerState::NetworkIssue;
+    else if ((_state == DepotServerState::NetworkIssue) && !issue) _state = DepotServerState::Polling;
+    bool changed = (_state != previous);
+    stateMutex.unlock();
+
+    if (!changed) return;
+    if (issue) appendLogMessage("Network issues, scanners are reconnecting");
+    else appendLogMessage("Network issues resolved, polling for telemetery");
+}
+
 void bookingOnPoint::startScannersAsync()
 {
     if (_state == DepotServerState::Started) return;
@@ -421,6 +541,9 @@ void bookingOnPoint::stopScannersAsync()
     });
 }
 
+/**
+ * Registers every scanner with the shared poll scheduler, the scanners are then polled from its worker threads.
+ */
 void bookingOnPoint::startPollingAsync()
 {
     if (_state != DepotServerState::Started) return;
@@ -436,9 +559,12 @@ void bookingOnPoint::startPollingAsync()
     appendLogMessage("Polling for telemetery");
 }
 
+/**
+ * Unregisters every scanner from the shared poll scheduler, waiting for any poll that is in progress to finish.
+ */
 void bookingOnPoint::stopPolling()
 {
-    if (_state != DepotServerState::Polling) return;
+    if ((_state != DepotServerState::Polling) && (_state != DepotServerState::NetworkIssue)) return;
     for (auto& scn : _scanners)
     {
         scn->pause();
@@ -448,4 +574,36 @@ void bookingOnPoint::stopPolling()
     appendLogMessage("Polling concluded");
 }
 
+/**
+ * Switches protocol tracing on or off for every scanner.
+ */
+void bookingOnPoint::setProtocolTracing(bool enabled)
+{
+    for (auto& scn : _scanners)
+    {
+        scn->setProtocolTracing(enabled);
+    }
+}
+
+/**
+ * Writes the last protocol lines each scanner has exchanged with its servers to the message log.
+ */
+void bookingOnPoint::dumpProtocolTrace()
+{
+    for (auto& scn : _scanners)
+    {
+        auto lines = scn->protocolTraceLines(PROTOCOL_TRACE_LINES);
+        if (lines.empty())
+        {
+            appendLogMessage(QString::fromStdString(scn->getID() + " has no protocol trace"));
+            continue;
+        }
+        appendLogMessage(QString::fromStdString("Protocol trace for " + scn->getID() + ":"));
+        for (const auto& line : lines)
+        {
+            appendLogMessage(QString::fromStdString(line));
+        }
+    }
+}
+
 #endif // DEPOT_H
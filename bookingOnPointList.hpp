@@ -77,6 +77,15 @@ public slots:
     }
 
 public:
+    void setProtocolTracing(bool enabled)
+    {
+        for (auto i = 0; i < count(); i++)
+        {
+            auto bop = dynamic_cast<bookingOnPoint *>(item(i));
+            bop->setProtocolTracing(enabled);
+        }
+    }
+
     [[nodiscard]] bool blocking() const
     {
         return _startFuture.valid() || _stopFuture.valid() || _restartFuture.valid();
@@ -153,7 +162,7 @@ public:
         for (auto i = 0; i < count(); i++)
         {
             auto bop = dynamic_cast<bookingOnPoint *>(item(i));
-            if (bop->state() == DepotServerState::Polling) return true;
+            if ((bop->state() == DepotServerState::Polling) || (bop->state() == DepotServerState::NetworkIssue)) return true;
         }
 
         return false;
@@ -164,7 +173,7 @@ public:
         for (auto i = 0; i < count(); i++)
         {
             auto bop = dynamic_cast<bookingOnPoint *>(item(i));
-            if (bop->state() != DepotServerState::Polling) return false;
+            if ((bop->state() != DepotServerState::Polling) && (bop->state() != DepotServerState::NetworkIssue)) return false;
         }
 
         return true;
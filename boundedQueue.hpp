@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: boundedQueue.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BOUNDED_QUEUE_HPP_
+#define _BOUNDED_QUEUE_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+namespace utilities
+{
+    /**
+     * <p>A first in, first out queue of limited capacity connecting the stages of a pipeline running on different threads.</p>
+     * <p>A producer that gets ahead of its consumer blocks once the queue is full, which bounds the memory held between the stages. Closing the queue
+     * lets the consumer drain what is left and then tells it that nothing more is coming.</p>
+     */
+    template<typename T>
+    class boundedQueue
+    {
+    private:
+        std::mutex _mutex;
+        std::condition_variable _notFull;
+        std::condition_variable _notEmpty;
+        std::deque<T> _items;
+        std::size_t _capacity;
+        bool _closed;
+
+    public:
+        explicit boundedQueue(std::size_t capacity)
+        {
+            _capacity = (capacity > 0) ? capacity : 1;
+            _closed = false;
+        }
+
+        boundedQueue(const boundedQueue& other) = delete;
+        boundedQueue& operator=(const boundedQueue& other) = delete;
+
+        /**
+         * Adds an item, waiting for room if the queue is full.
+         * @return false if the queue has been closed, in which case the item is not added.
+         */
+        bool push(T item)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _notFull.wait(lock, [this]{ return _closed || (_items.size() < _capacity); });
+            if (_closed) return false;
+            _items.push_back(std::move(item));
+            _notEmpty.notify_one();
+
+            return true;
+        }
+
+        /**
+         * Takes the oldest item, waiting for one if the queue is empty.
+         * @return false once the queue has been closed and every item in it taken.
+         */
+        bool pop(T& item)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _notEmpty.wait(lock, [this]{ return _closed || !_items.empty(); });
+            if (_items.empty()) return false;
+            item = std::move(_items.front());
+            _items.pop_front();
+            _notFull.notify_one();
+
+            return true;
+        }
+
+        /**
+         * Refuses any further items; those already queued can still be taken.
+         */
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+            _notFull.notify_all();
+            _notEmpty.notify_all();
+        }
+
+        [[nodiscard]] bool closed()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _closed;
+        }
+    };
+}
+
+#endif // _BOUNDED_QUEUE_HPP_
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: certificateCache.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CERTIFICATE_CACHE_HPP_
+#define _CERTIFICATE_CACHE_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <vmime/vmime.hpp>
+#include <vmime/utility/datetimeUtils.hpp>
+#include "sha256.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * <p>The certificates every gateway has come to trust, and the certificate chains already verified for each host, shared by all the sessions in
+     * the process.</p>
+     * <p>Certificates are keyed by the SHA-256 fingerprint of their DER encoding, so a certificate is trusted once however many handshakes present
+     * it. A successful verification is remembered against the fingerprints of the whole chain and the host name for a limited time, or until the
+     * first certificate in the chain expires if that is sooner, so a reconnect to the same server skips the full chain validation. Failures are
+     * never remembered.</p>
+     * <p>Lookups take a shared lock and can run on any number of threads at once.</p>
+     */
+    class certificateCache
+    {
+    public:
+        typedef utilities::sha256::digestType fingerprint;
+
+    private:
+        static constexpr std::size_t MAX_VERIFIED = 256;
+        static constexpr std::chrono::minutes VERIFIED_LIFETIME = std::chrono::minutes(60);
+
+        mutable std::shared_mutex _mutex;
+        std::map<fingerprint, vmime::shared_ptr<vmime::security::cert::X509Certificate>> _trusted;
+        // The trusted certificates in the form the vmime verifier wants them.
+        std::vector<vmime::shared_ptr<vmime::security::cert::X509Certificate>> _trustedList;
+        std::map<fingerprint, std::chrono::system_clock::time_point> _verified;
+
+        certificateCache() = default;
+
+        static std::chrono::system_clock::time_point expiryOf(const vmime::shared_ptr<vmime::security::cert::certificate>& certificate)
+        {
+            auto x509 = vmime::dynamicCast<vmime::security::cert::X509Certificate>(certificate);
+            if (!x509) return std::chrono::system_clock::time_point::max();
+            vmime::datetime expiry = vmime::utility::datetimeUtils::toUniversalTime(x509->getExpirationDate());
+            std::tm tm1{};
+            tm1.tm_year = expiry.getYear() - 1900;
+            tm1.tm_mon = expiry.getMonth() - 1;
+            tm1.tm_mday = expiry.getDay();
+            tm1.tm_hour = expiry.getHour();
+            tm1.tm_min = expiry.getMinute();
+            tm1.tm_sec = expiry.getSecond();
+
+#ifdef _WIN32
+            return std::chrono::system_clock::from_time_t(_mkgmtime(&tm1));
+#else
+            return std::chrono::system_clock::from_time_t(timegm(&tm1));
+#endif
+        }
+
+    public:
+        certificateCache(const certificateCache& other) = delete;
+        certificateCache& operator=(const certificateCache& other) = delete;
+
+        static certificateCache& instance()
+        {
+            static certificateCache cache;
+            return cache;
+        }
+
+        static fingerprint fingerprintOf(const vmime::shared_ptr<vmime::security::cert::certificate>& certificate)
+        {
+            vmime::byteArray der = certificate->getEncoded();
+            return utilities::sha256::hash(der.data(), der.size());
+        }
+
+        /**
+         * Builds the key a verification is remembered under: a digest of the fingerprint of every certificate in the chain, in order, and the host
+         * name it was presented for.
+         */
+        static fingerprint chainKey(const vmime::shared_ptr<vmime::security::cert::certificateChain>& chain, const std::string& hostname)
+        {
+            utilities::sha256 h;
+            for (std::size_t i = 0; i < chain->getCount(); i++)
+            {
+                fingerprint f = fingerprintOf(chain->getAt(i));
+                h.update(f.data(), f.size());
+            }
+            std::string host = boost::to_lower_copy(hostname);
+            h.update(host.data(), host.size());
+
+            return h.digest();
+        }
+
+        /**
+         * Checks whether a chain was verified for the host recently enough to be accepted again without verifying it.
+         */
+        [[nodiscard]] bool verified(const fingerprint& key) const
+        {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            auto it = _verified.find(key);
+
+            return (it != _verified.end()) && (std::chrono::system_clock::now() < it->second);
+        }
+
+        /**
+         * Remembers that a chain was verified for a host.
+         */
+        void rememberVerified(const fingerprint& key, const vmime::shared_ptr<vmime::security::cert::certificateChain>& chain)
+        {
+            auto until = std::chrono::system_clock::now() + VERIFIED_LIFETIME;
+            for (std::size_t i = 0; i < chain->getCount(); i++) until = std::min(until, expiryOf(chain->getAt(i)));
+
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            if ((_verified.size() >= MAX_VERIFIED) && !_verified.contains(key))
+            {
+                // Drop whatever has expired, and if that is not enough, the entry closest to expiring.
+                auto now = std::chrono::system_clock::now();
+                std::erase_if(_verified, [now](const auto& item){ return item.second <= now; });
+                if (_verified.size() >= MAX_VERIFIED)
+                {
+                    auto soonest = std::min_element(_verified.begin(), _verified.end(), [](const auto& a, const auto& b){ return a.second < b.second; });
+                    _verified.erase(soonest);
+                }
+            }
+            _verified[key] = until;
+        }
+
+        /**
+         * Adds a certificate to the trusted set, unless one with the same fingerprint is already there.
+         * @return true if the certificate was added.
+         */
+        bool trust(const vmime::shared_ptr<vmime::security::cert::X509Certificate>& certificate)
+        {
+            fingerprint f = fingerprintOf(certificate);
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            if (!_trusted.emplace(f, certificate).second) return false;
+            _trustedList.push_back(certificate);
+
+            return true;
+        }
+
+        [[nodiscard]] std::vector<vmime::shared_ptr<vmime::security::cert::X509Certificate>> trustedCertificates() const
+        {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            return _trustedList;
+        }
+
+        /**
+         * Forgets every remembered verification, so the next handshake with each server verifies its chain again.
+         */
+        void clearVerified()
+        {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            _verified.clear();
+        }
+    };
+}
+
+#endif // _CERTIFICATE_CACHE_HPP_
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: circuitBreaker.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CIRCUIT_BREAKER_HPP_
+#define _CIRCUIT_BREAKER_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace telemeteryServices
+{
+    /**
+     * <p>Decides when a gateway that cannot reach its mail server should try again.</p>
+     * <p>After a failure the gateway retries after a short delay that doubles with every further failure. Once a number of attempts in a row have
+     * failed the breaker opens: nothing is attempted until the delay has run out, and then a single attempt is let through to probe the server. A
+     * probe that succeeds closes the breaker again, one that fails opens it for twice as long, up to the maximum delay. Delays are spread by a random
+     * jitter so that gateways that lost the same server together do not all come back to it in the same second.</p>
+     * <p>The breaker is not thread safe; it belongs to the gateway that polls through it.</p>
+     */
+    class circuitBreaker
+    {
+    public:
+        enum class state
+        {
+            /**
+             * Attempts are allowed; any recent failures have not yet reached the threshold.
+             */
+            closed,
+            /**
+             * Too many attempts have failed; nothing is attempted until the retry time.
+             */
+            open,
+            /**
+             * The retry time of an open breaker has passed and a single probe is being let through.
+             */
+            halfOpen,
+        };
+
+    private:
+        state _state;
+        unsigned int _failures;
+        unsigned int _threshold;
+        std::chrono::milliseconds _baseDelay;
+        std::chrono::milliseconds _maxDelay;
+        std::chrono::milliseconds _delay;
+        std::chrono::steady_clock::time_point _retryAt;
+        std::mt19937 _random;
+
+        std::chrono::milliseconds spread(std::chrono::milliseconds delay)
+        {
+            std::uniform_real_distribution<double> dist(0.8, 1.2);
+            return std::chrono::milliseconds(static_cast<std::chrono::milliseconds::rep>(static_cast<double>(delay.count()) * dist(_random)));
+        }
+
+    public:
+        circuitBreaker()
+        {
+            _threshold = 3;
+            _baseDelay = std::chrono::seconds(5);
+            _maxDelay = std::chrono::minutes(10);
+            _random.seed(std::random_device()());
+            reset();
+        }
+
+        /**
+         * Sets how many attempts in a row must fail before the breaker opens, and the first and longest delays before a retry.
+         */
+        void setPolicy(unsigned int threshold, std::chrono::milliseconds baseDelay, std::chrono::milliseconds maxDelay)
+        {
+            _threshold = std::max(threshold, 1u);
+            _baseDelay = std::max(baseDelay, std::chrono::milliseconds(100));
+            _maxDelay = std::max(maxDelay, _baseDelay);
+        }
+
+        void reset()
+        {
+            _state = state::closed;
+            _failures = 0;
+            _delay = std::chrono::milliseconds(0);
+            _retryAt = std::chrono::steady_clock::time_point::min();
+        }
+
+        [[nodiscard]] state current() const
+        {
+            return _state;
+        }
+
+        [[nodiscard]] unsigned int failures() const
+        {
+            return _failures;
+        }
+
+        /**
+         * Checks whether an attempt may be made now; an open breaker whose retry time has passed lets a single probe through.
+         */
+        bool allow(std::chrono::steady_clock::time_point now)
+        {
+            if (now < _retryAt) return false;
+            if (_state == state::open) _state = state::halfOpen;
+
+            return true;
+        }
+
+        /**
+         * Gets how long it is until the next attempt is allowed.
+         */
+        [[nodiscard]] std::chrono::milliseconds retryIn(std::chrono::steady_clock::time_point now) const
+        {
+            if (now >= _retryAt) return std::chrono::milliseconds(0);
+            return std::chrono::duration_cast<std::chrono::milliseconds>(_retryAt - now);
+        }
+
+        /**
+         * Records that an attempt succeeded, closing the breaker.
+         */
+        void success()
+        {
+            reset();
+        }
+
+        /**
+         * Records that an attempt failed.
+         * @return How long to wait before the next attempt.
+         */
+        std::chrono::milliseconds failure(std::chrono::steady_clock::time_point now)
+        {
+            _failures++;
+            _delay = (_delay.count() == 0) ? _baseDelay : std::min(_delay * 2, _maxDelay);
+            if ((_state == state::halfOpen) || (_failures >= _threshold)) _state = state::open;
+            auto wait = spread(_delay);
+            _retryAt = now + wait;
+
+            return wait;
+        }
+    };
+}
+
+#endif // _CIRCUIT_BREAKER_HPP_
@@ -0,0 +1,649 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: connectionPool.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONNECTION_POOL_HPP_
+#define _CONNECTION_POOL_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <compare>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <vmime/vmime.hpp>
+
+namespace telemeteryServices
+{
+    /**
+     * Identifies a mail service account; connections are only ever shared between users of the same endpoint.
+     */
+    struct connectionEndpoint
+    {
+        std::string protocol;
+        std::string host;
+        unsigned int port = 0;
+        std::string username;
+        std::string password;
+
+        [[nodiscard]] std::string hostKey() const
+        {
+            return host + ":" + std::to_string(port);
+        }
+
+        auto operator<=>(const connectionEndpoint& other) const = default;
+    };
+
+    /**
+     * The exception that is thrown when no connection to a host becomes free before the lease timeout elapses.
+     */
+    class connection_pool_exhausted : public std::exception
+    {
+    private:
+        std::string _mess;
+    public:
+        explicit connection_pool_exhausted(const std::string& host) : std::exception()
+        {
+            _mess = "No connection to " + host + " became available in time.";
+        }
+
+        [[nodiscard]] const char *what() const noexcept override
+        {
+            return _mess.c_str();
+        }
+    };
+
+    /**
+     * <p>A process wide pool of connected vmime stores and transports, keyed by endpoint.</p>
+     * <p>Gateways lease a connection for as long as they need it and hand it back when the lease goes out of scope, so that gateways that share an
+     * account share its connections and a TLS handshake is only paid when the pool has to grow. The number of connections open to any one host, whatever
+     * the credentials, is capped; when the cap is reached a lease waits for a connection to be returned.</p>
+     * <p>An IMAP folder has a connection of its own, separate from its store's. A store's default folder is opened through its lease and stays open
+     * with the store while it is idle in the pool, so the next lease finds it selected; it counts towards the cap like the store. Connections the pool
+     * does not manage itself, such as a gateway's command channel, are counted by holding a host slot.</p>
+     * <p>Connections that have sat idle for a while are checked with a NOOP before they are handed out again, and ones that have been idle for too long
+     * are closed.</p>
+     * <p>Every session the pool creates shares one set of TLS properties, rather than each account carrying its own. Only the configuration is
+     * shared: vmime negotiates a new TLS session for every connection it opens and does not resume earlier ones.</p>
+     */
+    class connectionPool
+    {
+    public:
+        typedef std::function<void(const vmime::shared_ptr<vmime::net::service>& service)> serviceConfigurator;
+
+        /**
+         * Exclusive use of a pooled connection, returned to the pool on destruction.
+         */
+        template<typename ServiceT>
+        class lease
+        {
+        private:
+            connectionPool *_pool;
+            connectionEndpoint _endpoint;
+            vmime::shared_ptr<ServiceT> _service;
+            vmime::shared_ptr<vmime::net::folder> _folder;
+            bool _folderSlot;
+            bool _discard;
+
+        public:
+            lease()
+            {
+                _pool = nullptr;
+                _folderSlot = false;
+                _discard = false;
+            }
+
+            lease(connectionPool *pool, const connectionEndpoint& endpoint, const vmime::shared_ptr<ServiceT>& service, const vmime::shared_ptr<vmime::net::folder>& folder, bool folderSlot)
+            {
+                _pool = pool;
+                _endpoint = endpoint;
+                _service = service;
+                _folder = folder;
+                _folderSlot = folderSlot;
+                _discard = false;
+            }
+
+            lease(const lease& other) = delete;
+            lease& operator=(const lease& other) = delete;
+
+            lease(lease&& other) noexcept
+            {
+                _pool = other._pool;
+                _endpoint = std::move(other._endpoint);
+                _service = std::move(other._service);
+                _folder = std::move(other._folder);
+                _folderSlot = other._folderSlot;
+                _discard = other._discard;
+                other._pool = nullptr;
+            }
+
+            lease& operator=(lease&& other) noexcept
+            {
+                if (this == &other) return *this;
+                release();
+                _pool = other._pool;
+                _endpoint = std::move(other._endpoint);
+                _service = std::move(other._service);
+                _folder = std::move(other._folder);
+                _folderSlot = other._folderSlot;
+                _discard = other._discard;
+                other._pool = nullptr;
+
+                return *this;
+            }
+
+            ~lease()
+            {
+                release();
+            }
+
+            /**
+             * Marks the connection as broken so that it is closed rather than handed to the next user.
+             */
+            void discard()
+            {
+                _discard = true;
+            }
+
+            void release()
+            {
+                if (_pool && _service) _pool->release(_endpoint, _service, _folder, _folderSlot, _discard);
+                _pool = nullptr;
+                _service.reset();
+                _folder.reset();
+                _folderSlot = false;
+            }
+
+            /**
+             * Gets the default folder of the leased store, open read-write. A folder left open by an earlier lease of the store is handed back as it
+             * is; otherwise one is opened, taking the room kept for it when the store was leased or, failing that, any that is free under the cap.
+             */
+            const vmime::shared_ptr<vmime::net::folder>& defaultFolder()
+            {
+                if (_folder && _folder->isOpen()) return _folder;
+                if (_folder) closeQuietly(_folder);
+                _folder.reset();
+                if (!_folderSlot) _pool->reserveFolderSlot(_endpoint.hostKey());
+                _folderSlot = true;
+                _folder = _service->getDefaultFolder();
+                _folder->open(vmime::net::folder::MODE_READ_WRITE);
+
+                return _folder;
+            }
+
+            [[nodiscard]] const vmime::shared_ptr<ServiceT>& get() const
+            {
+                return _service;
+            }
+
+            ServiceT *operator->() const
+            {
+                return _service.get();
+            }
+
+            explicit operator bool() const
+            {
+                return static_cast<bool>(_service);
+            }
+        };
+
+        typedef lease<vmime::net::store> storeLease;
+        typedef lease<vmime::net::transport> transportLease;
+
+        /**
+         * A place under the per-host cap held for a connection that the pool does not manage, given back on destruction.
+         */
+        class hostSlot
+        {
+        private:
+            connectionPool *_pool;
+            std::string _hostKey;
+
+        public:
+            hostSlot()
+            {
+                _pool = nullptr;
+            }
+
+            hostSlot(connectionPool *pool, const std::string& hostKey)
+            {
+                _pool = pool;
+                _hostKey = hostKey;
+            }
+
+            hostSlot(const hostSlot& other) = delete;
+            hostSlot& operator=(const hostSlot& other) = delete;
+
+            hostSlot(hostSlot&& other) noexcept
+            {
+                _pool = other._pool;
+                _hostKey = std::move(other._hostKey);
+                other._pool = nullptr;
+            }
+
+            hostSlot& operator=(hostSlot&& other) noexcept
+            {
+                if (this == &other) return *this;
+                release();
+                _pool = other._pool;
+                _hostKey = std::move(other._hostKey);
+                other._pool = nullptr;
+
+                return *this;
+            }
+
+            ~hostSlot()
+            {
+                release();
+            }
+
+            void release()
+            {
+                if (_pool) _pool->releaseSlots(_hostKey, 1);
+                _pool = nullptr;
+            }
+
+            explicit operator bool() const
+            {
+                return _pool != nullptr;
+            }
+        };
+
+    private:
+        struct idleService
+        {
+            vmime::shared_ptr<vmime::net::service> service;
+            vmime::shared_ptr<vmime::net::folder> folder;
+            std::chrono::steady_clock::time_point since;
+        };
+
+        struct endpointEntry
+        {
+            vmime::shared_ptr<vmime::net::session> session;
+            std::vector<idleService> idle;
+        };
+
+        std::mutex _mutex;
+        std::condition_variable _released;
+        std::map<connectionEndpoint, endpointEntry> _endpoints;
+        std::map<std::string, unsigned int> _openPerHost;
+        unsigned int _maxPerHost;
+        std::chrono::seconds _idleTimeout;
+        std::chrono::seconds _healthCheckAfter;
+        std::chrono::seconds _leaseTimeout;
+        vmime::shared_ptr<vmime::net::tls::TLSProperties> _tlsProperties;
+
+        connectionPool()
+        {
+            _tlsProperties = vmime::make_shared<vmime::net::tls::TLSProperties>();
+            _tlsProperties->setCipherSuite(vmime::net::tls::TLSProperties::CIPHERSUITE_DEFAULT);
+            _maxPerHost = 4;
+            _idleTimeout = std::chrono::minutes(5);
+            _healthCheckAfter = std::chrono::seconds(30);
+            _leaseTimeout = std::chrono::minutes(2);
+        }
+
+        static void disconnectQuietly(const vmime::shared_ptr<vmime::net::service>& service)
+        {
+            try
+            {
+                if (service->isConnected()) service->disconnect();
+            }
+            catch (const std::exception&)
+            {
+                // The connection is being thrown away anyway.
+            }
+        }
+
+        static void closeQuietly(const vmime::shared_ptr<vmime::net::folder>& folder)
+        {
+            try
+            {
+                if (folder->isOpen()) folder->close(false);
+            }
+            catch (const std::exception&)
+            {
+                // The connection is being thrown away anyway.
+            }
+        }
+
+        static void disconnectIdle(const idleService& idle)
+        {
+            if (idle.folder) closeQuietly(idle.folder);
+            disconnectQuietly(idle.service);
+        }
+
+        /**
+         * Gets how many connections to its host an idle service holds: its own, and its folder's if it kept one open.
+         */
+        static unsigned int connections(const idleService& idle)
+        {
+            return idle.folder ? 2 : 1;
+        }
+
+        static bool healthy(const idleService& idle, std::chrono::seconds checkAfter)
+        {
+            try
+            {
+                // A store's NOOP is also sent on each of its open folders, so a kept folder is checked along with it.
+                if (!idle.service->isConnected()) return false;
+                if ((std::chrono::steady_clock::now() - idle.since) >= checkAfter) idle.service->noop();
+                return idle.service->isConnected();
+            }
+            catch (const std::exception&)
+            {
+                return false;
+            }
+        }
+
+        /**
+         * Removes connections that have been idle for longer than the idle timeout; the caller must hold the mutex and disconnect the returned services
+         * once it has released it.
+         */
+        std::vector<idleService> reapIdle()
+        {
+            std::vector<idleService> stale;
+            auto now = std::chrono::steady_clock::now();
+            for (auto& [endpoint, entry] : _endpoints)
+            {
+                for (auto it = entry.idle.begin(); it != entry.idle.end();)
+                {
+                    if ((now - it->since) < _idleTimeout)
+                    {
+                        ++it;
+                        continue;
+                    }
+                    stale.push_back(*it);
+                    _openPerHost[endpoint.hostKey()] -= connections(*it);
+                    it = entry.idle.erase(it);
+                }
+            }
+
+            return stale;
+        }
+
+        /**
+         * Gives up an idle connection held for another account on the same host so that a new one can be opened; the caller must hold the mutex.
+         */
+        idleService evictIdleForHost(const std::string& hostKey)
+        {
+            for (auto& [endpoint, entry] : _endpoints)
+            {
+                if ((endpoint.hostKey() != hostKey) || entry.idle.empty()) continue;
+                idleService victim = entry.idle.front();
+                entry.idle.erase(entry.idle.begin());
+                _openPerHost[hostKey] -= connections(victim);
+                return victim;
+            }
+
+            return idleService();
+        }
+
+        /**
+         * Counts the connections to a host that are idle in the pool, and so could be closed to make room; the caller must hold the mutex.
+         */
+        unsigned int idleForHost(const std::string& hostKey) const
+        {
+            unsigned int count = 0;
+            for (const auto& [endpoint, entry] : _endpoints)
+            {
+                if (endpoint.hostKey() != hostKey) continue;
+                for (const auto& i : entry.idle) count += connections(i);
+            }
+
+            return count;
+        }
+
+        /**
+         * Leases a connection to the endpoint. When a folder is wanted, room for its connection is taken along with the store's, so that a lease never
+         * holds a connection while it waits for another.
+         */
+        template<typename ServiceT>
+        lease<ServiceT> acquire(const connectionEndpoint& endpoint, const serviceConfigurator& configure, bool withFolder)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto deadline = std::chrono::steady_clock::now() + _leaseTimeout;
+            std::string hostKey = endpoint.hostKey();
+
+            while (true)
+            {
+                auto stale = reapIdle();
+                if (!stale.empty())
+                {
+                    lock.unlock();
+                    for (const auto& s : stale) disconnectIdle(s);
+                    lock.lock();
+                    continue;
+                }
+
+                auto& entry = _endpoints[endpoint];
+
+                // Reuse the most recently returned connection, it is the least likely to have been dropped by the server.
+                bool folderNeeded = withFolder && (entry.idle.empty() || !entry.idle.back().folder);
+                unsigned int needed = (entry.idle.empty() ? 1 : 0) + (folderNeeded ? 1 : 0);
+                if (!entry.idle.empty() && (_openPerHost[hostKey] + needed <= _maxPerHost))
+                {
+                    idleService candidate = entry.idle.back();
+                    entry.idle.pop_back();
+                    _openPerHost[hostKey] += needed;
+                    auto checkAfter = _healthCheckAfter;
+                    lock.unlock();
+                    if (healthy(candidate, checkAfter)) return lease<ServiceT>(this, endpoint, vmime::dynamicCast<ServiceT>(candidate.service), candidate.folder, folderNeeded || candidate.folder);
+                    disconnectIdle(candidate);
+                    lock.lock();
+                    _openPerHost[hostKey] -= connections(candidate) + needed;
+                    _released.notify_all();
+                    continue;
+                }
+
+                if (entry.idle.empty() && (_openPerHost[hostKey] + needed <= _maxPerHost))
+                {
+                    _openPerHost[hostKey] += needed;
+                    if (!entry.session)
+                    {
+                        entry.session = vmime::net::session::create();
+                        entry.session->getProperties().setProperty("options.sasl", true);
+                        entry.session->getProperties().setProperty("auth.username", endpoint.username);
+                        entry.session->getProperties().setProperty("auth.password", endpoint.password);
+                        entry.session->setTLSProperties(_tlsProperties);
+                    }
+                    auto session = entry.session;
+                    lock.unlock();
+
+                    try
+                    {
+                        vmime::utility::url url(endpoint.protocol, endpoint.host, endpoint.port);
+                        vmime::shared_ptr<ServiceT> service;
+                        if constexpr (std::is_same_v<ServiceT, vmime::net::store>) service = session->getStore(url);
+                        else service = session->getTransport(url);
+                        if (configure) configure(service);
+                        service->connect();
+                        return lease<ServiceT>(this, endpoint, service, nullptr, folderNeeded);
+                    }
+                    catch (...)
+                    {
+                        releaseSlots(hostKey, needed);
+                        throw;
+                    }
+                }
+
+                auto victim = evictIdleForHost(hostKey);
+                if (victim.service)
+                {
+                    lock.unlock();
+                    disconnectIdle(victim);
+                    lock.lock();
+                    continue;
+                }
+
+                if (_released.wait_until(lock, deadline) == std::cv_status::timeout) throw connection_pool_exhausted(hostKey);
+            }
+        }
+
+        void release(const connectionEndpoint& endpoint, const vmime::shared_ptr<vmime::net::service>& service, const vmime::shared_ptr<vmime::net::folder>& folder, bool folderSlot, bool discard)
+        {
+            bool keep = !discard && service->isConnected();
+            bool keepFolder = keep && folder && folder->isOpen();
+            if (folder && !keepFolder) closeQuietly(folder);
+            if (!keep) disconnectQuietly(service);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (keep) _endpoints[endpoint].idle.push_back({ service, keepFolder ? folder : nullptr, std::chrono::steady_clock::now() });
+            _openPerHost[endpoint.hostKey()] -= (keep ? 0 : 1) + ((folderSlot && !keepFolder) ? 1 : 0);
+            _released.notify_all();
+        }
+
+        void releaseSlots(const std::string& hostKey, unsigned int count)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _openPerHost[hostKey] -= count;
+            _released.notify_all();
+        }
+
+        /**
+         * Takes room under the cap for a folder opened on a store that was leased without it, closing an idle connection if that is what it takes.
+         * A store is already held, so rather than wait for a connection to be returned this throws when there is no room.
+         */
+        void reserveFolderSlot(const std::string& hostKey)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_openPerHost[hostKey] >= _maxPerHost)
+            {
+                auto victim = evictIdleForHost(hostKey);
+                if (!victim.service) throw connection_pool_exhausted(hostKey);
+                lock.unlock();
+                disconnectIdle(victim);
+                lock.lock();
+            }
+            _openPerHost[hostKey]++;
+        }
+
+    public:
+        connectionPool(const connectionPool& other) = delete;
+        connectionPool& operator=(const connectionPool& other) = delete;
+
+        static connectionPool& instance()
+        {
+            static connectionPool pool;
+            return pool;
+        }
+
+        /**
+         * Sets the most connections, leased or idle, that may be open to one host at a time. It is never less than two, as an IMAP store and its
+         * default folder take one each.
+         */
+        void setMaxConnectionsPerHost(unsigned int max)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _maxPerHost = std::max(max, 2u);
+            _released.notify_all();
+        }
+
+        [[nodiscard]] unsigned int maxConnectionsPerHost()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _maxPerHost;
+        }
+
+        [[nodiscard]] std::chrono::seconds idleTimeout()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _idleTimeout;
+        }
+
+        void setIdleTimeout(std::chrono::seconds timeout)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _idleTimeout = timeout;
+        }
+
+        /**
+         * Leases a connected store, creating and connecting one if there is no idle store for the endpoint.
+         * @param configure Called on a newly created store, before it is connected, to set its properties.
+         * @param withDefaultFolder Whether the default folder will be opened through the lease, in which case room is kept for its connection too.
+         */
+        storeLease leaseStore(const connectionEndpoint& endpoint, const serviceConfigurator& configure, bool withDefaultFolder = false)
+        {
+            return acquire<vmime::net::store>(endpoint, configure, withDefaultFolder);
+        }
+
+        /**
+         * Leases a connected transport, creating and connecting one if there is no idle transport for the endpoint.
+         * @param configure Called on a newly created transport, before it is connected, to set its properties.
+         */
+        transportLease leaseTransport(const connectionEndpoint& endpoint, const serviceConfigurator& configure)
+        {
+            return acquire<vmime::net::transport>(endpoint, configure, false);
+        }
+
+        /**
+         * Takes a place under the cap for a connection to the endpoint's host that the caller opens and keeps itself, closing idle connections to make
+         * room if need be. It does not wait: an empty slot is returned unless, once it is taken, there would still be room for keepFree more connections
+         * besides the ones in use, so that long lived connections cannot crowd out leases.
+         */
+        hostSlot tryReserveHostSlot(const connectionEndpoint& endpoint, unsigned int keepFree)
+        {
+            std::string hostKey = endpoint.hostKey();
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true)
+            {
+                if (_openPerHost[hostKey] - idleForHost(hostKey) + 1 + keepFree > _maxPerHost) return hostSlot();
+                if (_openPerHost[hostKey] < _maxPerHost)
+                {
+                    _openPerHost[hostKey]++;
+                    return hostSlot(this, hostKey);
+                }
+
+                auto victim = evictIdleForHost(hostKey);
+                if (!victim.service) return hostSlot();
+                lock.unlock();
+                disconnectIdle(victim);
+                lock.lock();
+            }
+        }
+
+        /**
+         * Closes every idle connection, leased connections are closed as they are returned.
+         */
+        void clear()
+        {
+            std::vector<idleService> idle;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (auto& [endpoint, entry] : _endpoints)
+                {
+                    for (const auto& i : entry.idle)
+                    {
+                        idle.push_back(i);
+                        _openPerHost[endpoint.hostKey()] -= connections(i);
+                    }
+                    entry.idle.clear();
+                }
+                _released.notify_all();
+            }
+
+            for (const auto& i : idle) disconnectIdle(i);
+        }
+    };
+}
+
+#endif // _CONNECTION_POOL_HPP_
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: emailAddressScanner.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EMAIL_ADDRESS_SCANNER_HPP_
+#define _EMAIL_ADDRESS_SCANNER_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace utilities
+{
+    namespace detail
+    {
+        constexpr std::uint8_t EMAIL_LOCAL = 0x01;
+        constexpr std::uint8_t EMAIL_DOMAIN = 0x02;
+        constexpr std::uint8_t EMAIL_ALNUM = 0x04;
+        constexpr std::uint8_t EMAIL_ALPHA = 0x08;
+
+        /**
+         * Classifies each byte as allowed in the local part of an address (the RFC 5322 atext characters and dots), in a domain (letters, digits,
+         * hyphens and dots), or both.
+         */
+        constexpr std::array<std::uint8_t, 256> makeEmailTable()
+        {
+            std::array<std::uint8_t, 256> table{};
+            for (int c = 'a'; c <= 'z'; c++) table[c] = EMAIL_LOCAL | EMAIL_DOMAIN | EMAIL_ALNUM | EMAIL_ALPHA;
+            for (int c = 'A'; c <= 'Z'; c++) table[c] = EMAIL_LOCAL | EMAIL_DOMAIN | EMAIL_ALNUM | EMAIL_ALPHA;
+            for (int c = '0'; c <= '9'; c++) table[c] = EMAIL_LOCAL | EMAIL_DOMAIN | EMAIL_ALNUM;
+            for (char c : std::string_view("!#$%&'*+/=?^_`{|}~")) table[static_cast<unsigned char>(c)] = EMAIL_LOCAL;
+            table['-'] = EMAIL_LOCAL | EMAIL_DOMAIN;
+            table['.'] = EMAIL_LOCAL | EMAIL_DOMAIN;
+
+            return table;
+        }
+
+        constexpr std::array<std::uint8_t, 256> EMAIL_TABLE = makeEmailTable();
+
+        constexpr std::size_t MAX_LOCAL_LENGTH = 64;
+        constexpr std::size_t MAX_DOMAIN_LENGTH = 255;
+        constexpr std::size_t MAX_LABEL_LENGTH = 63;
+
+        inline bool emailClass(char c, std::uint8_t mask)
+        {
+            return (EMAIL_TABLE[static_cast<unsigned char>(c)] & mask) != 0;
+        }
+
+        /**
+         * Checks the labels of a domain: at least two of them, none empty or longer than 63 characters, none starting or ending with a hyphen, and a
+         * top-level domain of two or more letters or an internationalised one in its xn-- form.
+         */
+        inline bool validDomain(std::string_view domain)
+        {
+            std::size_t labels = 0;
+            std::string_view last;
+            while (!domain.empty())
+            {
+                std::size_t dot = domain.find('.');
+                std::string_view label = domain.substr(0, dot);
+                if (label.empty() || (label.size() > MAX_LABEL_LENGTH)) return false;
+                if ((label.front() == '-') || (label.back() == '-')) return false;
+                labels++;
+                last = label;
+                if (dot == std::string_view::npos) break;
+                domain.remove_prefix(dot + 1);
+            }
+            if ((labels < 2) || (last.size() < 2)) return false;
+            if ((last.size() > 4) && ((last[0] | 0x20) == 'x') && ((last[1] | 0x20) == 'n') && (last[2] == '-') && (last[3] == '-')) return true;
+            for (char c : last)
+            {
+                if (!emailClass(c, EMAIL_ALPHA)) return false;
+            }
+
+            return true;
+        }
+    }
+
+    /**
+     * <p>Finds the email addresses in a header line or a piece of body text.</p>
+     * <p>Each '@' is found with memchr, which the C library vectorises, and the local part and domain around it are then grown and checked with a
+     * table lookup per character. Addresses are returned as views into the text being scanned, so nothing is allocated; the text must outlive them.
+     * Quoted local parts and domain literals are not recognised.</p>
+     */
+    class emailAddressScanner
+    {
+    private:
+        std::string_view _text;
+        std::size_t _position;
+        // The end of the last address found; the next one cannot reach back into it.
+        std::size_t _floor;
+
+    public:
+        explicit emailAddressScanner(std::string_view text)
+        {
+            _text = text;
+            _position = 0;
+            _floor = 0;
+        }
+
+        /**
+         * Finds the next address in the text.
+         * @return false once there are no more.
+         */
+        bool next(std::string_view& address)
+        {
+            const char *base = _text.data();
+            while (_position < _text.size())
+            {
+                const void *found = std::memchr(base + _position, '@', _text.size() - _position);
+                if (!found) break;
+                std::size_t at = static_cast<const char *>(found) - base;
+                _position = at + 1;
+
+                // Grow the local part to the left, giving up on anything too long to be one.
+                std::size_t begin = at;
+                while ((begin > _floor) && ((at - begin) <= detail::MAX_LOCAL_LENGTH) && detail::emailClass(base[begin - 1], detail::EMAIL_LOCAL)) begin--;
+                if ((at - begin) > detail::MAX_LOCAL_LENGTH) continue;
+                // Quotes and dots are allowed inside a local part but in running text they are far more likely to be punctuation around it.
+                while ((begin < at) && ((base[begin] == '.') || (base[begin] == '\'') || (base[begin] == '`'))) begin++;
+                if ((begin == at) || (base[at - 1] == '.')) continue;
+                if (std::string_view(base + begin, at - begin).find("..") != std::string_view::npos) continue;
+
+                // Grow the domain to the right and drop the punctuation that can follow an address at the end of a sentence.
+                std::size_t end = at + 1;
+                while ((end < _text.size()) && ((end - at - 1) <= detail::MAX_DOMAIN_LENGTH) && detail::emailClass(base[end], detail::EMAIL_DOMAIN)) end++;
+                if ((end - at - 1) > detail::MAX_DOMAIN_LENGTH) continue;
+                while ((end > at + 1) && ((base[end - 1] == '.') || (base[end - 1] == '-'))) end--;
+                if (!detail::validDomain(std::string_view(base + at + 1, end - at - 1))) continue;
+
+                address = std::string_view(base + begin, end - begin);
+                _position = end;
+                _floor = end;
+                return true;
+            }
+            _position = _text.size();
+
+            return false;
+        }
+    };
+
+    /**
+     * Calls a function with each email address found in a piece of text.
+     * @return The number of addresses found.
+     */
+    template<typename FunctionT>
+    std::size_t forEachEmailAddress(std::string_view text, FunctionT&& function)
+    {
+        emailAddressScanner scanner(text);
+        std::string_view address;
+        std::size_t count = 0;
+        while (scanner.next(address))
+        {
+            function(address);
+            count++;
+        }
+
+        return count;
+    }
+}
+
+#endif // _EMAIL_ADDRESS_SCANNER_HPP_
@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: imapCommandChannel.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IMAP_COMMAND_CHANNEL_HPP_
+#define _IMAP_COMMAND_CHANNEL_HPP_
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <boost/algorithm/string.hpp>
+#include <vmime/vmime.hpp>
+#include <vmime/net/imap/IMAPStore.hpp>
+#include <vmime/net/imap/IMAPConnection.hpp>
+#include "abstractGateway.hpp"
+#include "connectionPool.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * The state of the selected mailbox as reported when it was selected and kept up to date from the untagged responses since, zero where the server
+     * did not report the item.
+     */
+    struct imapMailboxStatus
+    {
+        std::uint64_t messages = 0;
+        std::uint64_t uidNext = 0;
+        std::uint64_t uidValidity = 0;
+        std::uint64_t highestModSeq = 0;
+    };
+
+    /**
+     * <p>A dedicated IMAP connection, opened alongside a store, over which the gateway issues the commands that vmime does not expose (IDLE, NOOP on a selected mailbox, etc.).</p>
+     * <p>vmime is only used to establish, secure and authenticate the connection; commands are then written and responses read directly on its socket so that vmime's own parser never sees them.</p>
+     */
+    class imapCommandChannel
+    {
+    private:
+        vmime::shared_ptr<vmime::net::imap::IMAPConnection> _connection;
+        connectionPool::hostSlot _slot;
+        std::string _buffer;
+        // Where the unread part of _buffer starts; the lines before it are only dropped when more data is received.
+        std::size_t _read;
+        std::string _idleTag;
+        unsigned int _tagCounter;
+        bool _idling;
+        imapMailboxStatus _mailbox;
+        bool _arrived;
+
+        std::string nextTag()
+        {
+            return "E" + std::to_string(++_tagCounter);
+        }
+
+        void send(const std::string& line)
+        {
+            if (auto tracer = _connection->getTracer()) tracer->traceSend(line);
+            _connection->getSocket()->send(line + "\r\n");
+        }
+
+        /**
+         * Finds the CRLF that ends the response starting at the read offset. A line that ends in a literal announcement, "{N}" (RFC 3501 section 4.3),
+         * is followed by N octets that may hold CRLFs of their own, so these are stepped over and the response carries on after them.
+         * @return The offset of the CRLF, or npos if the whole response has not arrived yet.
+         */
+        [[nodiscard]] std::size_t responseEnd() const
+        {
+            std::size_t from = _read;
+            while (true)
+            {
+                auto pos = _buffer.find("\r\n", from);
+                if ((pos == std::string::npos) || (pos == _read) || (_buffer[pos - 1] != '}')) return pos;
+
+                std::size_t open = _buffer.rfind('{', pos - 1);
+                if ((open == std::string::npos) || (open < from) || (open + 2 > pos - 1)) return pos;
+                std::size_t length = 0;
+                for (std::size_t i = open + 1; i < pos - 1; i++)
+                {
+                    if (!std::isdigit(static_cast<unsigned char>(_buffer[i]))) return pos;
+                    length = (length * 10) + static_cast<std::size_t>(_buffer[i] - '0');
+                }
+
+                from = pos + 2 + length;
+                if (from > _buffer.size()) return std::string::npos;
+            }
+        }
+
+        /**
+         * Reads one response line from the connection, along with any literals it carries, which are left in it as they were received.
+         * @param timeout The longest time to wait for the line to arrive, zero only consumes data that is already waiting.
+         * @param line Receives the line without its terminator.
+         * @return true if a line was read, false if the timeout elapsed first.
+         */
+        bool readLine(std::chrono::milliseconds timeout, std::string& line)
+        {
+            auto socket = _connection->getSocket();
+            auto deadline = std::chrono::steady_clock::now() + timeout;
+
+            while (true)
+            {
+                auto pos = responseEnd();
+                if (pos != std::string::npos)
+                {
+                    line = _buffer.substr(_read, pos - _read);
+                    _read = pos + 2;
+                    if (auto tracer = _connection->getTracer()) tracer->traceReceive(line);
+                    return true;
+                }
+
+                auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                if (remaining.count() < 0) remaining = std::chrono::milliseconds(0);
+                if (!socket->waitForRead(static_cast<int>(remaining.count())))
+                {
+                    if (!socket->isConnected()) throw vmime::exceptions::socket_exception("IMAP command channel closed by the server");
+                    return false;
+                }
+
+                std::string chunk;
+                socket->receive(chunk);
+                if (chunk.empty() && !socket->isConnected()) throw vmime::exceptions::socket_exception("IMAP command channel closed by the server");
+                _buffer.erase(0, _read);
+                _read = 0;
+                _buffer += chunk;
+            }
+        }
+
+        /**
+         * Reads lines until the tagged completion for the given tag, collecting the untagged responses on the way.
+         */
+        void readCompletion(const std::string& tag, const std::string& command, std::vector<std::string> *untagged)
+        {
+            std::string line;
+            while (true)
+            {
+                if (!readLine(std::chrono::seconds(30), line)) throw vmime::exceptions::operation_timed_out();
+                if (line.starts_with("* "))
+                {
+                    track(line.substr(2));
+                    if (untagged) untagged->push_back(line.substr(2));
+                    continue;
+                }
+                if (!line.starts_with(tag + " ")) continue;
+                if (line.compare(tag.length() + 1, 2, "OK") != 0) throw vmime::exceptions::command_error(command, line);
+                return;
+            }
+        }
+
+        /**
+         * Keeps the state of the selected mailbox up to date from an untagged response: the response codes of SELECT (RFC 3501 section 7.1 and RFC
+         * 7162), EXISTS and EXPUNGE, and the MODSEQ of FETCH responses once CONDSTORE is enabled. A message count that grows means new mail.
+         */
+        void track(const std::string& untagged)
+        {
+            std::istringstream iss(untagged);
+            std::string first;
+            std::string second;
+            iss >> first >> second;
+            if (boost::iequals(first, "OK") && second.starts_with("["))
+            {
+                std::string code = second.substr(1);
+                std::uint64_t value = 0;
+                iss >> value;
+                if (boost::iequals(code, "UIDVALIDITY")) _mailbox.uidValidity = value;
+                else if (boost::iequals(code, "UIDNEXT")) _mailbox.uidNext = value;
+                else if (boost::iequals(code, "HIGHESTMODSEQ")) _mailbox.highestModSeq = std::max(_mailbox.highestModSeq, value);
+                else if (boost::iequals(code, "NOMODSEQ]")) _mailbox.highestModSeq = 0;
+                return;
+            }
+            if (first.empty() || !std::isdigit(static_cast<unsigned char>(first[0]))) return;
+
+            std::uint64_t number = std::stoull(first);
+            if (boost::iequals(second, "EXISTS"))
+            {
+                if (number > _mailbox.messages) _arrived = true;
+                _mailbox.messages = number;
+            }
+            else if (boost::iequals(second, "EXPUNGE"))
+            {
+                if (_mailbox.messages > 0) _mailbox.messages--;
+            }
+            else if (boost::iequals(second, "FETCH"))
+            {
+                auto pos = boost::to_upper_copy(untagged).find("MODSEQ (");
+                if (pos == std::string::npos) return;
+                std::uint64_t modSeq = std::strtoull(untagged.c_str() + pos + 8, nullptr, 10);
+                _mailbox.highestModSeq = std::max(_mailbox.highestModSeq, modSeq);
+            }
+        }
+
+        void openMailbox(const std::string& verb, const std::string& mailbox)
+        {
+            _mailbox = imapMailboxStatus();
+            // Enabling CONDSTORE makes the server report HIGHESTMODSEQ on selection and MODSEQ with every FETCH (RFC 7162 section 3.1.8).
+            bool condStore = hasCapability("CONDSTORE") || hasCapability("QRESYNC");
+            command(verb + " " + quote(mailbox) + (condStore ? " (CONDSTORE)" : ""));
+            _arrived = false;
+        }
+
+    public:
+        imapCommandChannel()
+        {
+            _tagCounter = 0;
+            _read = 0;
+            _idling = false;
+            _arrived = false;
+        }
+
+        ~imapCommandChannel()
+        {
+            close();
+        }
+
+        /**
+         * Opens a new authenticated connection to the server behind the given store. The slot counts the connection against the pool's cap for the
+         * host and is held until the channel is closed.
+         */
+        void open(const vmime::shared_ptr<vmime::net::store>& store, connectionPool::hostSlot slot)
+        {
+            close();
+            auto imapStore = vmime::dynamicCast<vmime::net::imap::IMAPStore>(store);
+            if (!imapStore) throw illegal_object_state("The IMAP command channel requires an IMAP store.");
+            _slot = std::move(slot);
+            _connection = vmime::make_shared<vmime::net::imap::IMAPConnection>(imapStore, imapStore->getAuthenticator());
+            _connection->connect();
+        }
+
+        void close()
+        {
+            if (!_connection)
+            {
+                _slot.release();
+                return;
+            }
+            try
+            {
+                if (_idling) stopIdle();
+                if (_connection->isConnected()) _connection->disconnect();
+            }
+            catch (const std::exception&)
+            {
+                // The connection is being thrown away anyway.
+            }
+            _connection.reset();
+            _slot.release();
+            _buffer.clear();
+            _read = 0;
+            _idling = false;
+            _mailbox = imapMailboxStatus();
+            _arrived = false;
+        }
+
+        [[nodiscard]] bool connected() const
+        {
+            return _connection && _connection->isConnected();
+        }
+
+        [[nodiscard]] bool hasCapability(const std::string& capability) const
+        {
+            return _connection && _connection->hasCapability(capability);
+        }
+
+        /**
+         * Issues a command and waits for its tagged completion.
+         * @param command The command text without a tag or line terminator.
+         * @param untagged If not null, receives the untagged responses (without the leading "* ") sent before the completion.
+         */
+        void command(const std::string& command, std::vector<std::string> *untagged = nullptr)
+        {
+            if (!connected()) throw illegal_object_state("The IMAP command channel is not connected.");
+            if (_idling) stopIdle();
+            std::string tag = nextTag();
+            send(tag + " " + command);
+            readCompletion(tag, command, untagged);
+        }
+
+        /**
+         * Selects a mailbox read-only so that the server reports changes to it over this channel.
+         */
+        void examine(const std::string& mailbox)
+        {
+            openMailbox("EXAMINE", mailbox);
+        }
+
+        /**
+         * Selects a mailbox read-write, so that the channel can also remove messages from it with claim().
+         */
+        void select(const std::string& mailbox)
+        {
+            openMailbox("SELECT", mailbox);
+        }
+
+        /**
+         * Gets the state of the selected mailbox: UIDVALIDITY, UIDNEXT and HIGHESTMODSEQ as SELECT reported them, the latter raised by any FETCH
+         * responses since, and the message count as of the last EXISTS. It is brought up to date by any command, NOOP included, and by IDLE.
+         */
+        [[nodiscard]] const imapMailboxStatus& mailbox() const
+        {
+            return _mailbox;
+        }
+
+        /**
+         * Gets whether the server has announced new mail in the selected mailbox since it was selected or acknowledgeArrivals() was last called.
+         */
+        [[nodiscard]] bool mailArrived() const
+        {
+            return _arrived;
+        }
+
+        void acknowledgeArrivals()
+        {
+            _arrived = false;
+        }
+
+        /**
+         * Removes a batch of messages from the selected mailbox in as few round trips as the server allows: a single UID MOVE (RFC 6851) if they are
+         * to be archived, otherwise UID STORE followed by UID EXPUNGE (RFC 4315). Without UIDPLUS a plain EXPUNGE is used, which also removes any other
+         * message that is already flagged \Deleted.
+         * @param uids The UIDs of the messages.
+         * @param archive The mailbox to move the messages to, or an empty string to delete them.
+         */
+        void claim(const std::vector<std::uint64_t>& uids, const std::string& archive)
+        {
+            if (uids.empty()) return;
+
+            std::string set = sequenceSet(uids);
+            if (!archive.empty())
+            {
+                if (hasCapability("MOVE"))
+                {
+                    command("UID MOVE " + set + " " + quote(archive));
+                    return;
+                }
+                command("UID COPY " + set + " " + quote(archive));
+            }
+            command("UID STORE " + set + " +FLAGS.SILENT (\\Deleted)");
+            command(hasCapability("UIDPLUS") ? ("UID EXPUNGE " + set) : std::string("EXPUNGE"));
+        }
+
+        /**
+         * Compresses numbers into an IMAP sequence set such as "1:3,7,9:10".
+         */
+        static std::string sequenceSet(std::vector<std::uint64_t> numbers)
+        {
+            std::sort(numbers.begin(), numbers.end());
+            numbers.erase(std::unique(numbers.begin(), numbers.end()), numbers.end());
+            std::string retval;
+            for (std::size_t i = 0; i < numbers.size(); )
+            {
+                std::size_t j = i;
+                while ((j + 1 < numbers.size()) && (numbers[j + 1] == numbers[j] + 1)) j++;
+                if (!retval.empty()) retval.push_back(',');
+                retval += std::to_string(numbers[i]);
+                if (j > i) retval += ":" + std::to_string(numbers[j]);
+                i = j + 1;
+            }
+
+            return retval;
+        }
+
+        /**
+         * Runs a UID SEARCH and returns the matching UIDs in ascending order. ESEARCH (RFC 4731) is used when the server supports it, which reports the
+         * matches as a compact sequence set rather than one number per message.
+         * @param criteria The search keys, which must already be quoted where necessary.
+         */
+        std::vector<std::uint64_t> uidSearch(const std::string& criteria)
+        {
+            std::vector<std::uint64_t> retval;
+            std::vector<std::string> untagged;
+            bool esearch = hasCapability("ESEARCH");
+            command(esearch ? ("UID SEARCH RETURN (ALL) " + criteria) : ("UID SEARCH " + criteria), &untagged);
+
+            for (const auto& u : untagged)
+            {
+                if (esearch && u.starts_with("ESEARCH "))
+                {
+                    auto pos = u.find(" ALL ");
+                    if (pos == std::string::npos) continue;
+                    parseSequenceSet(u.substr(pos + 5), retval);
+                }
+                else if (!esearch && u.starts_with("SEARCH"))
+                {
+                    std::istringstream iss(u.substr(6));
+                    std::uint64_t uid;
+                    while (iss >> uid) retval.push_back(uid);
+                }
+            }
+
+            std::sort(retval.begin(), retval.end());
+
+            return retval;
+        }
+
+        /**
+         * Expands an IMAP sequence set such as "1:3,7,9:10" into its members.
+         */
+        static void parseSequenceSet(const std::string& set, std::vector<std::uint64_t>& out)
+        {
+            std::vector<std::string> ranges;
+            std::string trimmed = boost::trim_copy(set);
+            boost::split(ranges, trimmed.substr(0, trimmed.find(' ')), boost::is_any_of(","));
+            for (const auto& r : ranges)
+            {
+                if (r.empty()) continue;
+                auto colon = r.find(':');
+                std::uint64_t first = std::stoull(r.substr(0, colon));
+                std::uint64_t last = (colon == std::string::npos) ? first : std::stoull(r.substr(colon + 1));
+                if (last < first) std::swap(first, last);
+                for (auto n = first; n <= last; n++) out.push_back(n);
+            }
+        }
+
+        /**
+         * Quotes a string for use as an IMAP astring.
+         */
+        static std::string quote(const std::string& value)
+        {
+            std::string retval = "\"";
+            for (char c : value)
+            {
+                if ((c == '"') || (c == '\\')) retval.push_back('\\');
+                retval.push_back(c);
+            }
+            retval.push_back('"');
+
+            return retval;
+        }
+
+        /**
+         * Sends a NOOP, which collects any updates the server has for the selected mailbox.
+         * @return true if new mail has been announced and not yet acknowledged.
+         */
+        bool noop()
+        {
+            command("NOOP");
+
+            return _arrived;
+        }
+
+        /**
+         * Puts the connection into the IDLE state (RFC 2177).
+         * @return true if the server accepted the IDLE command, false if it does not support it.
+         */
+        bool startIdle()
+        {
+            if (_idling) return true;
+            if (!hasCapability("IDLE")) return false;
+
+            _idleTag = nextTag();
+            send(_idleTag + " IDLE");
+            std::string line;
+            while (true)
+            {
+                if (!readLine(std::chrono::seconds(30), line)) throw vmime::exceptions::operation_timed_out();
+                if (line.starts_with("+")) break;
+                if (line.starts_with(_idleTag + " ")) return false;
+            }
+            _idling = true;
+
+            return true;
+        }
+
+        /**
+         * Waits for the server to push a new mail notification while idling.
+         * @param timeout The longest time to block, no CPU is used while waiting.
+         * @return true if new mail has been announced and not yet acknowledged.
+         */
+        bool idleActivity(std::chrono::milliseconds timeout)
+        {
+            if (!_idling) return false;
+
+            std::string line;
+            while (readLine(timeout, line))
+            {
+                if (line.starts_with("* ")) track(line.substr(2));
+                if (_arrived) return true;
+                timeout = std::chrono::milliseconds(0);
+            }
+
+            return _arrived;
+        }
+
+        void stopIdle()
+        {
+            if (!_idling) return;
+            _idling = false;
+            send("DONE");
+            readCompletion(_idleTag, "IDLE", nullptr);
+        }
+
+        [[nodiscard]] bool idling() const
+        {
+            return _idling;
+        }
+    };
+}
+
+#endif // _IMAP_COMMAND_CHANNEL_HPP_
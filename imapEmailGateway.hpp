@@ -6,288 +6,749 @@
 #include <chrono>
 #include <future>
 #include <vmime/vmime.hpp>
+#include <vmime/net/imap/IMAPFolder.hpp>
 #include "utils.hpp"
+#include "imapCommandChannel.hpp"
+#include "mailboxCheckpoint.hpp"
+#include "verdictCache.hpp"
+#include "connectionPool.hpp"
+#include "outboundMailQueue.hpp"
+#include "attachmentCache.hpp"
+#include "boundedQueue.hpp"
+#include "mailServiceSupport.hpp"
 
 namespace telemeteryServices
 {
-    // Certificate verifier (TLS/SSL)
-    class customCertificateVerifier : public vmime::security::cert::defaultCertificateVerifier
+    class imapEmailGateway final : public abstractGateway
     {
-    public:
-        void verify(const vmime::shared_ptr <vmime::security::cert::certificateChain>& chain, const vmime::string& hostname)
+    private:
+        connectionEndpoint _fetchEndpoint;
+        connectionEndpoint _sendEndpoint;
+        std::string _fetchUsername;
+        std::string _fetchPassword;
+        std::string _fetchServer;
+        unsigned int _fetchPort;
+        std::string _sendUsername;
+        std::string _sendPassword;
+        std::string _sendServer;
+        unsigned int _sendPort;
+        imapCommandChannel _channel;
+        mailboxCheckpoint _checkpoint;
+        verdictCache _verdicts;
+        std::string _outboundAccount;
+        std::chrono::steady_clock::time_point _nextScan;
+        std::chrono::steady_clock::time_point _nextNoop;
+        // When polling last stopped with the command channel left open, or min() if it was not.
+        std::chrono::steady_clock::time_point _channelParkedAt;
+        // Whether no new mail has been acknowledged since the command channel selected INBOX, so that what SELECT reported about it still holds.
+        bool _selectionFresh;
+        // Whether the last scan through the command channel ran to completion, so that only newly announced mail calls for another.
+        bool _mailboxInSync;
+        std::uint64_t _windowHighestUid;
+        // The first message found outside the window on the last walk back through it.
+        std::uint64_t _windowBoundaryUid;
+        std::string _archiveFolder;
+        // Messages whose commands have been claimed but which have not yet been removed from the mailbox.
+        std::vector<std::uint64_t> _pendingClaims;
+        static constexpr vmime::size_t WINDOW_BATCH_SIZE = 50;
+        static constexpr std::size_t FETCH_QUEUE_DEPTH = 2;
+        static constexpr std::size_t DECODE_QUEUE_DEPTH = 4;
+        static constexpr std::chrono::milliseconds NOOP_INTERVAL = std::chrono::seconds(5);
+        static constexpr std::chrono::milliseconds IDLE_CHECK_INTERVAL = std::chrono::seconds(1);
+        // Servers may drop a connection that has been idling for 30 minutes (RFC 2177), so IDLE is re-issued, by rescanning, before then.
+        static constexpr std::chrono::milliseconds IDLE_REFRESH_INTERVAL = std::chrono::minutes(25);
+
+        static std::uint64_t messageUid(const vmime::shared_ptr<vmime::net::message>& message)
         {
             try
             {
-                setX509TrustedCerts(m_trustedCerts);
+                return std::stoull(static_cast<vmime::string>(message->getUID()));
+            }
+            catch (const std::exception&)
+            {
+                return 0;
+            }
+        }
+
+        /**
+         * Fetches everything the triage stage needs for a batch of messages in a single pipelined FETCH; the envelope carries the date, sender, recipients
+         * and subject, and the body structure is all that is needed to locate the attachments.
+         */
+        static void fetchTriageAttributes(const vmime::shared_ptr<vmime::net::folder>& folder, std::vector<vmime::shared_ptr<vmime::net::message>>& messages)
+        {
+            if (messages.empty()) return;
+            folder->fetchMessages(messages, vmime::net::fetchAttributes::ENVELOPE | vmime::net::fetchAttributes::STRUCTURE | vmime::net::fetchAttributes::SIZE | vmime::net::fetchAttributes::UID);
+        }
 
-                defaultCertificateVerifier::verify(chain, hostname);
+        static bool olderThanWindow(const vmime::shared_ptr<vmime::net::message>& message)
+        {
+            return abstractGateway::olderThanWindow(*message->getHeader());
+        }
+
+        /**
+         * Discards the verdicts, and any pending claims, reached against a previous UIDVALIDITY; the UIDs they refer to no longer mean anything.
+         */
+        void checkUidValidity(std::uint64_t uidValidity)
+        {
+            if (uidValidity == _verdicts.uidValidity()) return;
+            _verdicts.reset(uidValidity);
+            _pendingClaims.clear();
+        }
+
+        /**
+         * A message that has passed triage, with the parts chosen for it downloaded but still in their transfer encoding.
+         */
+        struct fetchedMessage
+        {
+            std::uint64_t uid = 0;
+            std::time_t sent = 0;
+            std::string subject;
+            std::string sender;
+            std::string senderName;
+            std::vector<utilities::rawMessagePart> text;
+            std::vector<utilities::rawMessagePart> attachments;
+        };
+
+        /**
+         * A message ready to be dispatched, its text decoded and its attachments written to temporary files.
+         */
+        struct decodedMessage
+        {
+            std::uint64_t uid = 0;
+            std::time_t sent = 0;
+            std::string subject;
+            std::string sender;
+            std::string senderName;
+            std::string text;
+            std::vector<std::unique_ptr<utilities::temporaryFile>> files;
+        };
+
+        /**
+         * <p>Processes the messages of a scan in three stages running side by side: fetching on the polling thread, which owns the connection, then
+         * decoding and dispatching on a thread each. While one message is being downloaded the one before it is being decoded and the one before
+         * that dispatched.</p>
+         * <p>The stages are joined by short bounded queues, so a slow stage holds up the ones before it rather than letting downloaded messages pile
+         * up in memory. Messages are dispatched in the order they were fetched. The threads are only started once there is a message to process.</p>
+         * <p>A message is only given its verdict once its command has been dispatched. One that could not be decoded or dispatched is left without a
+         * verdict, so that it is fetched and tried again next cycle.</p>
+         */
+        class messagePipeline
+        {
+        private:
+            imapEmailGateway& _gateway;
+            utilities::boundedQueue<fetchedMessage> _fetched;
+            utilities::boundedQueue<decodedMessage> _decoded;
+            std::thread _decoder;
+            std::thread _dispatcher;
+            std::vector<std::uint64_t> _claimed;
+            std::vector<std::pair<std::uint64_t, std::time_t>> _dispatched;
+            // Kept apart as each is only written by its own stage.
+            std::vector<std::uint64_t> _undecoded;
+            std::vector<std::uint64_t> _undispatched;
+
+            void decodeLoop()
+            {
+                fetchedMessage fetched;
+                while (_fetched.pop(fetched))
+                {
+                    try
+                    {
+                        _decoded.push(_gateway.decodeMessage(fetched));
+                    }
+                    catch (const std::exception& ex)
+                    {
+                        _undecoded.push_back(fetched.uid);
+                        if (_gateway._errorReceived) _gateway._errorReceived(_gateway, _gateway._id + " could not decode the message from '" + fetched.sender + "', it will be tried again next cycle: " + std::string(ex.what()), _gateway._user_data);
+                    }
+                }
+                _decoded.close();
             }
-            catch (vmime::security::cert::certificateException&)
+
+            void dispatchLoop()
             {
-                // Obtain subject's certificate
-                vmime::shared_ptr <vmime::security::cert::certificate> cert = chain->getAt(0);
+                decodedMessage decoded;
+                while (_decoded.pop(decoded))
+                {
+                    try
+                    {
+                        if (_gateway.dispatchMessage(decoded)) _claimed.push_back(decoded.uid);
+                        _dispatched.emplace_back(decoded.uid, decoded.sent);
+                    }
+                    catch (const std::exception& ex)
+                    {
+                        _undispatched.push_back(decoded.uid);
+                        if (_gateway._errorReceived) _gateway._errorReceived(_gateway, _gateway._id + " could not dispatch the command from '" + decoded.sender + "', it will be tried again next cycle: " + std::string(ex.what()), _gateway._user_data);
+                    }
+                }
+            }
+
+        public:
+            explicit messagePipeline(imapEmailGateway& gateway) : _gateway(gateway), _fetched(FETCH_QUEUE_DEPTH), _decoded(DECODE_QUEUE_DEPTH)
+            {
+            }
+
+            messagePipeline(const messagePipeline& other) = delete;
+            messagePipeline& operator=(const messagePipeline& other) = delete;
+
+            ~messagePipeline()
+            {
+                finish();
+            }
 
-                if (cert->getType() == "X.509")
+            /**
+             * Hands a fetched message to the decoding stage, waiting if the stages after it are busy.
+             */
+            void submit(fetchedMessage&& message)
+            {
+                if (!_decoder.joinable())
                 {
-                    m_trustedCerts.push_back(vmime::dynamicCast <vmime::security::cert::X509Certificate>(cert));
+                    _decoder = std::thread(&messagePipeline::decodeLoop, this);
+                    _dispatcher = std::thread(&messagePipeline::dispatchLoop, this);
+                }
+                _fetched.push(std::move(message));
+            }
+
+            /**
+             * Waits for every submitted message to be dispatched, records the verdicts on those that were and queues those whose commands were
+             * claimed for removal from the mailbox.
+             */
+            void finish()
+            {
+                _fetched.close();
+                if (_decoder.joinable()) _decoder.join();
+                if (_dispatcher.joinable()) _dispatcher.join();
+                for (const auto& [uid, sent] : _dispatched) _gateway._verdicts.record(uid, sent, triageVerdict::dispatched);
+                _dispatched.clear();
+                _gateway._pendingClaims.insert(_gateway._pendingClaims.end(), _claimed.begin(), _claimed.end());
+                _claimed.clear();
+            }
+
+            /**
+             * Gets the lowest UID of the messages that could not be decoded or dispatched, or 0 if there were none; only meaningful after finish().
+             */
+            [[nodiscard]] std::uint64_t lowestFailedUid() const
+            {
+                std::uint64_t retval = 0;
+                for (auto uid : _undecoded) retval = (retval == 0) ? uid : std::min(retval, uid);
+                for (auto uid : _undispatched) retval = (retval == 0) ? uid : std::min(retval, uid);
 
-                    setX509TrustedCerts(m_trustedCerts);
-                    defaultCertificateVerifier::verify(chain, hostname);
+                return retval;
+            }
+        };
+
+        /**
+         * The fetching stage: triages a message whose headers have been fetched and, if it is acceptable, downloads the parts that carry its payload.
+         * @return false if the message is to be ignored.
+         */
+        bool fetchMessage(const vmime::shared_ptr<vmime::net::message>& message, fetchedMessage& fetched)
+        {
+            if (!screenMessage(*message->getHeader(), fetched.subject, fetched.sender, fetched.senderName)) return false;
+            fetched.uid = messageUid(message);
+
+            // Choose the parts to download from the structure and the headers of its text parts. If the whole message fits in the payload limit none
+            // of its parts can exceed it.
+            utilities::messagePartSelection parts;
+            vmime::size_t budget = (message->getSize() <= _max_payload_size) ? message->getSize() : _max_payload_size;
+            utilities::selectMessageParts(message, _mimes_acl, _mime_access, budget, parts);
+            for (const auto& part : parts.oversized)
+            {
+                if (_warningReceived) _warningReceived(*this, _id + " ignored a " + utilities::getMimeType(part->getType()) + " part of " + std::to_string(part->getSize()) + " bytes from '" + fetched.sender + "' because it would exceed the maximum payload size", _user_data);
+            }
+
+            for (const auto& part : parts.text) fetched.text.push_back(utilities::fetchRawPart(message, part));
+            for (const auto& part : parts.attachments) fetched.attachments.push_back(utilities::fetchRawPart(message, part));
+
+            return true;
+        }
+
+        /**
+         * Triages a message that has not been seen before. A rejection is recorded at once, so that a message left in the mailbox is neither fetched nor
+         * reported again on later cycles; an accepted message is handed to the pipeline, which records its verdict once it has been dispatched.
+         */
+        void triageMessage(const vmime::shared_ptr<vmime::net::message>& message, std::time_t sent, messagePipeline& pipeline)
+        {
+            fetchedMessage fetched;
+            if (fetchMessage(message, fetched))
+            {
+                fetched.sent = sent;
+                pipeline.submit(std::move(fetched));
+            }
+            else
+            {
+                _verdicts.record(messageUid(message), sent, triageVerdict::rejected);
+            }
+        }
+
+        /**
+         * The decoding stage: decodes the text and writes the attachments out to temporary files.
+         */
+        static decodedMessage decodeMessage(const fetchedMessage& fetched)
+        {
+            decodedMessage decoded;
+            decoded.uid = fetched.uid;
+            decoded.sent = fetched.sent;
+            decoded.subject = fetched.subject;
+            decoded.sender = fetched.sender;
+            decoded.senderName = fetched.senderName;
+            for (const auto& raw : fetched.text) decoded.text += utilities::decodePartToString(raw);
+            for (const auto& raw : fetched.attachments)
+            {
+                decoded.files.push_back(utilities::decodePartToFile(raw));
+                utilities::attachmentCache::instance().admit(*decoded.files.back());
+            }
+
+            return decoded;
+        }
+
+        /**
+         * The dispatching stage: passes the message on as a command. The sender becomes the last sender only here, so that replies made by the callee
+         * go to the right person while later messages are already being screened.
+         * @return true if the command was claimed by the callee, in which case the message should be removed from the mailbox.
+         */
+        bool dispatchMessage(decodedMessage& decoded)
+        {
+            _last_sender = decoded.sender;
+            _last_sender_name = decoded.senderName;
+
+            return dispatchCommand(decoded.subject, decoded.text, decoded.files);
+        }
+
+        /**
+         * <p>Removes the messages claimed during the cycle from the mailbox in one batch, moving them to the archive folder if there is one.</p>
+         * <p>Nothing is removed while the mailbox is being walked, so message numbers stay stable for the whole scan. If the removal fails the messages
+         * are kept pending and the removal is retried next cycle; they are not dispatched again in the meantime.</p>
+         * @return true if the messages were flagged through the folder and it must be expunged.
+         */
+        bool claimMessages(const vmime::shared_ptr<vmime::net::folder>& folder)
+        {
+            if (_pendingClaims.empty()) return false;
+
+            if (_channel.connected())
+            {
+                try
+                {
+                    _channel.claim(_pendingClaims, _archiveFolder);
+                    _pendingClaims.clear();
+                }
+                catch (const std::exception& ex)
+                {
+                    _channel.close();
+                    if (_warningReceived) _warningReceived(*this, _id + " could not remove " + std::to_string(_pendingClaims.size()) + " claimed messages, they will be removed next cycle: " + std::string(ex.what()), _user_data);
                 }
+                return false;
             }
+
+            // Without the command channel, vmime issues one UID STORE for the whole batch and the caller expunges once it is done with the folder.
+            std::vector<vmime::net::message::uid> uids;
+            for (auto uid : _pendingClaims) uids.emplace_back(std::to_string(uid));
+            auto set = vmime::net::messageSet::byUID(uids);
+            if (!_archiveFolder.empty()) folder->copyMessages(vmime::net::folder::path::fromString(_archiveFolder, "/", vmime::charsets::UTF_8), set);
+            folder->deleteMessages(set);
+            _pendingClaims.clear();
+
+            return true;
         }
 
-    private:
-        static std::vector <vmime::shared_ptr <vmime::security::cert::X509Certificate> > m_trustedCerts;
-    };
+        /**
+         * Builds the UID SEARCH criteria that select the messages worth fetching: those above the checkpoint, delivered within the window and addressed to
+         * the input contact. The server only has date granularity and substring matching, so the exact checks are still made on the envelope afterwards.
+         */
+        std::string searchCriteria() const
+        {
+            static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+            std::time_t since = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now() - std::chrono::hours(36));
+            std::tm tm1{};
+#ifdef _WIN32
+            gmtime_s(&tm1, &since);
+#else
+            gmtime_r(&since, &tm1);
+#endif
+            std::string criteria;
+            if (!_checkpoint.empty()) criteria = "UID " + std::to_string(_checkpoint.highestUid() + 1) + ":* ";
+            criteria += "SINCE " + std::to_string(tm1.tm_mday) + "-" + months[tm1.tm_mon] + "-" + std::to_string(tm1.tm_year + 1900);
+            criteria += " OR TO " + imapCommandChannel::quote(_input_contact) + " CC " + imapCommandChannel::quote(_input_contact);
+
+            return criteria;
+        }
 
-    std::vector <vmime::shared_ptr<vmime::security::cert::X509Certificate>> customCertificateVerifier::m_trustedCerts;
+        /**
+         * Scans the mailbox for new messages with the help of the command channel; the server filters out everything that cannot be for this gateway
+         * and only the messages it finds are fetched.
+         */
+        bool scanWithSearch(const vmime::shared_ptr<vmime::net::folder>& folder, const imapMailboxStatus& status)
+        {
+            std::vector<std::uint64_t> uids = _channel.uidSearch(searchCriteria());
+            std::vector<vmime::net::message::uid> wanted;
+            for (auto uid : uids)
+            {
+                if ((uid > _checkpoint.highestUid()) && !_verdicts.find(uid)) wanted.emplace_back(std::to_string(uid));
+            }
 
-    class myTracer : public vmime::net::tracer
-    {
+            if (!wanted.empty())
+            {
+                auto messages = folder->getMessages(vmime::net::messageSet::byUID(wanted));
+                fetchTriageAttributes(folder, messages);
+                messagePipeline pipeline(*this);
+                std::uint64_t reached = 0;
+                for (const auto& message : messages)
+                {
+                    if (!_polling) break;
+                    std::time_t sent = messageTime(*message->getHeader());
+                    if (olderThanWindow(sent)) _verdicts.record(messageUid(message), sent, triageVerdict::rejected);
+                    else triageMessage(message, sent, pipeline);
+                    reached = std::max(reached, messageUid(message));
+                }
+                pipeline.finish();
 
-    public:
+                // A message that failed has no verdict and is only searched for again if the checkpoint stays below it; those after it that did
+                // not fail have verdicts and are passed over.
+                std::uint64_t failed = pipeline.lowestFailedUid();
+                if (failed != 0)
+                {
+                    _checkpoint.advanceUid(failed - 1);
+                    return true;
+                }
+                _checkpoint.advanceUid(reached);
+            }
 
-        myTracer(
-            const vmime::shared_ptr <std::ostringstream>& stream,
-            const vmime::shared_ptr <vmime::net::service>& serv,
-            const int connectionId
-        )
-            : m_stream(stream),
-              m_service(serv),
-              m_connectionId(connectionId) {
+            // Everything up to UIDNEXT has now been looked at, whether or not the server matched it.
+            if (_polling && (status.uidNext != 0)) _checkpoint.advanceUid(status.uidNext - 1);
+            _mailboxInSync = _polling;
 
+            return !wanted.empty();
         }
 
-        void traceSend(const vmime::string& line) {
+        /**
+         * <p>Scans the mailbox without the command channel by walking back through it a batch at a time until a message falls outside the window.</p>
+         * <p>The window is walked again every cycle, so only the UIDs of each batch are fetched at first. Messages that already have a verdict, which
+         * includes those claimed in an earlier cycle whose removal failed, are passed over using the date recorded with it; only the rest have their
+         * envelopes and structures fetched.</p>
+         */
+        bool scanWindow(const vmime::shared_ptr<vmime::net::folder>& folder)
+        {
+            vmime::size_t last = folder->getMessageCount();
+            bool outsideWindow = false;
+            bool found = false;
+            messagePipeline pipeline(*this);
+            _windowBoundaryUid = 0;
+            while (_polling && !outsideWindow && (last >= 1))
+            {
+                vmime::size_t first = (last > WINDOW_BATCH_SIZE) ? (last - WINDOW_BATCH_SIZE + 1) : 1;
+                auto messages = folder->getMessages(vmime::net::messageSet::byNumber(first, last));
+                folder->fetchMessages(messages, vmime::net::fetchAttributes::UID);
+                std::vector<vmime::shared_ptr<vmime::net::message>> unknown;
+                for (const auto& message : messages)
+                {
+                    if (!_verdicts.find(messageUid(message))) unknown.push_back(message);
+                }
+                fetchTriageAttributes(folder, unknown);
+
+                for (auto it = messages.rbegin(); it != messages.rend(); ++it)
+                {
+                    if (!_polling) break;
+                    std::uint64_t uid = messageUid(*it);
+                    const verdictCache::entry *verdict = _verdicts.find(uid);
+                    std::time_t sent = verdict ? verdict->date : messageTime(*(*it)->getHeader());
+                    if (olderThanWindow(sent))
+                    {
+                        if (!verdict) _verdicts.record(uid, sent, triageVerdict::rejected);
+                        _windowBoundaryUid = uid;
+                        outsideWindow = true;
+                        break;
+                    }
+                    // Only messages that have not been seen before count as activity.
+                    if (uid > _windowHighestUid)
+                    {
+                        _windowHighestUid = uid;
+                        found = true;
+                    }
+                    if (!verdict) triageMessage(*it, sent, pipeline);
+                }
+                last = first - 1;
+            }
 
-            *m_stream << "[" << m_service->getProtocolName() << ":" << m_connectionId << "] Rx: " << line << std::endl;
+            return found;
         }
 
-        void traceReceive(const vmime::string& line) {
+        connectionPool::storeLease leaseStore(bool withDefaultFolder = false) const
+        {
+            return connectionPool::instance().leaseStore(_fetchEndpoint, [this](const vmime::shared_ptr<vmime::net::service>& service)
+            {
+                service->setProperty("connection.tls", true);
+                service->setProperty("connection.tls.required", true);
+                service->setProperty("options.need-authentication", true);
+                service->setProperty("auth.username", _fetchUsername);
+                service->setProperty("auth.password", _fetchPassword);
+                service->setProperty("options.chunking", false);
+                service->setCertificateVerifier(vmime::make_shared<customCertificateVerifier>());
+                service->setTracerFactory(vmime::make_shared<protocolTracerFactory>(_protocol_trace));
+            }, withDefaultFolder);
+        }
 
-            *m_stream << "[" << m_service->getProtocolName() << ":" << m_connectionId << "] Tx: " << line << std::endl;
+        void configureTransport(const vmime::shared_ptr<vmime::net::service>& service) const
+        {
+            service->setProperty("connection.tls", true);
+            service->setProperty("connection.tls.required", true);
+            service->setProperty("options.need-authentication", true);
+            service->setProperty("auth.username", _sendUsername);
+            service->setProperty("auth.password", _sendPassword);
+            service->setProperty("options.chunking", false);
+            service->setCertificateVerifier(vmime::make_shared<customCertificateVerifier>());
+            service->setTracerFactory(vmime::make_shared<protocolTracerFactory>(_protocol_trace));
         }
 
-    private:
+        connectionPool::transportLease leaseTransport() const
+        {
+            return connectionPool::instance().leaseTransport(_sendEndpoint, [this](const vmime::shared_ptr<vmime::net::service>& service){ configureTransport(service); });
+        }
 
-        vmime::shared_ptr <std::ostringstream> m_stream;
-        vmime::shared_ptr <vmime::net::service> m_service;
-        const int m_connectionId;
-    };
+        /**
+         * Scans the default folder for new requests; any error talking to the server is thrown to the caller.
+         * @return true if there was new mail in the folder, false if there was none.
+         */
+        bool scanDefaultFolder()
+        {
+            bool found = false;
+            connectionPool::storeLease store;
 
+            try
+            {
+                imapMailboxStatus status;
 
-    class myTracerFactory : public vmime::net::tracerFactory {
+                if (_channel.connected())
+                {
+                    // INBOX is selected on the channel, so STATUS must not be used on it (RFC 3501 section 6.3.10). SELECT reported its state and
+                    // every response since has kept it up to date; a NOOP collects anything still outstanding, including what arrived during IDLE.
+                    _channel.noop();
+                    status = _channel.mailbox();
+                    if (status.uidValidity != _checkpoint.uidValidity()) _checkpoint.reset(status.uidValidity);
+                    checkUidValidity(status.uidValidity);
+                    if (!_checkpoint.empty() && _pendingClaims.empty())
+                    {
+                        // Nothing has arrived since the last scan, or since the checkpoint was taken, so there is no need to even open the folder.
+                        if (!_channel.mailArrived() && _mailboxInSync) return false;
+                        bool unchanged = (status.highestModSeq != 0) && (status.highestModSeq == _checkpoint.highestModSeq());
+                        if (!_channel.mailArrived() && _selectionFresh && (unchanged || ((status.uidNext != 0) && (status.uidNext <= _checkpoint.highestUid() + 1))))
+                        {
+                            _mailboxInSync = true;
+                            _checkpoint.setHighestModSeq(status.highestModSeq);
+                            _checkpoint.save();
+                            return false;
+                        }
+                    }
+                    // Anything announced from here on arrived after the search below and is picked up by the next scan.
+                    _channel.acknowledgeArrivals();
+                    _selectionFresh = false;
+                    _mailboxInSync = false;
+                }
 
-    public:
+                // The pool keeps a store's INBOX open while the store is idle, so the folder is usually still selected from the last scan and no
+                // new connection, LOGIN and SELECT is needed for it.
+                store = leaseStore(true);
+                vmime::shared_ptr <vmime::net::folder> folder = store.defaultFolder();
+
+                if (_channel.connected())
+                {
+                    found = scanWithSearch(folder, status);
+                }
+                else
+                {
+                    // A folder that was kept open only learns of new messages from the server's responses; the store's NOOP is also sent on its
+                    // open folders, which brings the message count up to date.
+                    store->noop();
+                    checkUidValidity(vmime::dynamicCast<vmime::net::imap::IMAPFolder>(folder)->getUIDValidity());
+                    found = scanWindow(folder);
+                }
+                if (claimMessages(folder)) folder->expunge();
 
-        myTracerFactory(const vmime::shared_ptr <std::ostringstream>& stream)
-            : m_stream(stream) {
+                _verdicts.pruneBefore(windowStart(), _channel.connected() ? 0 : _windowBoundaryUid);
+                if (!_verdicts.path().empty() && !_verdicts.save() && _warningReceived) _warningReceived(*this, _id + " could not save its triage verdicts to " + _verdicts.path().string(), _user_data);
 
+                if (_channel.connected())
+                {
+                    if (_polling) _checkpoint.setHighestModSeq(status.highestModSeq);
+                    if (!_checkpoint.path().empty() && !_checkpoint.save() && _warningReceived) _warningReceived(*this, _id + " could not save its mailbox checkpoint to " + _checkpoint.path().string(), _user_data);
+                }
+            }
+            catch (...)
+            {
+                // The store or its folder may have been left part way through a command, so they must not be handed to the next scan.
+                if (store) store.discard();
+                throw;
+            }
+
+            return found;
         }
 
-        vmime::shared_ptr <vmime::net::tracer> create(
-            const vmime::shared_ptr <vmime::net::service>& serv,
-            const int connectionId
-        ) {
+        void openCommandChannel()
+        {
+            // The channel is kept open between scans, so it holds a place under the pool's cap for the host; one is only taken if a store and its
+            // INBOX could still be leased beside it, as scanning matters more than being told of new mail early.
+            _channel.close();
+            auto slot = connectionPool::instance().tryReserveHostSlot(_fetchEndpoint, 2);
+            if (!slot)
+            {
+                if (_warningReceived) _warningReceived(*this, _id + " has no room for a command channel under the connection limit for " + _fetchEndpoint.host + ", falling back to timed full rescans", _user_data);
+                return;
+            }
 
-            return vmime::make_shared <myTracer>(m_stream, serv, connectionId);
+            try
+            {
+                _channel.open(leaseStore().get(), std::move(slot));
+                _channel.select("INBOX");
+                _selectionFresh = true;
+                _mailboxInSync = false;
+                if (_push_mode && !_channel.hasCapability("IDLE") && _warningReceived) _warningReceived(*this, _id + " does not support IDLE, falling back to NOOP polling", _user_data);
+            }
+            catch (const std::exception& ex)
+            {
+                _channel.close();
+                if (_warningReceived) _warningReceived(*this, _id + " could not open its command channel, falling back to timed full rescans: " + std::string(ex.what()), _user_data);
+            }
         }
 
-    private:
+    protected:
+        void pollingStarted() override
+        {
+            _nextScan = std::chrono::steady_clock::time_point::min();
+        }
 
-        vmime::shared_ptr <std::ostringstream> m_stream;
-    };
+        /**
+         * Leaves the command channel logged in with INBOX selected rather than closing it, so that polling again reuses the same connection instead
+         * of opening a new one, which would cost a full TLS handshake as well as LOGIN and SELECT. A channel that cannot be brought out of IDLE cleanly
+         * is closed, and stop() closes a parked channel for good.
+         */
+        void pollingStopped() override
+        {
+            if (!_channel.connected()) return;
+            try
+            {
+                _channel.stopIdle();
+                _channelParkedAt = std::chrono::steady_clock::now();
+            }
+            catch (const std::exception&)
+            {
+                _channel.close();
+            }
+        }
+
+        /**
+         * Checks a command channel left open by pollingStopped() before it is used again: one that has been parked for longer than the pool keeps
+         * an idle connection is closed, and any other is sent a NOOP, which also tells whether mail arrived in the meantime.
+         */
+        void checkParkedChannel(std::chrono::steady_clock::time_point now)
+        {
+            if (_channelParkedAt == std::chrono::steady_clock::time_point::min()) return;
+            auto parkedAt = _channelParkedAt;
+            _channelParkedAt = std::chrono::steady_clock::time_point::min();
+            if (!_channel.connected()) return;
+            if ((now - parkedAt) > connectionPool::instance().idleTimeout())
+            {
+                _channel.close();
+                return;
+            }
+
+            try
+            {
+                _channel.noop();
+                _nextNoop = now + NOOP_INTERVAL;
+            }
+            catch (const std::exception&)
+            {
+                _channel.close();
+            }
+        }
 
-    class imapEmailGateway final : public abstractGateway
-    {
-    private:
-        vmime::shared_ptr<vmime::net::session> _session;
-        vmime::shared_ptr<vmime::net::store> _store;
-        vmime::shared_ptr<vmime::net::transport> SMTPTransport;
-        std::thread _pollThread;
-        std::string _fetchUsername;
-        std::string _fetchPassword;
-        std::string _fetchServer;
-        unsigned int _fetchPort;
-        std::string _sendUsername;
-        std::string _sendPassword;
-        std::string _sendServer;
-        unsigned int _sendPort;
     public:
         imapEmailGateway() : abstractGateway()
         {
             _fetchPort = 993;
             _sendPort = 587;
+            _windowHighestUid = 0;
+            _windowBoundaryUid = 0;
+            _channelParkedAt = std::chrono::steady_clock::time_point::min();
+            _selectionFresh = false;
+            _mailboxInSync = false;
         }
 
-        void poll() override
+        /**
+         * <p>Performs one unit of polling work.</p>
+         * <p>While the command channel is idling this only checks, without blocking, whether the server has pushed a new mail notification, and asks to be
+         * called again in a second. Without IDLE the channel is sent a NOOP every few seconds instead. The mailbox is scanned when new mail is announced
+         * or the poll interval has elapsed; the interval shortens after a scan that found new mail and lengthens after one that did not.</p>
+         * <p>A scan that fails is retried after the delay the circuit breaker sets, and nothing at all is attempted while the breaker is open.</p>
+         */
+        std::chrono::milliseconds poll() override
         {
-            if (!_running) return;
-            if (_polling) return;
-            _polling = true;
-            std::chrono::time_point now = std::chrono::system_clock::now();
-            std::chrono::time_point stop = std::chrono::system_clock::now();
-            std::vector<std::string> addressList;
-            command currentCommand = command::none;
-            std::string subject;
-            bool claimed = false;
+            if (!_running || !_polling) return _poll_interval.maximum();
 
-            if (_notificationReceived) _notificationReceived(*this, _id + " is preparing to start polling for incoming requests", _user_data);
+            std::chrono::milliseconds wait;
+            if (!connectionAllowed(wait)) return wait;
 
-            while (_polling)
+            auto now = std::chrono::steady_clock::now();
+            checkParkedChannel(now);
+            bool scanDue = (now >= _nextScan);
+
+            if (!scanDue && _push_mode && _channel.connected())
             {
-                currentCommand = command::none;
                 try
                 {
-                    // Open the default folder in this store
-                    vmime::shared_ptr <vmime::net::folder> folder = _store->getDefaultFolder();
-                    folder->open(vmime::net::folder::MODE_READ_WRITE);
-                    vmime::size_t count = folder->getMessageCount();
-
-                    for (auto idx = count; idx >= 1; idx--)
+                    if (_channel.idling())
                     {
-                        if (!_polling) break;
-                        auto message = folder->getMessage(idx);
-                        folder->fetchMessage(message, vmime::net::fetchAttributes::FULL_HEADER);
-                        // Check how old the message is.
-                        auto date = vmime::dynamicCast<const vmime::datetime>(message->getHeader()->Date()->getValue());
-                        std::tm tm1{};
-                        tm1.tm_year = date->getYear() - 1900;
-                        tm1.tm_mon = date->getMonth() - 1;
-                        tm1.tm_mday = date->getDay();
-                        tm1.tm_hour = date->getHour();
-                        tm1.tm_min = date->getMinute();
-                        tm1.tm_sec = date->getSecond();
-                        std::time_t t1 = std::mktime(&tm1);
-                        std::chrono::time_point<std::chrono::system_clock> dt2 = std::chrono::system_clock::now() - std::chrono::hours(36);
-                        std::time_t t2 = std::chrono::system_clock::to_time_t(dt2);
-                        if (t1 < t2) break;
-                        // Get recipients.
-                        auto to = message->getHeader()->To();
-                        vmime::shared_ptr<const vmime::addressList> recipients1;
-                        vmime::shared_ptr<const vmime::addressList> recipients2;
-                        if (to) recipients1 = vmime::dynamicCast<const vmime::addressList>(to->getValue());
-                        auto cc = message->getHeader()->Cc();
-                        if (cc) recipients2 = vmime::dynamicCast<const vmime::addressList>(cc->getValue());
-                        if (!utilities::search_for_email_address(_input_contact, recipients1, recipients2)) continue;
-                        // Get sender.
-                        auto sh = message->getHeader()->From();
-                        if (sh)
-                        {
-                            auto sender = vmime::dynamicCast<const vmime::mailbox>(sh->getValue());
-                            _last_sender = sender->getEmail().toString();
-                            if (_last_sender.empty()) continue;
-                            _last_sender_name = sender->getName().getWholeBuffer();
-                            if (_last_sender_name.empty()) _last_sender_name = "Unknown sender";
-                        }
-                        else
-                        {
-                            continue;
-                        }
-                        // Get the subject.
-                        auto sjh = message->getHeader()->Subject();
-                        if (sjh)
-                        {
-                            auto subj = vmime::dynamicCast<const vmime::text>(sjh->getValue());
-                            subject = subj->getWholeBuffer();
-                            if (subject.empty()) subject = "No subject";
-                        }
-                        else
-                        {
-                            subject = "No subject";
-                        }
-
-                        if (utilities::search_for_email_address(_last_sender, _senders_acl))
-                        {
-                            if (_sender_access == utilities::accessControlAction::block)
-                            {
-                                if (_unauthorisedAccess) _unauthorisedAccess(*this, _last_sender, subject, _user_data);
-                                continue;
-                            }
-                        }
-                        else
-                        {
-                            if (_sender_access == utilities::accessControlAction::allow)
-                            {
-                                if (_unauthorisedAccess) _unauthorisedAccess(*this, _last_sender, subject, _user_data);
-                                continue;
-                            }
-                        }
-
-                        // Get the attachments.
-                        folder->fetchMessage(message, vmime::net::fetchAttributes::STRUCTURE);
-                        std::vector<std::unique_ptr<utilities::temporaryFile>> files;
-                        utilities::getAttachments(message, _mimes_acl, _mime_access, files);
-
-                        // Get the message text.
-                        std::string text = utilities::getMessageText(message);
-
-                        if (boost::iequals(subject, "post"))
-                        {
-                            currentCommand = command::explicit_post;
-                        }
-                        else if (boost::iequals(subject, "repost") || boost::iequals(subject, "re-post"))
-                        {
-                            currentCommand = command::repost;
-                        }
-                        else if (boost::iequals(subject, "delete") || boost::iequals(subject, "remove"))
-                        {
-                            currentCommand = command::remove;
-                        }
-                        else if (boost::iequals(subject, "killswitch"))
-                        {
-                            currentCommand = command::killswitch;
-                        }
-                        else
-                        {
-                            currentCommand = command::implicit_post;
-                        }
-
-                        if (_commandReceived)
-                        {
-                            claimed = _commandReceived(*this, currentCommand, _last_sender, text, files, _user_data);
-                            // If the command has been claimed by the callee then delete the email.
-                            if (claimed)
-                            {
-                                vmime::net::messageSet set = vmime::net::messageSet::byNumber(message->getNumber());
-                                folder->deleteMessages(set);
-                            }
-                        }
+                        scanDue = _channel.idleActivity(std::chrono::milliseconds(0));
+                    }
+                    else if (now >= _nextNoop)
+                    {
+                        scanDue = _channel.noop();
+                        _nextNoop = now + NOOP_INTERVAL;
                     }
-                    folder->close(true);
                 }
                 catch (const std::exception& ex)
                 {
-                    if (_errorReceived) _errorReceived(*this, _id + " encountered an error checking for new mail: " + std::string(ex.what()), _user_data);
+                    _channel.close();
+                    if (_warningReceived) _warningReceived(*this, _id + " lost its command channel, falling back to timed polling: " + std::string(ex.what()), _user_data);
                 }
+            }
 
-                now = std::chrono::system_clock::now();
-                stop = now + std::chrono::minutes(1);
-                while (true)
+            if (scanDue)
+            {
+                if (!_channel.connected()) openCommandChannel();
+                try
                 {
-                    now = std::chrono::system_clock::now();
-                    if (now >= stop) break;
-                    if (!_polling) break;
-                    std::this_thread::yield();
+                    if (scanDefaultFolder()) _poll_interval.activity();
+                    else _poll_interval.backoff();
+                    connectionSucceeded();
+                }
+                catch (const std::exception& ex)
+                {
+                    // The scan is retried as soon as the breaker allows, on a fresh command channel and store.
+                    _channel.close();
+                    return connectionFailed(_id + " encountered an error checking for new mail: " + std::string(ex.what()));
+                }
+                now = std::chrono::steady_clock::now();
+                auto interval = _poll_interval.next();
+                if (_push_mode) interval = std::min(interval, IDLE_REFRESH_INTERVAL);
+                _nextScan = now + interval;
+                _nextNoop = now + NOOP_INTERVAL;
+
+                if (_polling && _push_mode && _channel.connected())
+                {
+                    try
+                    {
+                        _channel.startIdle();
+                    }
+                    catch (const std::exception& ex)
+                    {
+                        _channel.close();
+                        if (_warningReceived) _warningReceived(*this, _id + " lost its command channel, falling back to timed polling: " + std::string(ex.what()), _user_data);
+                    }
                 }
             }
-        }
 
-        void pollAsync() override
-        {
-            if (!_running) return;
-            if (_polling) return;
-            _pollThread = std::thread([this]{ poll(); });
-        }
+            auto next = _nextScan;
+            if (_push_mode && _channel.connected()) next = std::min(next, _channel.idling() ? (now + IDLE_CHECK_INTERVAL) : _nextNoop);
 
-        void pause() override
-        {
-            if (!_running) return;
-            if (!_polling) return;
-            _polling = false;
-            if (_pollThread.joinable()) _pollThread.join();
-            if (_notificationReceived) _notificationReceived(*this, _id + " is no longer polling for incoming requests", _user_data);
+            return std::max(std::chrono::milliseconds(0), std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()));
         }
 
         bool start() override
@@ -310,31 +771,28 @@ namespace telemeteryServices
 
             _id = "IMAP session (" + _fetchServer + ":" + _input_contact + ")";
 
-            try
+            if (!_state_directory.empty())
             {
-                _session = vmime::net::session::create();
-                _session->getProperties().setProperty("options.sasl", true);
-                _session->getProperties().setProperty("auth.username", _fetchUsername);
-                _session->getProperties().setProperty("auth.password", _fetchPassword);
-                vmime::utility::url url("imaps", _fetchServer, _fetchPort);
-                _store = _session->getStore(url);
-                _store->setProperty("connection.tls", true);
-                _store->setProperty("connection.tls.required", true);
-                _store->setProperty("options.need-authentication", true);
-                _store->setProperty("auth.username", _fetchUsername);
-                _store->setProperty("auth.password", _fetchPassword);
-                _store->setProperty("options.chunking", false);
-                _store->setCertificateVerifier(vmime::make_shared<customCertificateVerifier>());
-
-                vmime::shared_ptr <std::ostringstream> traceStream = vmime::make_shared <std::ostringstream>();
-                _store->setTracerFactory(vmime::make_shared <myTracerFactory>(traceStream));
+                _checkpoint.setPath(_state_directory / mailboxCheckpoint::fileNameFor("imap-" + _fetchUsername + "@" + _fetchServer + "-" + _input_contact));
+                _checkpoint.load();
+                _verdicts.setPath(_state_directory / verdictCache::fileNameFor("imap-" + _fetchUsername + "@" + _fetchServer + "-" + _input_contact));
+                _verdicts.load();
+            }
 
-                _store->connect();
+            connectionEndpoint fetchEndpoint = { "imaps", _fetchServer, _fetchPort, _fetchUsername, _fetchPassword };
+            // A command channel parked by the last run is only any use if the account has not been changed since.
+            if (fetchEndpoint != _fetchEndpoint) _channel.close();
+            _fetchEndpoint = fetchEndpoint;
+            _sendEndpoint = { "smtp", _sendServer, _sendPort, _sendUsername, _sendPassword };
 
+            // Lease a connection from the pool once to check that the server can be reached, it is kept warm in the pool for the first poll cycle.
+            try
+            {
+                leaseStore();
             }
             catch (const std::exception& ex)
             {
-                if (_errorReceived) _errorReceived(*this, _id + " failed to start: " + std::string(ex.what()), _user_data);
+                reportConnectionError(_id + " failed to start: " + std::string(ex.what()));
                 return false;
             }
 
@@ -342,17 +800,7 @@ namespace telemeteryServices
 
             try
             {
-                vmime::utility::url url("smtp", _sendServer, _sendPort);
-                SMTPTransport = _session->getTransport(url);
-                SMTPTransport->setProperty("connection.tls", true);
-                SMTPTransport->setProperty("connection.tls.required", true);
-                SMTPTransport->setProperty("options.need-authentication", true);
-                SMTPTransport->setProperty("auth.username", _sendUsername);
-                SMTPTransport->setProperty("auth.password", _sendPassword);
-                SMTPTransport->setProperty("options.chunking", false);
-                SMTPTransport->setCertificateVerifier(vmime::make_shared<customCertificateVerifier>());
-                SMTPTransport->connect();
-
+                leaseTransport();
             }
             catch (const std::exception& ex)
             {
@@ -362,6 +810,14 @@ namespace telemeteryServices
 
             if (_notificationReceived) _notificationReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") is running", _user_data);
 
+            _outboundAccount = outboundMailQueue::instance().registerAccount(_input_contact, _sendEndpoint,
+                [this](const vmime::shared_ptr<vmime::net::service>& service){ configureTransport(service); },
+                [this](const std::string& recipient, const std::string& error, bool willRetry)
+                {
+                    std::string s = "SMTP session (" + _sendServer + ":" + _input_contact + ") sending message to '" + recipient + "' failed: " + error;
+                    if (willRetry && _warningReceived) _warningReceived(*this, s + ", it will be retried", _user_data);
+                    else if (!willRetry) reportConnectionError(s + ", giving up");
+                });
 
             _running = true;
 
@@ -372,11 +828,19 @@ namespace telemeteryServices
         {
             if (!_running) return;
             if (_polling) pause();
+            // A channel parked by pausing is only worth keeping for a gateway that will poll again; it also holds a place under the host's cap.
+            _channel.close();
+            _channelParkedAt = std::chrono::steady_clock::time_point::min();
+            outboundMailQueue::instance().unregisterAccount(_outboundAccount);
+            _running = false;
 
             if (_notificationReceived) _notificationReceived(*this, _id + " has stopped running", _user_data);
             if (_notificationReceived) _notificationReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") has stopped running", _user_data);
         }
 
+        /**
+         * Queues a message for sending and returns at once; failures are reported through the warning and error callbacks.
+         */
         void messageUser(const std::string& recipient, const std::string& subject, const std::string& message) const override
         {
             try
@@ -389,7 +853,7 @@ namespace telemeteryServices
                 msgbld.setSubject(vmime::text(subject));
                 msgbld.getTextPart()->setText(vmime::make_shared<vmime::stringContentHandler>(message));
                 vmime::shared_ptr<vmime::message> msg = msgbld.construct();
-                SMTPTransport->send(msg);
+                outboundMailQueue::instance().enqueue(_outboundAccount, vmime::mailbox(_input_contact), vmime::mailbox(recipient), msg);
             }
             catch (const std::exception& ex)
             {
@@ -486,6 +950,19 @@ namespace telemeteryServices
         {
             _sendPort = port;
         }
+
+        [[nodiscard]] std::string archiveFolder() const
+        {
+            return _archiveFolder;
+        }
+
+        /**
+         * Sets the folder that messages whose commands have been claimed are moved to; with none they are deleted.
+         */
+        void setArchiveFolder(const std::string& folder)
+        {
+            _archiveFolder = folder;
+        }
     };
 }
 
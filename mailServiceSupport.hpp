@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: mailServiceSupport.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MAIL_SERVICE_SUPPORT_HPP_
+#define _MAIL_SERVICE_SUPPORT_HPP_
+
+#include <vector>
+#include <vmime/vmime.hpp>
+#include "certificateCache.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * Certificate verifier (TLS/SSL). A server certificate that does not verify against the trusted set is trusted from then on, provided the chain
+     * then verifies for the host; the trusted set and the chains already verified are shared by every session through the certificate cache.
+     */
+    class customCertificateVerifier : public vmime::security::cert::defaultCertificateVerifier
+    {
+    public:
+        void verify(const vmime::shared_ptr <vmime::security::cert::certificateChain>& chain, const vmime::string& hostname)
+        {
+            auto& cache = certificateCache::instance();
+            auto key = certificateCache::chainKey(chain, hostname);
+            if (cache.verified(key)) return;
+
+            try
+            {
+                setX509TrustedCerts(cache.trustedCertificates());
+
+                defaultCertificateVerifier::verify(chain, hostname);
+            }
+            catch (vmime::security::cert::certificateException&)
+            {
+                // Obtain subject's certificate
+                vmime::shared_ptr <vmime::security::cert::certificate> cert = chain->getAt(0);
+
+                if (cert->getType() != "X.509") return;
+                cache.trust(vmime::dynamicCast <vmime::security::cert::X509Certificate>(cert));
+
+                setX509TrustedCerts(cache.trustedCertificates());
+                defaultCertificateVerifier::verify(chain, hostname);
+            }
+
+            cache.rememberVerified(key, chain);
+        }
+    };
+}
+
+#endif // _MAIL_SERVICE_SUPPORT_HPP_
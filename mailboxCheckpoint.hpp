@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: mailboxCheckpoint.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MAILBOX_CHECKPOINT_HPP_
+#define _MAILBOX_CHECKPOINT_HPP_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <boost/filesystem.hpp>
+#include "stateFile.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * <p>Records how far a gateway has got through a mailbox so that only messages that arrived since the last cycle, or since the last run, need to be fetched.</p>
+     * <p>A checkpoint is only meaningful while the mailbox UIDVALIDITY matches the one it was taken against; if the server reports a different value the checkpoint must be discarded.</p>
+     */
+    class mailboxCheckpoint
+    {
+    private:
+        boost::filesystem::path _path;
+        std::uint64_t _uidValidity;
+        std::uint64_t _highestUid;
+        std::uint64_t _highestModSeq;
+
+    public:
+        mailboxCheckpoint()
+        {
+            _uidValidity = 0;
+            _highestUid = 0;
+            _highestModSeq = 0;
+        }
+
+        /**
+         * Builds a file name for a checkpoint from an arbitrary key.
+         */
+        static std::string fileNameFor(const std::string& key)
+        {
+            return utilities::stateFileName(key, ".checkpoint");
+        }
+
+        void setPath(const boost::filesystem::path& path)
+        {
+            _path = path;
+        }
+
+        [[nodiscard]] const boost::filesystem::path& path() const
+        {
+            return _path;
+        }
+
+        [[nodiscard]] std::uint64_t uidValidity() const
+        {
+            return _uidValidity;
+        }
+
+        [[nodiscard]] std::uint64_t highestUid() const
+        {
+            return _highestUid;
+        }
+
+        [[nodiscard]] std::uint64_t highestModSeq() const
+        {
+            return _highestModSeq;
+        }
+
+        [[nodiscard]] bool empty() const
+        {
+            return (_uidValidity == 0) || (_highestUid == 0);
+        }
+
+        /**
+         * Discards the checkpoint and starts again against the given UIDVALIDITY.
+         */
+        void reset(std::uint64_t uidValidity)
+        {
+            _uidValidity = uidValidity;
+            _highestUid = 0;
+            _highestModSeq = 0;
+        }
+
+        void advanceUid(std::uint64_t uid)
+        {
+            if (uid > _highestUid) _highestUid = uid;
+        }
+
+        void setHighestModSeq(std::uint64_t modSeq)
+        {
+            _highestModSeq = modSeq;
+        }
+
+        /**
+         * Loads the checkpoint from its file, leaving it empty if there is no file or it cannot be read.
+         */
+        bool load()
+        {
+            reset(0);
+            if (_path.empty()) return false;
+
+            std::ifstream in(_path.string());
+            if (!in) return false;
+
+            std::string name;
+            std::uint64_t value;
+            while (in >> name >> value)
+            {
+                if (name == "uidvalidity") _uidValidity = value;
+                else if (name == "highestuid") _highestUid = value;
+                else if (name == "highestmodseq") _highestModSeq = value;
+            }
+
+            return !empty();
+        }
+
+        /**
+         * Saves the checkpoint, replacing the old file atomically.
+         */
+        bool save() const
+        {
+            return utilities::atomicWriteFile(_path, [this](std::ofstream& out)
+            {
+                out << "uidvalidity " << _uidValidity << "\n";
+                out << "highestuid " << _highestUid << "\n";
+                out << "highestmodseq " << _highestModSeq << "\n";
+            });
+        }
+    };
+}
+
+#endif // _MAILBOX_CHECKPOINT_HPP_
@@ -0,0 +1,518 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: maildirGateway.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MAILDIR_GATEWAY_HPP_
+#define _MAILDIR_GATEWAY_HPP_
+
+#include "abstractGateway.hpp"
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <set>
+#include <boost/filesystem.hpp>
+#include <vmime/vmime.hpp>
+#include <vmime/utility/inputStreamByteBufferAdapter.hpp>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#include "utils.hpp"
+#include "mappedFile.hpp"
+#include "connectionPool.hpp"
+#include "outboundMailQueue.hpp"
+#include "attachmentCache.hpp"
+#include "mailServiceSupport.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * <p>A gateway that collects commands from mail delivered to a local directory, either a Maildir or a plain drop directory that the MTA writes
+     * whole messages into.</p>
+     * <p>New messages are noticed through inotify as soon as they are renamed into (or finish being written to) the directory, and the directory is also
+     * rescanned on the poll interval in case a notification was missed. Each message is parsed straight from a read-only mapping of its file. Once it has
+     * been dealt with it is renamed, atomically, into cur/ with the Maildir "seen" flag, plus the "trashed" flag if its command was claimed, so that it is
+     * never picked up again. A plain drop directory is given a cur subdirectory for this.</p>
+     * <p>Unlike new/ in a Maildir, a drop directory can hold a file the MTA is still writing. A rescan there only takes files that have not been written
+     * to for a while, and a file that is empty or cannot be parsed is left where it is and tried again once it has changed.</p>
+     * <p>Replies are still sent through the outgoing SMTP server.</p>
+     */
+    class maildirGateway final : public abstractGateway
+    {
+    private:
+        boost::filesystem::path _directory;
+        boost::filesystem::path _newDirectory;
+        boost::filesystem::path _curDirectory;
+        std::string _sendUsername;
+        std::string _sendPassword;
+        std::string _sendServer;
+        unsigned int _sendPort;
+        connectionEndpoint _sendEndpoint;
+        std::string _outboundAccount;
+        int _watchFd;
+        bool _dropDirectory;
+        std::set<std::string> _pending;
+        std::set<std::string> _stuck;
+        std::map<std::string, std::pair<std::time_t, std::uintmax_t>> _unreadable;
+        std::chrono::steady_clock::time_point _nextScan;
+        static constexpr std::chrono::milliseconds WATCH_CHECK_INTERVAL = std::chrono::milliseconds(250);
+        static constexpr std::chrono::seconds DROP_SETTLE_TIME = std::chrono::seconds(30);
+
+        enum class fileOutcome
+        {
+            /**
+             * The file is empty or could not be parsed; it is left where it is.
+             */
+            unreadable,
+            /**
+             * The message was dealt with but its command was not claimed.
+             */
+            handled,
+            /**
+             * The message's command was claimed by the callee.
+             */
+            claimed,
+        };
+
+        void configureTransport(const vmime::shared_ptr<vmime::net::service>& service) const
+        {
+            service->setProperty("connection.tls", true);
+            service->setProperty("connection.tls.required", true);
+            service->setProperty("options.need-authentication", true);
+            service->setProperty("auth.username", _sendUsername);
+            service->setProperty("auth.password", _sendPassword);
+            service->setProperty("options.chunking", false);
+            service->setCertificateVerifier(vmime::make_shared<customCertificateVerifier>());
+            service->setTracerFactory(vmime::make_shared<protocolTracerFactory>(_protocol_trace));
+        }
+
+        connectionPool::transportLease leaseTransport() const
+        {
+            return connectionPool::instance().leaseTransport(_sendEndpoint, [this](const vmime::shared_ptr<vmime::net::service>& service){ configureTransport(service); });
+        }
+
+        static bool ignoredName(const std::string& name)
+        {
+            // Dot files are partial deliveries or belong to something else.
+            return name.empty() || (name[0] == '.');
+        }
+
+        void openWatch()
+        {
+#if defined(__linux__)
+            _watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if ((_watchFd >= 0) && (inotify_add_watch(_watchFd, _newDirectory.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE) < 0))
+            {
+                ::close(_watchFd);
+                _watchFd = -1;
+            }
+#endif
+            if ((_watchFd < 0) && _warningReceived) _warningReceived(*this, _id + " cannot watch " + _newDirectory.string() + " for new mail, falling back to timed rescans", _user_data);
+        }
+
+        void closeWatch()
+        {
+#if defined(__linux__)
+            if (_watchFd >= 0) ::close(_watchFd);
+#endif
+            _watchFd = -1;
+        }
+
+        /**
+         * Reads the notifications that have arrived since the last call, without blocking, and queues the files they name.
+         * @return true if a full rescan is needed because notifications were lost.
+         */
+        bool drainWatch()
+        {
+            bool rescan = false;
+#if defined(__linux__)
+            alignas(struct inotify_event) char buffer[16384];
+            while (_watchFd >= 0)
+            {
+                ssize_t length = ::read(_watchFd, buffer, sizeof(buffer));
+                if (length <= 0) break;
+
+                for (char *p = buffer; p < buffer + length; )
+                {
+                    auto event = reinterpret_cast<const struct inotify_event *>(p);
+                    if (event->mask & IN_Q_OVERFLOW) rescan = true;
+                    if (event->mask & IN_IGNORED)
+                    {
+                        // The directory itself has gone.
+                        closeWatch();
+                        rescan = true;
+                        if (_errorReceived) _errorReceived(*this, _id + " stopped receiving notifications for " + _newDirectory.string(), _user_data);
+                        break;
+                    }
+                    if ((event->len > 0) && !ignoredName(event->name)) _pending.insert(event->name);
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+#endif
+            return rescan;
+        }
+
+        void queueDirectory()
+        {
+            // In a drop directory a file that was written to recently may still be being delivered; its close is announced through inotify, and
+            // otherwise a later rescan takes it.
+            std::time_t settled = std::time(nullptr) - DROP_SETTLE_TIME.count();
+            boost::system::error_code ec;
+            for (boost::filesystem::directory_iterator it(_newDirectory, ec), end; !ec && (it != end); it.increment(ec))
+            {
+                std::string name = it->path().filename().string();
+                if (ignoredName(name)) continue;
+                if (_dropDirectory)
+                {
+                    boost::system::error_code timeError;
+                    std::time_t written = boost::filesystem::last_write_time(it->path(), timeError);
+                    if (timeError || (written > settled)) continue;
+                }
+                _pending.insert(name);
+            }
+            if (ec && _errorReceived) _errorReceived(*this, _id + " encountered an error checking for new mail: " + ec.message(), _user_data);
+        }
+
+        /**
+         * Parses a delivered message from a mapping of its file and, if it is acceptable, passes it on as a command.
+         */
+        fileOutcome processFile(const boost::filesystem::path& path)
+        {
+            // The mapping has to outlive the message, which refers to it rather than copying the body.
+            utilities::mappedFile file(path);
+            if (file.size() == 0) return fileOutcome::unreadable;
+
+            auto stream = vmime::make_shared<vmime::utility::inputStreamByteBufferAdapter>(reinterpret_cast<const vmime::byte_t *>(file.data()), file.size());
+            auto message = vmime::make_shared<vmime::message>();
+            try
+            {
+                message->parse(stream, file.size());
+            }
+            catch (const std::exception& ex)
+            {
+                if (_errorReceived) _errorReceived(*this, _id + " could not parse " + path.filename().string() + ", it will be tried again once it changes: " + std::string(ex.what()), _user_data);
+                return fileOutcome::unreadable;
+            }
+
+            if (olderThanWindow(*message->getHeader())) return fileOutcome::handled;
+            std::string subject;
+            if (!screenMessage(*message->getHeader(), subject)) return fileOutcome::handled;
+
+            if (file.size() > _max_payload_size)
+            {
+                if (_warningReceived) _warningReceived(*this, _id + " ignored a message of " + std::to_string(file.size()) + " bytes from '" + _last_sender + "' because it exceeds the maximum payload size", _user_data);
+                return fileOutcome::handled;
+            }
+
+            std::string text = utilities::getMessageText(message);
+            std::vector<std::unique_ptr<utilities::temporaryFile>> files;
+            utilities::getAttachments(message, _mimes_acl, _mime_access, files);
+            for (const auto& attachment : files) utilities::attachmentCache::instance().admit(*attachment);
+
+            return dispatchCommand(subject, text, files) ? fileOutcome::claimed : fileOutcome::handled;
+        }
+
+        /**
+         * Renames a message that has been dealt with into cur/, the Maildir equivalent of marking it seen (and deleted if it was claimed).
+         */
+        void retire(const std::string& name, bool claimed)
+        {
+            std::string unique = name.substr(0, name.find(':'));
+            boost::system::error_code ec;
+            boost::filesystem::rename(_newDirectory / name, _curDirectory / (unique + (claimed ? ":2,ST" : ":2,S")), ec);
+            if (ec)
+            {
+                // Leave it where it is, but do not process it again.
+                _stuck.insert(name);
+                if (_errorReceived) _errorReceived(*this, _id + " could not move " + name + " out of " + _newDirectory.string() + ": " + ec.message(), _user_data);
+            }
+        }
+
+        /**
+         * Processes the queued files in name order, which for a Maildir is delivery order.
+         * @return true if any new mail was found.
+         */
+        bool processPending()
+        {
+            bool found = false;
+            while (_polling && !_pending.empty())
+            {
+                std::string name = *_pending.begin();
+                _pending.erase(_pending.begin());
+                if (_stuck.contains(name)) continue;
+
+                boost::system::error_code ec;
+                auto path = _newDirectory / name;
+                if (!boost::filesystem::is_regular_file(path, ec))
+                {
+                    _unreadable.erase(name);
+                    continue;
+                }
+
+                // A file that could not be read last time is only tried again once it has been written to.
+                std::pair<std::time_t, std::uintmax_t> written(boost::filesystem::last_write_time(path, ec), boost::filesystem::file_size(path, ec));
+                auto unreadable = _unreadable.find(name);
+                if ((unreadable != _unreadable.end()) && !ec && (unreadable->second == written)) continue;
+                _unreadable.erase(name);
+
+                fileOutcome outcome = fileOutcome::handled;
+                try
+                {
+                    outcome = processFile(path);
+                }
+                catch (const std::exception& ex)
+                {
+                    if (_errorReceived) _errorReceived(*this, _id + " could not process " + name + ": " + std::string(ex.what()), _user_data);
+                }
+                if (outcome == fileOutcome::unreadable)
+                {
+                    _unreadable[name] = written;
+                    continue;
+                }
+
+                found = true;
+                retire(name, outcome == fileOutcome::claimed);
+            }
+
+            return found;
+        }
+
+    protected:
+        void pollingStarted() override
+        {
+            _nextScan = std::chrono::steady_clock::time_point::min();
+        }
+
+    public:
+        maildirGateway() : abstractGateway()
+        {
+            _sendPort = 587;
+            _watchFd = -1;
+            _dropDirectory = false;
+        }
+
+        ~maildirGateway() override
+        {
+            closeWatch();
+        }
+
+        /**
+         * <p>Performs one unit of polling work.</p>
+         * <p>Files that have been announced through inotify are processed straight away and the call asks to be made again shortly. The whole directory
+         * is rescanned when the poll interval has elapsed; the interval shortens when new mail is found and lengthens after a rescan that found none.</p>
+         */
+        std::chrono::milliseconds poll() override
+        {
+            if (!_running || !_polling) return _poll_interval.maximum();
+
+            auto now = std::chrono::steady_clock::now();
+            bool scanDue = (now >= _nextScan);
+            if (drainWatch()) scanDue = true;
+            if (scanDue) queueDirectory();
+
+            bool found = processPending();
+            if (found) _poll_interval.activity();
+            else if (scanDue) _poll_interval.backoff();
+            if (scanDue) _nextScan = std::chrono::steady_clock::now() + _poll_interval.next();
+
+            auto next = _nextScan;
+            if (_watchFd >= 0) next = std::min(next, std::chrono::steady_clock::now() + WATCH_CHECK_INTERVAL);
+
+            return std::max(std::chrono::milliseconds(0), std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()));
+        }
+
+        bool start() override
+        {
+            if (_running) return true;
+
+            if (_directory.empty()) return false;
+            if (_sendUsername.empty()) return false;
+            if (_sendPassword.empty()) return false;
+            if (_sendServer.empty()) return false;
+            if (_sendPort == 0) return false;
+            if (_senders_acl.empty() && (_sender_access == utilities::accessControlAction::allow)) return false;
+            if (_mimes_acl.empty() && (_mime_access == utilities::accessControlAction::allow)) return false;
+            if (_admin_contact.empty()) return false;
+            if (_input_contact.empty()) return false;
+            if (_killswitch_password.empty()) return false;
+
+            _id = "Maildir session (" + _directory.string() + ":" + _input_contact + ")";
+
+            boost::system::error_code ec;
+            if (!boost::filesystem::is_directory(_directory, ec))
+            {
+                if (_errorReceived) _errorReceived(*this, _id + " failed to start: " + _directory.string() + " is not a directory", _user_data);
+                return false;
+            }
+            if (boost::filesystem::is_directory(_directory / "new", ec) && boost::filesystem::is_directory(_directory / "cur", ec))
+            {
+                _newDirectory = _directory / "new";
+                _curDirectory = _directory / "cur";
+                _dropDirectory = false;
+            }
+            else
+            {
+                _newDirectory = _directory;
+                _curDirectory = _directory / "cur";
+                _dropDirectory = true;
+                boost::filesystem::create_directories(_curDirectory, ec);
+                if (ec)
+                {
+                    if (_errorReceived) _errorReceived(*this, _id + " failed to start: " + ec.message(), _user_data);
+                    return false;
+                }
+            }
+
+            _pending.clear();
+            _stuck.clear();
+            _unreadable.clear();
+            openWatch();
+
+            if (_notificationReceived) _notificationReceived(*this, _id + " is running", _user_data);
+
+            _sendEndpoint = { "smtp", _sendServer, _sendPort, _sendUsername, _sendPassword };
+
+            try
+            {
+                leaseTransport();
+            }
+            catch (const std::exception& ex)
+            {
+                closeWatch();
+                if (_errorReceived) _errorReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") failed to start: " + std::string(ex.what()), _user_data);
+                return false;
+            }
+
+            if (_notificationReceived) _notificationReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") is running", _user_data);
+
+            _outboundAccount = outboundMailQueue::instance().registerAccount(_input_contact, _sendEndpoint,
+                [this](const vmime::shared_ptr<vmime::net::service>& service){ configureTransport(service); },
+                [this](const std::string& recipient, const std::string& error, bool willRetry)
+                {
+                    std::string s = "SMTP session (" + _sendServer + ":" + _input_contact + ") sending message to '" + recipient + "' failed: " + error;
+                    if (willRetry && _warningReceived) _warningReceived(*this, s + ", it will be retried", _user_data);
+                    else if (!willRetry) reportConnectionError(s + ", giving up");
+                });
+
+            _running = true;
+
+            return true;
+        }
+
+        void stop() override
+        {
+            if (!_running) return;
+            if (_polling) pause();
+            outboundMailQueue::instance().unregisterAccount(_outboundAccount);
+            closeWatch();
+            _running = false;
+
+            if (_notificationReceived) _notificationReceived(*this, _id + " has stopped running", _user_data);
+            if (_notificationReceived) _notificationReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") has stopped running", _user_data);
+        }
+
+        /**
+         * Queues a message for sending and returns at once; failures are reported through the warning and error callbacks.
+         */
+        void messageUser(const std::string& recipient, const std::string& subject, const std::string& message) const override
+        {
+            try
+            {
+                vmime::messageBuilder msgbld;
+                msgbld.setExpeditor(vmime::mailbox(_input_contact));
+                vmime::addressList toli;
+                toli.appendAddress(vmime::make_shared<vmime::mailbox>(recipient));
+                msgbld.setRecipients(toli);
+                msgbld.setSubject(vmime::text(subject));
+                msgbld.getTextPart()->setText(vmime::make_shared<vmime::stringContentHandler>(message));
+                vmime::shared_ptr<vmime::message> msg = msgbld.construct();
+                outboundMailQueue::instance().enqueue(_outboundAccount, vmime::mailbox(_input_contact), vmime::mailbox(recipient), msg);
+            }
+            catch (const std::exception& ex)
+            {
+                if (_errorReceived) _errorReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") sending message to '" + recipient + "' failed: " + std::string(ex.what()), _user_data);
+            }
+        }
+
+        void messageAdmin(const std::string& subject, const std::string& message) const override
+        {
+            messageUser(_admin_contact, subject, message);
+        }
+
+        void messageLastPoster(const std::string& subject, const std::string& message) const override
+        {
+            messageUser(_last_sender, subject, message);
+        }
+
+        [[nodiscard]] const boost::filesystem::path& directory() const
+        {
+            return _directory;
+        }
+
+        [[nodiscard]] std::string sendUsername() const
+        {
+            return _sendUsername;
+        }
+
+        [[nodiscard]] std::string sendPassword() const
+        {
+            return _sendPassword;
+        }
+
+        [[nodiscard]] std::string sendServer() const
+        {
+            return _sendServer;
+        }
+
+        [[nodiscard]] unsigned int sendPort() const
+        {
+            return _sendPort;
+        }
+
+        /**
+         * Sets the Maildir (the directory holding new, cur and tmp) or plain drop directory to collect mail from.
+         */
+        void setDirectory(const boost::filesystem::path& directory)
+        {
+            _directory = directory;
+        }
+
+        void setSendUsername (const std::string& value)
+        {
+            _sendUsername = value;
+        }
+
+        void setSendPassword (const std::string& value)
+        {
+            _sendPassword = value;
+        }
+
+        void setSendServer (const std::string& value)
+        {
+            _sendServer = value;
+        }
+
+        void setSendPort(unsigned int port)
+        {
+            _sendPort = port;
+        }
+    };
+}
+
+#endif // _MAILDIR_GATEWAY_HPP_
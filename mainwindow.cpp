@@ -70,6 +70,9 @@ void MainWindow::aboutToQuit()
         itm->stopScanners();
         QCoreApplication::processEvents();
     }
+    telemeteryServices::pollScheduler::instance().shutdown();
+    telemeteryServices::outboundMailQueue::instance().shutdown();
+    telemeteryServices::connectionPool::instance().clear();
     _haveQuit = true;
 }
 
@@ -104,6 +107,39 @@ void MainWindow::loadConfiguration()
 
     bopCount = bopElements.count();
 
+    auto poolNode = docElement.namedItem("connection-pool");
+    if (!poolNode.isNull() && poolNode.isElement())
+    {
+        bool ok = false;
+        auto maxPerHost = poolNode.toElement().attribute("max-connections-per-host").toUInt(&ok);
+        if (ok) telemeteryServices::connectionPool::instance().setMaxConnectionsPerHost(maxPerHost);
+    }
+
+    auto schedulerNode = docElement.namedItem("scheduler");
+    if (!schedulerNode.isNull() && schedulerNode.isElement())
+    {
+        bool ok = false;
+        auto workers = schedulerNode.toElement().attribute("worker-threads").toUInt(&ok);
+        if (ok) telemeteryServices::pollScheduler::instance().setWorkerCount(workers);
+    }
+
+    auto outboundNode = docElement.namedItem("outbound-queue");
+    if (!outboundNode.isNull() && outboundNode.isElement())
+    {
+        bool ok = false;
+        auto senders = outboundNode.toElement().attribute("sender-threads").toUInt(&ok);
+        if (ok) telemeteryServices::outboundMailQueue::instance().setSenderCount(senders);
+    }
+    auto cacheNode = docElement.namedItem("attachment-cache");
+    if (!cacheNode.isNull() && cacheNode.isElement())
+    {
+        bool ok = false;
+        auto maxSize = cacheNode.toElement().attribute("max-size-mb").toULongLong(&ok);
+        if (ok) utilities::attachmentCache::instance().setMaxSize(maxSize * 1024 * 1024);
+    }
+    utilities::attachmentCache::instance().setDirectory(QDir::cleanPath(dataDirectory + QDir::separator() + "cache").toStdString());
+    telemeteryServices::outboundMailQueue::instance().setSpoolDirectory(QDir::cleanPath(dataDirectory + QDir::separator() + "spool").toStdString());
+
     for (int idx1 = 0; idx1 < bopCount; idx1++)
     {
         auto cNode = bopElements.at(idx1).namedItem("company");
@@ -145,14 +181,20 @@ void MainWindow::loadConfiguration()
                 auto proto = pNode.toElement().text();
                 if ((proto.compare("pop3", Qt::CaseInsensitive) == 0) || (proto.compare("pop3s", Qt::CaseInsensitive) == 0))
                 {
-                    //auto ptr = std::make_unique<telemeteryServices::pop3EmailGateway>(); // TODO: Implement POP3.
-                    //depotPtr->parseAndAddMailGateway(sNode, ptr);
+                    auto ptr = std::make_unique<telemeteryServices::pop3EmailGateway>();
+                    ptr->setImplicitTls(proto.compare("pop3s", Qt::CaseInsensitive) == 0);
+                    depotPtr->parseAndAddMailGateway(sNode, ptr);
                 }
                 else if ((proto.compare("IMAP", Qt::CaseInsensitive) == 0) || (proto.compare("IMAPS", Qt::CaseInsensitive) == 0))
                 {
                     auto ptr = std::make_unique<telemeteryServices::imapEmailGateway>();
                     depotPtr->parseAndAddMailGateway(sNode, ptr);
                 }
+                else if (proto.compare("maildir", Qt::CaseInsensitive) == 0)
+                {
+                    auto ptr = std::make_unique<telemeteryServices::maildirGateway>();
+                    depotPtr->parseAndAddMailGateway(sNode, ptr);
+                }
                 else
                 {
                     QMessageBox::warning(this, this->windowTitle(), "Unknown or unsupported email protocol specified in configuration file.");
@@ -161,6 +203,12 @@ void MainWindow::loadConfiguration()
             }
         }
 
+        for (const auto& scn : depotPtr->scanners())
+        {
+            scn->setStateDirectory(QDir::cleanPath(dataDirectory + QDir::separator() + "state").toStdString());
+        }
+        depotPtr->setProtocolTracing(ui->actionProtocol_Tracing->isChecked());
+
         if (depotPtr->scanners().size() == 0)
         {
             depotPtr->setState(DepotServerState::InvalidConfiguration);
@@ -257,6 +305,7 @@ void MainWindow::updateUi()
     ui->actionClear->setEnabled(ui->serverStatus->canClear());
     ui->actionSelect_All->setEnabled(ui->serverStatus->canSelectAll());
     ui->actionSave_Log->setEnabled(ui->serverStatus->canSave());
+    ui->actionDump_Protocol_Trace->setEnabled(currentDepot != nullptr);
 
     if (currentDepot)
     {
@@ -305,12 +354,12 @@ void MainWindow::updateUi()
         case DepotServerState::NetworkIssue:
             currentDepot->setIcon(QIcon("://images/Red_Light.svg"));
             currentDepot->setToolTip("Network issues");
-            //ui->startPollingButton->setEnabled(false);
-            //ui->actionStart_Polling->setEnabled(false);
-            //ui->stopPollingButton->setEnabled(false);
-            //ui->actionStop_Polling->setEnabled(false);
-            //ui->actionStart_Server->setEnabled(false);
-            //ui->actionStop_Server->setEnabled(true);
+            ui->startPollingButton->setEnabled(false);
+            ui->actionStart_Polling->setEnabled(false);
+            ui->stopPollingButton->setEnabled(true);
+            ui->actionStop_Polling->setEnabled(true);
+            ui->actionStart_Server->setEnabled(false);
+            ui->actionStop_Server->setEnabled(true);
             break;
         }
     }
@@ -525,4 +574,16 @@ void MainWindow::on_actionSave_Log_triggered()
     saveLogFileDialog->show();
 }
 
+void MainWindow::on_actionProtocol_Tracing_toggled(bool checked)
+{
+    ui->depotList->setProtocolTracing(checked);
+}
+
+void MainWindow::on_actionDump_Protocol_Trace_triggered()
+{
+    auto currentDepot = dynamic_cast<bookingOnPoint *>(ui->depotList->currentItem());
+    if (currentDepot) currentDepot->dumpProtocolTrace();
+    updateUi();
+}
+
 
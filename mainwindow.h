@@ -52,6 +52,8 @@ private slots:
     void on_actionStop_All_Polling_triggered();
     void on_actionHalt_All_Servers_triggered();
     void on_actionSave_Log_triggered();
+    void on_actionProtocol_Tracing_toggled(bool checked);
+    void on_actionDump_Protocol_Trace_triggered();
     void serverListMenuRequested(QPoint pos);
     void serverStatusMenuRequested(QPoint pos);
 
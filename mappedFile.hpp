@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: mappedFile.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MAPPED_FILE_HPP_
+#define _MAPPED_FILE_HPP_
+
+#include <cerrno>
+#include <cstddef>
+#include <system_error>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <boost/filesystem.hpp>
+
+namespace utilities
+{
+    /**
+     * <p>A read-only memory mapping of a whole file, unmapped when the object is destroyed.</p>
+     * <p>The pages are read in by the kernel as they are touched, so a parser working over the mapping reads the file without it ever being copied into
+     * a buffer of our own. The file must not be truncated while it is mapped.</p>
+     */
+    class mappedFile
+    {
+    private:
+        void *_data;
+        std::size_t _size;
+
+    public:
+        explicit mappedFile(const boost::filesystem::path& path)
+        {
+            _data = nullptr;
+            _size = 0;
+
+#ifdef _WIN32
+            HANDLE file = ::CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE) throw std::system_error(static_cast<int>(::GetLastError()), std::system_category(), "Could not open " + path.string());
+
+            LARGE_INTEGER size{};
+            if (!::GetFileSizeEx(file, &size))
+            {
+                DWORD error = ::GetLastError();
+                ::CloseHandle(file);
+                throw std::system_error(static_cast<int>(error), std::system_category(), "Could not read the size of " + path.string());
+            }
+
+            // An empty file cannot be mapped, it is simply left with no data.
+            _size = static_cast<std::size_t>(size.QuadPart);
+            if (_size > 0)
+            {
+                HANDLE mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                void *data = mapping ? ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+                DWORD error = ::GetLastError();
+                if (mapping) ::CloseHandle(mapping);
+                if (!data)
+                {
+                    ::CloseHandle(file);
+                    throw std::system_error(static_cast<int>(error), std::system_category(), "Could not map " + path.string());
+                }
+                _data = data;
+            }
+
+            // The view keeps its own reference to the file.
+            ::CloseHandle(file);
+#else
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) throw std::system_error(errno, std::generic_category(), "Could not open " + path.string());
+
+            struct stat st{};
+            if (::fstat(fd, &st) != 0)
+            {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "Could not read the size of " + path.string());
+            }
+
+            // An empty file cannot be mapped, it is simply left with no data.
+            _size = static_cast<std::size_t>(st.st_size);
+            if (_size > 0)
+            {
+                void *data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED)
+                {
+                    int error = errno;
+                    ::close(fd);
+                    throw std::system_error(error, std::generic_category(), "Could not map " + path.string());
+                }
+                _data = data;
+                ::madvise(_data, _size, MADV_SEQUENTIAL);
+            }
+
+            // The mapping keeps its own reference to the file.
+            ::close(fd);
+#endif
+        }
+
+        mappedFile(const mappedFile& other) = delete;
+        mappedFile& operator=(const mappedFile& other) = delete;
+
+        ~mappedFile()
+        {
+#ifdef _WIN32
+            if (_data) ::UnmapViewOfFile(_data);
+#else
+            if (_data) ::munmap(_data, _size);
+#endif
+        }
+
+        [[nodiscard]] const char *data() const
+        {
+            return static_cast<const char *>(_data);
+        }
+
+        [[nodiscard]] std::size_t size() const
+        {
+            return _size;
+        }
+    };
+}
+
+#endif // _MAPPED_FILE_HPP_
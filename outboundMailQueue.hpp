@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: outboundMailQueue.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OUTBOUND_MAIL_QUEUE_HPP_
+#define _OUTBOUND_MAIL_QUEUE_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <vmime/vmime.hpp>
+#include "connectionPool.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * A message waiting to be sent, together with everything needed to retry it after a restart.
+     */
+    struct outboundMail
+    {
+        std::string id;
+        std::string account;
+        std::string from;
+        std::string to;
+        std::string data;
+        unsigned int attempts = 0;
+        std::chrono::system_clock::time_point notBefore;
+    };
+
+    /**
+     * <p>Sends outgoing mail on its own threads so that a slow or failing SMTP server never holds up the gateways.</p>
+     * <p>Gateways register the account they send from and then hand messages to the queue, which returns at once. Each sender thread takes a batch of
+     * messages for one account and sends them over a single pooled, kept-alive transport. Every message is written to the spool directory before it
+     * is queued and only removed once the server has accepted it; a message that fails is retried with an increasing delay, and is set aside in the
+     * spool as a ".failed" file once it has run out of attempts. Spooled messages are picked up again when the application restarts and the account
+     * they belong to is registered.</p>
+     */
+    class outboundMailQueue
+    {
+    public:
+        /**
+         * Called when a message could not be sent.
+         * @param recipient The address the message was for.
+         * @param error A description of the failure.
+         * @param willRetry false if the message has run out of attempts and has been given up on.
+         */
+        typedef std::function<void(const std::string& recipient, const std::string& error, bool willRetry)> deliveryFailedCallback;
+
+    private:
+        struct account
+        {
+            connectionEndpoint endpoint;
+            connectionPool::serviceConfigurator configure;
+            deliveryFailedCallback failed;
+            unsigned int busy = 0;
+            bool removing = false;
+        };
+
+        static constexpr unsigned int MAX_ATTEMPTS = 10;
+        static constexpr std::size_t BATCH_SIZE = 20;
+        static constexpr std::chrono::seconds FIRST_RETRY_DELAY = std::chrono::seconds(30);
+        static constexpr std::chrono::seconds MAX_RETRY_DELAY = std::chrono::hours(1);
+
+        std::mutex _mutex;
+        std::condition_variable _queueChanged;
+        std::condition_variable _accountIdle;
+        std::map<std::string, account> _accounts;
+        std::list<outboundMail> _pending;
+        std::vector<std::thread> _senders;
+        boost::filesystem::path _spoolDirectory;
+        std::uint64_t _sequence;
+        unsigned int _senderCount;
+        bool _running;
+
+        outboundMailQueue()
+        {
+            _sequence = 0;
+            _senderCount = 2;
+            _running = false;
+        }
+
+        static std::int64_t toSeconds(std::chrono::system_clock::time_point time)
+        {
+            return std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count();
+        }
+
+        static std::chrono::system_clock::duration retryDelay(unsigned int attempts)
+        {
+            auto delay = FIRST_RETRY_DELAY * (std::int64_t(1) << std::min(attempts - 1, 16u));
+            return std::min<std::chrono::seconds>(delay, MAX_RETRY_DELAY);
+        }
+
+        [[nodiscard]] boost::filesystem::path spoolPath(const outboundMail& mail) const
+        {
+            return _spoolDirectory / (mail.id + ".mail");
+        }
+
+        /**
+         * Writes a message to the spool, to one side first and then renamed into place, so that a crash never leaves a torn file behind.
+         */
+        bool writeSpool(const outboundMail& mail) const
+        {
+            if (_spoolDirectory.empty()) return true;
+
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(_spoolDirectory, ec);
+            boost::filesystem::path path = spoolPath(mail);
+            boost::filesystem::path temp = path;
+            temp += ".tmp";
+
+            {
+                std::ofstream out(temp.string(), std::ios::binary | std::ios::trunc);
+                if (!out) return false;
+                out << "account " << mail.account << "\n";
+                out << "from " << mail.from << "\n";
+                out << "to " << mail.to << "\n";
+                out << "attempts " << mail.attempts << "\n";
+                out << "not-before " << toSeconds(mail.notBefore) << "\n\n";
+                out << mail.data;
+                if (!out.flush()) return false;
+            }
+
+            boost::filesystem::rename(temp, path, ec);
+
+            return !ec;
+        }
+
+        static bool readSpool(const boost::filesystem::path& path, outboundMail& mail)
+        {
+            std::ifstream in(path.string(), std::ios::binary);
+            if (!in) return false;
+
+            mail.id = path.stem().string();
+            std::string line;
+            while (std::getline(in, line) && !line.empty())
+            {
+                auto space = line.find(' ');
+                if (space == std::string::npos) continue;
+                std::string name = line.substr(0, space);
+                std::string value = line.substr(space + 1);
+                if (name == "account") mail.account = value;
+                else if (name == "from") mail.from = value;
+                else if (name == "to") mail.to = value;
+                else if (name == "attempts") mail.attempts = static_cast<unsigned int>(std::stoul(value));
+                else if (name == "not-before") mail.notBefore = std::chrono::system_clock::time_point(std::chrono::seconds(std::stoll(value)));
+            }
+            mail.data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+            return !mail.account.empty() && !mail.to.empty() && !mail.data.empty();
+        }
+
+        void removeSpool(const outboundMail& mail) const
+        {
+            if (_spoolDirectory.empty()) return;
+            boost::system::error_code ec;
+            boost::filesystem::remove(spoolPath(mail), ec);
+        }
+
+        void setAsideSpool(const outboundMail& mail) const
+        {
+            if (_spoolDirectory.empty()) return;
+            boost::system::error_code ec;
+            boost::filesystem::path failed = spoolPath(mail);
+            failed.replace_extension(".failed");
+            boost::filesystem::rename(spoolPath(mail), failed, ec);
+        }
+
+        /**
+         * Takes the next batch of messages that are due, all for the same registered account; the caller must hold the mutex.
+         * @param earliest Receives the time at which the next message that is not yet due will be, if the batch is empty.
+         */
+        std::vector<outboundMail> takeBatch(std::string& accountKey, std::chrono::system_clock::time_point& earliest)
+        {
+            std::vector<outboundMail> batch;
+            auto now = std::chrono::system_clock::now();
+            earliest = std::chrono::system_clock::time_point::max();
+            accountKey.clear();
+
+            for (auto it = _pending.begin(); (it != _pending.end()) && (batch.size() < BATCH_SIZE);)
+            {
+                auto acc = _accounts.find(it->account);
+                if ((acc == _accounts.end()) || acc->second.removing)
+                {
+                    ++it;
+                    continue;
+                }
+                if (it->notBefore > now)
+                {
+                    earliest = std::min(earliest, it->notBefore);
+                    ++it;
+                    continue;
+                }
+                if (accountKey.empty()) accountKey = it->account;
+                if (it->account != accountKey)
+                {
+                    ++it;
+                    continue;
+                }
+                batch.push_back(std::move(*it));
+                it = _pending.erase(it);
+            }
+
+            return batch;
+        }
+
+        /**
+         * Sends a batch of messages over one transport; messages that could not be sent are returned in the retry list.
+         */
+        void deliver(std::vector<outboundMail>& batch, const account& acc, std::vector<outboundMail>& retries)
+        {
+            std::size_t sent = 0;
+            std::string error;
+
+            try
+            {
+                auto transport = connectionPool::instance().leaseTransport(acc.endpoint, acc.configure);
+                for (; sent < batch.size(); sent++)
+                {
+                    auto& mail = batch[sent];
+                    try
+                    {
+                        vmime::mailboxList recipients;
+                        recipients.appendMailbox(vmime::make_shared<vmime::mailbox>(mail.to));
+                        vmime::utility::inputStreamStringAdapter is(mail.data);
+                        transport->send(vmime::mailbox(mail.from), recipients, is, mail.data.length());
+                        removeSpool(mail);
+                    }
+                    catch (const std::exception& ex)
+                    {
+                        // A rejected message is retried on its own; if the connection has gone the rest of the batch goes back in the queue with it.
+                        if (!transport->isConnected())
+                        {
+                            transport.discard();
+                            error = ex.what();
+                            break;
+                        }
+                        failed(mail, ex.what(), acc, retries);
+                    }
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                error = ex.what();
+            }
+
+            for (; sent < batch.size(); sent++) failed(batch[sent], error, acc, retries);
+        }
+
+        void failed(outboundMail& mail, const std::string& error, const account& acc, std::vector<outboundMail>& retries)
+        {
+            std::string recipient = mail.to;
+            mail.attempts++;
+            bool retry = (mail.attempts < MAX_ATTEMPTS);
+            if (retry)
+            {
+                mail.notBefore = std::chrono::system_clock::now() + retryDelay(mail.attempts);
+                writeSpool(mail);
+                retries.push_back(std::move(mail));
+            }
+            else
+            {
+                setAsideSpool(mail);
+            }
+            if (acc.failed) acc.failed(recipient, error, retry);
+        }
+
+        void senderLoop()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_running)
+            {
+                std::string accountKey;
+                std::chrono::system_clock::time_point earliest;
+                std::vector<outboundMail> batch = takeBatch(accountKey, earliest);
+                if (batch.empty())
+                {
+                    if (earliest == std::chrono::system_clock::time_point::max()) _queueChanged.wait(lock);
+                    else _queueChanged.wait_until(lock, earliest);
+                    continue;
+                }
+
+                // While the account is busy it cannot be unregistered, so its configurator and callback stay valid outside the lock.
+                account& acc = _accounts[accountKey];
+                acc.busy++;
+                lock.unlock();
+                std::vector<outboundMail> retries;
+                deliver(batch, acc, retries);
+                lock.lock();
+                acc.busy--;
+                _accountIdle.notify_all();
+
+                for (auto& r : retries) _pending.push_back(std::move(r));
+                if (!retries.empty()) _queueChanged.notify_all();
+            }
+        }
+
+        void startThreads()
+        {
+            if (_running) return;
+            _running = true;
+            for (unsigned int i = 0; i < _senderCount; i++) _senders.emplace_back([this]{ senderLoop(); });
+        }
+
+    public:
+        outboundMailQueue(const outboundMailQueue& other) = delete;
+        outboundMailQueue& operator=(const outboundMailQueue& other) = delete;
+
+        ~outboundMailQueue()
+        {
+            shutdown();
+        }
+
+        static outboundMailQueue& instance()
+        {
+            static outboundMailQueue queue;
+            return queue;
+        }
+
+        /**
+         * Sets the number of sender threads; it only takes effect the next time the queue starts.
+         */
+        void setSenderCount(unsigned int count)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _senderCount = std::max(1u, count);
+        }
+
+        /**
+         * Sets the directory messages are spooled to and queues any messages that were left in it by a previous run.
+         */
+        void setSpoolDirectory(const boost::filesystem::path& directory)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _spoolDirectory = directory;
+
+            boost::system::error_code ec;
+            if (!boost::filesystem::is_directory(directory, ec)) return;
+            for (boost::filesystem::directory_iterator it(directory, ec), end; !ec && (it != end); it.increment(ec))
+            {
+                const auto& path = it->path();
+                if (path.extension() == ".tmp")
+                {
+                    boost::system::error_code rec;
+                    boost::filesystem::remove(path, rec);
+                    continue;
+                }
+                if (path.extension() != ".mail") continue;
+
+                outboundMail mail;
+                try
+                {
+                    if (readSpool(path, mail)) _pending.push_back(std::move(mail));
+                }
+                catch (const std::exception&)
+                {
+                    // A spool file that cannot be parsed is left where it is for someone to look at.
+                }
+            }
+            _queueChanged.notify_all();
+        }
+
+        /**
+         * Registers, or updates, an account that mail can be sent from.
+         * @param owner Distinguishes gateways that send through the same SMTP account, typically the address they send as.
+         * @param endpoint The SMTP endpoint of the account.
+         * @param configure Configures new transports for the account; it is called on a sender thread.
+         * @param failed Called on a sender thread whenever a message from the account could not be sent.
+         * @return The key with which messages are queued for the account.
+         */
+        std::string registerAccount(const std::string& owner, const connectionEndpoint& endpoint, const connectionPool::serviceConfigurator& configure, const deliveryFailedCallback& failed)
+        {
+            std::string key = owner + " " + endpoint.username + "@" + endpoint.hostKey();
+            std::unique_lock<std::mutex> lock(_mutex);
+            account& acc = _accounts[key];
+            _accountIdle.wait(lock, [&acc]{ return acc.busy == 0; });
+            acc.endpoint = endpoint;
+            acc.configure = configure;
+            acc.failed = failed;
+            acc.removing = false;
+            startThreads();
+            _queueChanged.notify_all();
+
+            return key;
+        }
+
+        /**
+         * Unregisters an account, waiting for any batch that is being sent from it to finish. Its queued messages are kept until it is registered again.
+         */
+        void unregisterAccount(const std::string& key)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _accounts.find(key);
+            if (it == _accounts.end()) return;
+            it->second.removing = true;
+            _accountIdle.wait(lock, [&it]{ return it->second.busy == 0; });
+            _accounts.erase(it);
+        }
+
+        /**
+         * Spools a message and queues it for sending, returning at once.
+         * @param accountKey The key returned when the sending account was registered.
+         */
+        void enqueue(const std::string& accountKey, const vmime::mailbox& from, const vmime::mailbox& to, const vmime::shared_ptr<vmime::message>& message)
+        {
+            outboundMail mail;
+            mail.account = accountKey;
+            mail.from = from.getEmail().toString();
+            mail.to = to.getEmail().toString();
+            vmime::utility::outputStreamStringAdapter out(mail.data);
+            message->generate(out);
+            out.flush();
+            mail.notBefore = std::chrono::system_clock::now();
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            mail.id = std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(mail.notBefore.time_since_epoch()).count()) + "-" + std::to_string(++_sequence);
+            writeSpool(mail);
+            _pending.push_back(std::move(mail));
+            startThreads();
+            _queueChanged.notify_one();
+        }
+
+        [[nodiscard]] std::size_t pendingCount()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _pending.size();
+        }
+
+        /**
+         * Stops the sender threads once they have finished the batches they are sending. Messages still queued stay in the spool for the next run.
+         */
+        void shutdown()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_running) return;
+                _running = false;
+            }
+            _queueChanged.notify_all();
+            for (auto& s : _senders)
+            {
+                if (s.joinable()) s.join();
+            }
+            _senders.clear();
+        }
+    };
+}
+
+#endif // _OUTBOUND_MAIL_QUEUE_HPP_
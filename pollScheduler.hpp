@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: pollScheduler.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POLL_SCHEDULER_HPP_
+#define _POLL_SCHEDULER_HPP_
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace telemeteryServices
+{
+    /**
+     * <p>Runs the poll cycles of every gateway from a small, fixed pool of worker threads.</p>
+     * <p>A task is a function that performs one unit of work and returns how long it wants to wait before it is run again. Pending tasks are kept in a
+     * hierarchical timer wheel (four levels of 64 slots with a 100ms tick, enough for delays of several weeks) so that adding, firing and cancelling
+     * a task costs the same however many are registered. A task is never run on two workers at once.</p>
+     */
+    class pollScheduler
+    {
+    public:
+        typedef std::function<std::chrono::milliseconds()> task;
+        typedef std::uint64_t taskId;
+
+        static constexpr std::chrono::milliseconds TICK = std::chrono::milliseconds(100);
+
+    private:
+        static constexpr unsigned int LEVELS = 4;
+        static constexpr unsigned int SLOT_BITS = 6;
+        static constexpr unsigned int SLOTS = 1u << SLOT_BITS;
+        static constexpr std::uint64_t SLOT_MASK = SLOTS - 1;
+
+        struct entry
+        {
+            taskId id;
+            task function;
+            std::uint64_t due;
+            bool cancelled;
+            bool running;
+            bool queued;
+        };
+
+        typedef std::shared_ptr<entry> entryPtr;
+
+        std::mutex _mutex;
+        std::condition_variable _readyChanged;
+        std::condition_variable _taskFinished;
+        std::condition_variable _timerWake;
+        std::array<std::array<std::vector<entryPtr>, SLOTS>, LEVELS> _wheel;
+        std::deque<entryPtr> _ready;
+        std::map<taskId, entryPtr> _tasks;
+        std::vector<std::thread> _workers;
+        std::thread _timer;
+        std::chrono::steady_clock::time_point _epoch;
+        std::uint64_t _tick;
+        taskId _nextId;
+        unsigned int _workerCount;
+        bool _running;
+
+        pollScheduler()
+        {
+            _tick = 0;
+            _nextId = 0;
+            _running = false;
+            _workerCount = std::clamp(std::thread::hardware_concurrency(), 2u, 8u);
+        }
+
+        static std::uint64_t ticksFor(std::chrono::milliseconds delay)
+        {
+            if (delay.count() <= 0) return 0;
+            return static_cast<std::uint64_t>((delay.count() + TICK.count() - 1) / TICK.count());
+        }
+
+        /**
+         * Hands a task to the workers unless it is already waiting for or being run by one; the caller must hold the mutex.
+         */
+        void enqueue(const entryPtr& e)
+        {
+            if (e->cancelled || e->queued || e->running) return;
+            e->queued = true;
+            _ready.push_back(e);
+            _readyChanged.notify_one();
+        }
+
+        /**
+         * Files a task in the wheel according to how far away it is due; the caller must hold the mutex.
+         */
+        void insert(const entryPtr& e)
+        {
+            if (e->due <= _tick)
+            {
+                enqueue(e);
+                return;
+            }
+
+            std::uint64_t delta = e->due - _tick;
+            for (unsigned int level = 0; level < LEVELS; level++)
+            {
+                if ((delta < (std::uint64_t(1) << (SLOT_BITS * (level + 1)))) || (level == LEVELS - 1))
+                {
+                    // Anything beyond the range of the top level waits in its last slot and is re-filed when that slot cascades.
+                    std::uint64_t due = std::min(e->due, _tick + (std::uint64_t(1) << (SLOT_BITS * LEVELS)) - 1);
+                    _wheel[level][(due >> (SLOT_BITS * level)) & SLOT_MASK].push_back(e);
+                    return;
+                }
+            }
+        }
+
+        /**
+         * Re-files the tasks in one slot of a higher level into the levels below it; the caller must hold the mutex.
+         */
+        void cascade(unsigned int level)
+        {
+            auto& slot = _wheel[level][(_tick >> (SLOT_BITS * level)) & SLOT_MASK];
+            std::vector<entryPtr> tasks;
+            tasks.swap(slot);
+            for (const auto& e : tasks)
+            {
+                if (!e->cancelled) insert(e);
+            }
+        }
+
+        /**
+         * Advances the wheel by one tick and moves the tasks that have fallen due to the ready queue; the caller must hold the mutex.
+         */
+        void advance()
+        {
+            _tick++;
+
+            unsigned int top = 0;
+            while ((top + 1 < LEVELS) && ((_tick & ((std::uint64_t(1) << (SLOT_BITS * (top + 1))) - 1)) == 0)) top++;
+            for (unsigned int level = top; level >= 1; level--) cascade(level);
+
+            auto& slot = _wheel[0][_tick & SLOT_MASK];
+            std::vector<entryPtr> due;
+            due.swap(slot);
+            for (const auto& e : due)
+            {
+                // A task that was woken early leaves a stale copy behind in the slot it was originally due in.
+                if (e->due > _tick) continue;
+                enqueue(e);
+            }
+        }
+
+        void timerLoop()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_running)
+            {
+                auto next = _epoch + (TICK * static_cast<std::int64_t>(_tick + 1));
+                _timerWake.wait_until(lock, next, [this]{ return !_running; });
+                if (!_running) break;
+                // Catch up if the timer thread was held up, so that no slot is skipped.
+                while (_running && (std::chrono::steady_clock::now() >= (_epoch + (TICK * static_cast<std::int64_t>(_tick + 1))))) advance();
+            }
+        }
+
+        void workerLoop()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true)
+            {
+                _readyChanged.wait(lock, [this]{ return !_running || !_ready.empty(); });
+                if (!_running) break;
+
+                entryPtr e = _ready.front();
+                _ready.pop_front();
+                e->queued = false;
+                if (e->cancelled) continue;
+
+                e->running = true;
+                lock.unlock();
+                std::chrono::milliseconds delay;
+                try
+                {
+                    delay = e->function();
+                }
+                catch (...)
+                {
+                    // Gateways report their own errors, all that matters here is that the task keeps being scheduled.
+                    delay = std::chrono::seconds(1);
+                }
+                lock.lock();
+                e->running = false;
+
+                if (e->cancelled)
+                {
+                    _taskFinished.notify_all();
+                    continue;
+                }
+
+                e->due = _tick + std::max<std::uint64_t>(1, ticksFor(delay));
+                insert(e);
+            }
+        }
+
+        void startThreads()
+        {
+            if (_running) return;
+            _running = true;
+            _epoch = std::chrono::steady_clock::now();
+            _tick = 0;
+            _timer = std::thread([this]{ timerLoop(); });
+            for (unsigned int i = 0; i < _workerCount; i++) _workers.emplace_back([this]{ workerLoop(); });
+        }
+
+    public:
+        pollScheduler(const pollScheduler& other) = delete;
+        pollScheduler& operator=(const pollScheduler& other) = delete;
+
+        ~pollScheduler()
+        {
+            shutdown();
+        }
+
+        static pollScheduler& instance()
+        {
+            static pollScheduler scheduler;
+            return scheduler;
+        }
+
+        /**
+         * Sets the number of worker threads; it only takes effect the next time the scheduler starts.
+         */
+        void setWorkerCount(unsigned int count)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _workerCount = std::max(1u, count);
+        }
+
+        [[nodiscard]] unsigned int workerCount()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _workerCount;
+        }
+
+        /**
+         * Registers a task, starting the scheduler if this is the first.
+         * @param function The unit of work, which returns the delay before it should be run again.
+         * @param firstDelay How long to wait before running the task for the first time.
+         * @return An identifier with which the task can be removed.
+         */
+        taskId add(const task& function, std::chrono::milliseconds firstDelay = std::chrono::milliseconds(0))
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            startThreads();
+            auto e = std::make_shared<entry>(entry{ ++_nextId, function, _tick + ticksFor(firstDelay), false, false, false });
+            _tasks.emplace(e->id, e);
+            insert(e);
+
+            return e->id;
+        }
+
+        /**
+         * Unregisters a task. If the task is running, this waits until it has returned, so once this returns the task will never run again.
+         */
+        void remove(taskId id)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _tasks.find(id);
+            if (it == _tasks.end()) return;
+            entryPtr e = it->second;
+            _tasks.erase(it);
+            e->cancelled = true;
+            _taskFinished.wait(lock, [&e]{ return !e->running; });
+        }
+
+        /**
+         * Brings a task forward so that it runs as soon as a worker is free.
+         */
+        void wake(taskId id)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _tasks.find(id);
+            if (it == _tasks.end()) return;
+            it->second->due = _tick;
+            enqueue(it->second);
+        }
+
+        [[nodiscard]] std::size_t taskCount()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _tasks.size();
+        }
+
+        /**
+         * Stops the timer and the workers; tasks that are running are allowed to finish, tasks that are still registered are dropped.
+         */
+        void shutdown()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_running) return;
+                _running = false;
+                for (auto& [id, e] : _tasks) e->cancelled = true;
+                _tasks.clear();
+                _ready.clear();
+                for (auto& level : _wheel)
+                {
+                    for (auto& slot : level) slot.clear();
+                }
+            }
+            _timerWake.notify_all();
+            _readyChanged.notify_all();
+            if (_timer.joinable()) _timer.join();
+            for (auto& w : _workers)
+            {
+                if (w.joinable()) w.join();
+            }
+            _workers.clear();
+        }
+    };
+}
+
+#endif // _POLL_SCHEDULER_HPP_
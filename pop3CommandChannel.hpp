@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: pop3CommandChannel.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POP3_COMMAND_CHANNEL_HPP_
+#define _POP3_COMMAND_CHANNEL_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <vmime/vmime.hpp>
+#include <vmime/net/pop3/POP3Store.hpp>
+#include <vmime/net/pop3/POP3Connection.hpp>
+#include "abstractGateway.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * <p>Issues POP3 commands directly on the socket of a connected, authenticated vmime POP3 store.</p>
+     * <p>vmime sends one command and waits for its response before sending the next, so every message costs at least one round trip. When the server
+     * advertises PIPELINING (RFC 2449) this channel keeps a window of commands in flight instead, which on a high latency link is the difference between
+     * a cycle taking seconds and taking minutes.</p>
+     */
+    class pop3CommandChannel
+    {
+    public:
+        /**
+         * Called with the response to each command in a pipeline, in the order the commands were given.
+         * @param index The position of the command in the pipeline.
+         * @param ok true if the server replied +OK.
+         * @param status The status line of the response.
+         * @param body The body of a multi-line response, dot-unstuffed, with CRLF line endings; empty for a single line response or an error.
+         */
+        typedef std::function<void(std::size_t index, bool ok, const std::string& status, std::string& body)> responseHandler;
+
+    private:
+        static constexpr std::size_t PIPELINE_WINDOW = 16;
+        static constexpr std::chrono::milliseconds RESPONSE_TIMEOUT = std::chrono::seconds(60);
+
+        vmime::shared_ptr<vmime::net::socket> _socket;
+        // The tracer of the vmime connection the channel is attached to, so its commands appear in the same trace.
+        vmime::shared_ptr<vmime::net::tracer> _tracer;
+        std::string _buffer;
+        // Where the unread part of _buffer starts; the lines before it are only dropped when more data is received.
+        std::size_t _read = 0;
+        std::set<std::string> _capabilities;
+
+        std::string readLine()
+        {
+            auto deadline = std::chrono::steady_clock::now() + RESPONSE_TIMEOUT;
+            while (true)
+            {
+                auto pos = _buffer.find("\r\n", _read);
+                if (pos != std::string::npos)
+                {
+                    std::string line = _buffer.substr(_read, pos - _read);
+                    _read = pos + 2;
+                    return line;
+                }
+
+                auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                if (remaining.count() <= 0) throw vmime::exceptions::operation_timed_out();
+                if (!_socket->waitForRead(static_cast<int>(remaining.count())))
+                {
+                    if (!_socket->isConnected()) throw vmime::exceptions::socket_exception("POP3 connection closed by the server");
+                    continue;
+                }
+
+                std::string chunk;
+                _socket->receive(chunk);
+                if (chunk.empty() && !_socket->isConnected()) throw vmime::exceptions::socket_exception("POP3 connection closed by the server");
+                _buffer.erase(0, _read);
+                _read = 0;
+                _buffer += chunk;
+            }
+        }
+
+        /**
+         * Reads the body of a multi-line response up to its terminating ".", removing the byte-stuffing.
+         */
+        std::string readMultiline()
+        {
+            std::string body;
+            while (true)
+            {
+                std::string line = readLine();
+                if (line == ".") break;
+                if (line.starts_with("..")) line.erase(0, 1);
+                body += line;
+                body += "\r\n";
+            }
+
+            return body;
+        }
+
+        /**
+         * Sends a single command and reads its response, throwing if the server rejects it.
+         */
+        std::string simpleCommand(const std::string& command, bool multiline)
+        {
+            std::string body;
+            std::string error;
+            pipeline({ command }, multiline, [&](std::size_t, bool ok, const std::string& status, std::string& b)
+            {
+                if (!ok) error = status;
+                body.swap(b);
+            });
+            if (!error.empty()) throw vmime::exceptions::command_error(command, error);
+
+            return body;
+        }
+
+    public:
+        /**
+         * Takes over the socket of a connected POP3 store; the store must not be used for anything else until the channel is detached.
+         */
+        void attach(const vmime::shared_ptr<vmime::net::store>& store)
+        {
+            auto pop3Store = vmime::dynamicCast<vmime::net::pop3::POP3Store>(store);
+            if (!pop3Store || !pop3Store->isConnected()) throw illegal_object_state("The POP3 command channel requires a connected POP3 store.");
+            _socket = pop3Store->getConnection()->getSocket();
+            _tracer = pop3Store->getConnection()->getTracer();
+            _buffer.clear();
+            _read = 0;
+            _capabilities.clear();
+            readCapabilities();
+        }
+
+        void detach()
+        {
+            _socket.reset();
+            _tracer.reset();
+            _buffer.clear();
+            _read = 0;
+        }
+
+        [[nodiscard]] bool hasCapability(const std::string& capability) const
+        {
+            return _capabilities.contains(boost::to_upper_copy(capability));
+        }
+
+        [[nodiscard]] bool pipelining() const
+        {
+            return hasCapability("PIPELINING");
+        }
+
+        /**
+         * Asks the server for its capabilities (RFC 2449); a server that does not understand CAPA is taken to have none.
+         */
+        void readCapabilities()
+        {
+            _capabilities.clear();
+            try
+            {
+                std::istringstream iss(simpleCommand("CAPA", true));
+                std::string line;
+                while (std::getline(iss, line))
+                {
+                    boost::trim(line);
+                    if (line.empty()) continue;
+                    _capabilities.insert(boost::to_upper_copy(line.substr(0, line.find(' '))));
+                }
+            }
+            catch (const vmime::exceptions::command_error&)
+            {
+                // Pre RFC 2449 server.
+            }
+        }
+
+        /**
+         * Gets the unique id of every message in the maildrop, keyed by message number.
+         */
+        std::map<unsigned int, std::string> uidl()
+        {
+            std::map<unsigned int, std::string> retval;
+            std::istringstream iss(simpleCommand("UIDL", true));
+            unsigned int number;
+            std::string uid;
+            while (iss >> number >> uid) retval.emplace(number, uid);
+
+            return retval;
+        }
+
+        /**
+         * Gets the size in octets of every message in the maildrop, keyed by message number.
+         */
+        std::map<unsigned int, std::uint64_t> list()
+        {
+            std::map<unsigned int, std::uint64_t> retval;
+            std::istringstream iss(simpleCommand("LIST", true));
+            unsigned int number;
+            std::uint64_t size;
+            while (iss >> number >> size) retval.emplace(number, size);
+
+            return retval;
+        }
+
+        /**
+         * Sends a sequence of commands that all have the same kind of response, pipelining them if the server allows it.
+         * @param commands The commands, without line terminators.
+         * @param multiline true if a successful response to each command has a multi-line body (TOP, RETR), false if it is a single line (DELE).
+         * @param handler Called with each response as it is read.
+         */
+        void pipeline(const std::vector<std::string>& commands, bool multiline, const responseHandler& handler)
+        {
+            if (!_socket) throw illegal_object_state("The POP3 command channel is not attached.");
+
+            std::size_t window = pipelining() ? PIPELINE_WINDOW : 1;
+            std::size_t sent = 0;
+            for (std::size_t received = 0; received < commands.size(); received++)
+            {
+                std::string batch;
+                while ((sent < commands.size()) && (sent - received < window))
+                {
+                    if (_tracer) _tracer->traceSend(commands[sent]);
+                    batch += commands[sent++] + "\r\n";
+                }
+                if (!batch.empty()) _socket->send(batch);
+
+                std::string status = readLine();
+                if (_tracer) _tracer->traceReceive(status);
+                bool ok = status.starts_with("+OK");
+                std::string body;
+                if (ok && multiline) body = readMultiline();
+                handler(received, ok, status, body);
+            }
+        }
+    };
+}
+
+#endif // _POP3_COMMAND_CHANNEL_HPP_
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: pop3EmailGateway.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POP3_EMAIL_GATEWAY_HPP_
+#define _POP3_EMAIL_GATEWAY_HPP_
+
+#include "abstractGateway.hpp"
+#include <chrono>
+#include <exception>
+#include <vmime/vmime.hpp>
+#include "utils.hpp"
+#include "pop3CommandChannel.hpp"
+#include "uidlSet.hpp"
+#include "connectionPool.hpp"
+#include "outboundMailQueue.hpp"
+#include "attachmentCache.hpp"
+#include "mailServiceSupport.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * <p>A gateway that collects commands from a POP3 maildrop.</p>
+     * <p>Each poll opens a session, asks for the unique id of every message and only looks at the ones it has not seen before; the ids are kept in a
+     * file in the state directory so that this survives a restart. The headers of the new messages are fetched with TOP and screened before anything
+     * else is downloaded, then the messages that pass are retrieved whole and claimed messages are deleted. Where the server allows it the TOP, RETR
+     * and DELE commands are pipelined.</p>
+     * <p>A POP3 server locks the maildrop while a session is open and only carries out deletions when the session ends with QUIT, so sessions are never
+     * kept in the connection pool between polls. POP3 has no way of announcing new mail, so push mode has no effect.</p>
+     */
+    class pop3EmailGateway final : public abstractGateway
+    {
+    private:
+        connectionEndpoint _fetchEndpoint;
+        connectionEndpoint _sendEndpoint;
+        std::string _fetchUsername;
+        std::string _fetchPassword;
+        std::string _fetchServer;
+        unsigned int _fetchPort;
+        bool _implicitTls;
+        std::string _sendUsername;
+        std::string _sendPassword;
+        std::string _sendServer;
+        unsigned int _sendPort;
+        pop3CommandChannel _channel;
+        uidlSet _seen;
+        std::string _outboundAccount;
+
+        connectionPool::storeLease leaseStore() const
+        {
+            return connectionPool::instance().leaseStore(_fetchEndpoint, [this](const vmime::shared_ptr<vmime::net::service>& service)
+            {
+                // Ignored by pop3s, which is always secured; plain pop3 has to upgrade with STLS.
+                service->setProperty("connection.tls", true);
+                service->setProperty("connection.tls.required", true);
+                service->setProperty("options.need-authentication", true);
+                service->setProperty("auth.username", _fetchUsername);
+                service->setProperty("auth.password", _fetchPassword);
+                service->setCertificateVerifier(vmime::make_shared<customCertificateVerifier>());
+                service->setTracerFactory(vmime::make_shared<protocolTracerFactory>(_protocol_trace));
+            });
+        }
+
+        void configureTransport(const vmime::shared_ptr<vmime::net::service>& service) const
+        {
+            service->setProperty("connection.tls", true);
+            service->setProperty("connection.tls.required", true);
+            service->setProperty("options.need-authentication", true);
+            service->setProperty("auth.username", _sendUsername);
+            service->setProperty("auth.password", _sendPassword);
+            service->setProperty("options.chunking", false);
+            service->setCertificateVerifier(vmime::make_shared<customCertificateVerifier>());
+            service->setTracerFactory(vmime::make_shared<protocolTracerFactory>(_protocol_trace));
+        }
+
+        connectionPool::transportLease leaseTransport() const
+        {
+            return connectionPool::instance().leaseTransport(_sendEndpoint, [this](const vmime::shared_ptr<vmime::net::service>& service){ configureTransport(service); });
+        }
+
+        /**
+         * Decides from its header alone whether a new message is worth retrieving.
+         */
+        bool triageMessage(const vmime::header& header, std::uint64_t size)
+        {
+            if (olderThanWindow(header)) return false;
+
+            std::string subject;
+            if (!screenMessage(header, subject)) return false;
+
+            if (size > _max_payload_size)
+            {
+                if (_warningReceived) _warningReceived(*this, _id + " ignored a message of " + std::to_string(size) + " bytes from '" + _last_sender + "' because it exceeds the maximum payload size", _user_data);
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Extracts the payload of a retrieved message and passes it on as a command.
+         * @return true if the command was claimed, in which case the message should be deleted.
+         */
+        bool processMessage(const std::string& data)
+        {
+            auto message = vmime::make_shared<vmime::message>();
+            message->parse(data);
+
+            // The message was screened when its header was fetched, this puts the sender back as the last sender.
+            std::string subject;
+            if (!screenMessage(*message->getHeader(), subject)) return false;
+
+            std::string text = utilities::getMessageText(message);
+            std::vector<std::unique_ptr<utilities::temporaryFile>> files;
+            utilities::getAttachments(message, _mimes_acl, _mime_access, files);
+            for (const auto& file : files) utilities::attachmentCache::instance().admit(*file);
+
+            return dispatchCommand(subject, text, files);
+        }
+
+        /**
+         * Collects new requests from the maildrop in a single session; any error talking to the server is thrown to the caller once the list of
+         * seen messages has been saved.
+         * @return true if there was new mail in the maildrop, false if there was none.
+         */
+        bool scanMaildrop()
+        {
+            bool found = false;
+            std::exception_ptr failure;
+
+            try
+            {
+                auto store = leaseStore();
+                store.discard();
+                _channel.attach(store.get());
+
+                // Forget the messages that have gone from the maildrop and look for ones that have not been seen before.
+                auto uids = _channel.uidl();
+                _seen.retainOnly(uids);
+                std::vector<unsigned int> fresh;
+                for (const auto& [number, uid] : uids)
+                {
+                    if (!_seen.contains(uid)) fresh.push_back(number);
+                }
+
+                if (!fresh.empty())
+                {
+                    found = true;
+                    auto sizes = _channel.list();
+
+                    // Screen the new messages on their headers.
+                    std::vector<std::string> commands;
+                    for (auto number : fresh) commands.push_back("TOP " + std::to_string(number) + " 0");
+                    std::vector<unsigned int> wanted;
+                    _channel.pipeline(commands, true, [&](std::size_t index, bool ok, const std::string& status, std::string& body)
+                    {
+                        unsigned int number = fresh[index];
+                        if (!_polling) return;
+                        if (!ok)
+                        {
+                            if (_warningReceived) _warningReceived(*this, _id + " could not fetch the header of message " + std::to_string(number) + ": " + status, _user_data);
+                            return;
+                        }
+
+                        vmime::header header;
+                        header.parse(body);
+                        if (triageMessage(header, sizes[number])) wanted.push_back(number);
+                        else _seen.insert(uids[number]);
+                    });
+
+                    // Retrieve and process the messages that passed.
+                    commands.clear();
+                    for (auto number : wanted) commands.push_back("RETR " + std::to_string(number));
+                    std::vector<unsigned int> claimed;
+                    _channel.pipeline(commands, true, [&](std::size_t index, bool ok, const std::string& status, std::string& body)
+                    {
+                        unsigned int number = wanted[index];
+                        if (!_polling) return;
+                        if (!ok)
+                        {
+                            if (_warningReceived) _warningReceived(*this, _id + " could not retrieve message " + std::to_string(number) + ": " + status, _user_data);
+                            return;
+                        }
+
+                        try
+                        {
+                            if (processMessage(body)) claimed.push_back(number);
+                        }
+                        catch (const std::exception& ex)
+                        {
+                            if (_errorReceived) _errorReceived(*this, _id + " could not process message " + std::to_string(number) + ": " + std::string(ex.what()), _user_data);
+                        }
+                        _seen.insert(uids[number]);
+                    });
+
+                    // Mark the claimed messages for deletion, the server removes them when the session is closed.
+                    commands.clear();
+                    for (auto number : claimed) commands.push_back("DELE " + std::to_string(number));
+                    _channel.pipeline(commands, false, [&](std::size_t index, bool ok, const std::string& status, std::string&)
+                    {
+                        if (!ok && _warningReceived) _warningReceived(*this, _id + " could not delete message " + std::to_string(claimed[index]) + ": " + status, _user_data);
+                    });
+                }
+
+                _channel.detach();
+                store.release();
+            }
+            catch (...)
+            {
+                _channel.detach();
+                failure = std::current_exception();
+            }
+
+            if (!_seen.path().empty() && !_seen.save() && _warningReceived) _warningReceived(*this, _id + " could not save its list of seen messages to " + _seen.path().string(), _user_data);
+            if (failure) std::rethrow_exception(failure);
+
+            return found;
+        }
+
+    public:
+        pop3EmailGateway() : abstractGateway()
+        {
+            _fetchPort = 995;
+            _implicitTls = true;
+            _sendPort = 587;
+        }
+
+        /**
+         * <p>Performs one unit of polling work.</p>
+         * <p>The maildrop is checked every time; the interval shortens after a check that found new mail and lengthens after one that did not. A
+         * check that fails is retried after the delay the circuit breaker sets.</p>
+         */
+        std::chrono::milliseconds poll() override
+        {
+            if (!_running || !_polling) return _poll_interval.maximum();
+
+            std::chrono::milliseconds wait;
+            if (!connectionAllowed(wait)) return wait;
+
+            try
+            {
+                if (scanMaildrop()) _poll_interval.activity();
+                else _poll_interval.backoff();
+                connectionSucceeded();
+            }
+            catch (const std::exception& ex)
+            {
+                return connectionFailed(_id + " encountered an error checking for new mail: " + std::string(ex.what()));
+            }
+
+            return _poll_interval.next();
+        }
+
+        bool start() override
+        {
+            if (_running) return true;
+
+            if (_fetchUsername.empty()) return false;
+            if (_fetchPassword.empty()) return false;
+            if (_fetchServer.empty()) return false;
+            if (_fetchPort == 0) return false;
+            if (_sendUsername.empty()) return false;
+            if (_sendPassword.empty()) return false;
+            if (_sendServer.empty()) return false;
+            if (_sendPort == 0) return false;
+            if (_senders_acl.empty() && (_sender_access == utilities::accessControlAction::allow)) return false;
+            if (_mimes_acl.empty() && (_mime_access == utilities::accessControlAction::allow)) return false;
+            if (_admin_contact.empty()) return false;
+            if (_input_contact.empty()) return false;
+            if (_killswitch_password.empty()) return false;
+
+            _id = "POP3 session (" + _fetchServer + ":" + _input_contact + ")";
+
+            if (!_state_directory.empty())
+            {
+                _seen.setPath(_state_directory / uidlSet::fileNameFor("pop3-" + _fetchUsername + "@" + _fetchServer + "-" + _input_contact));
+                _seen.load();
+            }
+
+            _fetchEndpoint = { _implicitTls ? "pop3s" : "pop3", _fetchServer, _fetchPort, _fetchUsername, _fetchPassword };
+            _sendEndpoint = { "smtp", _sendServer, _sendPort, _sendUsername, _sendPassword };
+
+            // Open a session once to check that the server can be reached; it is closed straight away so that the maildrop is not left locked.
+            try
+            {
+                auto store = leaseStore();
+                store.discard();
+            }
+            catch (const std::exception& ex)
+            {
+                reportConnectionError(_id + " failed to start: " + std::string(ex.what()));
+                return false;
+            }
+
+            if (_notificationReceived) _notificationReceived(*this, _id + " is running", _user_data);
+
+            try
+            {
+                leaseTransport();
+            }
+            catch (const std::exception& ex)
+            {
+                if (_errorReceived) _errorReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") failed to start: " + std::string(ex.what()), _user_data);
+                return false;
+            }
+
+            if (_notificationReceived) _notificationReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") is running", _user_data);
+
+            _outboundAccount = outboundMailQueue::instance().registerAccount(_input_contact, _sendEndpoint,
+                [this](const vmime::shared_ptr<vmime::net::service>& service){ configureTransport(service); },
+                [this](const std::string& recipient, const std::string& error, bool willRetry)
+                {
+                    std::string s = "SMTP session (" + _sendServer + ":" + _input_contact + ") sending message to '" + recipient + "' failed: " + error;
+                    if (willRetry && _warningReceived) _warningReceived(*this, s + ", it will be retried", _user_data);
+                    else if (!willRetry) reportConnectionError(s + ", giving up");
+                });
+
+            _running = true;
+
+            return true;
+        }
+
+        void stop() override
+        {
+            if (!_running) return;
+            if (_polling) pause();
+            outboundMailQueue::instance().unregisterAccount(_outboundAccount);
+            _running = false;
+
+            if (_notificationReceived) _notificationReceived(*this, _id + " has stopped running", _user_data);
+            if (_notificationReceived) _notificationReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") has stopped running", _user_data);
+        }
+
+        /**
+         * Queues a message for sending and returns at once; failures are reported through the warning and error callbacks.
+         */
+        void messageUser(const std::string& recipient, const std::string& subject, const std::string& message) const override
+        {
+            try
+            {
+                vmime::messageBuilder msgbld;
+                msgbld.setExpeditor(vmime::mailbox(_input_contact));
+                vmime::addressList toli;
+                toli.appendAddress(vmime::make_shared<vmime::mailbox>(recipient));
+                msgbld.setRecipients(toli);
+                msgbld.setSubject(vmime::text(subject));
+                msgbld.getTextPart()->setText(vmime::make_shared<vmime::stringContentHandler>(message));
+                vmime::shared_ptr<vmime::message> msg = msgbld.construct();
+                outboundMailQueue::instance().enqueue(_outboundAccount, vmime::mailbox(_input_contact), vmime::mailbox(recipient), msg);
+            }
+            catch (const std::exception& ex)
+            {
+                if (_errorReceived) _errorReceived(*this, "SMTP session (" + _sendServer + ":" + _input_contact + ") sending message to '" + recipient + "' failed: " + std::string(ex.what()), _user_data);
+            }
+        }
+
+        void messageAdmin(const std::string& subject, const std::string& message) const override
+        {
+            messageUser(_admin_contact, subject, message);
+        }
+
+        void messageLastPoster(const std::string& subject, const std::string& message) const override
+        {
+            messageUser(_last_sender, subject, message);
+        }
+
+        [[nodiscard]] std::string fetchUsername() const
+        {
+            return _fetchUsername;
+        }
+
+        [[nodiscard]] std::string fetchPassword() const
+        {
+            return _fetchPassword;
+        }
+
+        [[nodiscard]] std::string fetchServer() const
+        {
+            return _fetchServer;
+        }
+
+        [[nodiscard]] unsigned int fetchPort() const
+        {
+            return _fetchPort;
+        }
+
+        /**
+         * Gets whether the session is secured from the outset (pop3s) rather than upgraded with STLS (pop3).
+         */
+        [[nodiscard]] bool implicitTls() const
+        {
+            return _implicitTls;
+        }
+
+        [[nodiscard]] std::string sendUsername() const
+        {
+            return _sendUsername;
+        }
+
+        [[nodiscard]] std::string sendPassword() const
+        {
+            return _sendPassword;
+        }
+
+        [[nodiscard]] std::string sendServer() const
+        {
+            return _sendServer;
+        }
+
+        [[nodiscard]] unsigned int sendPort() const
+        {
+            return _sendPort;
+        }
+
+        void setFetchUsername (const std::string& value)
+        {
+            _fetchUsername = value;
+        }
+
+        void setFetchPassword (const std::string& value)
+        {
+            _fetchPassword = value;
+        }
+
+        void setFetchServer (const std::string& value)
+        {
+            _fetchServer = value;
+        }
+
+        void setFetchPort(unsigned int port)
+        {
+            _fetchPort = port;
+        }
+
+        void setImplicitTls(bool value)
+        {
+            _implicitTls = value;
+        }
+
+        void setSendUsername (const std::string& value)
+        {
+            _sendUsername = value;
+        }
+
+        void setSendPassword (const std::string& value)
+        {
+            _sendPassword = value;
+        }
+
+        void setSendServer (const std::string& value)
+        {
+            _sendServer = value;
+        }
+
+        void setSendPort(unsigned int port)
+        {
+            _sendPort = port;
+        }
+    };
+}
+
+#endif // _POP3_EMAIL_GATEWAY_HPP_
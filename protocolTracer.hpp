@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: protocolTracer.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROTOCOL_TRACER_HPP_
+#define _PROTOCOL_TRACER_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <vmime/vmime.hpp>
+
+namespace telemeteryServices
+{
+    /**
+     * <p>The most recent protocol lines exchanged over one connection, in a fixed amount of memory.</p>
+     * <p>Lines are written by the thread driving the connection and read, at any time, by whoever wants to see them, without either taking a lock.
+     * Each slot is guarded by a sequence number in the manner of a seqlock: it is odd while the slot is being written, and a reader that sees it
+     * change while copying a line out throws the copy away. Everything in a slot is atomic, so a torn read is discarded rather than undefined.
+     * Lines longer than a slot are truncated.</p>
+     */
+    class traceRing
+    {
+    public:
+        static constexpr std::size_t CAPACITY = 128;
+        static constexpr std::size_t LINE_BYTES = 248;
+
+        /**
+         * A line read back out of a ring.
+         */
+        struct line
+        {
+            // Orders lines from every connection of a gateway.
+            std::uint64_t order;
+            std::int64_t time;
+            bool sent;
+            std::string connection;
+            std::string text;
+        };
+
+    private:
+        static constexpr std::size_t LINE_WORDS = LINE_BYTES / sizeof(std::uint64_t);
+
+        struct slot
+        {
+            std::atomic<std::uint64_t> sequence{0};
+            std::atomic<std::uint64_t> order{0};
+            std::atomic<std::int64_t> time{0};
+            std::atomic<std::uint32_t> length{0};
+            std::atomic<bool> sent{false};
+            std::array<std::atomic<std::uint64_t>, LINE_WORDS> words{};
+        };
+
+        std::string _connection;
+        std::array<slot, CAPACITY> _slots;
+        std::atomic<std::uint64_t> _head{0};
+
+    public:
+        explicit traceRing(std::string connection) : _connection(std::move(connection))
+        {
+        }
+
+        traceRing(const traceRing& other) = delete;
+        traceRing& operator=(const traceRing& other) = delete;
+
+        [[nodiscard]] const std::string& connection() const
+        {
+            return _connection;
+        }
+
+        void append(std::uint64_t order, bool sent, std::string_view text)
+        {
+            std::uint64_t index = _head.fetch_add(1, std::memory_order_relaxed);
+            slot& s = _slots[index % CAPACITY];
+            s.sequence.store((index * 2) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            std::array<std::uint64_t, LINE_WORDS> words{};
+            std::size_t length = std::min(text.size(), LINE_BYTES);
+            std::memcpy(words.data(), text.data(), length);
+            for (std::size_t i = 0; i < (length + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t); i++) s.words[i].store(words[i], std::memory_order_relaxed);
+            s.order.store(order, std::memory_order_relaxed);
+            s.time.store(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+            s.length.store(static_cast<std::uint32_t>(std::min<std::size_t>(text.size(), UINT32_MAX)), std::memory_order_relaxed);
+            s.sent.store(sent, std::memory_order_relaxed);
+
+            s.sequence.store((index * 2) + 2, std::memory_order_release);
+        }
+
+        /**
+         * Copies out the lines still held, skipping any that are overwritten while they are being copied.
+         */
+        void snapshot(std::vector<line>& lines) const
+        {
+            std::uint64_t head = _head.load(std::memory_order_acquire);
+            std::uint64_t first = (head > CAPACITY) ? (head - CAPACITY) : 0;
+            for (std::uint64_t index = first; index < head; index++)
+            {
+                const slot& s = _slots[index % CAPACITY];
+                std::uint64_t sequence = s.sequence.load(std::memory_order_acquire);
+                if (sequence != (index * 2) + 2) continue;
+
+                std::array<std::uint64_t, LINE_WORDS> words{};
+                std::uint32_t length = s.length.load(std::memory_order_relaxed);
+                std::size_t stored = std::min<std::size_t>(length, LINE_BYTES);
+                for (std::size_t i = 0; i < (stored + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t); i++) words[i] = s.words[i].load(std::memory_order_relaxed);
+                line l;
+                l.order = s.order.load(std::memory_order_relaxed);
+                l.time = s.time.load(std::memory_order_relaxed);
+                l.sent = s.sent.load(std::memory_order_relaxed);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (s.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+                l.connection = _connection;
+                l.text.assign(reinterpret_cast<const char *>(words.data()), stored);
+                if (length > stored) l.text += "...";
+                lines.push_back(std::move(l));
+            }
+        }
+    };
+
+    /**
+     * <p>The protocol trace of one gateway: a ring for each of the last few connections it has opened, which can be switched on and off while the
+     * gateway runs and dumped on demand.</p>
+     * <p>Writing a line costs a relaxed load of the switch, two atomic increments and a copy into the ring; nothing is allocated and nothing is
+     * locked. Only opening a connection, and reading the trace back, take the lock.</p>
+     */
+    class protocolTrace
+    {
+    public:
+        static constexpr std::size_t MAX_CONNECTIONS = 8;
+
+    private:
+        std::atomic<bool> _enabled{true};
+        std::atomic<std::uint64_t> _clock{0};
+        mutable std::mutex _mutex;
+        std::deque<std::shared_ptr<traceRing>> _rings;
+
+    public:
+        [[nodiscard]] bool enabled() const
+        {
+            return _enabled.load(std::memory_order_relaxed);
+        }
+
+        void setEnabled(bool enabled)
+        {
+            _enabled.store(enabled, std::memory_order_relaxed);
+        }
+
+        /**
+         * Starts a ring for a new connection; the ring of the oldest connection is dropped from the trace once there are too many.
+         */
+        std::shared_ptr<traceRing> openRing(const std::string& connection)
+        {
+            auto ring = std::make_shared<traceRing>(connection);
+            std::lock_guard<std::mutex> lock(_mutex);
+            _rings.push_back(ring);
+            if (_rings.size() > MAX_CONNECTIONS) _rings.pop_front();
+
+            return ring;
+        }
+
+        void record(traceRing& ring, bool sent, std::string_view text)
+        {
+            if (!enabled()) return;
+            ring.append(_clock.fetch_add(1, std::memory_order_relaxed), sent, text);
+        }
+
+        /**
+         * Gets the last lines traced over every connection, oldest first, formatted for the log.
+         */
+        [[nodiscard]] std::vector<std::string> lastLines(std::size_t count) const
+        {
+            std::vector<traceRing::line> lines;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (const auto& ring : _rings) ring->snapshot(lines);
+            }
+            std::sort(lines.begin(), lines.end(), [](const traceRing::line& a, const traceRing::line& b){ return a.order < b.order; });
+            if (lines.size() > count) lines.erase(lines.begin(), lines.end() - static_cast<std::ptrdiff_t>(count));
+
+            std::vector<std::string> retval;
+            retval.reserve(lines.size());
+            for (const auto& l : lines)
+            {
+                std::time_t seconds = static_cast<std::time_t>(l.time / 1000);
+                std::tm tm1{};
+#ifdef _WIN32
+                localtime_s(&tm1, &seconds);
+#else
+                localtime_r(&seconds, &tm1);
+#endif
+                char stamp[16];
+                std::snprintf(stamp, sizeof(stamp), "%02d:%02d:%02d.%03d", tm1.tm_hour, tm1.tm_min, tm1.tm_sec, static_cast<int>(l.time % 1000));
+                retval.push_back(std::string(stamp) + " [" + l.connection + "] " + (l.sent ? "Tx: " : "Rx: ") + l.text);
+            }
+
+            return retval;
+        }
+    };
+
+    /**
+     * Feeds the lines vmime exchanges over one connection into a gateway's protocol trace. The command channels, which drive their sockets
+     * themselves, use one too.
+     */
+    class protocolTracer final : public vmime::net::tracer
+    {
+    private:
+        std::shared_ptr<protocolTrace> _trace;
+        std::shared_ptr<traceRing> _ring;
+
+    public:
+        protocolTracer(const std::shared_ptr<protocolTrace>& trace, const std::string& connection) : _trace(trace), _ring(trace->openRing(connection))
+        {
+        }
+
+        void traceSend(const vmime::string& line) override
+        {
+            _trace->record(*_ring, true, line);
+        }
+
+        void traceReceive(const vmime::string& line) override
+        {
+            _trace->record(*_ring, false, line);
+        }
+    };
+
+    class protocolTracerFactory final : public vmime::net::tracerFactory
+    {
+    private:
+        std::shared_ptr<protocolTrace> _trace;
+
+    public:
+        explicit protocolTracerFactory(const std::shared_ptr<protocolTrace>& trace) : _trace(trace)
+        {
+        }
+
+        vmime::shared_ptr<vmime::net::tracer> create(const vmime::shared_ptr<vmime::net::service>& serv, const int connectionId) override
+        {
+            return vmime::make_shared<protocolTracer>(_trace, serv->getProtocolName() + ":" + std::to_string(connectionId));
+        }
+    };
+}
+
+#endif // _PROTOCOL_TRACER_HPP_
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: senderAcl.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SENDER_ACL_HPP_
+#define _SENDER_ACL_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace utilities
+{
+    /**
+     * <p>A compiled list of sender addresses that can be searched in constant time without allocating.</p>
+     * <p>Three forms of entry are understood:</p>
+     * <ul>
+     * <li><code>user@example.com</code> matches that address only;</li>
+     * <li><code>*@example.com</code> matches any address at example.com;</li>
+     * <li><code>*@*.example.com</code> matches any address at a subdomain of example.com, such as depot.example.com, but not example.com itself.</li>
+     * </ul>
+     * <p>Entries are case-folded once when they are added. Whole addresses go into an open-addressing hash set and the domain wildcards into a trie
+     * of domain labels read from right to left, whose edges are kept in a second hash table keyed on the parent node and the label. A lookup folds
+     * the address as it hashes and compares it, so nothing is copied. Only ASCII letters are folded, as an internationalised address has no
+     * case-insensitive form that everyone agrees on.</p>
+     */
+    class senderAcl
+    {
+    private:
+        static constexpr std::uint32_t EMPTY = UINT32_MAX;
+        static constexpr std::uint32_t ROOT = 0;
+
+        // An entry in a hash table: a folded string in the arena and, for a trie edge, the nodes it joins.
+        struct slot
+        {
+            std::uint64_t hash = 0;
+            std::uint32_t offset = EMPTY;
+            std::uint32_t length = 0;
+            std::uint32_t parent = 0;
+            std::uint32_t child = 0;
+        };
+
+        struct node
+        {
+            // The node was named by a *@domain entry.
+            bool domain = false;
+            // The node was named by a *@*.domain entry.
+            bool subdomains = false;
+        };
+
+        std::string _arena;
+        std::vector<slot> _addresses;
+        std::size_t _addressCount;
+        std::vector<slot> _edges;
+        std::size_t _edgeCount;
+        std::vector<node> _nodes;
+        std::size_t _wildcardCount;
+
+        static constexpr char fold(char c)
+        {
+            return ((c >= 'A') && (c <= 'Z')) ? static_cast<char>(c + ('a' - 'A')) : c;
+        }
+
+        // FNV-1a over the folded bytes, seeded so that the same label under different parents hashes differently.
+        static std::uint64_t hash(std::string_view s, std::uint64_t seed = 0)
+        {
+            std::uint64_t h = 14695981039346656037ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+            for (char c : s)
+            {
+                h ^= static_cast<unsigned char>(fold(c));
+                h *= 1099511628211ULL;
+            }
+
+            return h;
+        }
+
+        bool equal(const slot& entry, std::string_view s) const
+        {
+            if (entry.length != s.size()) return false;
+            const char *stored = _arena.data() + entry.offset;
+            for (std::size_t i = 0; i < s.size(); i++)
+            {
+                if (stored[i] != fold(s[i])) return false;
+            }
+
+            return true;
+        }
+
+        const slot *find(const std::vector<slot>& table, std::string_view s, std::uint64_t h, std::uint32_t parent) const
+        {
+            if (table.empty()) return nullptr;
+            std::size_t mask = table.size() - 1;
+            for (std::size_t i = h & mask; ; i = (i + 1) & mask)
+            {
+                const slot& entry = table[i];
+                if (entry.offset == EMPTY) return nullptr;
+                if ((entry.hash == h) && (entry.parent == parent) && equal(entry, s)) return &entry;
+            }
+        }
+
+        std::uint32_t store(std::string_view s)
+        {
+            auto offset = static_cast<std::uint32_t>(_arena.size());
+            for (char c : s) _arena.push_back(fold(c));
+
+            return offset;
+        }
+
+        // Keeps the table at most half full so that probe sequences stay short.
+        static void reserve(std::vector<slot>& table, std::size_t count)
+        {
+            if ((count * 2) <= table.size()) return;
+            std::size_t capacity = table.empty() ? 16 : table.size();
+            while (capacity < (count * 2)) capacity *= 2;
+            std::vector<slot> rehashed(capacity);
+            std::size_t mask = capacity - 1;
+            for (const auto& entry : table)
+            {
+                if (entry.offset == EMPTY) continue;
+                std::size_t i = entry.hash & mask;
+                while (rehashed[i].offset != EMPTY) i = (i + 1) & mask;
+                rehashed[i] = entry;
+            }
+            table.swap(rehashed);
+        }
+
+        static void insert(std::vector<slot>& table, const slot& entry)
+        {
+            std::size_t mask = table.size() - 1;
+            std::size_t i = entry.hash & mask;
+            while (table[i].offset != EMPTY) i = (i + 1) & mask;
+            table[i] = entry;
+        }
+
+        // Follows, or adds, the path of labels for a domain read from right to left and returns the node it ends at.
+        std::uint32_t addDomain(std::string_view domain)
+        {
+            std::uint32_t current = ROOT;
+            while (!domain.empty())
+            {
+                std::size_t dot = domain.rfind('.');
+                std::string_view label = (dot == std::string_view::npos) ? domain : domain.substr(dot + 1);
+                domain = (dot == std::string_view::npos) ? std::string_view() : domain.substr(0, dot);
+                if (label.empty()) continue;
+
+                std::uint64_t h = hash(label, current + 1);
+                const slot *edge = find(_edges, label, h, current);
+                if (edge)
+                {
+                    current = edge->child;
+                    continue;
+                }
+                reserve(_edges, _edgeCount + 1);
+                slot entry;
+                entry.hash = h;
+                entry.length = static_cast<std::uint32_t>(label.size());
+                entry.offset = store(label);
+                entry.parent = current;
+                entry.child = static_cast<std::uint32_t>(_nodes.size());
+                _nodes.emplace_back();
+                insert(_edges, entry);
+                _edgeCount++;
+                current = entry.child;
+            }
+
+            return current;
+        }
+
+    public:
+        senderAcl()
+        {
+            _addressCount = 0;
+            _edgeCount = 0;
+            _wildcardCount = 0;
+            _nodes.emplace_back();
+        }
+
+        /**
+         * Adds an address or a domain wildcard to the list; anything that is not one of the understood forms is ignored.
+         */
+        void add(std::string_view entry)
+        {
+            while (!entry.empty() && ((entry.front() == ' ') || (entry.front() == '\t'))) entry.remove_prefix(1);
+            while (!entry.empty() && ((entry.back() == ' ') || (entry.back() == '\t'))) entry.remove_suffix(1);
+            std::size_t at = entry.rfind('@');
+            if ((at == std::string_view::npos) || (at + 1 == entry.size())) return;
+
+            if (entry.substr(0, at) == "*")
+            {
+                std::string_view domain = entry.substr(at + 1);
+                bool subdomains = (domain.substr(0, 2) == "*.");
+                if (subdomains) domain.remove_prefix(2);
+                if (domain.empty() || (domain.find('*') != std::string_view::npos)) return;
+                node& n = _nodes[addDomain(domain)];
+                if (subdomains ? n.subdomains : n.domain) return;
+                (subdomains ? n.subdomains : n.domain) = true;
+                _wildcardCount++;
+                return;
+            }
+
+            std::uint64_t h = hash(entry);
+            if (find(_addresses, entry, h, 0)) return;
+            reserve(_addresses, _addressCount + 1);
+            slot s;
+            s.hash = h;
+            s.length = static_cast<std::uint32_t>(entry.size());
+            s.offset = store(entry);
+            insert(_addresses, s);
+            _addressCount++;
+        }
+
+        /**
+         * Checks whether an address is on the list, either by itself or through a domain wildcard.
+         */
+        [[nodiscard]] bool contains(std::string_view address) const
+        {
+            if (find(_addresses, address, hash(address), 0)) return true;
+            if (_wildcardCount == 0) return false;
+
+            std::size_t at = address.rfind('@');
+            if (at == std::string_view::npos) return false;
+            std::string_view domain = address.substr(at + 1);
+            std::uint32_t current = ROOT;
+            while (!domain.empty())
+            {
+                std::size_t dot = domain.rfind('.');
+                std::string_view label = (dot == std::string_view::npos) ? domain : domain.substr(dot + 1);
+                domain = (dot == std::string_view::npos) ? std::string_view() : domain.substr(0, dot);
+                const slot *edge = find(_edges, label, hash(label, current + 1), current);
+                if (!edge) return false;
+                current = edge->child;
+                if (domain.empty()) return _nodes[current].domain;
+                if (_nodes[current].subdomains) return true;
+            }
+
+            return false;
+        }
+
+        [[nodiscard]] bool empty() const
+        {
+            return (_addressCount == 0) && (_wildcardCount == 0);
+        }
+
+        /**
+         * Gets the number of addresses and wildcards on the list.
+         */
+        [[nodiscard]] std::size_t size() const
+        {
+            return _addressCount + _wildcardCount;
+        }
+
+        void clear()
+        {
+            _arena.clear();
+            _addresses.clear();
+            _addressCount = 0;
+            _edges.clear();
+            _edgeCount = 0;
+            _nodes.clear();
+            _nodes.emplace_back();
+            _wildcardCount = 0;
+        }
+    };
+}
+
+#endif // _SENDER_ACL_HPP_
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: sha256.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHA256_HPP_
+#define _SHA256_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace utilities
+{
+    /**
+     * <p>A streaming implementation of SHA-256 (FIPS 180-4).</p>
+     * <p>Data can be fed in pieces of any size; the digest is the same as hashing it in one go. It is used to fingerprint certificates, where the
+     * hash has to be the one everybody else uses and has to resist collisions, which rules out the much faster xxHash64.</p>
+     */
+    class sha256
+    {
+    public:
+        typedef std::array<std::uint8_t, 32> digestType;
+
+    private:
+        static constexpr std::uint32_t K[64] =
+        {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+
+        std::uint32_t _state[8];
+        unsigned char _buffer[64];
+        std::size_t _buffered;
+        std::uint64_t _total;
+
+        static std::uint32_t rotr(std::uint32_t x, int r)
+        {
+            return (x >> r) | (x << (32 - r));
+        }
+
+        void block(const unsigned char *p)
+        {
+            std::uint32_t w[64];
+            for (int i = 0; i < 16; i++) w[i] = (std::uint32_t(p[i * 4]) << 24) | (std::uint32_t(p[i * 4 + 1]) << 16) | (std::uint32_t(p[i * 4 + 2]) << 8) | p[i * 4 + 3];
+            for (int i = 16; i < 64; i++)
+            {
+                std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            std::uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3], e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+            for (int i = 0; i < 64; i++)
+            {
+                std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+                std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+            _state[0] += a;
+            _state[1] += b;
+            _state[2] += c;
+            _state[3] += d;
+            _state[4] += e;
+            _state[5] += f;
+            _state[6] += g;
+            _state[7] += h;
+        }
+
+    public:
+        sha256()
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            static constexpr std::uint32_t INITIAL[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+            std::memcpy(_state, INITIAL, sizeof(_state));
+            _buffered = 0;
+            _total = 0;
+        }
+
+        void update(const void *data, std::size_t length)
+        {
+            auto p = static_cast<const unsigned char *>(data);
+            _total += length;
+
+            if (_buffered > 0)
+            {
+                std::size_t fill = std::min(length, sizeof(_buffer) - _buffered);
+                std::memcpy(_buffer + _buffered, p, fill);
+                _buffered += fill;
+                p += fill;
+                length -= fill;
+                if (_buffered < sizeof(_buffer)) return;
+                block(_buffer);
+                _buffered = 0;
+            }
+
+            while (length >= sizeof(_buffer))
+            {
+                block(p);
+                p += sizeof(_buffer);
+                length -= sizeof(_buffer);
+            }
+
+            std::memcpy(_buffer, p, length);
+            _buffered = length;
+        }
+
+        [[nodiscard]] digestType digest() const
+        {
+            // Pad a copy, so that more data can still be added afterwards.
+            sha256 last = *this;
+            std::uint64_t bits = _total * 8;
+            unsigned char padding[72] = { 0x80 };
+            std::size_t padLength = (_buffered < 56) ? (56 - _buffered) : (120 - _buffered);
+            last.update(padding, padLength);
+            unsigned char length[8];
+            for (int i = 0; i < 8; i++) length[i] = static_cast<unsigned char>(bits >> (56 - i * 8));
+            last.update(length, sizeof(length));
+
+            digestType retval;
+            for (int i = 0; i < 8; i++)
+            {
+                retval[i * 4] = static_cast<std::uint8_t>(last._state[i] >> 24);
+                retval[i * 4 + 1] = static_cast<std::uint8_t>(last._state[i] >> 16);
+                retval[i * 4 + 2] = static_cast<std::uint8_t>(last._state[i] >> 8);
+                retval[i * 4 + 3] = static_cast<std::uint8_t>(last._state[i]);
+            }
+
+            return retval;
+        }
+
+        static digestType hash(const void *data, std::size_t length)
+        {
+            sha256 h;
+            h.update(data, length);
+
+            return h.digest();
+        }
+
+        static std::string toHex(const digestType& digest)
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::string retval;
+            retval.reserve(digest.size() * 2);
+            for (auto b : digest)
+            {
+                retval.push_back(digits[b >> 4]);
+                retval.push_back(digits[b & 0xF]);
+            }
+
+            return retval;
+        }
+    };
+}
+
+#endif // _SHA256_HPP_
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: stateFile.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATE_FILE_HPP_
+#define _STATE_FILE_HPP_
+
+#include <cctype>
+#include <fstream>
+#include <string>
+#include <boost/filesystem.hpp>
+
+namespace utilities
+{
+    /**
+     * Builds the name of a file that a gateway keeps its state in from an arbitrary key, replacing anything that is not safe in a file name on any
+     * platform.
+     * @param extension Appended to the name, including its dot.
+     */
+    inline std::string stateFileName(const std::string& key, const std::string& extension)
+    {
+        std::string retval;
+        for (char c : key)
+        {
+            if (std::isalnum(static_cast<unsigned char>(c)) || (c == '@') || (c == '.') || (c == '-')) retval.push_back(c);
+            else retval.push_back('_');
+        }
+
+        return retval + extension;
+    }
+
+    /**
+     * Writes a file by calling writer with a stream on a temporary file next to it and then renaming that over it, so that a crash can never leave a
+     * torn file behind. Any missing directories are created.
+     * @return true if the file was written and renamed into place.
+     */
+    template<typename WriterT>
+    bool atomicWriteFile(const boost::filesystem::path& path, WriterT&& writer)
+    {
+        if (path.empty()) return false;
+
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(path.parent_path(), ec);
+        boost::filesystem::path temp = path;
+        temp += ".tmp";
+
+        {
+            std::ofstream out(temp.string(), std::ios::trunc);
+            if (!out) return false;
+            writer(out);
+            if (!out.flush()) return false;
+        }
+
+        boost::filesystem::rename(temp, path, ec);
+
+        return !ec;
+    }
+}
+
+#endif // _STATE_FILE_HPP_
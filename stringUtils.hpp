@@ -1,261 +1,455 @@
-/**************************************************************************
-Microsoft Windows platform specific code.
-
-Copyright (C) 2020 Chris Morrison (gnosticist@protonmail.com)
-
-This program is free software: you can redistribute it and/or modify
-it under the terms of the GNU General Public License as published by
-the Free Software Foundation, either version 3 of the License, or
-(at your option) any later version.
-
-This program is distributed in the hope that it will be useful,
-but WITHOUT ANY WARRANTY; without even the implied warranty of
-MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-GNU General Public License for more details.
-
-You should have received a copy of the GNU General Public License
-along with this program.  If not, see <http://www.gnu.org/licenses/>.
-**************************************************************************/
-#ifndef _STRING_UTILS_
-#define _STRING_UTILS_
-
-#ifdef _MSC_VER
-#include <windows.h>
-#endif
-
-#include <boost/algorithm/string.hpp>
-#include <boost/algorithm/string/replace.hpp>
-#include <boost/algorithm/string/regex.hpp>
-#include <boost/algorithm/string/trim.hpp>
-#include <boost/regex.h>
-
-namespace fsl::_private
-{
-#ifdef _MSC_VER
-
-	inline wchar_t* _fromUTF8(const char* src, size_t src_length = 0, size_t* out_length = nullptr)
-	{
-		if (!src) return nullptr;
-
-		if (src_length == 0) src_length = strlen(src);
-		int length = MultiByteToWideChar(CP_UTF8, 0, src, src_length, 0, 0);
-		wchar_t* output_buffer = (wchar_t*)std::malloc((length + 1) * sizeof(wchar_t));
-		if (output_buffer)
-		{
-			MultiByteToWideChar(CP_UTF8, 0, src, src_length, output_buffer, length);
-			output_buffer[length] = L'\0';
-		}
-		if (out_length) *out_length = length;
-
-		return output_buffer;
-	}
-
-	inline char* _toUTF8(const wchar_t* src, size_t src_length = 0, size_t* out_length = nullptr)
-	{
-		if (!src) return nullptr;
-
-		if (src_length == 0) src_length = wcslen(src);
-		int length = WideCharToMultiByte(CP_UTF8, 0, src, src_length, 0, 0, NULL, NULL);
-		char* output_buffer = (char*)std::malloc((length + 1) * sizeof(char));
-		if (output_buffer)
-		{
-			WideCharToMultiByte(CP_UTF8, 0, src, src_length, output_buffer, length, NULL, NULL);
-			output_buffer[length] = '\0';
-		}
-		if (out_length) *out_length = length;
-
-		return output_buffer;
-	}
-
-#else
-
-	inline wchar_t* _fromUTF8(const char* src, size_t src_length = 0, size_t* out_length = nullptr)
-	{
-        return nullptr;
-	}
-
-	inline char* _toUTF8(const wchar_t* src, size_t src_length = 0, size_t* out_length = nullptr)
-	{
-        return nullptr;
-	}
-
-#endif
-
-    inline std::wstring _utf8_to_wstring(const std::string& str)
-    {
-        std::wstring_convert<std::codecvt_utf8<wchar_t>> myconv;
-        return myconv.from_bytes(str);
-    }
-
-    // Convert wstring to UTF-8 string
-    inline std::string _wstring_to_utf8(const std::wstring& str)
-    {
-        std::wstring_convert<std::codecvt_utf8<wchar_t>> myconv;
-        return myconv.to_bytes(str);
-    }
-
-    inline bool _wspc_pred(wchar_t c)
-    {
-        if (c == 0x0009) return true;
-        if (c == 0x000A) return true;
-        if (c == 0x000B) return true;
-        if (c == 0x000C) return true;
-        if (c == 0x0020) return true;
-        if (c == 0x00A0) return true;
-        if (c == 0x1680) return true;
-        if (c == 0x2000) return true;
-        if (c == 0x2001) return true;
-        if (c == 0x2002) return true;
-        if (c == 0x2003) return true;
-        if (c == 0x2004) return true;
-        if (c == 0x2005) return true;
-        if (c == 0x2006) return true;
-        if (c == 0x2007) return true;
-        if (c == 0x2008) return true;
-        if (c == 0x2009) return true;
-        if (c == 0x200A) return true;
-        if (c == 0x202F) return true;
-        if (c == 0x205F) return true;
-        if (c == 0x3000) return true;
-
-        return false;
-    }
-
-    inline bool _spc_pred(char c)
-    {
-        return _wspc_pred(static_cast<wchar_t>(c));
-    }
-
-    inline std::wstring& _prep_string(const std::wstring& in, std::wstring& out)
-    {
-        bool space_seen = false;
-        for (const auto& c : in)
-        {
-            if (c == 0x2029)
-            {
-                out.push_back('\n');
-                out.push_back('\n');
-                continue;
-            }
-            if ((c == 0x2028) || (c == 0x0A) || (c == 0x0D))
-            {
-                out.push_back('\n');
-                continue;
-            }
-            if (_wspc_pred(c))
-            {
-                if (space_seen) continue;
-                out.push_back(' ');
-                space_seen = true;
-                continue;
-            }
-            else
-            {
-                space_seen = false;
-            }
-            if (c == 0x0085) { out.append(L"\n"); continue; } // Next line.
-            if (c == 0x2028) { out.append(L"\n"); continue; } // Line separator.
-            if (c == 0x2029) { out.append(L"\n\n"); continue; } // Paragraph separator.
-            if (c == 0x00AB) { out.append(L"\""); continue; } // LEFT-POINTING DOUBLE ANGLE QUOTATION MARK
-            if (c == 0x00AD) { out.append(L"-"); continue; }  // SOFT HYPHEN
-            if (c == 0x00B4) { out.append(L"'"); continue; }  // ACUTE ACCENT
-            if (c == 0x00BB) { out.append(L"\""); continue; } // RIGHT-POINTING DOUBLE ANGLE QUOTATION MARK
-            if (c == 0x00F7) { out.append(L"/"); continue; }  // DIVISION SIGN
-            if (c == 0x01C0) { out.append(L"|"); continue; }  // LATIN LETTER DENTAL CLICK
-            if (c == 0x01C3) { out.append(L"!"); continue; }  // LATIN LETTER RETROFLEX CLICK
-            if (c == 0x02B9) { out.append(L"'"); continue; }  // MODIFIER LETTER PRIME
-            if (c == 0x02BA) { out.append(L"\""); continue; } // MODIFIER LETTER DOUBLE PRIME
-            if (c == 0x02BC) { out.append(L"'"); continue; }  // MODIFIER LETTER APOSTROPHE
-            if (c == 0x02C4) { out.append(L"^"); continue; }  // MODIFIER LETTER UP ARROWHEAD
-            if (c == 0x02C6) { out.append(L"^"); continue; }  // MODIFIER LETTER CIRCUMFLEX ACCENT
-            if (c == 0x02C8) { out.append(L"'"); continue; }  // MODIFIER LETTER VERTICAL LINE
-            if (c == 0x02CB) { out.append(L"`"); continue; }  // MODIFIER LETTER GRAVE ACCENT
-            if (c == 0x02CD) { out.append(L"_"); continue; }  // MODIFIER LETTER LOW MACRON
-            if (c == 0x02DC) { out.append(L"~"); continue; }  // SMALL TILDE
-            if (c == 0x0300) { out.append(L"`"); continue; }  // COMBINING GRAVE ACCENT
-            if (c == 0x0301) { out.append(L"'"); continue; }  // COMBINING ACUTE ACCENT
-            if (c == 0x0302) { out.append(L"^"); continue; }  // COMBINING CIRCUMFLEX ACCENT
-            if (c == 0x0303) { out.append(L"~"); continue; }  // COMBINING TILDE
-            if (c == 0x030B) { out.append(L"\""); continue; } // COMBINING DOUBLE ACUTE ACCENT
-            if (c == 0x030E) { out.append(L"\""); continue; } // COMBINING DOUBLE VERTICAL LINE ABOVE
-            if (c == 0x0331) { out.append(L"_"); continue; }  // COMBINING MACRON BELOW
-            if (c == 0x0332) { out.append(L"_"); continue; }  // COMBINING LOW LINE
-            if (c == 0x0338) { out.append(L"/"); continue; }  // COMBINING LONG SOLIDUS OVERLAY
-            if (c == 0x0589) { out.append(L":"); continue; }  // ARMENIAN FULL STOP
-            if (c == 0x05C0) { out.append(L"|"); continue; }  // HEBREW PUNCTUATION PASEQ
-            if (c == 0x05C3) { out.append(L":"); continue; }  // HEBREW PUNCTUATION SOF PASUQ
-            if (c == 0x066A) { out.append(L"%"); continue; }  // ARABIC PERCENT SIGN
-            if (c == 0x066D) { out.append(L"*"); continue; }  // ARABIC FIVE POINTED STAR
-            if (c == 0x2010) { out.append(L"-"); continue; }  // HYPHEN
-            if (c == 0x2011) { out.append(L"-"); continue; }  // NON-BREAKING HYPHEN
-            if (c == 0x2012) { out.append(L"-"); continue; }  // FIGURE DASH
-            if (c == 0x2013) { out.append(L"-"); continue; }  // EN DASH
-            if (c == 0x2014) { out.append(L"-"); continue; }  // EM DASH
-            if (c == 0x2015) { out.append(L"--"); continue; } // HORIZONTAL BAR
-            if (c == 0x2016) { out.append(L"||"); continue; } // DOUBLE VERTICAL LINE
-            if (c == 0x2017) { out.append(L"_"); continue; }  // DOUBLE LOW LINE
-            if (c == 0x2018) { out.append(L"'"); continue; }  // LEFT SINGLE QUOTATION MARK
-            if (c == 0x2019) { out.append(L"'"); continue; }  // RIGHT SINGLE QUOTATION MARK
-            if (c == 0x201A) { out.append(L","); continue; }  // SINGLE LOW-9 QUOTATION MARK
-            if (c == 0x201B) { out.append(L"'"); continue; }  // SINGLE HIGH-REVERSED-9 QUOTATION MARK
-            if (c == 0x201C) { out.append(L"\""); continue; } // LEFT DOUBLE QUOTATION MARK
-            if (c == 0x201D) { out.append(L"\""); continue; } // RIGHT DOUBLE QUOTATION MARK
-            if (c == 0x201E) { out.append(L"\""); continue; } // DOUBLE LOW-9 QUOTATION MARK
-            if (c == 0x201F) { out.append(L"\""); continue; } // DOUBLE HIGH-REVERSED-9 QUOTATION MARK
-            if (c == 0x2032) { out.append(L"'"); continue; }  // PRIME
-            if (c == 0x2033) { out.append(L"\""); continue; } // DOUBLE PRIME
-            if (c == 0x2034) { out.append(L"'"); continue; }  // TRIPLE PRIME
-            if (c == 0x2035) { out.append(L"`"); continue; }  // REVERSED PRIME
-            if (c == 0x2036) { out.append(L"\""); continue; } // REVERSED DOUBLE PRIME
-            if (c == 0x2037) { out.append(L"'"); continue; }  // REVERSED TRIPLE PRIME
-            if (c == 0x2038) { out.append(L"^"); continue; }  // CARET
-            if (c == 0x2039) { out.append(L"<"); continue; }  // SINGLE LEFT-POINTING ANGLE QUOTATION MARK
-            if (c == 0x203A) { out.append(L">"); continue; }  // SINGLE RIGHT-POINTING ANGLE QUOTATION MARK
-            if (c == 0x203D) { out.append(L"?"); continue; }  // INTERROBANG
-            if (c == 0x2044) { out.append(L"/"); continue; }  // FRACTION SLASH
-            if (c == 0x204E) { out.append(L"*"); continue; }  // LOW ASTERISK
-            if (c == 0x2052) { out.append(L"%"); continue; }  // COMMERCIAL MINUS SIGN
-            if (c == 0x2053) { out.append(L"~"); continue; }  // SWUNG DASH
-            if (c == 0x20E5) { out.append(L"\\"); continue; }  // COMBINING REVERSE SOLIDUS OVERLAY
-            if (c == 0x2212) { out.append(L"-"); continue; }  // MINUS SIGN
-            if (c == 0x2215) { out.append(L"/"); continue; }  // DIVISION SLASH
-            if (c == 0x2216) { out.append(L"\\"); continue; }  // SET MINUS
-            if (c == 0x2217) { out.append(L"*"); continue; }  // ASTERISK OPERATOR
-            if (c == 0x2223) { out.append(L"|"); continue; }  // DIVIDES
-            if (c == 0x2236) { out.append(L":"); continue; }  // RATIO
-            if (c == 0x223C) { out.append(L"~"); continue; }  // TILDE OPERATOR
-            if (c == 0x2264) { out.append(L"<="); continue; } // LESS-THAN OR EQUAL TO
-            if (c == 0x2265) { out.append(L">="); continue; } // GREATER-THAN OR EQUAL TO
-            if (c == 0x2266) { out.append(L"<="); continue; } // LESS-THAN OVER EQUAL TO
-            if (c == 0x2267) { out.append(L">="); continue; } // GREATER-THAN OVER EQUAL TO
-            if (c == 0x2303) { out.append(L"^"); continue; }  // UP ARROWHEAD
-            if (c == 0x2329) { out.append(L"<"); continue; }  // LEFT-POINTING ANGLE BRACKET
-            if (c == 0x232A) { out.append(L">"); continue; }  // RIGHT-POINTING ANGLE BRACKET
-            if (c == 0x266F) { out.append(L"#"); continue; }  // MUSIC SHARP SIGN
-            if (c == 0x2731) { out.append(L"*"); continue; }  // HEAVY ASTERISK
-            if (c == 0x2758) { out.append(L"|"); continue; }  // LIGHT VERTICAL BAR
-            if (c == 0x2762) { out.append(L"!"); continue; }  // HEAVY EXCLAMATION MARK ORNAMENT
-            if (c == 0x27E6) { out.append(L"["); continue; }  // MATHEMATICAL LEFT WHITE SQUARE BRACKET
-            if (c == 0x27E8) { out.append(L"<"); continue; }  // MATHEMATICAL LEFT ANGLE BRACKET
-            if (c == 0x27E9) { out.append(L">"); continue; }  // MATHEMATICAL RIGHT ANGLE BRACKET
-            if (c == 0x2983) { out.append(L"{"); continue; }  // LEFT WHITE CURLY BRACKET
-            if (c == 0x2984) { out.append(L"}"); continue; }  // RIGHT WHITE CURLY BRACKET
-            if (c == 0x3003) { out.append(L"\""); continue; } // DITTO MARK
-            if (c == 0x3008) { out.append(L"<"); continue; }  // LEFT ANGLE BRACKET
-            if (c == 0x3009) { out.append(L">"); continue; }  // RIGHT ANGLE BRACKET
-            if (c == 0x301B) { out.append(L"]"); continue; }  // RIGHT WHITE SQUARE BRACKET
-            if (c == 0x301C) { out.append(L"~"); continue; }  // WAVE DASH
-            if (c == 0x301D) { out.append(L"\""); continue; } // REVERSED DOUBLE PRIME QUOTATION MARK
-            if (c == 0x301E) { out.append(L"\""); continue; } // DOUBLE PRIME QUOTATION MARK
-
-            out.push_back(c);
-        }
-
-        // Replace all instances of more than two newlines with two.
-        boost::replace_all_regex(out, boost::wregex(L"\\n{2,}"), std::wstring(L"\n\n"));
-
-        return out;
-    }
-}
-
-#endif // _STRING_UTILS_
+/**************************************************************************
+Microsoft Windows platform specific code.
+
+Copyright (C) 2020 Chris Morrison (gnosticist@protonmail.com)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+#ifndef _STRING_UTILS_
+#define _STRING_UTILS_
+
+#ifdef _MSC_VER
+#include <windows.h>
+#endif
+
+#include <boost/algorithm/string.hpp>
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/algorithm/string/regex.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/regex.h>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace fsl::_private
+{
+#ifdef _MSC_VER
+
+	inline wchar_t* _fromUTF8(const char* src, size_t src_length = 0, size_t* out_length = nullptr)
+	{
+		if (!src) return nullptr;
+
+		if (src_length == 0) src_length = strlen(src);
+		int length = MultiByteToWideChar(CP_UTF8, 0, src, src_length, 0, 0);
+		wchar_t* output_buffer = (wchar_t*)std::malloc((length + 1) * sizeof(wchar_t));
+		if (output_buffer)
+		{
+			MultiByteToWideChar(CP_UTF8, 0, src, src_length, output_buffer, length);
+			output_buffer[length] = L'\0';
+		}
+		if (out_length) *out_length = length;
+
+		return output_buffer;
+	}
+
+	inline char* _toUTF8(const wchar_t* src, size_t src_length = 0, size_t* out_length = nullptr)
+	{
+		if (!src) return nullptr;
+
+		if (src_length == 0) src_length = wcslen(src);
+		int length = WideCharToMultiByte(CP_UTF8, 0, src, src_length, 0, 0, NULL, NULL);
+		char* output_buffer = (char*)std::malloc((length + 1) * sizeof(char));
+		if (output_buffer)
+		{
+			WideCharToMultiByte(CP_UTF8, 0, src, src_length, output_buffer, length, NULL, NULL);
+			output_buffer[length] = '\0';
+		}
+		if (out_length) *out_length = length;
+
+		return output_buffer;
+	}
+
+#else
+
+	inline wchar_t* _fromUTF8(const char* src, size_t src_length = 0, size_t* out_length = nullptr)
+	{
+        return nullptr;
+	}
+
+	inline char* _toUTF8(const wchar_t* src, size_t src_length = 0, size_t* out_length = nullptr)
+	{
+        return nullptr;
+	}
+
+#endif
+
+    inline std::wstring _utf8_to_wstring(const std::string& str)
+    {
+        std::wstring_convert<std::codecvt_utf8<wchar_t>> myconv;
+        return myconv.from_bytes(str);
+    }
+
+    // Convert wstring to UTF-8 string
+    inline std::string _wstring_to_utf8(const std::wstring& str)
+    {
+        std::wstring_convert<std::codecvt_utf8<wchar_t>> myconv;
+        return myconv.to_bytes(str);
+    }
+
+    inline bool _wspc_pred(wchar_t c)
+    {
+        if (c == 0x0009) return true;
+        if (c == 0x000A) return true;
+        if (c == 0x000B) return true;
+        if (c == 0x000C) return true;
+        if (c == 0x0020) return true;
+        if (c == 0x00A0) return true;
+        if (c == 0x1680) return true;
+        if (c == 0x2000) return true;
+        if (c == 0x2001) return true;
+        if (c == 0x2002) return true;
+        if (c == 0x2003) return true;
+        if (c == 0x2004) return true;
+        if (c == 0x2005) return true;
+        if (c == 0x2006) return true;
+        if (c == 0x2007) return true;
+        if (c == 0x2008) return true;
+        if (c == 0x2009) return true;
+        if (c == 0x200A) return true;
+        if (c == 0x202F) return true;
+        if (c == 0x205F) return true;
+        if (c == 0x3000) return true;
+
+        return false;
+    }
+
+    inline bool _spc_pred(char c)
+    {
+        return _wspc_pred(static_cast<wchar_t>(c));
+    }
+
+    /**
+     * How _prep_string() treats a character: kept as it is, collapsed as white space, turned into a line or paragraph break, or folded to the ASCII
+     * replacement at (action - PREP_FOLD) in PREP_FOLDS.
+     */
+    enum : std::uint8_t
+    {
+        PREP_KEEP = 0,
+        PREP_SPACE = 1,
+        PREP_BREAK = 2,
+        PREP_PARAGRAPH = 3,
+        PREP_FOLD = 4,
+    };
+
+    struct _prep_fold
+    {
+        char32_t c;
+        const wchar_t *replacement;
+    };
+
+    // Decorative characters and their ASCII equivalents.
+    inline constexpr _prep_fold PREP_FOLDS[] =
+    {
+        { 0x0085, L"\n" },         // Next line.
+        { 0x00AB, L"\"" },         // LEFT-POINTING DOUBLE ANGLE QUOTATION MARK
+        { 0x00AD, L"-" },          // SOFT HYPHEN
+        { 0x00B4, L"'" },          // ACUTE ACCENT
+        { 0x00BB, L"\"" },         // RIGHT-POINTING DOUBLE ANGLE QUOTATION MARK
+        { 0x00F7, L"/" },          // DIVISION SIGN
+        { 0x01C0, L"|" },          // LATIN LETTER DENTAL CLICK
+        { 0x01C3, L"!" },          // LATIN LETTER RETROFLEX CLICK
+        { 0x02B9, L"'" },          // MODIFIER LETTER PRIME
+        { 0x02BA, L"\"" },         // MODIFIER LETTER DOUBLE PRIME
+        { 0x02BC, L"'" },          // MODIFIER LETTER APOSTROPHE
+        { 0x02C4, L"^" },          // MODIFIER LETTER UP ARROWHEAD
+        { 0x02C6, L"^" },          // MODIFIER LETTER CIRCUMFLEX ACCENT
+        { 0x02C8, L"'" },          // MODIFIER LETTER VERTICAL LINE
+        { 0x02CB, L"`" },          // MODIFIER LETTER GRAVE ACCENT
+        { 0x02CD, L"_" },          // MODIFIER LETTER LOW MACRON
+        { 0x02DC, L"~" },          // SMALL TILDE
+        { 0x0300, L"`" },          // COMBINING GRAVE ACCENT
+        { 0x0301, L"'" },          // COMBINING ACUTE ACCENT
+        { 0x0302, L"^" },          // COMBINING CIRCUMFLEX ACCENT
+        { 0x0303, L"~" },          // COMBINING TILDE
+        { 0x030B, L"\"" },         // COMBINING DOUBLE ACUTE ACCENT
+        { 0x030E, L"\"" },         // COMBINING DOUBLE VERTICAL LINE ABOVE
+        { 0x0331, L"_" },          // COMBINING MACRON BELOW
+        { 0x0332, L"_" },          // COMBINING LOW LINE
+        { 0x0338, L"/" },          // COMBINING LONG SOLIDUS OVERLAY
+        { 0x0589, L":" },          // ARMENIAN FULL STOP
+        { 0x05C0, L"|" },          // HEBREW PUNCTUATION PASEQ
+        { 0x05C3, L":" },          // HEBREW PUNCTUATION SOF PASUQ
+        { 0x066A, L"%" },          // ARABIC PERCENT SIGN
+        { 0x066D, L"*" },          // ARABIC FIVE POINTED STAR
+        { 0x2010, L"-" },          // HYPHEN
+        { 0x2011, L"-" },          // NON-BREAKING HYPHEN
+        { 0x2012, L"-" },          // FIGURE DASH
+        { 0x2013, L"-" },          // EN DASH
+        { 0x2014, L"-" },          // EM DASH
+        { 0x2015, L"--" },         // HORIZONTAL BAR
+        { 0x2016, L"||" },         // DOUBLE VERTICAL LINE
+        { 0x2017, L"_" },          // DOUBLE LOW LINE
+        { 0x2018, L"'" },          // LEFT SINGLE QUOTATION MARK
+        { 0x2019, L"'" },          // RIGHT SINGLE QUOTATION MARK
+        { 0x201A, L"," },          // SINGLE LOW-9 QUOTATION MARK
+        { 0x201B, L"'" },          // SINGLE HIGH-REVERSED-9 QUOTATION MARK
+        { 0x201C, L"\"" },         // LEFT DOUBLE QUOTATION MARK
+        { 0x201D, L"\"" },         // RIGHT DOUBLE QUOTATION MARK
+        { 0x201E, L"\"" },         // DOUBLE LOW-9 QUOTATION MARK
+        { 0x201F, L"\"" },         // DOUBLE HIGH-REVERSED-9 QUOTATION MARK
+        { 0x2032, L"'" },          // PRIME
+        { 0x2033, L"\"" },         // DOUBLE PRIME
+        { 0x2034, L"'" },          // TRIPLE PRIME
+        { 0x2035, L"`" },          // REVERSED PRIME
+        { 0x2036, L"\"" },         // REVERSED DOUBLE PRIME
+        { 0x2037, L"'" },          // REVERSED TRIPLE PRIME
+        { 0x2038, L"^" },          // CARET
+        { 0x2039, L"<" },          // SINGLE LEFT-POINTING ANGLE QUOTATION MARK
+        { 0x203A, L">" },          // SINGLE RIGHT-POINTING ANGLE QUOTATION MARK
+        { 0x203D, L"?" },          // INTERROBANG
+        { 0x2044, L"/" },          // FRACTION SLASH
+        { 0x204E, L"*" },          // LOW ASTERISK
+        { 0x2052, L"%" },          // COMMERCIAL MINUS SIGN
+        { 0x2053, L"~" },          // SWUNG DASH
+        { 0x20E5, L"\\" },         // COMBINING REVERSE SOLIDUS OVERLAY
+        { 0x2212, L"-" },          // MINUS SIGN
+        { 0x2215, L"/" },          // DIVISION SLASH
+        { 0x2216, L"\\" },         // SET MINUS
+        { 0x2217, L"*" },          // ASTERISK OPERATOR
+        { 0x2223, L"|" },          // DIVIDES
+        { 0x2236, L":" },          // RATIO
+        { 0x223C, L"~" },          // TILDE OPERATOR
+        { 0x2264, L"<=" },         // LESS-THAN OR EQUAL TO
+        { 0x2265, L">=" },         // GREATER-THAN OR EQUAL TO
+        { 0x2266, L"<=" },         // LESS-THAN OVER EQUAL TO
+        { 0x2267, L">=" },         // GREATER-THAN OVER EQUAL TO
+        { 0x2303, L"^" },          // UP ARROWHEAD
+        { 0x2329, L"<" },          // LEFT-POINTING ANGLE BRACKET
+        { 0x232A, L">" },          // RIGHT-POINTING ANGLE BRACKET
+        { 0x266F, L"#" },          // MUSIC SHARP SIGN
+        { 0x2731, L"*" },          // HEAVY ASTERISK
+        { 0x2758, L"|" },          // LIGHT VERTICAL BAR
+        { 0x2762, L"!" },          // HEAVY EXCLAMATION MARK ORNAMENT
+        { 0x27E6, L"[" },          // MATHEMATICAL LEFT WHITE SQUARE BRACKET
+        { 0x27E8, L"<" },          // MATHEMATICAL LEFT ANGLE BRACKET
+        { 0x27E9, L">" },          // MATHEMATICAL RIGHT ANGLE BRACKET
+        { 0x2983, L"{" },          // LEFT WHITE CURLY BRACKET
+        { 0x2984, L"}" },          // RIGHT WHITE CURLY BRACKET
+        { 0x3003, L"\"" },         // DITTO MARK
+        { 0x3008, L"<" },          // LEFT ANGLE BRACKET
+        { 0x3009, L">" },          // RIGHT ANGLE BRACKET
+        { 0x301B, L"]" },          // RIGHT WHITE SQUARE BRACKET
+        { 0x301C, L"~" },          // WAVE DASH
+        { 0x301D, L"\"" },         // REVERSED DOUBLE PRIME QUOTATION MARK
+        { 0x301E, L"\"" },         // DOUBLE PRIME QUOTATION MARK
+    };
+
+    static_assert(std::size(PREP_FOLDS) + PREP_FOLD <= 256, "Too many folds for the action table.");
+
+    /**
+     * A two-level lookup table of _prep_string() actions for the Basic Multilingual Plane: the high byte of a character picks a block of 256
+     * actions, and every block with nothing to do shares block 0. Characters above the BMP are always kept.
+     */
+    struct _prep_table
+    {
+        static constexpr std::size_t MAX_BLOCKS = 32;
+
+        std::array<std::uint8_t, 256> blocks{};
+        std::array<std::array<std::uint8_t, 256>, MAX_BLOCKS> actions{};
+
+        constexpr void set(char32_t c, std::uint8_t action)
+        {
+            std::size_t high = c >> 8;
+            if (blocks[high] == 0)
+            {
+                std::size_t used = 0;
+                for (auto b : blocks) used = std::max<std::size_t>(used, b);
+                blocks[high] = static_cast<std::uint8_t>(used + 1);
+            }
+            actions[blocks[high]][c & 0xFF] = action;
+        }
+
+        constexpr _prep_table()
+        {
+            for (char32_t c : { 0x0009, 0x000B, 0x000C, 0x0020, 0x00A0, 0x1680, 0x2000, 0x2001, 0x2002, 0x2003, 0x2004, 0x2005, 0x2006, 0x2007, 0x2008,
+                                0x2009, 0x200A, 0x202F, 0x205F, 0x3000 }) set(c, PREP_SPACE);
+            for (char32_t c : { 0x000A, 0x000D, 0x2028 }) set(c, PREP_BREAK);
+            set(0x2029, PREP_PARAGRAPH);
+            for (std::size_t i = 0; i < std::size(PREP_FOLDS); i++) set(PREP_FOLDS[i].c, static_cast<std::uint8_t>(PREP_FOLD + i));
+        }
+    };
+
+    inline constexpr _prep_table PREP_TABLE{};
+
+    inline std::uint8_t _prep_action(wchar_t c)
+    {
+        auto u = static_cast<std::uint32_t>(c);
+        if (u > 0xFFFF) return PREP_KEEP;
+
+        return PREP_TABLE.actions[PREP_TABLE.blocks[u >> 8]][u & 0xFF];
+    }
+
+    /**
+     * Works out how many leading characters of a vector of them can be copied to the output as they are, from the movemask bits of the bytes of
+     * the characters that are printable ASCII and of those that are spaces. A space that follows another space stops the copy, as it has to be
+     * collapsed.
+     */
+    inline std::size_t _prep_plain_lanes(std::uint32_t plain, std::uint32_t space, std::uint32_t full, bool& space_seen)
+    {
+        constexpr unsigned LANE = sizeof(wchar_t);
+        std::uint32_t doubled = space & ((space << LANE) | (space_seen ? ((1u << LANE) - 1) : 0u));
+        std::uint32_t bad = (~plain | doubled) & full;
+        std::size_t lanes = static_cast<std::size_t>(bad ? std::countr_zero(bad) : std::popcount(full)) / LANE;
+        if (lanes > 0) space_seen = ((space >> ((lanes - 1) * LANE)) & 1) != 0;
+
+        return lanes;
+    }
+
+    /**
+     * Skips, a vector at a time, over the run of printable ASCII at the start of the input that can be copied as it is.
+     * @return The end of the run.
+     */
+    inline const wchar_t *_prep_ascii_run(const wchar_t *p, const wchar_t *end, bool& space_seen)
+    {
+#if defined(__AVX2__)
+        constexpr std::ptrdiff_t WIDE_LANES = 32 / sizeof(wchar_t);
+        while ((end - p) >= WIDE_LANES)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            __m256i plain;
+            __m256i space;
+            if constexpr (sizeof(wchar_t) == 4)
+            {
+                __m256i x = _mm256_sub_epi32(v, _mm256_set1_epi32(0x20));
+                plain = _mm256_and_si256(_mm256_cmpgt_epi32(x, _mm256_set1_epi32(-1)), _mm256_cmpgt_epi32(_mm256_set1_epi32(0x5F), x));
+                space = _mm256_cmpeq_epi32(v, _mm256_set1_epi32(0x20));
+            }
+            else
+            {
+                __m256i x = _mm256_sub_epi16(v, _mm256_set1_epi16(0x20));
+                plain = _mm256_and_si256(_mm256_cmpgt_epi16(x, _mm256_set1_epi16(-1)), _mm256_cmpgt_epi16(_mm256_set1_epi16(0x5F), x));
+                space = _mm256_cmpeq_epi16(v, _mm256_set1_epi16(0x20));
+            }
+            std::size_t lanes = _prep_plain_lanes(static_cast<std::uint32_t>(_mm256_movemask_epi8(plain)), static_cast<std::uint32_t>(_mm256_movemask_epi8(space)), 0xFFFFFFFFu, space_seen);
+            p += lanes;
+            if (lanes < static_cast<std::size_t>(WIDE_LANES)) return p;
+        }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        constexpr std::ptrdiff_t LANES = 16 / sizeof(wchar_t);
+        while ((end - p) >= LANES)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            __m128i plain;
+            __m128i space;
+            if constexpr (sizeof(wchar_t) == 4)
+            {
+                __m128i x = _mm_sub_epi32(v, _mm_set1_epi32(0x20));
+                plain = _mm_and_si128(_mm_cmpgt_epi32(x, _mm_set1_epi32(-1)), _mm_cmplt_epi32(x, _mm_set1_epi32(0x5F)));
+                space = _mm_cmpeq_epi32(v, _mm_set1_epi32(0x20));
+            }
+            else
+            {
+                __m128i x = _mm_sub_epi16(v, _mm_set1_epi16(0x20));
+                plain = _mm_and_si128(_mm_cmpgt_epi16(x, _mm_set1_epi16(-1)), _mm_cmplt_epi16(x, _mm_set1_epi16(0x5F)));
+                space = _mm_cmpeq_epi16(v, _mm_set1_epi16(0x20));
+            }
+            std::size_t lanes = _prep_plain_lanes(static_cast<std::uint32_t>(_mm_movemask_epi8(plain)), static_cast<std::uint32_t>(_mm_movemask_epi8(space)), 0xFFFFu, space_seen);
+            p += lanes;
+            if (lanes < static_cast<std::size_t>(LANES)) return p;
+        }
+#endif
+        return p;
+    }
+
+    /**
+     * <p>Normalises a piece of text in a single pass, appending the result to out:</p>
+     * <ul>
+     * <li>Unicode line breaks, CR and LF become '\n' and paragraph separators "\n\n".</li>
+     * <li>Runs of white space become a single ASCII space.</li>
+     * <li>Runs of more than two line breaks become two; line breaks already at the end of out count towards them.</li>
+     * <li>Decorative characters such as curly quotation marks are folded to their ASCII equivalents.</li>
+     * </ul>
+     * <p>Each character is classified by a lookup in a two-level table rather than by comparing it with every special character in turn, and runs
+     * of printable ASCII, which is most of any email, are checked and copied a vector at a time.</p>
+     */
+    inline std::wstring& _prep_string(const std::wstring& in, std::wstring& out)
+    {
+        out.reserve(out.size() + in.size());
+
+        std::size_t newlines = 0;
+        while ((newlines < out.size()) && (out[out.size() - newlines - 1] == L'\n')) newlines++;
+        auto putNewline = [&out, &newlines]
+        {
+            if (newlines < 2) out.push_back(L'\n');
+            newlines++;
+        };
+
+        bool space_seen = false;
+        const wchar_t *p = in.data();
+        const wchar_t *end = p + in.size();
+        while (p < end)
+        {
+            const wchar_t *run = _prep_ascii_run(p, end, space_seen);
+            if (run != p)
+            {
+                out.append(p, run);
+                newlines = 0;
+                p = run;
+                if (p == end) break;
+            }
+
+            wchar_t c = *p++;
+            std::uint8_t action = _prep_action(c);
+            switch (action)
+            {
+            case PREP_KEEP:
+                out.push_back(c);
+                newlines = 0;
+                space_seen = false;
+                break;
+            case PREP_SPACE:
+                if (space_seen) break;
+                out.push_back(L' ');
+                newlines = 0;
+                space_seen = true;
+                break;
+            case PREP_BREAK:
+                putNewline();
+                break;
+            case PREP_PARAGRAPH:
+                putNewline();
+                putNewline();
+                break;
+            default:
+                for (const wchar_t *r = PREP_FOLDS[action - PREP_FOLD].replacement; *r; r++)
+                {
+                    if (*r == L'\n')
+                    {
+                        putNewline();
+                    }
+                    else
+                    {
+                        out.push_back(*r);
+                        newlines = 0;
+                    }
+                }
+                space_seen = false;
+                break;
+            }
+        }
+
+        return out;
+    }
+}
+
+#endif // _STRING_UTILS_
@@ -32,6 +32,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "stringUtils.hpp"
 #include "textCorpusItem.hpp"
+#include "textSegmenter.hpp"
 
 #ifndef MAX_PATH
 #define MAX_PATH 512
@@ -94,8 +95,6 @@ namespace fsl::text
 
         void parseString(const std::wstring& input, bool append)
         {
-            std::vector<std::wstring> items;
-            std::vector<std::wstring> temp;
             if (append)
             {
                 if (_splitParagraphs && !_items.empty() && !_items.back().empty()) _items.emplace_back();
@@ -131,103 +130,32 @@ namespace fsl::text
             fsl::_private::_prep_string(trimmed, copy);
 
             // ---------------------------------------------------------------------------------------------------------
-            // Phase 4 - If the caller has requested it, remove all the HTML/XML tabs. Replace paragraph ends
+            // Phase 4 - If the caller has requested it, remove all the HTML/XML tags. Replace paragraph ends
             // with '\n\n' and line breaks with '\n'
             // ---------------------------------------------------------------------------------------------------------
-            if (_removeHtmlTags)
-            {
-                boost::ireplace_all(copy, L"</p>", L"\n\n");
-                boost::ireplace_all(copy, L"<br>", "\n");
-                boost::erase_all_regex(copy, boost::wregex(L"<[^<>]+>"));
-            }
+            if (_removeHtmlTags) textSegmenter::stripHtmlTags(copy);
 
             // ---------------------------------------------------------------------------------------------------------
-            // Phase 5 - Split the string into items.
+            // Phase 5 - Split the string into items in a single scan. When splitting sentences, single line breaks
+            // are joined and the items are sentences; otherwise they are whole paragraphs, or lines. When splitting
+            // paragraphs, an empty item delimits each one.
             // ---------------------------------------------------------------------------------------------------------
-            boost::wregex wrx;
-            if (_splitSentences)
-            {
-                // Remove all single line breaks.
-                wrx.assign(L"([^\\n])( *\\n *)([^\\n])");
-                copy = boost::regex_replace(copy, wrx, [](const boost::wsmatch& m)->std::wstring
-                {
-                    return m[1].str() + L" " + m[3].str();
-                });
-
-                // Replace them with breaks at sentences.
-                wrx.assign(L"!(\\s{1})");
-                copy = boost::regex_replace(copy, wrx, L"!\n");
-                wrx.assign(L"\\?(\\s{1})");
-                copy = boost::regex_replace(copy, wrx, L"!\n");
-                wrx.assign(L"!\"(\\s{1})");
-                copy = boost::regex_replace(copy, wrx, L"!\"\n");
-                wrx.assign(L"\\?\"(\\s{1})");
-                copy = boost::regex_replace(copy, wrx, L"?\"\n");
-                wrx.assign(L"\\.\"(\\s{1})");
-                copy = boost::regex_replace(copy, wrx, L".\"\n");
-                wrx.assign(L"!'(\\s{1})");
-                copy = boost::regex_replace(copy, wrx, L"!'\n");
-                wrx.assign(L"\\?'(\\s{1})");
-                copy = boost::regex_replace(copy, wrx, L"?'\n");
-                wrx.assign(L"\\.'(\\s{1})");
-                copy = boost::regex_replace(copy, wrx, L".'\n");
-                // The case of sentences that end with a period is considerably more complex and will require careful handling.
-                wrx.assign(L"[A-Za-z]{2,}\\.+)([[:space:]]+)(?=[A-Z])"); // Letter at end only.
-                copy = boost::regex_replace(copy, wrx, [](const boost::wsmatch& m)->std::wstring
-                {
-                    return m[1] + L"\n";
-                });
-            }
-            // If we are not splitting paragraphs when remove all the paragraph breaks and replace them with ordinary line breaks.
-            if (!_splitParagraphs)
-            {
-                wrx.assign(L"\\n{2,}");
-                copy = boost::regex_replace(copy, wrx, L"\n");
-            }
-
-            // If we are splitting by paragraph
-            if (_splitParagraphs)
+            textSegmenter::lineBreaks breaks = textSegmenter::lineBreaks::split;
+            if (_splitSentences) breaks = textSegmenter::lineBreaks::join;
+            else if (_splitParagraphs) breaks = textSegmenter::lineBreaks::keep;
+            textCorpusItem::itemType type = textCorpusItem::itemType::text;
+            if (_splitParagraphs) type = _splitSentences ? textCorpusItem::itemType::sentence : textCorpusItem::itemType::paragraph;
+
+            textSegmenter segmenter(_splitSentences, breaks);
+            segmenter.segment(copy, [this, type](std::wstring_view item)
             {
-                wrx.assign(L"\\n{2,}");
-                boost::split_regex(items, copy, wrx);
-                // loop through each paragraph.
-                for (const auto& s : items)
-                {
-                    if (_splitSentences)
-                    {
-                        std::vector<std::wstring> sentences;
-                        boost::split(sentences, s, [](wchar_t wc) { if (wc == L'\n') return true; return false; });
-                        for (const auto& st : sentences)
-                        {
-                            if (st.empty()) continue;
-                            textCorpusItem itm(st, textCorpusItem::itemType::sentence);
-                            _items.push_back(std::move(itm));
-                        }
-                    }
-                    else
-                    {
-                        if (s.empty()) continue;
-                        textCorpusItem itm(s, textCorpusItem::itemType::paragraph);
-                        _items.push_back(std::move(itm));
-                    }
-
-                    // Add empty item to delimit the paragraphs.
-                    _items.emplace_back();
-                }
-            }
-            else
+                _items.push_back(textCorpusItem::fromPrepared(item, type));
+            },
+            [this]
             {
-                // In all other cases, just split each line by line breaks and add to the list.
-                boost::split(temp, copy, [](wchar_t wc) { if (wc == L'\n') return true; return false; });
-                for (const auto& st : temp)
-                {
-                    if (st.empty()) continue;
-                    textCorpusItem itm(st, textCorpusItem::itemType::text);
-                    _items.push_back(std::move(itm));
-                }
-            }
-
-
+                // Add empty item to delimit the paragraphs.
+                if (_splitParagraphs) _items.emplace_back();
+            });
         }
 
         [[nodiscard]] bool removeHtmlTags() const
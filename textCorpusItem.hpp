@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define _TEXT_CORPUS_ITEM_HPP_
 
 #include <ostream>
+#include <string_view>
 #include "stringUtils.hpp"
 
 namespace fsl::text
@@ -75,6 +76,19 @@ namespace fsl::text
             fsl::_private::_prep_string(temp2, _payload);
         }
 
+        /**
+         * Makes an item from text that has already been through _prep_string() and trimmed, as textSegmenter hands it out, without preparing it
+         * again.
+         */
+        static textCorpusItem fromPrepared(std::wstring_view prepared, itemType type)
+        {
+            textCorpusItem retval;
+            retval._payload.assign(prepared);
+            retval._type = type;
+
+            return retval;
+        }
+
         [[nodiscard]] std::string stringData() const
         {
             auto cs = fsl::_private::_toUTF8(_payload.c_str());
@@ -0,0 +1,260 @@
+/**************************************************************************
+A class for finding the sentences, paragraphs and lines in a body of text.
+
+Copyright (C) 2021 Chris Morrison (gnosticist@protonmail.com)
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#ifndef _TEXT_SEGMENTER_HPP_
+#define _TEXT_SEGMENTER_HPP_
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace fsl::text
+{
+    /**
+     * <p>Splits text that has been through _prep_string() into the items of a textCorpus in a single scan.</p>
+     * <p>A blank line ends a paragraph. What a single line break does depends on the mode: it is joined into a space when sentences are being
+     * split, kept inside a paragraph, or ends the item when the text is split into lines. Runs of spaces are collapsed and items are trimmed as
+     * they are built, so they can be used as they are.</p>
+     * <p>When splitting sentences, a sentence ends at a '!' or '?', or at a full stop followed by a closing quote, followed by white space. A bare
+     * full stop only ends one if the word before it has at least two letters and is not a common abbreviation, and the next word starts with a
+     * capital letter, so that initials, "e.g." and "Mr. Smith" do not split a sentence.</p>
+     */
+    class textSegmenter
+    {
+    public:
+        enum class lineBreaks
+        {
+            /**
+             * A single line break is treated as a space.
+             */
+            join,
+            /**
+             * A single line break is kept in the item.
+             */
+            keep,
+            /**
+             * A single line break ends the item.
+             */
+            split,
+        };
+
+    private:
+        bool _splitSentences;
+        lineBreaks _lineBreaks;
+
+        static constexpr std::array<std::wstring_view, 34> ABBREVIATIONS =
+        {
+            L"mr", L"mrs", L"ms", L"dr", L"prof", L"rev", L"st", L"sr", L"jr", L"mt", L"co", L"ltd", L"inc", L"plc", L"vs", L"dept", L"rd", L"ave",
+            L"approx", L"ref", L"tel", L"fig", L"ft", L"jan", L"feb", L"mar", L"apr", L"aug", L"sep", L"sept", L"oct", L"nov", L"dec", L"cf",
+        };
+
+        static bool isTerminator(wchar_t c)
+        {
+            return (c == L'.') || (c == L'!') || (c == L'?');
+        }
+
+        static bool isCloser(wchar_t c)
+        {
+            return (c == L'"') || (c == L'\'') || (c == L')') || (c == L']');
+        }
+
+        static bool isWhite(wchar_t c)
+        {
+            return (c == L' ') || (c == L'\n');
+        }
+
+        static bool isLetter(wchar_t c)
+        {
+            return ((c >= L'a') && (c <= L'z')) || ((c >= L'A') && (c <= L'Z'));
+        }
+
+        static bool isAbbreviation(std::wstring_view word)
+        {
+            if (word.size() > 6) return false;
+            wchar_t lower[6];
+            for (std::size_t i = 0; i < word.size(); i++) lower[i] = (word[i] <= L'Z') ? static_cast<wchar_t>(word[i] + (L'a' - L'A')) : word[i];
+            std::wstring_view folded(lower, word.size());
+            for (const auto& a : ABBREVIATIONS)
+            {
+                if (a == folded) return true;
+            }
+
+            return false;
+        }
+
+        /**
+         * Decides whether a run of full stops, which has just been added to the item at runStart, ends a sentence; next is where the text carries
+         * on after the run.
+         */
+        static bool fullStopEndsSentence(const std::wstring& item, std::size_t runStart, std::wstring_view text, std::size_t next)
+        {
+            std::size_t begin = runStart;
+            while ((begin > 0) && isLetter(item[begin - 1])) begin--;
+            if ((runStart - begin) < 2) return false;
+            if (isAbbreviation(std::wstring_view(item).substr(begin, runStart - begin))) return false;
+
+            while ((next < text.size()) && isWhite(text[next])) next++;
+            while ((next < text.size()) && ((text[next] == L'"') || (text[next] == L'\'') || (text[next] == L'('))) next++;
+
+            return (next < text.size()) && (text[next] >= L'A') && (text[next] <= L'Z');
+        }
+
+        static const wchar_t *tagReplacement(std::wstring_view tag)
+        {
+            auto is = [tag](std::wstring_view name)
+            {
+                if (tag.size() != name.size()) return false;
+                for (std::size_t i = 0; i < tag.size(); i++)
+                {
+                    wchar_t c = ((tag[i] >= L'A') && (tag[i] <= L'Z')) ? static_cast<wchar_t>(tag[i] + (L'a' - L'A')) : tag[i];
+                    if (c != name[i]) return false;
+                }
+
+                return true;
+            };
+            if (is(L"/p")) return L"\n\n";
+            if (is(L"br") || is(L"br/") || is(L"br /")) return L"\n";
+
+            return L"";
+        }
+
+    public:
+        textSegmenter(bool splitSentences, lineBreaks breaks)
+        {
+            _splitSentences = splitSentences;
+            _lineBreaks = breaks;
+        }
+
+        /**
+         * Removes the HTML or XML tags from a string in place, in a single pass; a closing paragraph tag becomes a blank line and a line break tag a
+         * line break.
+         */
+        static void stripHtmlTags(std::wstring& text)
+        {
+            std::size_t out = 0;
+            std::size_t i = 0;
+            while (i < text.size())
+            {
+                if (text[i] == L'<')
+                {
+                    std::size_t end = i + 1;
+                    while ((end < text.size()) && (text[end] != L'<') && (text[end] != L'>')) end++;
+                    if ((end < text.size()) && (text[end] == L'>') && (end > i + 1))
+                    {
+                        // A replacement is never longer than the tag, so it cannot overwrite text that has not been read yet.
+                        for (const wchar_t *r = tagReplacement(std::wstring_view(text).substr(i + 1, end - i - 1)); *r; r++) text[out++] = *r;
+                        i = end + 1;
+                        continue;
+                    }
+                }
+                text[out++] = text[i++];
+            }
+            text.resize(out);
+        }
+
+        /**
+         * Scans the text, calling item with each item found and paragraph at the end of each paragraph that had any items in it.
+         */
+        template<typename ItemFunctionT, typename ParagraphFunctionT>
+        void segment(std::wstring_view text, ItemFunctionT&& item, ParagraphFunctionT&& paragraph) const
+        {
+            std::wstring current;
+            bool space = false;
+            bool paragraphHasItems = false;
+            auto flush = [&]
+            {
+                while (!current.empty() && (current.back() == L'\n')) current.pop_back();
+                if (!current.empty())
+                {
+                    item(std::wstring_view(current));
+                    paragraphHasItems = true;
+                }
+                current.clear();
+                space = false;
+            };
+
+            std::size_t i = 0;
+            while (i < text.size())
+            {
+                wchar_t c = text[i];
+                if (isWhite(c))
+                {
+                    // Take the whole run of white space at once; a blank line in it ends the paragraph.
+                    std::size_t newlines = 0;
+                    for (; (i < text.size()) && isWhite(text[i]); i++)
+                    {
+                        if (text[i] == L'\n') newlines++;
+                    }
+                    if (newlines >= 2)
+                    {
+                        flush();
+                        if (paragraphHasItems) paragraph();
+                        paragraphHasItems = false;
+                    }
+                    else if ((newlines == 1) && (_lineBreaks == lineBreaks::split))
+                    {
+                        flush();
+                    }
+                    else if ((newlines == 1) && (_lineBreaks == lineBreaks::keep))
+                    {
+                        if (!current.empty()) current.push_back(L'\n');
+                        space = false;
+                    }
+                    else
+                    {
+                        space = !current.empty();
+                    }
+                    continue;
+                }
+
+                if (space) current.push_back(L' ');
+                space = false;
+                if (!_splitSentences || !isTerminator(c))
+                {
+                    current.push_back(c);
+                    i++;
+                    continue;
+                }
+
+                // Take the run of terminators, and any closing quotes or brackets after it, at once.
+                std::size_t runStart = current.size();
+                bool fullStopsOnly = true;
+                bool closed = false;
+                for (; (i < text.size()) && isTerminator(text[i]); i++)
+                {
+                    if (text[i] != L'.') fullStopsOnly = false;
+                    current.push_back(text[i]);
+                }
+                for (; (i < text.size()) && isCloser(text[i]); i++)
+                {
+                    closed = true;
+                    current.push_back(text[i]);
+                }
+                if ((i < text.size()) && !isWhite(text[i])) continue;
+                if (!fullStopsOnly || closed || fullStopEndsSentence(current, runStart, text, i)) flush();
+            }
+
+            flush();
+            if (paragraphHasItems) paragraph();
+        }
+    };
+}
+
+#endif // _TEXT_SEGMENTER_HPP_
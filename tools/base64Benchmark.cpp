@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: base64Benchmark.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Compares the attachment decoders in base64Decoder.hpp with vmime's encoder chain on a synthetic multi-megabyte attachment.
+// Usage: base64Benchmark [megabytes]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vmime/vmime.hpp>
+#include "../base64Decoder.hpp"
+
+namespace
+{
+    std::string encodeWithVmime(const std::string& data, const std::string& encoding)
+    {
+        std::string retval;
+        vmime::utility::inputStreamStringAdapter in(data);
+        vmime::utility::outputStreamStringAdapter out(retval);
+        vmime::encoding(encoding).getEncoder()->encode(in, out);
+        out.flush();
+
+        return retval;
+    }
+
+    template<typename FunctionT>
+    void measure(const std::string& name, std::size_t inputSize, const std::string& expected, FunctionT&& function)
+    {
+        constexpr int RUNS = 5;
+        double best = 0;
+        std::string result;
+        for (int i = 0; i < RUNS; i++)
+        {
+            result.clear();
+            auto start = std::chrono::steady_clock::now();
+            function(result);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if ((i == 0) || (seconds < best)) best = seconds;
+        }
+        std::cout << name << ": " << (static_cast<double>(inputSize) / 1e6 / best) << " MB/s" << ((result == expected) ? "" : " (OUTPUT MISMATCH)") << "\n";
+    }
+
+    template<typename DecoderT>
+    void runDecoder(DecoderT& decoder, const std::string& encoded, std::string& result)
+    {
+        utilities::decodeStreaming(decoder, encoded.data(), encoded.length(), [&result](const unsigned char *data, std::size_t length)
+        {
+            result.append(reinterpret_cast<const char *>(data), length);
+        });
+    }
+
+    void runVmime(const std::string& encoding, const std::string& encoded, std::string& result)
+    {
+        vmime::utility::inputStreamStringAdapter in(encoded);
+        vmime::utility::outputStreamStringAdapter out(result);
+        vmime::encoding(encoding).getEncoder()->decode(in, out);
+        out.flush();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t megabytes = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 16;
+    if (megabytes == 0) megabytes = 16;
+
+    std::mt19937 random(42);
+    std::string data(megabytes * 1024 * 1024, '\0');
+    for (auto& c : data) c = static_cast<char>(random());
+
+    std::string base64 = encodeWithVmime(data, vmime::encodingTypes::BASE64);
+    std::string qp = encodeWithVmime(data, vmime::encodingTypes::QUOTED_PRINTABLE);
+
+    utilities::base64Decoder probe;
+    std::cout << "Decoding " << megabytes << " MB, vector kernel: " << probe.kernelName() << "\n";
+
+    measure("base64 vmime", base64.size(), data, [&](std::string& r){ runVmime(vmime::encodingTypes::BASE64, base64, r); });
+    measure("base64 scalar", base64.size(), data, [&](std::string& r){ utilities::base64Decoder d; d.forceScalar(); runDecoder(d, base64, r); });
+    measure(std::string("base64 ") + probe.kernelName(), base64.size(), data, [&](std::string& r){ utilities::base64Decoder d; runDecoder(d, base64, r); });
+    measure("quoted-printable vmime", qp.size(), data, [&](std::string& r){ runVmime(vmime::encodingTypes::QUOTED_PRINTABLE, qp, r); });
+    measure("quoted-printable", qp.size(), data, [&](std::string& r){ utilities::quotedPrintableDecoder d; runDecoder(d, qp, r); });
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: emailScannerBenchmark.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Compares the email address scanner in emailAddressScanner.hpp with the boost::regex it replaced, line by line over a synthetic corpus of
+// message headers of the kind the gateways receive: address headers, Received chains, message IDs, DKIM signatures and MIME headers.
+// Usage: emailScannerBenchmark [messages]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/regex.hpp>
+#include "../emailAddressScanner.hpp"
+
+namespace
+{
+    const char *FIRST_NAMES[] = { "alice", "Bob", "carol", "DAVE", "erin", "Frank", "grace", "heidi", "Ivan", "judy" };
+    const char *LAST_NAMES[] = { "smith", "Jones", "taylor", "Brown", "williams", "Wilson", "o'neill", "evans", "THOMAS", "roberts" };
+    const char *DOMAINS[] = { "depot.example.co.uk", "Fleet-Services.example.com", "mail.haulage.org", "example.net", "Transport.example.de", "logistics.example.io" };
+
+    std::string pick(std::mt19937& random, const char *const *list, std::size_t count)
+    {
+        return list[random() % count];
+    }
+
+    template<typename ArrayT>
+    std::string pick(std::mt19937& random, const ArrayT& list)
+    {
+        return pick(random, list, sizeof(list) / sizeof(list[0]));
+    }
+
+    std::string address(std::mt19937& random)
+    {
+        return pick(random, FIRST_NAMES) + "." + pick(random, LAST_NAMES) + "@" + pick(random, DOMAINS);
+    }
+
+    std::string token(std::mt19937& random, std::size_t length, const char *alphabet)
+    {
+        std::size_t size = std::char_traits<char>::length(alphabet);
+        std::string retval;
+        for (std::size_t i = 0; i < length; i++) retval.push_back(alphabet[random() % size]);
+
+        return retval;
+    }
+
+    std::vector<std::string> buildCorpus(std::size_t messages)
+    {
+        static const char *B64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        static const char *HEX = "0123456789abcdef";
+        std::mt19937 random(42);
+        std::vector<std::string> lines;
+        for (std::size_t m = 0; m < messages; m++)
+        {
+            std::string from = address(random);
+            lines.push_back("Return-Path: <" + from + ">");
+            for (int hop = 0; hop < 3; hop++)
+            {
+                lines.push_back("Received: from mx" + std::to_string(hop) + "." + pick(random, DOMAINS) + " (mx" + std::to_string(hop) + "." + pick(random, DOMAINS) + " [10.0." + std::to_string(random() % 256) + "." + std::to_string(random() % 256) + "])");
+                lines.push_back("        by mail.example.com with ESMTPS id " + token(random, 16, HEX) + " for <" + address(random) + ">;");
+                lines.push_back("        Mon, 12 Jul 2021 09:" + std::to_string(10 + random() % 50) + ":00 +0100 (BST)");
+            }
+            lines.push_back("DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/relaxed; d=" + pick(random, DOMAINS) + "; s=selector1;");
+            lines.push_back("        h=from:to:subject:date:message-id; bh=" + token(random, 44, B64) + ";");
+            for (int i = 0; i < 4; i++) lines.push_back("        b=" + token(random, 72, B64));
+            lines.push_back("From: \"" + pick(random, FIRST_NAMES) + " " + pick(random, LAST_NAMES) + "\" <" + from + ">");
+            lines.push_back("To: Depot Bookings <bookings@" + pick(random, DOMAINS) + ">");
+            lines.push_back("Cc: " + address(random) + ", \"Transport Office\" <" + address(random) + ">, " + address(random));
+            lines.push_back("Subject: post");
+            lines.push_back("Date: Mon, 12 Jul 2021 09:41:23 +0100");
+            lines.push_back("Message-ID: <" + token(random, 24, HEX) + "@" + pick(random, DOMAINS) + ">");
+            lines.push_back("MIME-Version: 1.0");
+            lines.push_back("Content-Type: multipart/mixed; boundary=\"----=_Part_" + token(random, 12, HEX) + "\"");
+            lines.push_back("Please book the 10:30 slot for trailer TR-" + std::to_string(random() % 10000) + ". Reply to " + address(random) + " if there is a problem.");
+        }
+
+        return lines;
+    }
+
+    // The implementation the scanner replaced: a regex built on every call that only reports the first match.
+    std::size_t regexPerCall(const std::string& line, std::vector<std::string>& addresses)
+    {
+        addresses.clear();
+        boost::regex exp("(?:[a-z0-9_\\-\\.]+@[a-z0-9_\\-\\.]+\\.){1}(?:(?:[a-z]{2,10})|(?:[a-z]{2,10}\\.[a-z]{2,10}))");
+        boost::smatch match;
+        if (boost::regex_search(line, match, exp))
+        {
+            for (const auto& sm : match) addresses.push_back(sm.str());
+        }
+
+        return addresses.size();
+    }
+
+    template<typename FunctionT>
+    void measure(const std::string& name, const std::vector<std::string>& lines, std::size_t bytes, FunctionT&& function)
+    {
+        constexpr int RUNS = 5;
+        double best = 0;
+        std::size_t found = 0;
+        for (int i = 0; i < RUNS; i++)
+        {
+            found = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (const auto& line : lines) found += function(line);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if ((i == 0) || (seconds < best)) best = seconds;
+        }
+        std::cout << name << ": " << (static_cast<double>(bytes) / 1e6 / best) << " MB/s, " << (static_cast<double>(lines.size()) / 1e6 / best) << " M lines/s, " << found << " addresses\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t messages = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 2000;
+    if (messages == 0) messages = 2000;
+
+    auto lines = buildCorpus(messages);
+    std::size_t bytes = 0;
+    for (const auto& line : lines) bytes += line.size();
+    std::cout << "Scanning " << lines.size() << " header lines (" << bytes << " bytes) from " << messages << " messages\n";
+
+    std::vector<std::string> strings;
+    measure("regex compiled per call", lines, bytes, [&](const std::string& line){ return regexPerCall(line, strings); });
+
+    const boost::regex compiled("(?:[a-z0-9_\\-\\.]+@[a-z0-9_\\-\\.]+\\.){1}(?:(?:[a-z]{2,10})|(?:[a-z]{2,10}\\.[a-z]{2,10}))", boost::regex::icase);
+    measure("regex compiled once, every match", lines, bytes, [&](const std::string& line)
+    {
+        std::size_t n = 0;
+        for (boost::sregex_iterator it(line.begin(), line.end(), compiled), end; it != end; ++it) n++;
+        return n;
+    });
+
+    measure("scanner", lines, bytes, [](const std::string& line){ return utilities::forEachEmailAddress(line, [](std::string_view){}); });
+
+    return 0;
+}
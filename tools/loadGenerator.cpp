@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: loadGenerator.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Runs each gateway configuration against the mock mail server in mockMailServer.hpp, posting messages into its mailbox and measuring how quickly
+// the gateway hands them over. Reports messages per second, the latency from a message being posted to its command being dispatched, and the
+// processor time the gateway spent per message (the mock servers' own time is left out).
+// Usage: loadGenerator [--messages N] [--population N] [--attachment-size BYTES] [--post-interval MS] [--poll MS] [--latency MS] [--jitter MS]
+//                      [--drop PROBABILITY] [--rate COMMANDS_PER_SECOND] [--max-connections N] [--timeout SECONDS]
+//                      [--configs imap-poll,imap-push,pop3,maildir] [--verbose]
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include "../imapEmailGateway.hpp"
+#include "../pop3EmailGateway.hpp"
+#include "../maildirGateway.hpp"
+#include "mockMailServer.hpp"
+
+namespace
+{
+    const std::string INPUT_CONTACT = "depot@load.test";
+    const std::string POSTER = "poster@load.test";
+    const std::string USERNAME = "depot";
+    const std::string PASSWORD = "secret";
+
+    struct options
+    {
+        std::size_t messages = 200;
+        std::size_t population = 1000;
+        std::size_t attachmentSize = 64 * 1024;
+        std::chrono::milliseconds postInterval{ 0 };
+        std::chrono::milliseconds poll{ 200 };
+        std::chrono::seconds timeout{ 120 };
+        telemeteryServices::mockFaultProfile faults;
+        std::vector<std::string> configs{ "imap-poll", "imap-push", "pop3", "maildir" };
+        bool verbose = false;
+    };
+
+    struct results
+    {
+        std::size_t received = 0;
+        std::size_t errors = 0;
+        std::vector<double> latencies;
+        double seconds = 0;
+        double cpuPerMessage = 0;
+        telemeteryServices::mockServerStatistics server;
+        std::uint64_t replies = 0;
+    };
+
+    /**
+     * Collects what the gateway under test reports through its callbacks.
+     */
+    class collector
+    {
+    private:
+        std::mutex _mutex;
+        std::condition_variable _changed;
+        std::map<std::size_t, std::chrono::steady_clock::time_point> _posted;
+        std::vector<double> _latencies;
+        std::size_t _errors = 0;
+        bool _verbose;
+
+    public:
+        explicit collector(bool verbose)
+        {
+            _verbose = verbose;
+        }
+
+        void posted(std::size_t id)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _posted[id] = std::chrono::steady_clock::now();
+        }
+
+        bool received(const std::string& text)
+        {
+            auto pos = text.find("load-id: ");
+            if (pos == std::string::npos) return false;
+            std::size_t id = std::stoul(text.substr(pos + 9));
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _posted.find(id);
+            if (it == _posted.end()) return false;
+            _latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - it->second).count());
+            _posted.erase(it);
+            _changed.notify_all();
+
+            return true;
+        }
+
+        void error(const std::string& message)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _errors++;
+            if (_verbose) std::cerr << message << "\n";
+        }
+
+        bool waitFor(std::size_t count, std::chrono::seconds timeout)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _changed.wait_for(lock, timeout, [&]{ return _latencies.size() >= count; });
+        }
+
+        std::vector<double> latencies()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _latencies;
+        }
+
+        std::size_t errors()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _errors;
+        }
+    };
+
+    std::chrono::nanoseconds processCpuTime()
+    {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    }
+
+    template<typename GatewayT>
+    void configureSending(GatewayT& gateway, telemeteryServices::mockMailServer& server)
+    {
+        gateway.setSendServer("localhost");
+        gateway.setSendPort(server.smtp().port());
+        gateway.setSendUsername(USERNAME);
+        gateway.setSendPassword(PASSWORD);
+    }
+
+    template<typename GatewayT>
+    void configureFetching(GatewayT& gateway, unsigned short port)
+    {
+        gateway.setFetchServer("localhost");
+        gateway.setFetchPort(port);
+        gateway.setFetchUsername(USERNAME);
+        gateway.setFetchPassword(PASSWORD);
+    }
+
+    std::unique_ptr<telemeteryServices::abstractGateway> makeGateway(const std::string& config, telemeteryServices::mockMailServer& server, const boost::filesystem::path& work)
+    {
+        if (boost::starts_with(config, "imap"))
+        {
+            auto gateway = std::make_unique<telemeteryServices::imapEmailGateway>();
+            configureFetching(*gateway, server.imap().port());
+            configureSending(*gateway, server);
+            gateway->setPushMode(config == "imap-push");
+            return gateway;
+        }
+        if (config == "pop3")
+        {
+            auto gateway = std::make_unique<telemeteryServices::pop3EmailGateway>();
+            configureFetching(*gateway, server.pop3().port());
+            configureSending(*gateway, server);
+            gateway->setImplicitTls(true);
+            return gateway;
+        }
+        if (config == "maildir")
+        {
+            auto gateway = std::make_unique<telemeteryServices::maildirGateway>();
+            gateway->setDirectory(work / "Maildir");
+            configureSending(*gateway, server);
+            return gateway;
+        }
+
+        throw std::invalid_argument("unknown configuration " + config);
+    }
+
+    /**
+     * Puts a message where the gateway will find it: straight into the mock mailbox, or into the Maildir the way a delivery agent does.
+     */
+    void deliver(const std::string& config, telemeteryServices::mockMailServer& server, const boost::filesystem::path& work, const std::string& message, std::size_t id)
+    {
+        if (config != "maildir")
+        {
+            server.mailbox().append(message);
+            return;
+        }
+
+        std::string name = std::to_string(std::time(nullptr)) + ".load" + std::to_string(id) + ".localhost";
+        auto temp = work / "Maildir" / "tmp" / name;
+        {
+            std::ofstream out(temp.string(), std::ios::binary);
+            out << message;
+        }
+        boost::filesystem::rename(temp, work / "Maildir" / "new" / name);
+    }
+
+    results run(const std::string& config, const options& opts)
+    {
+        using namespace telemeteryServices;
+
+        results retval;
+        auto work = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("eunomia-load-%%%%-%%%%");
+        boost::filesystem::create_directories(work);
+        if (config == "maildir")
+        {
+            for (const char *sub : { "tmp", "new", "cur" }) boost::filesystem::create_directories(work / "Maildir" / sub);
+        }
+
+        mockMailServer server;
+        server.setCredentials(USERNAME, PASSWORD);
+        server.smtp().addLocalAddress(INPUT_CONTACT);
+        server.setFaults(opts.faults);
+
+        // Mail the gateway must look at and pass over.
+        for (std::size_t i = 0; i < opts.population; i++)
+        {
+            std::string noise = mockMailServer::composeMessage("noise" + std::to_string(i % 17) + "@load.test", "someone-else@load.test", "Noise " + std::to_string(i), "Not for the depot.");
+            if (config == "maildir") deliver(config, server, work, noise, opts.messages + i);
+            else server.mailbox().append(noise);
+        }
+        server.start();
+
+        collector events(opts.verbose);
+        auto gateway = makeGateway(config, server, work);
+        gateway->setAdminContact("admin@load.test");
+        gateway->setInputContact(INPUT_CONTACT);
+        gateway->setKillswitchPassword("not-used");
+        gateway->addControlledSender(POSTER);
+        gateway->setSendersAccessControlAction(utilities::accessControlAction::allow);
+        gateway->addControlledMimeType("application/pdf");
+        gateway->setMimeTypeAccessControlAction(utilities::accessControlAction::allow);
+        gateway->setPollInterval(opts.poll, std::max(opts.poll, std::chrono::milliseconds(1000)));
+        gateway->setStateDirectory(work / "state");
+        gateway->setErrorCallback([&](const abstractGateway&, const std::string& message, void *){ events.error(message); });
+        gateway->setWarningCallback([&](const abstractGateway&, const std::string& message, void *){ events.error(message); });
+        gateway->setCommandReceivedCallback([&](const abstractGateway& sender, command, const std::string&, std::string& text, std::vector<std::unique_ptr<utilities::temporaryFile>>&, void *)
+        {
+            if (!events.received(text)) return false;
+            // Answer some of the posts, as the depot does, so that the outbound path carries a share of the load.
+            if (text.find("reply: yes") != std::string::npos) sender.messageLastPoster("Re: post", "Received.");
+            return true;
+        });
+
+        if (!gateway->start())
+        {
+            std::cerr << config << ": the gateway did not start\n";
+            retval.errors = events.errors() + 1;
+            server.stop();
+            boost::filesystem::remove_all(work);
+            return retval;
+        }
+        gateway->pollAsync();
+
+        std::mt19937_64 random(42);
+        std::string attachment(opts.attachmentSize, '\0');
+        auto serverBefore = server.statistics();
+        auto cpuBefore = processCpuTime();
+        auto generatorBefore = mockDetail::threadCpuTime();
+        auto start = std::chrono::steady_clock::now();
+        std::size_t replies = 0;
+        for (std::size_t i = 0; i < opts.messages; i++)
+        {
+            // Every attachment is different so that none of them is recognised by the attachment cache.
+            for (auto& c : attachment) c = static_cast<char>(random());
+            bool reply = (i % 10) == 0;
+            if (reply) replies++;
+            std::string message = mockMailServer::composeMessage(POSTER, INPUT_CONTACT, "post", "load-id: " + std::to_string(i) + "\r\nreply: " + (reply ? "yes" : "no"),
+                                                                 "payload" + std::to_string(i) + ".pdf", attachment);
+            events.posted(i);
+            deliver(config, server, work, message, i);
+            if (opts.postInterval.count() > 0) std::this_thread::sleep_for(opts.postInterval);
+        }
+
+        bool complete = events.waitFor(opts.messages, opts.timeout);
+        retval.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        // Give the replies a moment to reach the mock SMTP server.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while ((server.smtp().delivered() < replies) && (std::chrono::steady_clock::now() < deadline)) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        auto serverAfter = server.statistics();
+        // Leave out the time spent composing the messages here and answering them in the mock servers.
+        auto cpu = (processCpuTime() - cpuBefore) - (serverAfter.cpu - serverBefore.cpu) - (mockDetail::threadCpuTime() - generatorBefore);
+        retval.latencies = events.latencies();
+        retval.received = retval.latencies.size();
+        retval.cpuPerMessage = (retval.received > 0) ? (std::chrono::duration<double, std::micro>(cpu).count() / static_cast<double>(retval.received)) : 0;
+        retval.server = serverAfter;
+        retval.replies = server.smtp().delivered();
+        if (!complete) std::cerr << config << ": timed out with " << retval.received << " of " << opts.messages << " messages received\n";
+
+        gateway->stop();
+        retval.errors = events.errors();
+        connectionPool::instance().clear();
+        server.stop();
+        boost::filesystem::remove_all(work);
+
+        return retval;
+    }
+
+    double percentile(std::vector<double> values, double p)
+    {
+        if (values.empty()) return 0;
+        std::sort(values.begin(), values.end());
+        auto index = static_cast<std::size_t>(p * static_cast<double>(values.size() - 1) + 0.5);
+
+        return values[std::min(index, values.size() - 1)];
+    }
+
+    void usage()
+    {
+        std::cerr << "Usage: loadGenerator [--messages N] [--population N] [--attachment-size BYTES] [--post-interval MS] [--poll MS] [--latency MS] [--jitter MS]\n"
+                     "                     [--drop PROBABILITY] [--rate COMMANDS_PER_SECOND] [--max-connections N] [--timeout SECONDS]\n"
+                     "                     [--configs imap-poll,imap-push,pop3,maildir] [--verbose]\n";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--verbose")
+        {
+            opts.verbose = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        std::string value = argv[++i];
+        if (arg == "--messages") opts.messages = std::stoul(value);
+        else if (arg == "--population") opts.population = std::stoul(value);
+        else if (arg == "--attachment-size") opts.attachmentSize = std::stoul(value);
+        else if (arg == "--post-interval") opts.postInterval = std::chrono::milliseconds(std::stoul(value));
+        else if (arg == "--poll") opts.poll = std::chrono::milliseconds(std::stoul(value));
+        else if (arg == "--latency") opts.faults.latency = std::chrono::milliseconds(std::stoul(value));
+        else if (arg == "--jitter") opts.faults.jitter = std::chrono::milliseconds(std::stoul(value));
+        else if (arg == "--drop") opts.faults.dropProbability = std::stod(value);
+        else if (arg == "--rate") opts.faults.commandsPerSecond = static_cast<unsigned int>(std::stoul(value));
+        else if (arg == "--max-connections") opts.faults.maxConnections = static_cast<unsigned int>(std::stoul(value));
+        else if (arg == "--timeout") opts.timeout = std::chrono::seconds(std::stoul(value));
+        else if (arg == "--configs") boost::split(opts.configs, value, boost::is_any_of(","));
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto work = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("eunomia-load-%%%%-%%%%");
+    utilities::attachmentCache::instance().setDirectory(work / "cache");
+    telemeteryServices::outboundMailQueue::instance().setSpoolDirectory(work / "spool");
+
+    std::cout << std::left << std::setw(11) << "config" << std::right << std::setw(9) << "received" << std::setw(10) << "msg/s" << std::setw(10) << "p50 ms"
+              << std::setw(10) << "p95 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << std::setw(12) << "cpu us/msg" << std::setw(9) << "replies"
+              << std::setw(10) << "commands" << std::setw(7) << "drops" << std::setw(8) << "errors" << "\n";
+    int status = EXIT_SUCCESS;
+    for (const auto& config : opts.configs)
+    {
+        results r;
+        try
+        {
+            r = run(config, opts);
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << config << ": " << ex.what() << "\n";
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (r.received < opts.messages) status = EXIT_FAILURE;
+
+        std::cout << std::left << std::setw(11) << config << std::right << std::fixed << std::setprecision(1) << std::setw(9) << r.received
+                  << std::setw(10) << ((r.seconds > 0) ? (static_cast<double>(r.received) / r.seconds) : 0.0) << std::setw(10) << percentile(r.latencies, 0.50)
+                  << std::setw(10) << percentile(r.latencies, 0.95) << std::setw(10) << percentile(r.latencies, 0.99) << std::setw(10) << percentile(r.latencies, 1.0)
+                  << std::setw(12) << r.cpuPerMessage << std::setw(9) << r.replies << std::setw(10) << r.server.commands << std::setw(7) << r.server.drops
+                  << std::setw(8) << r.errors << "\n";
+    }
+
+    telemeteryServices::pollScheduler::instance().shutdown();
+    telemeteryServices::outboundMailQueue::instance().shutdown();
+    telemeteryServices::connectionPool::instance().clear();
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(work, ec);
+
+    return status;
+}
@@ -0,0 +1,2368 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: mockMailServer.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MOCK_MAIL_SERVER_HPP_
+#define _MOCK_MAIL_SERVER_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <boost/algorithm/string.hpp>
+
+/*
+ * A small IMAP4rev1, POP3 and SMTP server for exercising the gateways on localhost without a real mail provider. It implements as much of each protocol
+ * as vmime and the gateways use, keeps its single mailbox in memory and can be told to add latency, throttle, refuse connections and cut connections
+ * at random. All of them use TLS with a throw-away self-signed certificate for "localhost": IMAP and POP3 from the outset (imaps, pop3s) and SMTP after
+ * STARTTLS.
+ */
+
+namespace telemeteryServices
+{
+    /**
+     * The faults a mock server injects.
+     */
+    struct mockFaultProfile
+    {
+        // Added before every response.
+        std::chrono::milliseconds latency{ 0 };
+        // Up to this much more is added at random.
+        std::chrono::milliseconds jitter{ 0 };
+        // The chance that a connection is cut instead of a command being answered.
+        double dropProbability = 0.0;
+        // Commands answered per second across all connections, 0 for no limit; commands over the limit are held back.
+        unsigned int commandsPerSecond = 0;
+        // Connections served at once, 0 for no limit; connections over the limit are refused.
+        unsigned int maxConnections = 0;
+    };
+
+    struct mockServerStatistics
+    {
+        std::uint64_t connections = 0;
+        std::uint64_t refused = 0;
+        std::uint64_t commands = 0;
+        std::uint64_t drops = 0;
+        std::chrono::nanoseconds cpu{ 0 };
+    };
+
+    namespace mockDetail
+    {
+        inline std::string upper(std::string s)
+        {
+            boost::to_upper(s);
+            return s;
+        }
+
+        /**
+         * Formats a string as an IMAP quoted string, or as a literal if it cannot be quoted.
+         */
+        inline std::string imapString(const std::string& s)
+        {
+            bool literal = false;
+            for (unsigned char c : s)
+            {
+                if ((c == '\r') || (c == '\n') || (c >= 0x80)) literal = true;
+            }
+            if (literal) return "{" + std::to_string(s.size()) + "}\r\n" + s;
+
+            std::string retval = "\"";
+            for (char c : s)
+            {
+                if ((c == '"') || (c == '\\')) retval.push_back('\\');
+                retval.push_back(c);
+            }
+
+            return retval + "\"";
+        }
+
+        inline std::string imapNString(const std::string& s)
+        {
+            return s.empty() ? "NIL" : imapString(s);
+        }
+
+        inline std::string base64Decode(const std::string& in)
+        {
+            static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string retval;
+            unsigned int buffer = 0;
+            int bits = 0;
+            for (char c : in)
+            {
+                auto pos = alphabet.find(c);
+                if (pos == std::string::npos) continue;
+                buffer = (buffer << 6) | static_cast<unsigned int>(pos);
+                bits += 6;
+                if (bits >= 8)
+                {
+                    bits -= 8;
+                    retval.push_back(static_cast<char>((buffer >> bits) & 0xFF));
+                }
+            }
+
+            return retval;
+        }
+
+        inline std::string base64Encode(const std::string& in, std::size_t lineLength = 0)
+        {
+            static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string retval;
+            std::size_t column = 0;
+            for (std::size_t i = 0; i < in.size(); i += 3)
+            {
+                unsigned int n = static_cast<unsigned char>(in[i]) << 16;
+                if (i + 1 < in.size()) n |= static_cast<unsigned char>(in[i + 1]) << 8;
+                if (i + 2 < in.size()) n |= static_cast<unsigned char>(in[i + 2]);
+                retval.push_back(alphabet[(n >> 18) & 63]);
+                retval.push_back(alphabet[(n >> 12) & 63]);
+                retval.push_back((i + 1 < in.size()) ? alphabet[(n >> 6) & 63] : '=');
+                retval.push_back((i + 2 < in.size()) ? alphabet[n & 63] : '=');
+                column += 4;
+                if ((lineLength > 0) && (column >= lineLength))
+                {
+                    retval += "\r\n";
+                    column = 0;
+                }
+            }
+            if ((lineLength > 0) && (column > 0)) retval += "\r\n";
+
+            return retval;
+        }
+
+        /**
+         * Converts bare line feeds to CRLF, which is how messages are kept.
+         */
+        inline std::string canonicalLineEndings(const std::string& in)
+        {
+            std::string retval;
+            retval.reserve(in.size() + in.size() / 32);
+            for (std::size_t i = 0; i < in.size(); i++)
+            {
+                if ((in[i] == '\n') && ((i == 0) || (in[i - 1] != '\r'))) retval.push_back('\r');
+                retval.push_back(in[i]);
+            }
+
+            return retval;
+        }
+
+        /**
+         * Splits IMAP command arguments at the top level, keeping parenthesised and bracketed groups together and unquoting quoted strings.
+         */
+        inline std::vector<std::string> tokenize(const std::string& s)
+        {
+            std::vector<std::string> retval;
+            std::size_t i = 0;
+            while (i < s.size())
+            {
+                while ((i < s.size()) && (s[i] == ' ')) i++;
+                if (i >= s.size()) break;
+
+                std::string token;
+                if (s[i] == '"')
+                {
+                    for (i++; (i < s.size()) && (s[i] != '"'); i++)
+                    {
+                        if ((s[i] == '\\') && (i + 1 < s.size())) i++;
+                        token.push_back(s[i]);
+                    }
+                    i++;
+                }
+                else
+                {
+                    int depth = 0;
+                    bool quoted = false;
+                    for (; i < s.size(); i++)
+                    {
+                        char c = s[i];
+                        if (quoted)
+                        {
+                            if ((c == '\\') && (i + 1 < s.size())) token.push_back(s[i++]);
+                            else if (c == '"') quoted = false;
+                        }
+                        else if (c == '"') quoted = true;
+                        else if ((c == '(') || (c == '[')) depth++;
+                        else if ((c == ')') || (c == ']')) depth--;
+                        else if ((c == ' ') && (depth <= 0)) break;
+                        token.push_back(s[i]);
+                    }
+                }
+                retval.push_back(token);
+            }
+
+            return retval;
+        }
+
+        inline std::string stripParentheses(const std::string& s)
+        {
+            if ((s.size() >= 2) && (s.front() == '(') && (s.back() == ')')) return s.substr(1, s.size() - 2);
+            return s;
+        }
+
+        /**
+         * Gets the number of days since the epoch of an IMAP date ("1-Feb-2021").
+         */
+        inline long imapDay(const std::string& s)
+        {
+            static const char *months[] = { "JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC" };
+            std::vector<std::string> parts;
+            boost::split(parts, s, boost::is_any_of("-"));
+            if (parts.size() != 3) throw std::invalid_argument("bad date");
+            std::tm tm1{};
+            tm1.tm_mday = std::stoi(parts[0]);
+            tm1.tm_year = std::stoi(parts[2]) - 1900;
+            tm1.tm_mon = -1;
+            for (int m = 0; m < 12; m++)
+            {
+                if (upper(parts[1]) == months[m]) tm1.tm_mon = m;
+            }
+            if (tm1.tm_mon < 0) throw std::invalid_argument("bad date");
+
+            return static_cast<long>(timegm(&tm1) / 86400);
+        }
+
+        inline std::string imapDateTime(std::time_t t)
+        {
+            std::tm tm1{};
+            gmtime_r(&t, &tm1);
+            char buffer[64];
+            std::strftime(buffer, sizeof(buffer), "%d-%b-%Y %H:%M:%S +0000", &tm1);
+
+            return buffer;
+        }
+
+        inline std::string rfc2822DateTime(std::time_t t)
+        {
+            std::tm tm1{};
+            gmtime_r(&t, &tm1);
+            char buffer[64];
+            std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S +0000", &tm1);
+
+            return buffer;
+        }
+
+        inline std::chrono::nanoseconds threadCpuTime()
+        {
+            timespec ts{};
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+        }
+    }
+
+    /**
+     * The MIME structure of a message, as offsets into its text, from which the mock IMAP server answers ENVELOPE, BODYSTRUCTURE and BODY[section].
+     */
+    struct mockMimePart
+    {
+        std::size_t headerBegin = 0;
+        std::size_t headerLength = 0;
+        std::size_t bodyBegin = 0;
+        std::size_t bodyLength = 0;
+        std::vector<std::pair<std::string, std::string>> fields;
+        std::string type = "TEXT";
+        std::string subtype = "PLAIN";
+        std::vector<std::pair<std::string, std::string>> parameters;
+        std::string encoding = "7BIT";
+        std::size_t lines = 0;
+        // The parts of a multipart, or the one embedded message of a message/rfc822 part.
+        std::vector<mockMimePart> children;
+
+        [[nodiscard]] bool multipart() const
+        {
+            return type == "MULTIPART";
+        }
+
+        [[nodiscard]] bool embeddedMessage() const
+        {
+            return (type == "MESSAGE") && (subtype == "RFC822");
+        }
+
+        [[nodiscard]] std::string field(const std::string& name) const
+        {
+            for (const auto& [n, v] : fields)
+            {
+                if (boost::iequals(n, name)) return v;
+            }
+
+            return "";
+        }
+
+        [[nodiscard]] std::string parameter(const std::string& name) const
+        {
+            for (const auto& [n, v] : parameters)
+            {
+                if (boost::iequals(n, name)) return v;
+            }
+
+            return "";
+        }
+
+        static mockMimePart parse(const std::string& data, std::size_t begin, std::size_t end)
+        {
+            mockMimePart part;
+            part.headerBegin = begin;
+            if (data.compare(begin, 2, "\r\n") == 0)
+            {
+                part.headerLength = 2;
+            }
+            else
+            {
+                auto pos = data.find("\r\n\r\n", begin);
+                part.headerLength = ((pos == std::string::npos) || (pos + 4 > end)) ? (end - begin) : (pos + 4 - begin);
+            }
+            part.bodyBegin = begin + part.headerLength;
+            part.bodyLength = end - part.bodyBegin;
+            part.lines = static_cast<std::size_t>(std::count(data.begin() + static_cast<std::ptrdiff_t>(part.bodyBegin), data.begin() + static_cast<std::ptrdiff_t>(end), '\n'));
+
+            // Unfold the header fields.
+            std::istringstream iss(data.substr(begin, part.headerLength));
+            std::string line;
+            while (std::getline(iss, line))
+            {
+                if (!line.empty() && (line.back() == '\r')) line.pop_back();
+                if (line.empty()) continue;
+                if (((line[0] == ' ') || (line[0] == '\t')) && !part.fields.empty())
+                {
+                    part.fields.back().second += line;
+                    continue;
+                }
+                auto colon = line.find(':');
+                if (colon == std::string::npos) continue;
+                part.fields.emplace_back(boost::trim_copy(line.substr(0, colon)), boost::trim_copy(line.substr(colon + 1)));
+            }
+
+            std::string contentType = part.field("Content-Type");
+            if (!contentType.empty())
+            {
+                std::vector<std::string> items;
+                std::string item;
+                bool quoted = false;
+                for (char c : contentType)
+                {
+                    if (c == '"') quoted = !quoted;
+                    if ((c == ';') && !quoted)
+                    {
+                        items.push_back(boost::trim_copy(item));
+                        item.clear();
+                    }
+                    else
+                    {
+                        item.push_back(c);
+                    }
+                }
+                items.push_back(boost::trim_copy(item));
+
+                auto slash = items[0].find('/');
+                if (slash != std::string::npos)
+                {
+                    part.type = mockDetail::upper(boost::trim_copy(items[0].substr(0, slash)));
+                    part.subtype = mockDetail::upper(boost::trim_copy(items[0].substr(slash + 1)));
+                }
+                for (std::size_t i = 1; i < items.size(); i++)
+                {
+                    auto eq = items[i].find('=');
+                    if (eq == std::string::npos) continue;
+                    std::string value = boost::trim_copy(items[i].substr(eq + 1));
+                    if ((value.size() >= 2) && (value.front() == '"')) value = value.substr(1, value.size() - 2);
+                    part.parameters.emplace_back(mockDetail::upper(boost::trim_copy(items[i].substr(0, eq))), value);
+                }
+            }
+            if (part.parameters.empty() && (part.type == "TEXT")) part.parameters.emplace_back("CHARSET", "us-ascii");
+            std::string encoding = part.field("Content-Transfer-Encoding");
+            if (!encoding.empty()) part.encoding = mockDetail::upper(encoding);
+
+            if (part.multipart())
+            {
+                std::string delimiter = "--" + part.parameter("BOUNDARY");
+                std::size_t childBegin = std::string::npos;
+                std::size_t pos = part.bodyBegin;
+                while (pos < end)
+                {
+                    auto eol = data.find("\r\n", pos);
+                    if ((eol == std::string::npos) || (eol > end)) eol = end;
+                    if ((delimiter.size() > 2) && (data.compare(pos, delimiter.size(), delimiter) == 0))
+                    {
+                        // The line break before a delimiter belongs to the delimiter.
+                        if (childBegin != std::string::npos) part.children.push_back(parse(data, childBegin, std::max(childBegin, pos - 2)));
+                        if (data.compare(pos + delimiter.size(), 2, "--") == 0) break;
+                        childBegin = std::min(eol + 2, end);
+                    }
+                    pos = eol + 2;
+                }
+            }
+            else if (part.embeddedMessage())
+            {
+                part.children.push_back(parse(data, part.bodyBegin, end));
+            }
+
+            return part;
+        }
+    };
+
+    struct mockStoredMessage
+    {
+        std::uint32_t uid = 0;
+        std::string data;
+        mockMimePart structure;
+        std::time_t internalDate = 0;
+    };
+
+    /**
+     * The single mailbox ("INBOX") served by the mock IMAP server and delivered into by the mock SMTP server.
+     */
+    class mockMailbox
+    {
+    private:
+        struct entry
+        {
+            std::shared_ptr<const mockStoredMessage> message;
+            std::set<std::string> flags;
+            std::uint64_t modSeq;
+        };
+
+        mutable std::mutex _mutex;
+        std::condition_variable _changed;
+        std::map<std::uint32_t, entry> _messages;
+        std::uint32_t _uidValidity;
+        std::uint32_t _uidNext;
+        std::uint64_t _highestModSeq;
+        std::uint64_t _generation;
+        std::uint64_t _moved;
+
+    public:
+        mockMailbox()
+        {
+            _uidValidity = static_cast<std::uint32_t>(std::time(nullptr));
+            _uidNext = 1;
+            _highestModSeq = 1;
+            _generation = 0;
+            _moved = 0;
+        }
+
+        std::uint32_t append(const std::string& data, std::time_t internalDate = std::time(nullptr))
+        {
+            auto message = std::make_shared<mockStoredMessage>();
+            message->data = mockDetail::canonicalLineEndings(data);
+            message->structure = mockMimePart::parse(message->data, 0, message->data.size());
+            message->internalDate = internalDate;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            message->uid = _uidNext++;
+            _messages.emplace(message->uid, entry{ message, {}, ++_highestModSeq });
+            _generation++;
+            _changed.notify_all();
+
+            return message->uid;
+        }
+
+        [[nodiscard]] std::vector<std::uint32_t> uids() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            std::vector<std::uint32_t> retval;
+            retval.reserve(_messages.size());
+            for (const auto& [uid, e] : _messages) retval.push_back(uid);
+
+            return retval;
+        }
+
+        [[nodiscard]] std::shared_ptr<const mockStoredMessage> find(std::uint32_t uid) const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _messages.find(uid);
+            return (it == _messages.end()) ? nullptr : it->second.message;
+        }
+
+        [[nodiscard]] std::set<std::string> flags(std::uint32_t uid) const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _messages.find(uid);
+            return (it == _messages.end()) ? std::set<std::string>() : it->second.flags;
+        }
+
+        [[nodiscard]] std::uint64_t modSeq(std::uint32_t uid) const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _messages.find(uid);
+            return (it == _messages.end()) ? 0 : it->second.modSeq;
+        }
+
+        /**
+         * Changes the flags of a message.
+         * @param mode '+' to add, '-' to remove, anything else to replace.
+         */
+        void storeFlags(std::uint32_t uid, char mode, const std::set<std::string>& flags)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _messages.find(uid);
+            if (it == _messages.end()) return;
+            if (mode == '+') it->second.flags.insert(flags.begin(), flags.end());
+            else if (mode == '-') for (const auto& f : flags) it->second.flags.erase(f);
+            else it->second.flags = flags;
+            it->second.modSeq = ++_highestModSeq;
+        }
+
+        /**
+         * Removes the messages flagged \Deleted, or only those of them in the given set.
+         */
+        void expunge(const std::set<std::uint32_t> *only = nullptr)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto it = _messages.begin(); it != _messages.end(); )
+            {
+                if (it->second.flags.contains("\\Deleted") && (!only || only->contains(it->first)))
+                {
+                    it = _messages.erase(it);
+                    _generation++;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            _highestModSeq++;
+            _changed.notify_all();
+        }
+
+        /**
+         * Moves messages out of the mailbox; the mock keeps a count of them rather than a second mailbox.
+         */
+        void move(const std::set<std::uint32_t>& uids)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto uid : uids)
+            {
+                if (_messages.erase(uid) > 0) _moved++;
+            }
+            _generation++;
+            _highestModSeq++;
+            _changed.notify_all();
+        }
+
+        /**
+         * Removes messages outright, as a POP3 server does with those deleted in a session.
+         */
+        void remove(const std::set<std::uint32_t>& uids)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto uid : uids) _messages.erase(uid);
+            _generation++;
+            _highestModSeq++;
+            _changed.notify_all();
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _messages.clear();
+            _generation++;
+            _changed.notify_all();
+        }
+
+        [[nodiscard]] std::size_t count() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _messages.size();
+        }
+
+        [[nodiscard]] std::size_t unseen() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return static_cast<std::size_t>(std::count_if(_messages.begin(), _messages.end(), [](const auto& m){ return !m.second.flags.contains("\\Seen"); }));
+        }
+
+        [[nodiscard]] std::uint32_t uidValidity() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _uidValidity;
+        }
+
+        [[nodiscard]] std::uint32_t uidNext() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _uidNext;
+        }
+
+        [[nodiscard]] std::uint64_t highestModSeq() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _highestModSeq;
+        }
+
+        [[nodiscard]] std::uint64_t generation() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _generation;
+        }
+
+        [[nodiscard]] std::uint64_t moved() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _moved;
+        }
+
+        /**
+         * Waits until messages have been added or removed since the given generation, or the timeout passes.
+         */
+        bool waitForChange(std::uint64_t generation, std::chrono::milliseconds timeout)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _changed.wait_for(lock, timeout, [&]{ return _generation != generation; });
+        }
+    };
+
+    /**
+     * A server side TLS context with a freshly generated, self-signed certificate for localhost.
+     */
+    class mockTlsContext
+    {
+    private:
+        SSL_CTX *_context;
+
+    public:
+        mockTlsContext()
+        {
+            EVP_PKEY *key = EVP_RSA_gen(2048);
+            X509 *cert = X509_new();
+            X509_set_version(cert, 2);
+            ASN1_INTEGER_set(X509_get_serialNumber(cert), static_cast<long>(std::time(nullptr)));
+            X509_gmtime_adj(X509_getm_notBefore(cert), -86400);
+            X509_gmtime_adj(X509_getm_notAfter(cert), 86400L * 30);
+            X509_set_pubkey(cert, key);
+            X509_NAME *name = X509_get_subject_name(cert);
+            X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+            X509_set_issuer_name(cert, name);
+            X509V3_CTX ctx;
+            X509V3_set_ctx_nodb(&ctx);
+            X509V3_set_ctx(&ctx, cert, cert, nullptr, nullptr, 0);
+            X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &ctx, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+            if (ext)
+            {
+                X509_add_ext(cert, ext, -1);
+                X509_EXTENSION_free(ext);
+            }
+            X509_sign(cert, key, EVP_sha256());
+
+            _context = SSL_CTX_new(TLS_server_method());
+            SSL_CTX_use_certificate(_context, cert);
+            SSL_CTX_use_PrivateKey(_context, key);
+            X509_free(cert);
+            EVP_PKEY_free(key);
+            if (!SSL_CTX_check_private_key(_context)) throw std::runtime_error("Could not create the mock server certificate");
+        }
+
+        mockTlsContext(const mockTlsContext& other) = delete;
+        mockTlsContext& operator=(const mockTlsContext& other) = delete;
+
+        ~mockTlsContext()
+        {
+            SSL_CTX_free(_context);
+        }
+
+        [[nodiscard]] SSL_CTX *get() const
+        {
+            return _context;
+        }
+    };
+
+    /**
+     * One client connection to a mock server, in clear or over TLS.
+     */
+    class mockConnection
+    {
+    private:
+        int _fd;
+        SSL *_ssl;
+        std::string _buffer;
+
+        int fill(int timeoutMs)
+        {
+            if (!_ssl || (SSL_pending(_ssl) == 0))
+            {
+                pollfd pfd{ _fd, POLLIN, 0 };
+                int ready = ::poll(&pfd, 1, timeoutMs);
+                if (ready == 0) return 0;
+                if (ready < 0) return -1;
+            }
+
+            char chunk[16384];
+            int n = _ssl ? SSL_read(_ssl, chunk, sizeof(chunk)) : static_cast<int>(::recv(_fd, chunk, sizeof(chunk), 0));
+            if (n <= 0) return -1;
+            _buffer.append(chunk, static_cast<std::size_t>(n));
+
+            return 1;
+        }
+
+    public:
+        explicit mockConnection(int fd)
+        {
+            _fd = fd;
+            _ssl = nullptr;
+        }
+
+        mockConnection(const mockConnection& other) = delete;
+        mockConnection& operator=(const mockConnection& other) = delete;
+
+        ~mockConnection()
+        {
+            close();
+        }
+
+        bool startTls(SSL_CTX *context)
+        {
+            _buffer.clear();
+            _ssl = SSL_new(context);
+            SSL_set_fd(_ssl, _fd);
+            if (SSL_accept(_ssl) != 1)
+            {
+                ERR_clear_error();
+                return false;
+            }
+
+            return true;
+        }
+
+        [[nodiscard]] bool secure() const
+        {
+            return _ssl != nullptr;
+        }
+
+        /**
+         * Reads a line without its terminator.
+         * @return 1 if a line was read, 0 if the timeout passed first, -1 if the connection was closed.
+         */
+        int readLine(std::string& line, int timeoutMs = -1)
+        {
+            while (true)
+            {
+                auto pos = _buffer.find("\r\n");
+                if (pos != std::string::npos)
+                {
+                    line = _buffer.substr(0, pos);
+                    _buffer.erase(0, pos + 2);
+                    return 1;
+                }
+                int r = fill(timeoutMs);
+                if (r <= 0) return r;
+            }
+        }
+
+        bool readBytes(std::size_t count, std::string& out)
+        {
+            while (_buffer.size() < count)
+            {
+                if (fill(-1) <= 0) return false;
+            }
+            out = _buffer.substr(0, count);
+            _buffer.erase(0, count);
+
+            return true;
+        }
+
+        bool write(const std::string& data)
+        {
+            std::size_t sent = 0;
+            while (sent < data.size())
+            {
+                int n = _ssl ? SSL_write(_ssl, data.data() + sent, static_cast<int>(data.size() - sent))
+                             : static_cast<int>(::send(_fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL));
+                if (n <= 0) return false;
+                sent += static_cast<std::size_t>(n);
+            }
+
+            return true;
+        }
+
+        /**
+         * Cuts the connection without any goodbye, as a failing server or network would.
+         */
+        void abort()
+        {
+            if (_fd >= 0) ::shutdown(_fd, SHUT_RDWR);
+        }
+
+        void close()
+        {
+            if (_ssl)
+            {
+                SSL_free(_ssl);
+                _ssl = nullptr;
+            }
+            if (_fd >= 0)
+            {
+                ::close(_fd);
+                _fd = -1;
+            }
+        }
+    };
+
+    /**
+     * The listening socket, connection threads, fault injection and accounting shared by the mock servers.
+     */
+    class mockServerBase
+    {
+    private:
+        int _listenFd;
+        unsigned short _port;
+        std::thread _acceptThread;
+        std::list<std::thread> _sessions;
+        std::set<int> _active;
+        mutable std::mutex _mutex;
+        std::mt19937_64 _random;
+        std::chrono::steady_clock::time_point _nextToken;
+        std::atomic<std::uint64_t> _connections;
+        std::atomic<std::uint64_t> _refused;
+        std::atomic<std::uint64_t> _commands;
+        std::atomic<std::uint64_t> _drops;
+        std::atomic<std::int64_t> _cpu;
+
+        void acceptLoop()
+        {
+            while (_running)
+            {
+                int fd = ::accept(_listenFd, nullptr, nullptr);
+                if (fd < 0)
+                {
+                    if (!_running) break;
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> lock(_mutex);
+                _connections++;
+                bool refuse = (_faults.maxConnections > 0) && (_active.size() >= _faults.maxConnections);
+                if (refuse) _refused++;
+                _active.insert(fd);
+                _sessions.emplace_back([this, fd, refuse]
+                {
+                    auto start = mockDetail::threadCpuTime();
+                    try
+                    {
+                        mockConnection connection(fd);
+                        serve(connection, refuse);
+                    }
+                    catch (const std::exception&)
+                    {
+                        // The client went away.
+                    }
+                    _cpu += (mockDetail::threadCpuTime() - start).count();
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _active.erase(fd);
+                });
+            }
+        }
+
+    protected:
+        std::atomic<bool> _running;
+        mockFaultProfile _faults;
+        mockTlsContext& _tls;
+
+        /**
+         * Runs a session on a newly accepted connection.
+         * @param refuse true if the server is at its connection limit and should turn the client away.
+         */
+        virtual void serve(mockConnection& connection, bool refuse) = 0;
+
+        /**
+         * Applies the fault profile before a command is answered.
+         * @return false if the connection should be cut instead.
+         */
+        bool beforeResponse(mockConnection& connection)
+        {
+            _commands++;
+            std::chrono::milliseconds delay = _faults.latency;
+            bool drop = false;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_faults.jitter.count() > 0) delay += std::chrono::milliseconds(std::uniform_int_distribution<std::int64_t>(0, _faults.jitter.count())(_random));
+                if (_faults.dropProbability > 0.0) drop = std::uniform_real_distribution<double>(0.0, 1.0)(_random) < _faults.dropProbability;
+                if (_faults.commandsPerSecond > 0)
+                {
+                    // A token bucket one command deep, which spaces the commands out evenly.
+                    auto now = std::chrono::steady_clock::now();
+                    _nextToken = std::max(_nextToken, now) + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(1)) / _faults.commandsPerSecond;
+                    delay += std::chrono::duration_cast<std::chrono::milliseconds>(_nextToken - now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(1)) / _faults.commandsPerSecond);
+                }
+            }
+            if (delay.count() > 0) std::this_thread::sleep_for(delay);
+            if (drop)
+            {
+                _drops++;
+                connection.abort();
+                return false;
+            }
+
+            return true;
+        }
+
+    public:
+        explicit mockServerBase(mockTlsContext& tls) : _tls(tls)
+        {
+            _listenFd = -1;
+            _port = 0;
+            _running = false;
+            _random.seed(std::random_device()());
+            _connections = 0;
+            _refused = 0;
+            _commands = 0;
+            _drops = 0;
+            _cpu = 0;
+        }
+
+        mockServerBase(const mockServerBase& other) = delete;
+        mockServerBase& operator=(const mockServerBase& other) = delete;
+
+        virtual ~mockServerBase()
+        {
+            stop();
+        }
+
+        void setFaults(const mockFaultProfile& faults)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _faults = faults;
+        }
+
+        /**
+         * Starts listening on the loopback interface.
+         * @param port The port to listen on, 0 for one chosen by the system.
+         */
+        void start(unsigned short port = 0)
+        {
+            if (_running) return;
+
+            // TLS writes to a client that has gone away must fail rather than raise SIGPIPE.
+            ::signal(SIGPIPE, SIG_IGN);
+            _listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+            int yes = 1;
+            ::setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(port);
+            if ((::bind(_listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) || (::listen(_listenFd, 128) != 0))
+            {
+                ::close(_listenFd);
+                _listenFd = -1;
+                throw std::runtime_error("The mock server could not listen on port " + std::to_string(port));
+            }
+            socklen_t length = sizeof(address);
+            ::getsockname(_listenFd, reinterpret_cast<sockaddr *>(&address), &length);
+            _port = ntohs(address.sin_port);
+
+            _running = true;
+            _acceptThread = std::thread(&mockServerBase::acceptLoop, this);
+        }
+
+        void stop()
+        {
+            if (!_running) return;
+            _running = false;
+            ::shutdown(_listenFd, SHUT_RDWR);
+            ::close(_listenFd);
+            if (_acceptThread.joinable()) _acceptThread.join();
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (int fd : _active) ::shutdown(fd, SHUT_RDWR);
+            }
+            for (auto& t : _sessions)
+            {
+                if (t.joinable()) t.join();
+            }
+            _sessions.clear();
+        }
+
+        [[nodiscard]] unsigned short port() const
+        {
+            return _port;
+        }
+
+        [[nodiscard]] std::size_t activeConnections() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _active.size();
+        }
+
+        /**
+         * Gets the counters, including the processor time spent by finished sessions.
+         */
+        [[nodiscard]] mockServerStatistics statistics() const
+        {
+            mockServerStatistics retval;
+            retval.connections = _connections;
+            retval.refused = _refused;
+            retval.commands = _commands;
+            retval.drops = _drops;
+            retval.cpu = std::chrono::nanoseconds(_cpu.load());
+
+            return retval;
+        }
+
+    protected:
+        /**
+         * Adds the processor time a session has used so far; sessions call this as they go so that long lived connections are counted too.
+         */
+        void accountCpu(std::chrono::nanoseconds& mark)
+        {
+            auto now = mockDetail::threadCpuTime();
+            _cpu += (now - mark).count();
+            mark = now;
+        }
+    };
+
+    /**
+     * A mock IMAP4rev1 server with the IDLE, UIDPLUS, MOVE and CONDSTORE extensions, serving one mailbox.
+     */
+    class mockImapServer final : public mockServerBase
+    {
+    private:
+        mockMailbox& _mailbox;
+        std::string _username;
+        std::string _password;
+
+        static constexpr const char *CAPABILITIES = "IMAP4rev1 AUTH=PLAIN IDLE UIDPLUS MOVE CONDSTORE ENABLE LITERAL+";
+
+        struct session
+        {
+            mockConnection& connection;
+            bool authenticated = false;
+            bool selected = false;
+            bool readOnly = false;
+            std::vector<std::uint32_t> view;
+            std::uint64_t viewGeneration = 0;
+
+            explicit session(mockConnection& c) : connection(c)
+            {
+            }
+        };
+
+        [[nodiscard]] bool checkCredentials(const std::string& username, const std::string& password) const
+        {
+            return _username.empty() || ((username == _username) && (password == _password));
+        }
+
+        /**
+         * Reads a command line, taking in any literals it carries as quoted strings.
+         */
+        static int readCommand(mockConnection& connection, std::string& line)
+        {
+            int r = connection.readLine(line);
+            if (r <= 0) return r;
+
+            while (!line.empty() && (line.back() == '}'))
+            {
+                auto open = line.rfind('{');
+                if (open == std::string::npos) break;
+                std::string count = line.substr(open + 1, line.size() - open - 2);
+                bool nonSynchronising = !count.empty() && (count.back() == '+');
+                if (nonSynchronising) count.pop_back();
+                std::size_t length = std::stoul(count);
+                if (!nonSynchronising && !connection.write("+ Ready for literal data\r\n")) return -1;
+                std::string literal;
+                if (!connection.readBytes(length, literal)) return -1;
+                std::string rest;
+                if (connection.readLine(rest) <= 0) return -1;
+                line = line.substr(0, open) + mockDetail::imapString(literal) + rest;
+            }
+
+            return 1;
+        }
+
+        /**
+         * Brings the session's view of the mailbox up to date, reporting what has changed.
+         * @param expunges false while answering a command during which EXPUNGE responses are not allowed.
+         */
+        std::string synchronise(session& s, bool expunges = true)
+        {
+            if (!s.selected) return "";
+            auto generation = _mailbox.generation();
+            if (generation == s.viewGeneration) return "";
+
+            std::string retval;
+            auto current = _mailbox.uids();
+            std::set<std::uint32_t> present(current.begin(), current.end());
+            if (expunges)
+            {
+                for (std::size_t i = s.view.size(); i-- > 0; )
+                {
+                    if (present.contains(s.view[i])) continue;
+                    retval += "* " + std::to_string(i + 1) + " EXPUNGE\r\n";
+                    s.view.erase(s.view.begin() + static_cast<std::ptrdiff_t>(i));
+                }
+            }
+            std::size_t before = s.view.size();
+            std::uint32_t highest = s.view.empty() ? 0 : s.view.back();
+            for (auto uid : current)
+            {
+                if (uid > highest) s.view.push_back(uid);
+            }
+            if (s.view.size() != before) retval += "* " + std::to_string(s.view.size()) + " EXISTS\r\n";
+            if (expunges) s.viewGeneration = generation;
+
+            return retval;
+        }
+
+        /**
+         * Resolves a sequence set (of message numbers or UIDs) to positions in the session's view.
+         */
+        static std::vector<std::size_t> resolve(const session& s, const std::string& set, bool byUid)
+        {
+            std::set<std::size_t> positions;
+            if (s.view.empty()) return {};
+            std::uint64_t star = byUid ? s.view.back() : s.view.size();
+            std::vector<std::string> ranges;
+            boost::split(ranges, set, boost::is_any_of(","));
+            for (const auto& range : ranges)
+            {
+                auto colon = range.find(':');
+                std::string a = range.substr(0, colon);
+                std::string b = (colon == std::string::npos) ? a : range.substr(colon + 1);
+                std::uint64_t low = (a == "*") ? star : std::stoull(a);
+                std::uint64_t high = (b == "*") ? star : std::stoull(b);
+                if (low > high) std::swap(low, high);
+                for (std::size_t i = 0; i < s.view.size(); i++)
+                {
+                    std::uint64_t key = byUid ? s.view[i] : (i + 1);
+                    if ((key >= low) && (key <= high)) positions.insert(i);
+                }
+            }
+
+            return { positions.begin(), positions.end() };
+        }
+
+        static std::string addressList(const std::string& value)
+        {
+            if (value.empty()) return "NIL";
+
+            std::vector<std::string> addresses;
+            std::string current;
+            bool quoted = false;
+            int angle = 0;
+            for (char c : value)
+            {
+                if (c == '"') quoted = !quoted;
+                else if (!quoted && (c == '<')) angle++;
+                else if (!quoted && (c == '>')) angle--;
+                if ((c == ',') && !quoted && (angle == 0))
+                {
+                    addresses.push_back(current);
+                    current.clear();
+                }
+                else
+                {
+                    current.push_back(c);
+                }
+            }
+            addresses.push_back(current);
+
+            std::string retval = "(";
+            for (auto address : addresses)
+            {
+                boost::trim(address);
+                if (address.empty()) continue;
+                std::string name;
+                std::string email = address;
+                auto lt = address.find('<');
+                if (lt != std::string::npos)
+                {
+                    name = boost::trim_copy(address.substr(0, lt));
+                    if ((name.size() >= 2) && (name.front() == '"')) name = name.substr(1, name.size() - 2);
+                    email = address.substr(lt + 1, address.find('>', lt) - lt - 1);
+                }
+                auto at = email.find('@');
+                std::string mailbox = email.substr(0, at);
+                std::string host = (at == std::string::npos) ? "" : email.substr(at + 1);
+                retval += "(" + mockDetail::imapNString(name) + " NIL " + mockDetail::imapNString(mailbox) + " " + mockDetail::imapNString(host) + ")";
+            }
+
+            return (retval == "(") ? "NIL" : (retval + ")");
+        }
+
+        static std::string envelope(const mockMimePart& message)
+        {
+            std::string from = message.field("From");
+            std::string sender = message.field("Sender");
+            std::string replyTo = message.field("Reply-To");
+
+            return "(" + mockDetail::imapNString(message.field("Date")) + " " + mockDetail::imapNString(message.field("Subject")) + " " + addressList(from) + " " +
+                   addressList(sender.empty() ? from : sender) + " " + addressList(replyTo.empty() ? from : replyTo) + " " + addressList(message.field("To")) + " " +
+                   addressList(message.field("Cc")) + " " + addressList(message.field("Bcc")) + " " + mockDetail::imapNString(message.field("In-Reply-To")) + " " +
+                   mockDetail::imapNString(message.field("Message-ID")) + ")";
+        }
+
+        static std::string bodyStructure(const mockMimePart& part)
+        {
+            if (part.multipart())
+            {
+                std::string retval = "(";
+                for (const auto& child : part.children) retval += bodyStructure(child);
+                if (part.children.empty()) retval += "(\"TEXT\" \"PLAIN\" NIL NIL NIL \"7BIT\" 0 0)";
+                return retval + " " + mockDetail::imapString(part.subtype) + ")";
+            }
+
+            std::string parameters = "NIL";
+            if (!part.parameters.empty())
+            {
+                parameters = "(";
+                for (const auto& [name, value] : part.parameters) parameters += ((parameters.size() > 1) ? " " : "") + mockDetail::imapString(name) + " " + mockDetail::imapString(value);
+                parameters += ")";
+            }
+            std::string retval = "(" + mockDetail::imapString(part.type) + " " + mockDetail::imapString(part.subtype) + " " + parameters + " " +
+                                 mockDetail::imapNString(part.field("Content-ID")) + " " + mockDetail::imapNString(part.field("Content-Description")) + " " +
+                                 mockDetail::imapString(part.encoding) + " " + std::to_string(part.bodyLength);
+            if (part.embeddedMessage() && !part.children.empty()) retval += " " + envelope(part.children[0]) + " " + bodyStructure(part.children[0]) + " " + std::to_string(part.lines);
+            else if (part.type == "TEXT") retval += " " + std::to_string(part.lines);
+
+            return retval + ")";
+        }
+
+        /**
+         * Gets the text of a BODY[section].
+         * @return false if the section does not exist.
+         */
+        static bool section(const mockStoredMessage& message, const std::string& spec, std::string& out)
+        {
+            const std::string& data = message.data;
+            const mockMimePart *current = &message.structure;
+            const mockMimePart *part = &message.structure;
+            std::string rest = mockDetail::upper(spec);
+
+            // Walk the part numbers.
+            bool numbered = false;
+            while (!rest.empty() && std::isdigit(static_cast<unsigned char>(rest[0])))
+            {
+                auto dot = rest.find('.');
+                std::size_t k = std::stoul(rest.substr(0, dot));
+                rest = (dot == std::string::npos) ? "" : rest.substr(dot + 1);
+                if (current->multipart())
+                {
+                    if ((k < 1) || (k > current->children.size())) return false;
+                    part = &current->children[k - 1];
+                }
+                else if (k == 1)
+                {
+                    part = current;
+                }
+                else
+                {
+                    return false;
+                }
+                current = (part->embeddedMessage() && !part->children.empty()) ? &part->children[0] : part;
+                numbered = true;
+            }
+
+            if (rest.empty())
+            {
+                if (!numbered) out = data;
+                else out = data.substr(part->bodyBegin, part->bodyLength);
+                return true;
+            }
+            if (rest == "MIME")
+            {
+                if (!numbered) return false;
+                out = data.substr(part->headerBegin, part->headerLength);
+                return true;
+            }
+
+            // HEADER, TEXT and HEADER.FIELDS apply to the message itself or to an embedded message.
+            const mockMimePart *target = numbered ? current : &message.structure;
+            if (numbered && (target == part) && !part->embeddedMessage()) return false;
+            if (rest == "HEADER")
+            {
+                out = data.substr(target->headerBegin, target->headerLength);
+                return true;
+            }
+            if (rest == "TEXT")
+            {
+                out = data.substr(target->bodyBegin, target->bodyLength);
+                return true;
+            }
+            if (rest.starts_with("HEADER.FIELDS"))
+            {
+                bool negate = rest.starts_with("HEADER.FIELDS.NOT");
+                auto open = rest.find('(');
+                auto close = rest.find(')');
+                std::vector<std::string> names;
+                if ((open != std::string::npos) && (close != std::string::npos)) names = mockDetail::tokenize(rest.substr(open + 1, close - open - 1));
+                out.clear();
+                std::istringstream iss(data.substr(target->headerBegin, target->headerLength));
+                std::string line;
+                bool keep = false;
+                while (std::getline(iss, line))
+                {
+                    if (!line.empty() && (line.back() == '\r')) line.pop_back();
+                    if (line.empty()) break;
+                    if ((line[0] != ' ') && (line[0] != '\t'))
+                    {
+                        std::string name = mockDetail::upper(boost::trim_copy(line.substr(0, line.find(':'))));
+                        keep = (std::find(names.begin(), names.end(), name) != names.end()) != negate;
+                    }
+                    if (keep) out += line + "\r\n";
+                }
+                out += "\r\n";
+                return true;
+            }
+
+            return false;
+        }
+
+        /**
+         * Answers FETCH and UID FETCH.
+         */
+        bool fetch(session& s, const std::string& tag, const std::vector<std::string>& args, bool byUid)
+        {
+            if (args.size() < 2) return s.connection.write(tag + " BAD Missing arguments\r\n");
+
+            std::string itemText = args[1];
+            for (std::size_t i = 2; i < args.size(); i++) itemText += " " + args[i];
+            std::string macro = mockDetail::upper(itemText);
+            if (macro == "ALL") itemText = "(FLAGS INTERNALDATE RFC822.SIZE ENVELOPE)";
+            else if (macro == "FAST") itemText = "(FLAGS INTERNALDATE RFC822.SIZE)";
+            else if (macro == "FULL") itemText = "(FLAGS INTERNALDATE RFC822.SIZE ENVELOPE BODY)";
+            auto items = mockDetail::tokenize(mockDetail::stripParentheses(itemText));
+            if (byUid && std::none_of(items.begin(), items.end(), [](const std::string& i){ return boost::iequals(i, "UID"); })) items.insert(items.begin(), "UID");
+
+            std::string out = synchronise(s, byUid);
+            for (auto position : resolve(s, args[0], byUid))
+            {
+                std::uint32_t uid = s.view[position];
+                auto message = _mailbox.find(uid);
+                if (!message) continue;
+
+                std::string response;
+                bool seen = false;
+                for (const auto& item : items)
+                {
+                    std::string name = mockDetail::upper(item.substr(0, item.find('[')));
+                    if (!response.empty()) response += " ";
+                    if (name == "UID") response += "UID " + std::to_string(uid);
+                    else if (name == "RFC822.SIZE") response += "RFC822.SIZE " + std::to_string(message->data.size());
+                    else if (name == "INTERNALDATE") response += "INTERNALDATE \"" + mockDetail::imapDateTime(message->internalDate) + "\"";
+                    else if (name == "ENVELOPE") response += "ENVELOPE " + envelope(message->structure);
+                    else if ((name == "BODYSTRUCTURE") || (name == "BODY" && (item.find('[') == std::string::npos))) response += name + " " + bodyStructure(message->structure);
+                    else if (name == "MODSEQ") response += "MODSEQ (" + std::to_string(_mailbox.modSeq(uid)) + ")";
+                    else if (name == "FLAGS") response += "FLAGS";
+                    else if ((name == "RFC822") || (name == "RFC822.HEADER") || (name == "RFC822.TEXT") || (name == "BODY") || (name == "BODY.PEEK"))
+                    {
+                        std::string spec;
+                        std::string label = name;
+                        if (name == "RFC822.HEADER") spec = "HEADER";
+                        else if (name == "RFC822.TEXT") spec = "TEXT";
+                        else if (name != "RFC822")
+                        {
+                            auto open = item.find('[');
+                            auto close = item.rfind(']');
+                            spec = item.substr(open + 1, close - open - 1);
+                            label = "BODY[" + mockDetail::upper(spec) + "]";
+                        }
+                        if ((name == "BODY") || (name == "RFC822") || (name == "RFC822.TEXT")) seen = true;
+
+                        std::string data;
+                        if (!section(*message, spec, data)) data.clear();
+                        auto lt = item.find('<', item.rfind(']') == std::string::npos ? 0 : item.rfind(']'));
+                        if ((lt != std::string::npos) && (name != "RFC822") && (name.starts_with("BODY")))
+                        {
+                            auto dot = item.find('.', lt);
+                            std::size_t origin = std::stoul(item.substr(lt + 1));
+                            std::size_t length = (dot == std::string::npos) ? std::string::npos : std::stoul(item.substr(dot + 1));
+                            data = (origin < data.size()) ? data.substr(origin, length) : "";
+                            label += "<" + std::to_string(origin) + ">";
+                        }
+                        response += label + " {" + std::to_string(data.size()) + "}\r\n" + data;
+                    }
+                    else return s.connection.write(out + tag + " BAD Unknown fetch item " + item + "\r\n");
+                }
+                if (seen && !s.readOnly) _mailbox.storeFlags(uid, '+', { "\\Seen" });
+
+                // Flags go last so that they reflect the fetch itself.
+                std::string flags = "FLAGS (" + boost::join(_mailbox.flags(uid), " ") + ")";
+                auto f = response.find("FLAGS");
+                while ((f != std::string::npos) && (f > 0) && (response[f - 1] != ' ')) f = response.find("FLAGS", f + 1);
+                if ((f != std::string::npos) && ((f + 5 == response.size()) || (response[f + 5] == ' '))) response.replace(f, 5, flags);
+                out += "* " + std::to_string(position + 1) + " FETCH (" + response + ")\r\n";
+            }
+
+            return s.connection.write(out + tag + " OK FETCH completed\r\n");
+        }
+
+        bool store(session& s, const std::string& tag, const std::vector<std::string>& args, bool byUid)
+        {
+            if (args.size() < 3) return s.connection.write(tag + " BAD Missing arguments\r\n");
+            if (s.readOnly) return s.connection.write(tag + " NO Mailbox is read-only\r\n");
+
+            std::string action = mockDetail::upper(args[1]);
+            char mode = (action[0] == '+') ? '+' : ((action[0] == '-') ? '-' : '=');
+            bool silent = action.ends_with(".SILENT");
+            std::set<std::string> flags;
+            for (std::size_t i = 2; i < args.size(); i++)
+            {
+                for (const auto& f : mockDetail::tokenize(mockDetail::stripParentheses(args[i]))) flags.insert(f);
+            }
+
+            std::string out = synchronise(s, byUid);
+            for (auto position : resolve(s, args[0], byUid))
+            {
+                std::uint32_t uid = s.view[position];
+                _mailbox.storeFlags(uid, mode, flags);
+                if (!silent) out += "* " + std::to_string(position + 1) + " FETCH (" + (byUid ? ("UID " + std::to_string(uid) + " ") : "") + "FLAGS (" + boost::join(_mailbox.flags(uid), " ") + "))\r\n";
+            }
+
+            return s.connection.write(out + tag + " OK STORE completed\r\n");
+        }
+
+        typedef std::function<bool(const mockStoredMessage&, std::size_t, const std::set<std::string>&)> searchKey;
+
+        /**
+         * Parses one search key, and its arguments, into a predicate.
+         */
+        static searchKey parseSearchKey(const session& s, const std::vector<std::string>& tokens, std::size_t& i)
+        {
+            if (i >= tokens.size()) throw std::invalid_argument("missing search key");
+            std::string raw = tokens[i++];
+            std::string key = mockDetail::upper(raw);
+            auto argument = [&]() -> std::string
+            {
+                if (i >= tokens.size()) throw std::invalid_argument("missing search argument");
+                return tokens[i++];
+            };
+            auto contains = [](const std::string& haystack, const std::string& needle){ return boost::ifind_first(haystack, needle).begin() != haystack.end(); };
+            auto flag = [](const std::string& name, bool set) -> searchKey
+            {
+                return [name, set](const mockStoredMessage&, std::size_t, const std::set<std::string>& flags){ return flags.contains(name) == set; };
+            };
+            auto day = [](std::time_t t){ return static_cast<long>(t / 86400); };
+
+            if (key.starts_with("("))
+            {
+                auto inner = mockDetail::tokenize(mockDetail::stripParentheses(raw));
+                std::vector<searchKey> all;
+                for (std::size_t j = 0; j < inner.size(); ) all.push_back(parseSearchKey(s, inner, j));
+                return [all](const mockStoredMessage& m, std::size_t seq, const std::set<std::string>& f){ return std::all_of(all.begin(), all.end(), [&](const searchKey& k){ return k(m, seq, f); }); };
+            }
+            if (key == "ALL") return [](const mockStoredMessage&, std::size_t, const std::set<std::string>&){ return true; };
+            if (key == "SEEN") return flag("\\Seen", true);
+            if (key == "UNSEEN") return flag("\\Seen", false);
+            if (key == "DELETED") return flag("\\Deleted", true);
+            if (key == "UNDELETED") return flag("\\Deleted", false);
+            if (key == "FLAGGED") return flag("\\Flagged", true);
+            if (key == "UNFLAGGED") return flag("\\Flagged", false);
+            if (key == "ANSWERED") return flag("\\Answered", true);
+            if (key == "UNANSWERED") return flag("\\Answered", false);
+            if ((key == "NEW") || (key == "RECENT")) return flag("\\Seen", false);
+            if (key == "OLD") return flag("\\Seen", true);
+            if (key == "NOT")
+            {
+                auto k = parseSearchKey(s, tokens, i);
+                return [k](const mockStoredMessage& m, std::size_t seq, const std::set<std::string>& f){ return !k(m, seq, f); };
+            }
+            if (key == "OR")
+            {
+                auto a = parseSearchKey(s, tokens, i);
+                auto b = parseSearchKey(s, tokens, i);
+                return [a, b](const mockStoredMessage& m, std::size_t seq, const std::set<std::string>& f){ return a(m, seq, f) || b(m, seq, f); };
+            }
+            if ((key == "SINCE") || (key == "SENTSINCE"))
+            {
+                long d = mockDetail::imapDay(argument());
+                return [=](const mockStoredMessage& m, std::size_t, const std::set<std::string>&){ return day(m.internalDate) >= d; };
+            }
+            if ((key == "BEFORE") || (key == "SENTBEFORE"))
+            {
+                long d = mockDetail::imapDay(argument());
+                return [=](const mockStoredMessage& m, std::size_t, const std::set<std::string>&){ return day(m.internalDate) < d; };
+            }
+            if ((key == "ON") || (key == "SENTON"))
+            {
+                long d = mockDetail::imapDay(argument());
+                return [=](const mockStoredMessage& m, std::size_t, const std::set<std::string>&){ return day(m.internalDate) == d; };
+            }
+            if ((key == "FROM") || (key == "TO") || (key == "CC") || (key == "BCC") || (key == "SUBJECT"))
+            {
+                std::string field = key;
+                std::string value = argument();
+                return [=](const mockStoredMessage& m, std::size_t, const std::set<std::string>&){ return contains(m.structure.field(field), value); };
+            }
+            if (key == "HEADER")
+            {
+                std::string field = argument();
+                std::string value = argument();
+                return [=](const mockStoredMessage& m, std::size_t, const std::set<std::string>&){ return contains(m.structure.field(field), value); };
+            }
+            if ((key == "BODY") || (key == "TEXT"))
+            {
+                std::string value = argument();
+                return [=](const mockStoredMessage& m, std::size_t, const std::set<std::string>&){ return contains(m.data, value); };
+            }
+            if ((key == "LARGER") || (key == "SMALLER"))
+            {
+                std::size_t size = std::stoul(argument());
+                bool larger = (key == "LARGER");
+                return [=](const mockStoredMessage& m, std::size_t, const std::set<std::string>&){ return larger ? (m.data.size() > size) : (m.data.size() < size); };
+            }
+            if ((key == "UID") || std::isdigit(static_cast<unsigned char>(key[0])) || (key[0] == '*'))
+            {
+                bool byUid = (key == "UID");
+                auto positions = resolve(s, byUid ? argument() : raw, byUid);
+                std::set<std::size_t> sequences;
+                for (auto p : positions) sequences.insert(p + 1);
+                return [sequences](const mockStoredMessage&, std::size_t seq, const std::set<std::string>&){ return sequences.contains(seq); };
+            }
+
+            throw std::invalid_argument("unsupported search key " + raw);
+        }
+
+        bool search(session& s, const std::string& tag, std::vector<std::string> args, bool byUid)
+        {
+            if (!args.empty() && boost::iequals(args[0], "CHARSET") && (args.size() > 1)) args.erase(args.begin(), args.begin() + 2);
+
+            std::vector<searchKey> keys;
+            try
+            {
+                for (std::size_t i = 0; i < args.size(); ) keys.push_back(parseSearchKey(s, args, i));
+            }
+            catch (const std::exception& ex)
+            {
+                return s.connection.write(tag + " BAD " + ex.what() + "\r\n");
+            }
+
+            std::string out = synchronise(s, byUid);
+            std::string result = "* SEARCH";
+            for (std::size_t i = 0; i < s.view.size(); i++)
+            {
+                auto message = _mailbox.find(s.view[i]);
+                if (!message) continue;
+                auto flags = _mailbox.flags(s.view[i]);
+                if (std::all_of(keys.begin(), keys.end(), [&](const searchKey& k){ return k(*message, i + 1, flags); })) result += " " + std::to_string(byUid ? s.view[i] : (i + 1));
+            }
+
+            return s.connection.write(out + result + "\r\n" + tag + " OK SEARCH completed\r\n");
+        }
+
+        bool select(session& s, const std::string& tag, const std::vector<std::string>& args, bool readOnly)
+        {
+            if (args.empty() || !boost::iequals(args[0], "INBOX"))
+            {
+                s.selected = false;
+                return s.connection.write(tag + " NO Mailbox does not exist\r\n");
+            }
+
+            s.selected = true;
+            s.readOnly = readOnly;
+            s.viewGeneration = _mailbox.generation();
+            s.view = _mailbox.uids();
+            std::string out = "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n";
+            out += "* " + std::to_string(s.view.size()) + " EXISTS\r\n";
+            out += "* 0 RECENT\r\n";
+            out += "* OK [UIDVALIDITY " + std::to_string(_mailbox.uidValidity()) + "] UIDs valid\r\n";
+            out += "* OK [UIDNEXT " + std::to_string(_mailbox.uidNext()) + "] Predicted next UID\r\n";
+            out += "* OK [HIGHESTMODSEQ " + std::to_string(_mailbox.highestModSeq()) + "] Highest\r\n";
+            out += "* OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)] Limited\r\n";
+
+            return s.connection.write(out + tag + (readOnly ? " OK [READ-ONLY] EXAMINE completed\r\n" : " OK [READ-WRITE] SELECT completed\r\n"));
+        }
+
+        bool status(session& s, const std::string& tag, const std::vector<std::string>& args)
+        {
+            if ((args.size() < 2) || !boost::iequals(args[0], "INBOX")) return s.connection.write(tag + " NO Mailbox does not exist\r\n");
+
+            std::string result;
+            for (const auto& item : mockDetail::tokenize(mockDetail::stripParentheses(args[1])))
+            {
+                std::string name = mockDetail::upper(item);
+                std::uint64_t value = 0;
+                if (name == "MESSAGES") value = _mailbox.count();
+                else if (name == "RECENT") value = 0;
+                else if (name == "UIDNEXT") value = _mailbox.uidNext();
+                else if (name == "UIDVALIDITY") value = _mailbox.uidValidity();
+                else if (name == "UNSEEN") value = _mailbox.unseen();
+                else if (name == "HIGHESTMODSEQ") value = _mailbox.highestModSeq();
+                else return s.connection.write(tag + " BAD Unknown status item\r\n");
+                result += (result.empty() ? "" : " ") + name + " " + std::to_string(value);
+            }
+
+            return s.connection.write(synchronise(s) + "* STATUS INBOX (" + result + ")\r\n" + tag + " OK STATUS completed\r\n");
+        }
+
+        bool expunge(session& s, const std::string& tag, const std::string *set)
+        {
+            if (s.readOnly) return s.connection.write(tag + " NO Mailbox is read-only\r\n");
+            if (set)
+            {
+                std::set<std::uint32_t> only;
+                for (auto position : resolve(s, *set, true)) only.insert(s.view[position]);
+                _mailbox.expunge(&only);
+            }
+            else
+            {
+                _mailbox.expunge();
+            }
+
+            return s.connection.write(synchronise(s) + tag + " OK EXPUNGE completed\r\n");
+        }
+
+        bool move(session& s, const std::string& tag, const std::vector<std::string>& args, bool byUid)
+        {
+            if (args.size() < 2) return s.connection.write(tag + " BAD Missing arguments\r\n");
+            if (s.readOnly) return s.connection.write(tag + " NO Mailbox is read-only\r\n");
+
+            std::set<std::uint32_t> uids;
+            for (auto position : resolve(s, args[0], byUid)) uids.insert(s.view[position]);
+            _mailbox.move(uids);
+
+            return s.connection.write(synchronise(s) + tag + " OK MOVE completed\r\n");
+        }
+
+        bool idle(session& s, const std::string& tag)
+        {
+            if (!s.connection.write("+ idling\r\n")) return false;
+            auto mark = mockDetail::threadCpuTime();
+            while (_running)
+            {
+                std::string line;
+                int r = s.connection.readLine(line, 100);
+                if (r < 0) return false;
+                if (r > 0)
+                {
+                    if (boost::iequals(boost::trim_copy(line), "DONE")) break;
+                    return s.connection.write(tag + " BAD Expected DONE\r\n");
+                }
+                std::string update = synchronise(s);
+                if (!update.empty() && !s.connection.write(update)) return false;
+                accountCpu(mark);
+            }
+
+            return s.connection.write(tag + " OK IDLE terminated\r\n");
+        }
+
+        bool authenticate(session& s, const std::string& tag, const std::vector<std::string>& args)
+        {
+            if (args.empty() || !boost::iequals(args[0], "PLAIN")) return s.connection.write(tag + " NO Unsupported mechanism\r\n");
+
+            std::string response;
+            if (args.size() > 1)
+            {
+                response = args[1];
+            }
+            else
+            {
+                if (!s.connection.write("+ \r\n") || (s.connection.readLine(response) <= 0)) return false;
+            }
+            std::string decoded = mockDetail::base64Decode(response);
+            std::vector<std::string> parts;
+            boost::split(parts, decoded, [](char c){ return c == '\0'; });
+            if ((parts.size() == 3) && checkCredentials(parts[1], parts[2]))
+            {
+                s.authenticated = true;
+                return s.connection.write(tag + " OK [CAPABILITY " + CAPABILITIES + "] Authenticated\r\n");
+            }
+
+            return s.connection.write(tag + " NO [AUTHENTICATIONFAILED] Invalid credentials\r\n");
+        }
+
+    protected:
+        void serve(mockConnection& connection, bool refuse) override
+        {
+            if (!connection.startTls(_tls.get())) return;
+            if (refuse)
+            {
+                connection.write("* BYE [UNAVAILABLE] Too many connections\r\n");
+                return;
+            }
+            if (!connection.write(std::string("* OK [CAPABILITY ") + CAPABILITIES + "] Mock IMAP server ready\r\n")) return;
+
+            session s(connection);
+            auto mark = mockDetail::threadCpuTime();
+            std::string line;
+            while (_running && (readCommand(connection, line) > 0))
+            {
+                accountCpu(mark);
+                auto space = line.find(' ');
+                if (space == std::string::npos)
+                {
+                    if (!connection.write("* BAD Missing command\r\n")) return;
+                    continue;
+                }
+                std::string tag = line.substr(0, space);
+                auto args = mockDetail::tokenize(line.substr(space + 1));
+                if (args.empty()) continue;
+                std::string command = mockDetail::upper(args[0]);
+                args.erase(args.begin());
+                bool byUid = false;
+                if ((command == "UID") && !args.empty())
+                {
+                    byUid = true;
+                    command = mockDetail::upper(args[0]);
+                    args.erase(args.begin());
+                }
+
+                if (!beforeResponse(connection)) return;
+
+                bool ok;
+                if (command == "CAPABILITY") ok = connection.write(std::string("* CAPABILITY ") + CAPABILITIES + "\r\n" + tag + " OK CAPABILITY completed\r\n");
+                else if (command == "NOOP" || command == "CHECK") ok = connection.write(synchronise(s) + tag + " OK " + command + " completed\r\n");
+                else if (command == "LOGOUT")
+                {
+                    connection.write("* BYE Logging out\r\n" + tag + " OK LOGOUT completed\r\n");
+                    return;
+                }
+                else if (command == "ID") ok = connection.write("* ID NIL\r\n" + tag + " OK ID completed\r\n");
+                else if (!s.authenticated)
+                {
+                    if ((command == "LOGIN") && (args.size() >= 2))
+                    {
+                        s.authenticated = checkCredentials(args[0], args[1]);
+                        ok = connection.write(tag + (s.authenticated ? (std::string(" OK [CAPABILITY ") + CAPABILITIES + "] Logged in\r\n") : " NO [AUTHENTICATIONFAILED] Invalid credentials\r\n"));
+                    }
+                    else if (command == "AUTHENTICATE") ok = authenticate(s, tag, args);
+                    else ok = connection.write(tag + " BAD Not authenticated\r\n");
+                }
+                else if (command == "ENABLE")
+                {
+                    std::string enabled;
+                    for (const auto& a : args)
+                    {
+                        if (boost::iequals(a, "CONDSTORE")) enabled += " CONDSTORE";
+                    }
+                    ok = connection.write("* ENABLED" + enabled + "\r\n" + tag + " OK ENABLE completed\r\n");
+                }
+                else if ((command == "LIST") || (command == "LSUB"))
+                {
+                    std::string pattern = (args.size() > 1) ? args[1] : "";
+                    bool match = pattern.empty() || (pattern == "*") || (pattern == "%") || boost::iequals(pattern, "INBOX");
+                    ok = connection.write((match ? ("* " + command + " (\\HasNoChildren) \"/\" \"INBOX\"\r\n") : std::string()) + tag + " OK " + command + " completed\r\n");
+                }
+                else if (command == "SELECT") ok = select(s, tag, args, false);
+                else if (command == "EXAMINE") ok = select(s, tag, args, true);
+                else if (command == "STATUS") ok = status(s, tag, args);
+                else if (command == "IDLE") ok = idle(s, tag);
+                else if (!s.selected) ok = connection.write(tag + " BAD No mailbox selected\r\n");
+                else if (command == "FETCH") ok = fetch(s, tag, args, byUid);
+                else if (command == "STORE") ok = store(s, tag, args, byUid);
+                else if (command == "SEARCH") ok = search(s, tag, args, byUid);
+                else if (command == "EXPUNGE") ok = expunge(s, tag, (byUid && !args.empty()) ? &args[0] : nullptr);
+                else if (command == "MOVE") ok = move(s, tag, args, byUid);
+                else if ((command == "CLOSE") || (command == "UNSELECT"))
+                {
+                    if ((command == "CLOSE") && !s.readOnly) _mailbox.expunge();
+                    s.selected = false;
+                    s.view.clear();
+                    ok = connection.write(tag + " OK " + command + " completed\r\n");
+                }
+                else ok = connection.write(tag + " BAD Unknown command\r\n");
+
+                if (!ok) return;
+            }
+        }
+
+    public:
+        mockImapServer(mockMailbox& mailbox, mockTlsContext& tls) : mockServerBase(tls), _mailbox(mailbox)
+        {
+        }
+
+        ~mockImapServer() override
+        {
+            stop();
+        }
+
+        /**
+         * Sets the only credentials accepted; with none set any are accepted.
+         */
+        void setCredentials(const std::string& username, const std::string& password)
+        {
+            _username = username;
+            _password = password;
+        }
+    };
+
+    /**
+     * A mock POP3 server, over TLS from the outset (pop3s), with the UIDL, TOP and PIPELINING capabilities.
+     */
+    class mockPop3Server final : public mockServerBase
+    {
+    private:
+        mockMailbox& _mailbox;
+        std::string _username;
+        std::string _password;
+
+        static std::string dotStuffed(const std::string& data)
+        {
+            std::string retval;
+            retval.reserve(data.size() + 64);
+            std::size_t pos = 0;
+            while (pos < data.size())
+            {
+                auto eol = data.find("\r\n", pos);
+                if (eol == std::string::npos) eol = data.size();
+                if (data[pos] == '.') retval.push_back('.');
+                retval.append(data, pos, eol - pos);
+                retval += "\r\n";
+                pos = eol + 2;
+            }
+
+            return retval + ".\r\n";
+        }
+
+    protected:
+        void serve(mockConnection& connection, bool refuse) override
+        {
+            if (!connection.startTls(_tls.get())) return;
+            if (refuse)
+            {
+                connection.write("-ERR [SYS/TEMP] Too many connections\r\n");
+                return;
+            }
+            if (!connection.write("+OK Mock POP3 server ready\r\n")) return;
+
+            std::string username;
+            bool authenticated = false;
+            // The maildrop as it was when the session was authenticated, and the messages deleted in it.
+            std::vector<std::shared_ptr<const mockStoredMessage>> maildrop;
+            std::set<std::size_t> deleted;
+            auto mark = mockDetail::threadCpuTime();
+            std::string line;
+            while (_running && (connection.readLine(line) > 0))
+            {
+                accountCpu(mark);
+                auto args = mockDetail::tokenize(line);
+                if (args.empty()) continue;
+                std::string command = mockDetail::upper(args[0]);
+                if (!beforeResponse(connection)) return;
+
+                // Resolves a message number argument, or fails the command.
+                auto message = [&](std::size_t index, std::size_t& position) -> bool
+                {
+                    if (args.size() <= index) return false;
+                    try
+                    {
+                        position = std::stoul(args[index]) - 1;
+                    }
+                    catch (const std::exception&)
+                    {
+                        return false;
+                    }
+                    return (position < maildrop.size()) && !deleted.contains(position);
+                };
+                auto login = [&](const std::string& u, const std::string& p)
+                {
+                    authenticated = _username.empty() || ((u == _username) && (p == _password));
+                    if (!authenticated) return connection.write("-ERR [AUTH] Invalid credentials\r\n");
+                    for (auto uid : _mailbox.uids())
+                    {
+                        auto m = _mailbox.find(uid);
+                        if (m) maildrop.push_back(m);
+                    }
+                    return connection.write("+OK Maildrop locked and ready\r\n");
+                };
+
+                bool ok;
+                std::size_t n = 0;
+                if (command == "CAPA") ok = connection.write("+OK Capability list follows\r\nUSER\r\nUIDL\r\nTOP\r\nPIPELINING\r\nSASL PLAIN\r\nRESP-CODES\r\n.\r\n");
+                else if (command == "NOOP") ok = connection.write("+OK\r\n");
+                else if (command == "QUIT")
+                {
+                    std::set<std::uint32_t> uids;
+                    for (auto position : deleted) uids.insert(maildrop[position]->uid);
+                    if (!uids.empty()) _mailbox.remove(uids);
+                    connection.write("+OK Bye\r\n");
+                    return;
+                }
+                else if (!authenticated)
+                {
+                    if ((command == "USER") && (args.size() > 1))
+                    {
+                        username = args[1];
+                        ok = connection.write("+OK\r\n");
+                    }
+                    else if ((command == "PASS") && (args.size() > 1)) ok = login(username, line.substr(line.find(' ') + 1));
+                    else if ((command == "AUTH") && (args.size() > 1) && boost::iequals(args[1], "PLAIN"))
+                    {
+                        std::string response = (args.size() > 2) ? args[2] : "";
+                        if (response.empty() && (!connection.write("+ \r\n") || (connection.readLine(response) <= 0))) return;
+                        std::string decoded = mockDetail::base64Decode(response);
+                        std::vector<std::string> parts;
+                        boost::split(parts, decoded, [](char c){ return c == '\0'; });
+                        ok = (parts.size() == 3) ? login(parts[1], parts[2]) : connection.write("-ERR [AUTH] Invalid credentials\r\n");
+                    }
+                    else ok = connection.write("-ERR Not authenticated\r\n");
+                }
+                else if (command == "STAT")
+                {
+                    std::size_t count = 0;
+                    std::size_t size = 0;
+                    for (std::size_t i = 0; i < maildrop.size(); i++)
+                    {
+                        if (deleted.contains(i)) continue;
+                        count++;
+                        size += maildrop[i]->data.size();
+                    }
+                    ok = connection.write("+OK " + std::to_string(count) + " " + std::to_string(size) + "\r\n");
+                }
+                else if ((command == "LIST") || (command == "UIDL"))
+                {
+                    auto value = [&](std::size_t i){ return (command == "LIST") ? std::to_string(maildrop[i]->data.size()) : std::to_string(_mailbox.uidValidity()) + "." + std::to_string(maildrop[i]->uid); };
+                    if (args.size() > 1)
+                    {
+                        ok = message(1, n) ? connection.write("+OK " + std::to_string(n + 1) + " " + value(n) + "\r\n") : connection.write("-ERR No such message\r\n");
+                    }
+                    else
+                    {
+                        std::string out = "+OK\r\n";
+                        for (std::size_t i = 0; i < maildrop.size(); i++)
+                        {
+                            if (!deleted.contains(i)) out += std::to_string(i + 1) + " " + value(i) + "\r\n";
+                        }
+                        ok = connection.write(out + ".\r\n");
+                    }
+                }
+                else if (command == "RETR")
+                {
+                    ok = message(1, n) ? connection.write("+OK " + std::to_string(maildrop[n]->data.size()) + " octets\r\n" + dotStuffed(maildrop[n]->data)) : connection.write("-ERR No such message\r\n");
+                }
+                else if (command == "TOP")
+                {
+                    if (!message(1, n) || (args.size() < 3))
+                    {
+                        ok = connection.write("-ERR No such message\r\n");
+                    }
+                    else
+                    {
+                        const auto& m = *maildrop[n];
+                        std::size_t lines = std::stoul(args[2]);
+                        std::size_t end = m.structure.bodyBegin;
+                        for (std::size_t i = 0; (i < lines) && (end < m.data.size()); i++)
+                        {
+                            auto eol = m.data.find("\r\n", end);
+                            end = (eol == std::string::npos) ? m.data.size() : (eol + 2);
+                        }
+                        ok = connection.write("+OK\r\n" + dotStuffed(m.data.substr(0, end)));
+                    }
+                }
+                else if (command == "DELE")
+                {
+                    if (message(1, n)) deleted.insert(n);
+                    ok = connection.write(deleted.contains(n) ? "+OK Marked for deletion\r\n" : "-ERR No such message\r\n");
+                }
+                else if (command == "RSET")
+                {
+                    deleted.clear();
+                    ok = connection.write("+OK\r\n");
+                }
+                else ok = connection.write("-ERR Unknown command\r\n");
+
+                if (!ok) return;
+            }
+        }
+
+    public:
+        mockPop3Server(mockMailbox& mailbox, mockTlsContext& tls) : mockServerBase(tls), _mailbox(mailbox)
+        {
+        }
+
+        ~mockPop3Server() override
+        {
+            stop();
+        }
+
+        void setCredentials(const std::string& username, const std::string& password)
+        {
+            _username = username;
+            _password = password;
+        }
+    };
+
+    /**
+     * A message accepted by the mock SMTP server for a recipient other than the mailbox's own addresses.
+     */
+    struct mockDelivery
+    {
+        std::string from;
+        std::vector<std::string> to;
+        std::string data;
+        std::chrono::steady_clock::time_point received;
+    };
+
+    /**
+     * A mock SMTP submission server with STARTTLS, AUTH PLAIN/LOGIN and PIPELINING. Mail for the local addresses is appended to the mailbox, anything
+     * else is kept as an outgoing delivery.
+     */
+    class mockSmtpServer final : public mockServerBase
+    {
+    public:
+        typedef std::function<void(const mockDelivery& delivery)> deliveryCallback;
+
+    private:
+        mockMailbox& _mailbox;
+        std::string _username;
+        std::string _password;
+        std::set<std::string> _localAddresses;
+        std::vector<mockDelivery> _deliveries;
+        deliveryCallback _onDelivery;
+        std::mutex _deliveriesMutex;
+        std::atomic<std::uint64_t> _delivered;
+
+        static std::string addressIn(const std::string& argument)
+        {
+            auto lt = argument.find('<');
+            auto gt = argument.find('>', lt);
+            if ((lt == std::string::npos) || (gt == std::string::npos)) return boost::trim_copy(argument.substr(argument.find(':') + 1));
+
+            return argument.substr(lt + 1, gt - lt - 1);
+        }
+
+        void deliver(const std::string& from, const std::vector<std::string>& to, const std::string& data)
+        {
+            mockDelivery outgoing{ from, {}, data, std::chrono::steady_clock::now() };
+            bool local = false;
+            for (const auto& recipient : to)
+            {
+                if (_localAddresses.contains(boost::to_lower_copy(recipient))) local = true;
+                else outgoing.to.push_back(recipient);
+            }
+            if (local) _mailbox.append("Return-Path: <" + from + ">\r\n" + data);
+            if (outgoing.to.empty()) return;
+
+            _delivered++;
+            deliveryCallback callback;
+            {
+                std::lock_guard<std::mutex> lock(_deliveriesMutex);
+                callback = _onDelivery;
+                if (!callback) _deliveries.push_back(outgoing);
+            }
+            if (callback) callback(outgoing);
+        }
+
+    protected:
+        void serve(mockConnection& connection, bool refuse) override
+        {
+            if (refuse)
+            {
+                connection.write("421 4.7.0 Too many connections\r\n");
+                return;
+            }
+            if (!connection.write("220 localhost Mock ESMTP server ready\r\n")) return;
+
+            bool authenticated = _username.empty();
+            std::string from;
+            std::vector<std::string> to;
+            bool transaction = false;
+            auto mark = mockDetail::threadCpuTime();
+            std::string line;
+            while (_running && (connection.readLine(line) > 0))
+            {
+                accountCpu(mark);
+                std::string verb = mockDetail::upper(line.substr(0, line.find(' ')));
+                std::string argument = (line.find(' ') == std::string::npos) ? "" : line.substr(line.find(' ') + 1);
+                if (!beforeResponse(connection)) return;
+
+                bool ok;
+                if ((verb == "EHLO") || (verb == "HELO"))
+                {
+                    transaction = false;
+                    std::string reply = "250-localhost\r\n250-PIPELINING\r\n250-8BITMIME\r\n250-SIZE 52428800\r\n";
+                    if (!connection.secure()) reply += "250-STARTTLS\r\n";
+                    ok = connection.write(reply + "250 AUTH PLAIN LOGIN\r\n");
+                }
+                else if (verb == "STARTTLS")
+                {
+                    if (connection.secure()) ok = connection.write("503 5.5.1 TLS already active\r\n");
+                    else ok = connection.write("220 2.0.0 Ready to start TLS\r\n") && connection.startTls(_tls.get());
+                    transaction = false;
+                }
+                else if (verb == "AUTH")
+                {
+                    auto words = mockDetail::tokenize(argument);
+                    std::string mechanism = words.empty() ? "" : mockDetail::upper(words[0]);
+                    std::string username;
+                    std::string password;
+                    ok = true;
+                    if (mechanism == "PLAIN")
+                    {
+                        std::string response = (words.size() > 1) ? words[1] : "";
+                        if (response.empty()) ok = connection.write("334 \r\n") && (connection.readLine(response) > 0);
+                        std::vector<std::string> parts;
+                        std::string decoded = mockDetail::base64Decode(response);
+                        boost::split(parts, decoded, [](char c){ return c == '\0'; });
+                        if (parts.size() == 3)
+                        {
+                            username = parts[1];
+                            password = parts[2];
+                        }
+                    }
+                    else if (mechanism == "LOGIN")
+                    {
+                        std::string response;
+                        ok = connection.write("334 VXNlcm5hbWU6\r\n") && (connection.readLine(response) > 0);
+                        username = mockDetail::base64Decode(response);
+                        ok = ok && connection.write("334 UGFzc3dvcmQ6\r\n") && (connection.readLine(response) > 0);
+                        password = mockDetail::base64Decode(response);
+                    }
+                    else
+                    {
+                        ok = connection.write("504 5.5.4 Unrecognised authentication type\r\n");
+                        if (!ok) return;
+                        continue;
+                    }
+                    if (!ok) return;
+                    authenticated = _username.empty() || ((username == _username) && (password == _password));
+                    ok = connection.write(authenticated ? "235 2.7.0 Authentication successful\r\n" : "535 5.7.8 Authentication credentials invalid\r\n");
+                }
+                else if (verb == "MAIL")
+                {
+                    if (!connection.secure()) ok = connection.write("530 5.7.0 Must issue a STARTTLS command first\r\n");
+                    else if (!authenticated) ok = connection.write("530 5.7.0 Authentication required\r\n");
+                    else
+                    {
+                        from = addressIn(argument);
+                        to.clear();
+                        transaction = true;
+                        ok = connection.write("250 2.1.0 OK\r\n");
+                    }
+                }
+                else if (verb == "RCPT")
+                {
+                    if (!transaction) ok = connection.write("503 5.5.1 Need MAIL command\r\n");
+                    else
+                    {
+                        to.push_back(addressIn(argument));
+                        ok = connection.write("250 2.1.5 OK\r\n");
+                    }
+                }
+                else if (verb == "DATA")
+                {
+                    if (!transaction || to.empty())
+                    {
+                        ok = connection.write("503 5.5.1 Need RCPT command\r\n");
+                    }
+                    else
+                    {
+                        if (!connection.write("354 End data with <CR><LF>.<CR><LF>\r\n")) return;
+                        std::string data;
+                        std::string dataLine;
+                        while (true)
+                        {
+                            if (connection.readLine(dataLine) <= 0) return;
+                            if (dataLine == ".") break;
+                            if (dataLine.starts_with(".")) dataLine.erase(0, 1);
+                            data += dataLine + "\r\n";
+                        }
+                        accountCpu(mark);
+                        deliver(from, to, data);
+                        transaction = false;
+                        ok = connection.write("250 2.0.0 OK queued\r\n");
+                    }
+                }
+                else if (verb == "RSET")
+                {
+                    transaction = false;
+                    ok = connection.write("250 2.0.0 OK\r\n");
+                }
+                else if (verb == "NOOP") ok = connection.write("250 2.0.0 OK\r\n");
+                else if (verb == "VRFY") ok = connection.write("252 2.1.5 Cannot verify\r\n");
+                else if (verb == "QUIT")
+                {
+                    connection.write("221 2.0.0 Bye\r\n");
+                    return;
+                }
+                else ok = connection.write("502 5.5.2 Command not recognised\r\n");
+
+                if (!ok) return;
+            }
+        }
+
+    public:
+        mockSmtpServer(mockMailbox& mailbox, mockTlsContext& tls) : mockServerBase(tls), _mailbox(mailbox)
+        {
+            _delivered = 0;
+        }
+
+        ~mockSmtpServer() override
+        {
+            stop();
+        }
+
+        void setCredentials(const std::string& username, const std::string& password)
+        {
+            _username = username;
+            _password = password;
+        }
+
+        /**
+         * Adds an address whose mail is appended to the mailbox.
+         */
+        void addLocalAddress(const std::string& address)
+        {
+            _localAddresses.insert(boost::to_lower_copy(address));
+        }
+
+        /**
+         * Sets a function to be called with every outgoing delivery instead of keeping them.
+         */
+        void setDeliveryCallback(const deliveryCallback& callback)
+        {
+            std::lock_guard<std::mutex> lock(_deliveriesMutex);
+            _onDelivery = callback;
+        }
+
+        [[nodiscard]] std::vector<mockDelivery> deliveries()
+        {
+            std::lock_guard<std::mutex> lock(_deliveriesMutex);
+            return _deliveries;
+        }
+
+        [[nodiscard]] std::uint64_t delivered() const
+        {
+            return _delivered;
+        }
+    };
+
+    /**
+     * Mock IMAP, POP3 and SMTP servers sharing one mailbox.
+     */
+    class mockMailServer
+    {
+    private:
+        mockTlsContext _tls;
+        mockMailbox _mailbox;
+        mockImapServer _imap;
+        mockPop3Server _pop3;
+        mockSmtpServer _smtp;
+
+    public:
+        mockMailServer() : _imap(_mailbox, _tls), _pop3(_mailbox, _tls), _smtp(_mailbox, _tls)
+        {
+        }
+
+        void start(unsigned short imapPort = 0, unsigned short pop3Port = 0, unsigned short smtpPort = 0)
+        {
+            _imap.start(imapPort);
+            _pop3.start(pop3Port);
+            _smtp.start(smtpPort);
+        }
+
+        void stop()
+        {
+            _imap.stop();
+            _pop3.stop();
+            _smtp.stop();
+        }
+
+        void setCredentials(const std::string& username, const std::string& password)
+        {
+            _imap.setCredentials(username, password);
+            _pop3.setCredentials(username, password);
+            _smtp.setCredentials(username, password);
+        }
+
+        void setFaults(const mockFaultProfile& faults)
+        {
+            _imap.setFaults(faults);
+            _pop3.setFaults(faults);
+            _smtp.setFaults(faults);
+        }
+
+        /**
+         * Gets the statistics of the three servers added together.
+         */
+        [[nodiscard]] mockServerStatistics statistics() const
+        {
+            mockServerStatistics retval;
+            for (const mockServerBase *server : { static_cast<const mockServerBase *>(&_imap), static_cast<const mockServerBase *>(&_pop3), static_cast<const mockServerBase *>(&_smtp) })
+            {
+                auto s = server->statistics();
+                retval.connections += s.connections;
+                retval.refused += s.refused;
+                retval.commands += s.commands;
+                retval.drops += s.drops;
+                retval.cpu += s.cpu;
+            }
+
+            return retval;
+        }
+
+        mockMailbox& mailbox()
+        {
+            return _mailbox;
+        }
+
+        mockImapServer& imap()
+        {
+            return _imap;
+        }
+
+        mockPop3Server& pop3()
+        {
+            return _pop3;
+        }
+
+        mockSmtpServer& smtp()
+        {
+            return _smtp;
+        }
+
+        /**
+         * Builds a simple message, with an optional base64 encoded attachment.
+         */
+        static std::string composeMessage(const std::string& from, const std::string& to, const std::string& subject, const std::string& text,
+                                          const std::string& attachmentName = "", const std::string& attachment = "", const std::string& attachmentType = "application/pdf",
+                                          std::time_t date = std::time(nullptr))
+        {
+            static std::atomic<std::uint64_t> sequence{ 0 };
+            std::string id = std::to_string(date) + "." + std::to_string(++sequence) + "@mock.localhost";
+            std::string retval = "Date: " + mockDetail::rfc2822DateTime(date) + "\r\nFrom: " + from + "\r\nTo: " + to + "\r\nSubject: " + subject +
+                                 "\r\nMessage-ID: <" + id + ">\r\nMIME-Version: 1.0\r\n";
+            if (attachmentName.empty())
+            {
+                return retval + "Content-Type: text/plain; charset=us-ascii\r\n\r\n" + text + "\r\n";
+            }
+
+            std::string boundary = "=_mock_" + std::to_string(sequence);
+            retval += "Content-Type: multipart/mixed; boundary=\"" + boundary + "\"\r\n\r\n";
+            retval += "--" + boundary + "\r\nContent-Type: text/plain; charset=us-ascii\r\n\r\n" + text + "\r\n";
+            retval += "--" + boundary + "\r\nContent-Type: " + attachmentType + "; name=\"" + attachmentName + "\"\r\nContent-Transfer-Encoding: base64\r\n" +
+                      "Content-Disposition: attachment; filename=\"" + attachmentName + "\"\r\n\r\n" + mockDetail::base64Encode(attachment, 76);
+            retval += "--" + boundary + "--\r\n";
+
+            return retval;
+        }
+    };
+}
+
+#endif // _MOCK_MAIL_SERVER_HPP_
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: prepStringBenchmark.cpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Compares the table-driven _prep_string() in stringUtils.hpp with the if-chain and regex pass it replaced, over synthetic email bodies: plain
+// text prose with typographic punctuation and Windows line endings, and HTML newsletters with runs of blank lines and non-breaking spaces. Both
+// must produce the same text.
+// Usage: prepStringBenchmark [messages]
+
+#include <chrono>
+#include <codecvt>
+#include <cstdlib>
+#include <iostream>
+#include <locale>
+#include <random>
+#include <string>
+#include <vector>
+#include "../stringUtils.hpp"
+
+namespace
+{
+    const wchar_t *WORDS[] = { L"the", L"depot", L"booking", L"trailer", L"slot", L"please", L"confirm", L"arrival", L"at", L"Tuesday", L"delivery",
+                               L"for", L"our", L"customer", L"and", L"we", L"will", L"collect", L"pallets", L"from", L"bay", L"seven" };
+    const wchar_t *PUNCTUATION[] = { L"\u2019s", L" \u2013 ", L" \u2014 ", L"\u201C", L"\u201D", L"\u2026", L"\u00A0", L"  ", L"\u2018", L"\u2264" };
+
+    std::wstring pick(std::mt19937& random, const wchar_t *const *list, std::size_t count)
+    {
+        return list[random() % count];
+    }
+
+    template<typename ArrayT>
+    std::wstring pick(std::mt19937& random, const ArrayT& list)
+    {
+        return pick(random, list, sizeof(list) / sizeof(list[0]));
+    }
+
+    std::wstring sentence(std::mt19937& random)
+    {
+        std::wstring retval;
+        std::size_t words = 6 + random() % 14;
+        for (std::size_t i = 0; i < words; i++)
+        {
+            if (i > 0) retval += L' ';
+            retval += pick(random, WORDS);
+            if ((random() % 9) == 0) retval += pick(random, PUNCTUATION);
+        }
+        retval += L". ";
+
+        return retval;
+    }
+
+    std::wstring plainBody(std::mt19937& random)
+    {
+        std::wstring retval;
+        std::size_t paragraphs = 4 + random() % 8;
+        for (std::size_t p = 0; p < paragraphs; p++)
+        {
+            std::size_t sentences = 2 + random() % 6;
+            for (std::size_t s = 0; s < sentences; s++)
+            {
+                retval += sentence(random);
+                if ((random() % 3) == 0) retval += L"\r\n";
+            }
+            retval += L"\r\n\r\n";
+        }
+
+        return retval;
+    }
+
+    std::wstring htmlBody(std::mt19937& random)
+    {
+        std::wstring retval = L"<html>\n<head><style>p { margin: 0; }</style></head>\n<body>\n";
+        std::size_t blocks = 10 + random() % 20;
+        for (std::size_t b = 0; b < blocks; b++)
+        {
+            retval += L"<table width=\"100%\"><tr><td>&nbsp;\u00A0</td></tr></table>\n\n\n\n";
+            retval += L"    <p class=\"body\">" + sentence(random) + sentence(random) + L"</p>\n";
+            retval += L"\t\t<br>\n\n\n";
+        }
+        retval += L"</body>\n</html>\n";
+
+        return retval;
+    }
+
+    // The implementation the table replaced: a comparison against each special character in turn, and a regex pass to limit the line breaks.
+    std::wstring& ifChain(const std::wstring& in, std::wstring& out)
+    {
+        bool space_seen = false;
+        for (const auto& c : in)
+        {
+            if (c == 0x2029)
+            {
+                out.push_back('\n');
+                out.push_back('\n');
+                continue;
+            }
+            if ((c == 0x2028) || (c == 0x0A) || (c == 0x0D))
+            {
+                out.push_back('\n');
+                continue;
+            }
+            if (fsl::_private::_wspc_pred(c))
+            {
+                if (space_seen) continue;
+                out.push_back(' ');
+                space_seen = true;
+                continue;
+            }
+            space_seen = false;
+
+            bool folded = false;
+            for (const auto& fold : fsl::_private::PREP_FOLDS)
+            {
+                if (static_cast<char32_t>(c) != fold.c) continue;
+                out.append(fold.replacement);
+                folded = true;
+                break;
+            }
+            if (!folded) out.push_back(c);
+        }
+        boost::replace_all_regex(out, boost::wregex(L"\\n{2,}"), std::wstring(L"\n\n"));
+
+        return out;
+    }
+
+    template<typename FunctionT>
+    void measure(const std::string& name, const std::vector<std::wstring>& bodies, std::size_t characters, std::vector<std::wstring>& results, FunctionT&& function)
+    {
+        constexpr int RUNS = 5;
+        double best = 0;
+        for (int i = 0; i < RUNS; i++)
+        {
+            results.assign(bodies.size(), std::wstring());
+            auto start = std::chrono::steady_clock::now();
+            for (std::size_t b = 0; b < bodies.size(); b++) function(bodies[b], results[b]);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if ((i == 0) || (seconds < best)) best = seconds;
+        }
+        std::cout << name << ": " << (static_cast<double>(characters) / 1e6 / best) << " M chars/s, " << (best * 1e3 / static_cast<double>(bodies.size())) << " ms per body\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t messages = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 200;
+    if (messages == 0) messages = 200;
+
+    std::mt19937 random(42);
+    std::vector<std::wstring> bodies;
+    std::size_t characters = 0;
+    for (std::size_t m = 0; m < messages; m++)
+    {
+        // Make each body a large one by joining several together, as a forwarded thread or a newsletter would be.
+        std::wstring body;
+        for (int part = 0; part < 8; part++) body += (m % 2) ? htmlBody(random) : plainBody(random);
+        characters += body.size();
+        bodies.push_back(std::move(body));
+    }
+    std::cout << "Preparing " << bodies.size() << " bodies (" << characters << " characters)\n";
+
+    std::vector<std::wstring> expected;
+    std::vector<std::wstring> actual;
+    measure("if-chain and regex", bodies, characters, expected, ifChain);
+    measure("table", bodies, characters, actual, fsl::_private::_prep_string);
+
+    if (expected != actual)
+    {
+        std::cout << "The outputs differ\n";
+        return 1;
+    }
+    std::cout << "The outputs match\n";
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: uidlSet.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UIDL_SET_HPP_
+#define _UIDL_SET_HPP_
+
+#include <fstream>
+#include <string>
+#include <unordered_set>
+#include <boost/filesystem.hpp>
+#include "stateFile.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * <p>The unique ids (as reported by UIDL) of the messages in a POP3 maildrop that a gateway has already looked at, so that each poll only downloads
+     * messages it has not seen before, even across a restart.</p>
+     * <p>Ids of messages that have left the maildrop are pruned every cycle, so the set never grows beyond the size of the maildrop.</p>
+     */
+    class uidlSet
+    {
+    private:
+        boost::filesystem::path _path;
+        std::unordered_set<std::string> _uids;
+        bool _dirty;
+
+    public:
+        uidlSet()
+        {
+            _dirty = false;
+        }
+
+        /**
+         * Makes a file name for the set belonging to the given maildrop.
+         */
+        static std::string fileNameFor(const std::string& key)
+        {
+            return utilities::stateFileName(key, ".uidl");
+        }
+
+        void setPath(const boost::filesystem::path& path)
+        {
+            _path = path;
+        }
+
+        [[nodiscard]] const boost::filesystem::path& path() const
+        {
+            return _path;
+        }
+
+        [[nodiscard]] bool contains(const std::string& uid) const
+        {
+            return _uids.contains(uid);
+        }
+
+        void insert(const std::string& uid)
+        {
+            if (_uids.insert(uid).second) _dirty = true;
+        }
+
+        [[nodiscard]] std::size_t size() const
+        {
+            return _uids.size();
+        }
+
+        /**
+         * Forgets every id that is not in the given collection of ids currently in the maildrop.
+         */
+        template<typename MapT>
+        void retainOnly(const MapT& present)
+        {
+            std::unordered_set<std::string> keep;
+            for (const auto& [number, uid] : present)
+            {
+                if (_uids.contains(uid)) keep.insert(uid);
+            }
+            if (keep.size() != _uids.size())
+            {
+                _uids.swap(keep);
+                _dirty = true;
+            }
+        }
+
+        bool load()
+        {
+            _uids.clear();
+            _dirty = false;
+            if (_path.empty()) return false;
+
+            std::ifstream in(_path.string());
+            if (!in) return false;
+            std::string uid;
+            while (in >> uid) _uids.insert(uid);
+
+            return true;
+        }
+
+        /**
+         * Saves the set if it has changed, replacing the old file atomically.
+         */
+        bool save()
+        {
+            if (!_dirty) return true;
+
+            bool saved = utilities::atomicWriteFile(_path, [this](std::ofstream& out)
+            {
+                for (const auto& uid : _uids) out << uid << "\n";
+            });
+            if (saved) _dirty = false;
+
+            return saved;
+        }
+    };
+}
+
+#endif // _UIDL_SET_HPP_
@@ -1,7 +1,11 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
+#include <cstdint>
+#include <memory>
+#include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <boost/regex.hpp>
 #include <boost/algorithm/string.hpp>
@@ -9,6 +13,9 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <vmime/vmime.hpp>
 #include "textCorpus.hpp"
+#include "base64Decoder.hpp"
+#include "emailAddressScanner.hpp"
+#include "xxHash64.hpp"
 
 namespace utilities
 {
@@ -22,16 +29,28 @@ namespace utilities
     {
     private:
         boost::filesystem::path _path;
+        std::uint64_t _digest;
+        std::uint64_t _size;
+        bool _hasDigest;
+        bool _duplicate;
     public:
         temporaryFile()
         {
             _path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+            _digest = 0;
+            _size = 0;
+            _hasDigest = false;
+            _duplicate = false;
         }
 
         template<typename StringT>
         explicit temporaryFile(const StringT& file_path)
         {
             _path = boost::filesystem::path(file_path);
+            _digest = 0;
+            _size = 0;
+            _hasDigest = false;
+            _duplicate = false;
         }
 
         ~temporaryFile()
@@ -58,6 +77,41 @@ namespace utilities
             return _path.wstring();
         }
 
+        // The content digest (XXH64) and length, computed as the file was written.
+        void setDigest(std::uint64_t digest, std::uint64_t size)
+        {
+            _digest = digest;
+            _size = size;
+            _hasDigest = true;
+        }
+
+        [[nodiscard]] bool hasDigest() const
+        {
+            return _hasDigest;
+        }
+
+        [[nodiscard]] std::uint64_t digest() const
+        {
+            return _digest;
+        }
+
+        [[nodiscard]] std::uint64_t size() const
+        {
+            return _size;
+        }
+
+        // Marks the file as identical to one received earlier.
+        void setDuplicate()
+        {
+            _duplicate = true;
+        }
+
+        [[nodiscard]] bool isDuplicate() const
+        {
+            return _duplicate;
+        }
+
+
         void copyTo(const boost::filesystem::path& dest)
         {
             boost::filesystem::copy_file(_path, dest);
@@ -105,18 +159,21 @@ namespace utilities
         }
     };
 
+    /**
+     * Finds every email address in a line of text; the views returned point into the line.
+     */
+    inline size_t extract_email_addresses(std::string_view line, std::vector<std::string_view>& addresses, bool clear = true)
+    {
+        if (clear) addresses.clear();
+        forEachEmailAddress(line, [&addresses](std::string_view address){ addresses.push_back(address); });
+
+        return addresses.size();
+    }
+
     inline size_t extract_email_addresses(const std::string& line, std::vector<std::string>& addresses, bool clear = true)
     {
         if (clear) addresses.clear();
-        boost::regex exp("(?:[a-z0-9_\\-\\.]+@[a-z0-9_\\-\\.]+\\.){1}(?:(?:[a-z]{2,10})|(?:[a-z]{2,10}\\.[a-z]{2,10}))");
-        boost::smatch match;
-        if (boost::regex_search(line, match, exp))
-        {
-            for (const auto& sm : match)
-            {
-                addresses.push_back(sm.str());
-            }
-        }
+        forEachEmailAddress(line, [&addresses](std::string_view address){ addresses.emplace_back(address); });
 
         return addresses.size();
     }
@@ -149,10 +206,123 @@ namespace utilities
         return false;
     }
 
-    inline std::string getMessageText(const vmime::shared_ptr<vmime::net::message>& message)
+    // Decodes base64 or quoted-printable content as it is written and passes the decoded bytes on to another stream, so that encoded content can be
+    // streamed through it from wherever it is extracted without first being collected into a buffer. finish() must be called after the last write.
+    template<typename DecoderT>
+    class decodingOutputStream : public vmime::utility::outputStream
+    {
+    private:
+        static constexpr std::size_t CHUNK = 64 * 1024;
+
+        vmime::utility::outputStream& _target;
+        DecoderT _decoder;
+        std::vector<unsigned char> _buffer;
+
+    protected:
+        void writeImpl(const vmime::byte_t* const data, const size_t count) override
+        {
+            const char *in = reinterpret_cast<const char *>(data);
+            for (std::size_t offset = 0; offset < count; offset += CHUNK)
+            {
+                std::size_t n = _decoder.decode(in + offset, std::min(CHUNK, count - offset), _buffer.data());
+                if (n > 0) _target.write(_buffer.data(), n);
+            }
+        }
+
+    public:
+        explicit decodingOutputStream(vmime::utility::outputStream& target) : _target(target), _buffer(DecoderT::outputCapacity(CHUNK))
+        {
+        }
+
+        void flush() override
+        {
+            _target.flush();
+        }
+
+        /**
+         * Writes out whatever the decoder is still holding at the end of the content.
+         */
+        void finish()
+        {
+            std::size_t n = _decoder.flush(_buffer.data());
+            if (n > 0) _target.write(_buffer.data(), n);
+            _target.flush();
+        }
+    };
+
+    // Writes content to out with its transfer encoding decoded; extract is called with the stream to write the still encoded content to. Base64 and
+    // quoted-printable are decoded as extract writes them, everything else is collected first and goes through vmime's encoders.
+    template<typename ExtractFunctionT>
+    void decodeTransferEncoding(const std::string& encoding, ExtractFunctionT&& extract, vmime::utility::outputStream& out)
+    {
+        if (boost::iequals(encoding, vmime::encodingTypes::BASE64))
+        {
+            decodingOutputStream<base64Decoder> decoder(out);
+            extract(decoder);
+            decoder.finish();
+            return;
+        }
+        if (boost::iequals(encoding, vmime::encodingTypes::QUOTED_PRINTABLE))
+        {
+            decodingOutputStream<quotedPrintableDecoder> decoder(out);
+            extract(decoder);
+            decoder.finish();
+            return;
+        }
+
+        std::string data;
+        vmime::utility::outputStreamStringAdapter raw(data);
+        extract(raw);
+        raw.flush();
+        vmime::utility::inputStreamStringAdapter in(data);
+        vmime::shared_ptr<vmime::utility::encoder::encoder> decoder;
+        try
+        {
+            decoder = vmime::encoding(encoding).getEncoder();
+        }
+        catch (const vmime::exceptions::no_encoder_available&)
+        {
+            // An unknown encoding is passed through untouched, as vmime does when parsing a whole message.
+        }
+
+        if (decoder) decoder->decode(in, out);
+        else out.write(data.data(), data.length());
+        out.flush();
+    }
+
+    // Passes everything written to it on to another stream, hashing it on the way.
+    class hashingOutputStream : public vmime::utility::outputStream
+    {
+    private:
+        vmime::utility::outputStream& _target;
+        xxHash64 _hash;
+
+    protected:
+        void writeImpl(const vmime::byte_t* const data, const size_t count) override
+        {
+            _hash.update(data, count);
+            _target.write(data, count);
+        }
+
+    public:
+        explicit hashingOutputStream(vmime::utility::outputStream& target) : _target(target)
+        {
+        }
+
+        void flush() override
+        {
+            _target.flush();
+        }
+
+        [[nodiscard]] const xxHash64& hash() const
+        {
+            return _hash;
+        }
+    };
+
+    inline std::string getMessageText(const vmime::shared_ptr<const vmime::message>& pm)
     {
         std::stringstream ss;
-        auto pm = message->getParsedMessage();
         if (!pm) return "";
         vmime::messageParser parser(pm);
         vmime::utility::outputStreamAdapter out(ss);
@@ -175,10 +345,14 @@ namespace utilities
         return ss.str();
     }
 
-    inline size_t getAttachments(const vmime::shared_ptr<vmime::net::message>& message, const std::set<std::string>& mimes, accessControlAction accessControl, std::vector<std::unique_ptr<utilities::temporaryFile>>& files)
+    inline std::string getMessageText(const vmime::shared_ptr<vmime::net::message>& message)
+    {
+        return getMessageText(message->getParsedMessage());
+    }
+
+    inline size_t getAttachments(const vmime::shared_ptr<const vmime::message>& pm, const std::set<std::string>& mimes, accessControlAction accessControl, std::vector<std::unique_ptr<utilities::temporaryFile>>& files)
     {
         size_t count = 0;
-        auto pm = message->getParsedMessage();
         if (!pm) return 0;
         std::vector <vmime::shared_ptr<const vmime::attachment> > attchs = vmime::attachmentHelper::findAttachmentsInMessage(pm);
 
@@ -214,7 +388,18 @@ namespace utilities
                 vmime::shared_ptr <vmime::utility::file> file = fsf->create(vmime::utility::path::fromString(temporary_file->string(), "/", vmime::charsets::UTF_8));
                 file->createFile();
                 vmime::shared_ptr <vmime::utility::outputStream> output = file->getFileWriter()->getOutputStream();
-                att->getData()->extract(*output);
+                hashingOutputStream hashed(*output);
+                if (att->getData()->isEncoded())
+                {
+                    auto data = att->getData();
+                    decodeTransferEncoding(data->getEncoding().getName(), [&data](vmime::utility::outputStream& raw){ data->extractRaw(raw); }, hashed);
+                }
+                else
+                {
+                    att->getData()->extract(hashed);
+                    hashed.flush();
+                }
+                temporary_file->setDigest(hashed.hash().digest(), hashed.hash().length());
                 files.push_back(std::move(temporary_file));
             }
         }
@@ -222,6 +407,161 @@ namespace utilities
         return files.size();
     }
 
+    inline size_t getAttachments(const vmime::shared_ptr<vmime::net::message>& message, const std::set<std::string>& mimes, accessControlAction accessControl, std::vector<std::unique_ptr<utilities::temporaryFile>>& files)
+    {
+        return getAttachments(message->getParsedMessage(), mimes, accessControl, files);
+    }
+
+    inline std::string getMimeType(const vmime::mediaType& type)
+    {
+        return type.getType() + "/" + type.getSubType();
+    }
+
+    inline bool mimeTypeAccepted(const std::string& mime, const std::set<std::string>& mimes, accessControlAction accessControl)
+    {
+        if (mimes.contains(mime)) return (accessControl == accessControlAction::allow);
+        return (accessControl == accessControlAction::block);
+    }
+
+    // The parts of a message worth downloading, chosen from its BODYSTRUCTURE before any of its content is fetched.
+    struct messagePartSelection
+    {
+        std::vector<vmime::shared_ptr<vmime::net::messagePart>> text;
+        std::vector<vmime::shared_ptr<vmime::net::messagePart>> attachments;
+        std::vector<vmime::shared_ptr<vmime::net::messagePart>> oversized;
+    };
+
+    // Gets the MIME header of a part of a message, fetching it if it has not been already.
+    inline vmime::shared_ptr<const vmime::header> getPartHeader(const vmime::shared_ptr<vmime::net::message>& message, const vmime::shared_ptr<vmime::net::messagePart>& part)
+    {
+        try
+        {
+            auto header = part->getHeader();
+            if (header) return header;
+        }
+        catch (const vmime::exceptions::unfetched_object&)
+        {
+        }
+        message->fetchPartHeader(part);
+
+        return part->getHeader();
+    }
+
+    inline bool isAttachmentPart(const vmime::shared_ptr<vmime::net::message>& message, const vmime::shared_ptr<vmime::net::messagePart>& part)
+    {
+        auto field = getPartHeader(message, part)->findField(vmime::fields::CONTENT_DISPOSITION);
+        if (!field) return false;
+        auto disposition = vmime::dynamicCast<const vmime::contentDisposition>(field->getValue());
+
+        return disposition && boost::iequals(disposition->getName(), vmime::contentDispositionTypes::ATTACHMENT);
+    }
+
+    inline void collectMessageParts(const vmime::shared_ptr<vmime::net::message>& message, const vmime::shared_ptr<vmime::net::messageStructure>& structure, const std::set<std::string>& mimes, accessControlAction accessControl,
+                                    std::vector<vmime::shared_ptr<vmime::net::messagePart>>& plain, std::vector<vmime::shared_ptr<vmime::net::messagePart>>& html, std::vector<vmime::shared_ptr<vmime::net::messagePart>>& attachments)
+    {
+        if (!structure) return;
+
+        for (vmime::size_t i = 0; i < structure->getPartCount(); i++)
+        {
+            auto part = structure->getPartAt(i);
+            if (part->getPartCount() > 0)
+            {
+                collectMessageParts(message, part->getStructure(), mimes, accessControl, plain, html, attachments);
+                continue;
+            }
+            if (part->getType().getType() == vmime::mediaTypes::MULTIPART) continue;
+
+            std::string mime = getMimeType(part->getType());
+            bool isPlain = boost::iequals(mime, "text/plain");
+            if ((isPlain || boost::iequals(mime, "text/html")) && !isAttachmentPart(message, part))
+            {
+                (isPlain ? plain : html).push_back(part);
+                continue;
+            }
+            if (mimeTypeAccepted(mime, mimes, accessControl)) attachments.push_back(part);
+        }
+    }
+
+    // Chooses the parts of a message to download from its BODYSTRUCTURE. Text parts that are not sent as attachments are the message text: the plain
+    // text ones, or the HTML ones if there are none, as when vmime parses the whole message; only their MIME headers are fetched, to find out how they
+    // are disposed. Any other leaf part, text sent as an attachment included, is an attachment if its type passes the MIME access control list. The
+    // text is charged to the payload budget first and then the attachments in order, and a part that does not fit in what is left of it is set aside
+    // as oversized. Part sizes are as transferred, i.e. before any transfer encoding is decoded.
+    inline void selectMessageParts(const vmime::shared_ptr<vmime::net::message>& message, const std::set<std::string>& mimes, accessControlAction accessControl, vmime::size_t& budget, messagePartSelection& selection)
+    {
+        std::vector<vmime::shared_ptr<vmime::net::messagePart>> plain;
+        std::vector<vmime::shared_ptr<vmime::net::messagePart>> html;
+        std::vector<vmime::shared_ptr<vmime::net::messagePart>> attachments;
+        collectMessageParts(message, message->getStructure(), mimes, accessControl, plain, html, attachments);
+
+        auto charge = [&budget, &selection](const vmime::shared_ptr<vmime::net::messagePart>& part, std::vector<vmime::shared_ptr<vmime::net::messagePart>>& chosen)
+        {
+            if (part->getSize() > budget)
+            {
+                selection.oversized.push_back(part);
+                return;
+            }
+            budget -= part->getSize();
+            chosen.push_back(part);
+        };
+        for (const auto& part : plain.empty() ? html : plain) charge(part, selection.text);
+        for (const auto& part : attachments) charge(part, selection.attachments);
+    }
+
+    // A message part as it was transferred, still in its content transfer encoding.
+    struct rawMessagePart
+    {
+        std::string mime;
+        std::string encoding;
+        std::string data;
+    };
+
+    // Downloads one part of a message with BODY.PEEK[part] so that the message is not marked as seen, along with the part's MIME header for its encoding.
+    inline rawMessagePart fetchRawPart(const vmime::shared_ptr<vmime::net::message>& message, const vmime::shared_ptr<vmime::net::messagePart>& part)
+    {
+        rawMessagePart raw;
+        raw.mime = getMimeType(part->getType());
+        raw.encoding = vmime::encodingTypes::SEVEN_BIT;
+
+        auto cte = getPartHeader(message, part)->findField(vmime::fields::CONTENT_TRANSFER_ENCODING);
+        if (cte) raw.encoding = vmime::dynamicCast<const vmime::encoding>(cte->getValue())->getName();
+
+        vmime::utility::outputStreamStringAdapter out(raw.data);
+        message->extractPart(part, out, nullptr, 0, -1, true);
+        out.flush();
+
+        return raw;
+    }
+
+    // Decodes a downloaded part by streaming its content through the decoder for its transfer encoding, without making a second copy of it.
+    inline void decodePart(const rawMessagePart& raw, vmime::utility::outputStream& out)
+    {
+        decodeTransferEncoding(raw.encoding, [&raw](vmime::utility::outputStream& encoded){ encoded.write(raw.data.data(), raw.data.length()); }, out);
+    }
+
+    inline std::string decodePartToString(const rawMessagePart& raw)
+    {
+        std::string retval;
+        vmime::utility::outputStreamStringAdapter out(retval);
+        decodePart(raw, out);
+
+        return retval;
+    }
+
+    inline std::unique_ptr<temporaryFile> decodePartToFile(const rawMessagePart& raw)
+    {
+        auto temporary_file = std::make_unique<utilities::temporaryFile>();
+        vmime::shared_ptr <vmime::utility::fileSystemFactory> fsf = vmime::platform::getHandler()->getFileSystemFactory();
+        vmime::shared_ptr <vmime::utility::file> file = fsf->create(vmime::utility::path::fromString(temporary_file->string(), "/", vmime::charsets::UTF_8));
+        file->createFile();
+        vmime::shared_ptr <vmime::utility::outputStream> output = file->getFileWriter()->getOutputStream();
+        hashingOutputStream hashed(*output);
+        decodePart(raw, hashed);
+        temporary_file->setDigest(hashed.hash().digest(), hashed.hash().length());
+
+        return temporary_file;
+    }
+
     inline bool search_for_email_address(const std::string& address1, const vmime::shared_ptr<const vmime::addressList>& addressList1, const vmime::shared_ptr<const vmime::addressList>& addressList2)
     {
         if (addressList1)
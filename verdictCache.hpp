@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: verdictCache.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _VERDICT_CACHE_HPP_
+#define _VERDICT_CACHE_HPP_
+
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <boost/filesystem.hpp>
+#include "stateFile.hpp"
+
+namespace telemeteryServices
+{
+    /**
+     * What a gateway decided about a message the first time it looked at it.
+     */
+    enum class triageVerdict : char
+    {
+        /**
+         * The message was not addressed to the gateway, or its sender is not allowed; it has been reported if it had to be.
+         */
+        rejected = 'r',
+        /**
+         * The message was passed on as a command.
+         */
+        dispatched = 'd',
+    };
+
+    /**
+     * <p>The verdicts a gateway has reached on the messages in a mailbox, by UID, so that a message that stays in the mailbox is triaged once rather
+     * than on every cycle: it is neither fetched nor reported again.</p>
+     * <p>Each verdict is kept with the date of its message so that the window can be walked without fetching anything for the messages already
+     * decided, and so that verdicts on messages that have left the window can be pruned. Like a checkpoint, the verdicts are only meaningful while
+     * the mailbox UIDVALIDITY matches the one they were reached against.</p>
+     */
+    class verdictCache
+    {
+    public:
+        struct entry
+        {
+            std::time_t date;
+            triageVerdict verdict;
+        };
+
+    private:
+        boost::filesystem::path _path;
+        std::uint64_t _uidValidity;
+        std::unordered_map<std::uint64_t, entry> _entries;
+        bool _dirty;
+
+    public:
+        verdictCache()
+        {
+            _uidValidity = 0;
+            _dirty = false;
+        }
+
+        /**
+         * Builds a file name for a verdict cache from an arbitrary key.
+         */
+        static std::string fileNameFor(const std::string& key)
+        {
+            return utilities::stateFileName(key, ".verdicts");
+        }
+
+        void setPath(const boost::filesystem::path& path)
+        {
+            _path = path;
+        }
+
+        [[nodiscard]] const boost::filesystem::path& path() const
+        {
+            return _path;
+        }
+
+        [[nodiscard]] std::uint64_t uidValidity() const
+        {
+            return _uidValidity;
+        }
+
+        [[nodiscard]] std::size_t size() const
+        {
+            return _entries.size();
+        }
+
+        /**
+         * Discards every verdict and starts again against the given UIDVALIDITY.
+         */
+        void reset(std::uint64_t uidValidity)
+        {
+            if (_entries.empty() && (_uidValidity == uidValidity)) return;
+            _uidValidity = uidValidity;
+            _entries.clear();
+            _dirty = true;
+        }
+
+        /**
+         * Gets the verdict on a message, or null if it has not been triaged.
+         */
+        [[nodiscard]] const entry *find(std::uint64_t uid) const
+        {
+            auto it = _entries.find(uid);
+            return (it == _entries.end()) ? nullptr : &it->second;
+        }
+
+        void record(std::uint64_t uid, std::time_t date, triageVerdict verdict)
+        {
+            if (uid == 0) return;
+            _entries[uid] = { date, verdict };
+            _dirty = true;
+        }
+
+        /**
+         * Forgets the verdicts on messages dated before the given time, which a gateway will never act upon, except the one on the given message: a
+         * walk back through the window stops at the first message outside it, and knowing its date saves fetching it every time to find out.
+         */
+        void pruneBefore(std::time_t cutoff, std::uint64_t boundaryUid = 0)
+        {
+            for (auto it = _entries.begin(); it != _entries.end(); )
+            {
+                if ((it->second.date < cutoff) && (it->first != boundaryUid))
+                {
+                    it = _entries.erase(it);
+                    _dirty = true;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        /**
+         * Loads the verdicts from their file, leaving the cache empty if there is no file or it cannot be read.
+         */
+        bool load()
+        {
+            _uidValidity = 0;
+            _entries.clear();
+            _dirty = false;
+            if (_path.empty()) return false;
+
+            std::ifstream in(_path.string());
+            if (!in) return false;
+
+            std::string name;
+            if (!(in >> name >> _uidValidity) || (name != "uidvalidity"))
+            {
+                _uidValidity = 0;
+                return false;
+            }
+            std::uint64_t uid;
+            long long date;
+            char verdict;
+            while (in >> uid >> date >> verdict)
+            {
+                if ((verdict != static_cast<char>(triageVerdict::rejected)) && (verdict != static_cast<char>(triageVerdict::dispatched))) continue;
+                _entries[uid] = { static_cast<std::time_t>(date), static_cast<triageVerdict>(verdict) };
+            }
+
+            return true;
+        }
+
+        /**
+         * Saves the verdicts if they have changed, replacing the old file atomically.
+         */
+        bool save()
+        {
+            if (!_dirty) return true;
+
+            bool saved = utilities::atomicWriteFile(_path, [this](std::ofstream& out)
+            {
+                out << "uidvalidity " << _uidValidity << "\n";
+                for (const auto& [uid, e] : _entries) out << uid << " " << static_cast<long long>(e.date) << " " << static_cast<char>(e.verdict) << "\n";
+            });
+            if (saved) _dirty = false;
+
+            return saved;
+        }
+    };
+}
+
+#endif // _VERDICT_CACHE_HPP_
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2021 Chris Morrison
+ *
+ * Filename: xxHash64.hpp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XXHASH64_HPP_
+#define _XXHASH64_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace utilities
+{
+    /**
+     * <p>A streaming implementation of the 64-bit xxHash algorithm (XXH64).</p>
+     * <p>Data can be fed in pieces of any size as it arrives; the digest is the same as hashing it in one go. It is a fast non-cryptographic hash, suitable
+     * for recognising content that has been seen before but not for anything an adversary might try to collide.</p>
+     */
+    class xxHash64
+    {
+    private:
+        static constexpr std::uint64_t PRIME1 = 11400714785074694791ULL;
+        static constexpr std::uint64_t PRIME2 = 14029467366897019727ULL;
+        static constexpr std::uint64_t PRIME3 = 1609587929392839161ULL;
+        static constexpr std::uint64_t PRIME4 = 9650029242287828579ULL;
+        static constexpr std::uint64_t PRIME5 = 2870177450012600261ULL;
+
+        std::uint64_t _seed;
+        std::uint64_t _acc[4];
+        unsigned char _buffer[32];
+        std::size_t _buffered;
+        std::uint64_t _total;
+
+        static std::uint64_t rotl(std::uint64_t x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        static std::uint64_t read64(const unsigned char *p)
+        {
+            std::uint64_t v = 0;
+            for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+            return v;
+        }
+
+        static std::uint32_t read32(const unsigned char *p)
+        {
+            return std::uint32_t(p[0]) | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24);
+        }
+
+        static std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+        {
+            acc += input * PRIME2;
+            acc = rotl(acc, 31);
+            return acc * PRIME1;
+        }
+
+        static std::uint64_t merge(std::uint64_t h, std::uint64_t acc)
+        {
+            h ^= round(0, acc);
+            return h * PRIME1 + PRIME4;
+        }
+
+        void stripe(const unsigned char *p)
+        {
+            _acc[0] = round(_acc[0], read64(p));
+            _acc[1] = round(_acc[1], read64(p + 8));
+            _acc[2] = round(_acc[2], read64(p + 16));
+            _acc[3] = round(_acc[3], read64(p + 24));
+        }
+
+    public:
+        explicit xxHash64(std::uint64_t seed = 0)
+        {
+            reset(seed);
+        }
+
+        void reset(std::uint64_t seed = 0)
+        {
+            _seed = seed;
+            _acc[0] = seed + PRIME1 + PRIME2;
+            _acc[1] = seed + PRIME2;
+            _acc[2] = seed;
+            _acc[3] = seed - PRIME1;
+            _buffered = 0;
+            _total = 0;
+        }
+
+        void update(const void *data, std::size_t length)
+        {
+            auto p = static_cast<const unsigned char *>(data);
+            _total += length;
+
+            if (_buffered + length < 32)
+            {
+                std::memcpy(_buffer + _buffered, p, length);
+                _buffered += length;
+                return;
+            }
+
+            if (_buffered > 0)
+            {
+                std::size_t fill = 32 - _buffered;
+                std::memcpy(_buffer + _buffered, p, fill);
+                stripe(_buffer);
+                p += fill;
+                length -= fill;
+                _buffered = 0;
+            }
+
+            while (length >= 32)
+            {
+                stripe(p);
+                p += 32;
+                length -= 32;
+            }
+
+            std::memcpy(_buffer, p, length);
+            _buffered = length;
+        }
+
+        [[nodiscard]] std::uint64_t digest() const
+        {
+            std::uint64_t h;
+            if (_total >= 32)
+            {
+                h = rotl(_acc[0], 1) + rotl(_acc[1], 7) + rotl(_acc[2], 12) + rotl(_acc[3], 18);
+                for (auto acc : _acc) h = merge(h, acc);
+            }
+            else
+            {
+                h = _seed + PRIME5;
+            }
+            h += _total;
+
+            const unsigned char *p = _buffer;
+            std::size_t remaining = _buffered;
+            while (remaining >= 8)
+            {
+                h ^= round(0, read64(p));
+                h = rotl(h, 27) * PRIME1 + PRIME4;
+                p += 8;
+                remaining -= 8;
+            }
+            if (remaining >= 4)
+            {
+                h ^= std::uint64_t(read32(p)) * PRIME1;
+                h = rotl(h, 23) * PRIME2 + PRIME3;
+                p += 4;
+                remaining -= 4;
+            }
+            while (remaining > 0)
+            {
+                h ^= std::uint64_t(*p) * PRIME5;
+                h = rotl(h, 11) * PRIME1;
+                p++;
+                remaining--;
+            }
+
+            h ^= h >> 33;
+            h *= PRIME2;
+            h ^= h >> 29;
+            h *= PRIME3;
+            h ^= h >> 32;
+
+            return h;
+        }
+
+        /**
+         * Gets the number of bytes hashed so far.
+         */
+        [[nodiscard]] std::uint64_t length() const
+        {
+            return _total;
+        }
+
+        static std::string toHex(std::uint64_t digest)
+        {
+            static const char digits[] = "0123456789abcdef";
+            std::string retval(16, '0');
+            for (int i = 15; i >= 0; i--)
+            {
+                retval[i] = digits[digest & 0xF];
+                digest >>= 4;
+            }
+
+            return retval;
+        }
+    };
+}
+
+#endif // _XXHASH64_HPP_